@@ -0,0 +1,25 @@
+#ifndef __GNEGNU_H
+#define __GNEGNU_H
+
+/* Public header of libgnegnu, the gnegnu NN engine without Tcl.
+ * Programs include this header and link with -lgnegnu -lm -lpthread
+ * (plus -lrt for the data parallel training of nnpar.h on old C
+ * libraries). The API is the one of nn.h and nnpar.h; it can be used
+ * from C++ as well. */
+#define GNEGNU_VERSION_MAJOR 0	/* soname of libgnegnu.so */
+#define GNEGNU_VERSION_MINOR 1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "nn.h"
+#include "nnpar.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GNEGNU_H */
@@ -0,0 +1,525 @@
+#ifndef __GNEGNU_HPP
+#define __GNEGNU_HPP
+
+/* Header only C++ nets with the layer sizes fixed at compile time.
+ *
+ * gnegnu::Net<64, 8, 64> is the net of AnnCreateNet() with the same
+ * units, from the output layer to the input one, but all its arrays
+ * live inside the object, aligned to cache lines, and every loop bound
+ * is a constant the compiler can unroll and vectorize. The layout of
+ * every layer is the one of nn.c (rows of the unit outputs, bias
+ * included, with the units of the next layer as stride), and the
+ * kernels sum in the same order of nn.c, so a net converted with
+ * from_ann() computes exactly the same outputs, gradients and RPROP
+ * steps of the struct Ann it comes from.
+ *
+ * Objects are big for big nets, allocate them with new instead of on
+ * the stack. Programs using this header need C++17 and link with
+ * -lgnegnu -lm, like the ones using gnegnu.h. */
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+#include "gnegnu.h"
+
+namespace gnegnu {
+
+namespace detail {
+
+/* Arrays of every layer start at a 64 bytes boundary */
+constexpr std::size_t Pad(std::size_t n)
+{
+	return (n+7) & ~(std::size_t)7;
+}
+
+/* Units of the layer l, bias unit included */
+template<std::size_t N>
+constexpr std::size_t Units(const std::array<std::size_t, N> &u, std::size_t l)
+{
+	return u[l] + (l > 1);
+}
+
+template<std::size_t N>
+constexpr std::size_t Weights(const std::array<std::size_t, N> &u, std::size_t l)
+{
+	return l ? Units(u, l)*Units(u, l-1) : 0;
+}
+
+/* Offset of the outputs of the layer l in the outputs array, and of the
+ * weights of the layer l in the weights array. With l == N the size of
+ * the array is returned. */
+template<std::size_t N>
+constexpr std::size_t OutputOffset(const std::array<std::size_t, N> &u, std::size_t l)
+{
+	std::size_t off = 0;
+
+	for (std::size_t i = 0; i < l; i++)
+		off += Pad(Units(u, i));
+	return off;
+}
+
+template<std::size_t N>
+constexpr std::size_t WeightOffset(const std::array<std::size_t, N> &u, std::size_t l)
+{
+	std::size_t off = 0;
+
+	for (std::size_t i = 1; i < l; i++)
+		off += Pad(Weights(u, i));
+	return off;
+}
+
+inline double Sign(double n)
+{
+	if (n > 0) return +1;
+	if (n < 0) return -1;
+	return 0;
+}
+
+} /* namespace detail */
+
+template<std::size_t... Units>
+class Net {
+public:
+	static constexpr std::size_t layers = sizeof...(Units);
+	static constexpr std::array<std::size_t, layers> spec = {Units...};
+	static constexpr std::size_t inputs = spec[layers-1];
+	static constexpr std::size_t outputs = spec[0];
+
+	static_assert(layers >= 2, "a net needs at least two layers");
+	static_assert(((Units > 0) && ...), "every layer needs a unit");
+
+	/* Same parameters and defaults of struct Ann */
+	double learn_rate = DEFAULT_LEARN_RATE;
+	double momentum = DEFAULT_MOMENTUM;
+	double rprop_nminus = DEFAULT_RPROP_NMINUS;
+	double rprop_nplus = DEFAULT_RPROP_NPLUS;
+	double rprop_maxupdate = DEFAULT_RPROP_MAXUPDATE;
+	double rprop_minupdate = DEFAULT_RPROP_MINUPDATE;
+	int sigmoid = ANN_SIGMOID_EXACT;
+	double meanerr = 0;	/* mean error of the last epoch */
+
+	/* All the weights are zero, the RPROP deltas are the initial ones */
+	Net()
+	{
+		weight_.fill(0);
+		gradient_.fill(0);
+		sgradient_.fill(0);
+		pgradient_.fill(0);
+		delta_.fill(RPROP_INITIAL_DELTA);
+		output_.fill(0);
+		error_.fill(0);
+		activation_.fill(ANN_ACT_LOGISTIC);
+		for (std::size_t l = 2; l < layers; l++)
+			output_[OutputOffset(l)+UnitsOf(l)-1] = 1;
+	}
+
+	/* Raw interface, like the macros of nn.h */
+	double &weight(std::size_t l, std::size_t i, std::size_t j)
+	{
+		return weight_[WeightOffset(l)+i*UnitsOf(l-1)+j];
+	}
+	double &output(std::size_t l, std::size_t i)
+	{
+		return output_[OutputOffset(l)+i];
+	}
+	double *input() { return &output_[OutputOffset(layers-1)]; }
+	const double *output() const { return &output_[0]; }
+	int activation(std::size_t l) const { return activation_[l]; }
+
+	/* Number of weights of the net, bias weights included */
+	static constexpr std::size_t weight_count()
+	{
+		std::size_t n = 0;
+
+		for (std::size_t l = 1; l < layers; l++)
+			n += WeightsOf(l);
+		return n;
+	}
+
+	/* Set the activation of the units of a non input layer.
+	 * Return non-zero if the layer or the activation are not valid,
+	 * like AnnSetActivation(). */
+	int set_activation(std::size_t l, int activation)
+	{
+		if (l >= layers-1 || activation < 0 ||
+		    activation > ANN_ACT_HARDSIG)
+			return 1;
+		activation_[l] = activation;
+		return 0;
+	}
+
+	/* Random weights in the [-0.5,0.5) range, the same ones of
+	 * AnnSetRandomWeights() for a net with the same seed */
+	void set_random_weights(unsigned long long seed)
+	{
+		unsigned long long n = 0;
+
+		for (std::size_t l = 1; l < layers; l++) {
+			double *w = &weight_[WeightOffset(l)];
+
+			for (std::size_t i = 0; i < WeightsOf(l); i++)
+				w[i] = -.5+(AnnRandomBits(seed, n++) >> 11) *
+					(1.0/9007199254740992.0);
+		}
+	}
+
+	/* Simulate the net on the given inputs, the outputs are at output() */
+	void simulate(const double *in)
+	{
+		std::memcpy(input(), in, sizeof(double)*inputs);
+		Simulate(std::make_index_sequence<layers-1>());
+	}
+
+	/* Global error of the last simulation, see AnnGlobalError() */
+	double global_error(const double *desidered) const
+	{
+		double e = 0;
+
+		for (std::size_t i = 0; i < outputs; i++) {
+			double t = desidered[i] - output_[i];
+			e += std::fabs(t*t);
+		}
+		return .5*e;
+	}
+
+	/* Gradients of the last simulation, see AnnCalculateGradients() */
+	void calculate_gradients(const double *desidered)
+	{
+		for (std::size_t i = 0; i < outputs; i++)
+			error_[i] = output_[i] - desidered[i];
+		Backprop(std::make_index_sequence<layers-1>());
+	}
+
+	void reset_sgradient() { sgradient_.fill(0); }
+	void update_sgradient()
+	{
+		for (std::size_t i = 0; i < nweights; i++)
+			sgradient_[i] += gradient_[i];
+	}
+
+	/* Weights updates, see AnnAdjustWeightsGD(), AnnAdjustWeightsGDM()
+	 * and AnnAdjustWeightsResilientBP() */
+	void adjust_weights_gd()
+	{
+		for (std::size_t i = 0; i < nweights; i++)
+			weight_[i] -= learn_rate*gradient_[i];
+	}
+
+	void adjust_weights_gdm()
+	{
+		for (std::size_t i = 0; i < nweights; i++) {
+			weight_[i] -= learn_rate*(gradient_[i] + pgradient_[i]*momentum);
+			pgradient_[i] = gradient_[i];
+		}
+	}
+
+	void adjust_weights_rprop()
+	{
+		for (std::size_t i = 0; i < nweights; i++) {
+			double t = pgradient_[i]*sgradient_[i];
+
+			if (t > 0) {
+				delta_[i] = MIN(delta_[i]*rprop_nplus, rprop_maxupdate);
+				weight_[i] -= detail::Sign(sgradient_[i])*delta_[i];
+				pgradient_[i] = sgradient_[i];
+			} else if (t < 0) {
+				delta_[i] = MAX(delta_[i]*rprop_nminus, rprop_minupdate);
+				pgradient_[i] = 0;
+			} else {
+				weight_[i] -= detail::Sign(sgradient_[i])*delta_[i];
+				pgradient_[i] = sgradient_[i];
+			}
+		}
+	}
+
+	/* Training epochs over 'setlen' samples stored one after the other,
+	 * returning the max error and setting meanerr, like
+	 * AnnResilientBPEpoch(), AnnOnlineGDEpoch() and AnnOnlineGDMEpoch(). */
+	double rprop_epoch(const double *in, const double *desidered, std::size_t setlen)
+	{
+		double maxerr = 0, toterr = 0;
+
+		reset_sgradient();
+		for (std::size_t j = 0; j < setlen; j++) {
+			double e = SimulateSample(in, desidered, j);
+
+			if (e > maxerr) maxerr = e;
+			toterr += e;
+			calculate_gradients(desidered+j*outputs);
+			update_sgradient();
+		}
+		adjust_weights_rprop();
+		meanerr = setlen ? toterr/setlen : 0;
+		return maxerr;
+	}
+
+	double gd_epoch(const double *in, const double *desidered, std::size_t setlen)
+	{
+		return OnlineEpoch(in, desidered, setlen, false);
+	}
+
+	double gdm_epoch(const double *in, const double *desidered, std::size_t setlen)
+	{
+		return OnlineEpoch(in, desidered, setlen, true);
+	}
+
+	/* Copy the weights, activations, training parameters and RPROP
+	 * state of 'net', that must have the same units.
+	 * Return non-zero if the units don't match or the net is tied.
+	 * Pruned and frozen layers are copied as they are, but they are
+	 * trained like the other ones. */
+	int from_ann(const struct Ann *net)
+	{
+		if (LAYERS(net) != (int)layers)
+			return 1;
+		for (std::size_t l = 0; l < layers; l++) {
+			if (UNITS(net,l) != (int)UnitsOf(l) || TIED(net,l))
+				return 1;
+		}
+		for (std::size_t l = 1; l < layers; l++) {
+			std::size_t off = WeightOffset(l), n = sizeof(double)*WeightsOf(l);
+
+			std::memcpy(&weight_[off], net->layer[l].weight, n);
+			std::memcpy(&pgradient_[off], net->layer[l].pgradient, n);
+			std::memcpy(&delta_[off], net->layer[l].delta, n);
+		}
+		for (std::size_t l = 0; l < layers-1; l++)
+			activation_[l] = net->layer[l].activation;
+		learn_rate = LEARN_RATE(net);
+		momentum = MOMENTUM(net);
+		rprop_nminus = RPROP_NMINUS(net);
+		rprop_nplus = RPROP_NPLUS(net);
+		rprop_maxupdate = RPROP_MAXUPDATE(net);
+		rprop_minupdate = RPROP_MINUPDATE(net);
+		sigmoid = net->sigmoid;
+		return 0;
+	}
+
+	/* Return a new struct Ann with the same units, weights, activations,
+	 * training parameters and RPROP state, using RPROP.
+	 * On out of memory NULL is returned. */
+	struct Ann *to_ann() const
+	{
+		int units[layers];
+		struct Ann *net;
+
+		for (std::size_t l = 0; l < layers; l++)
+			units[l] = (int)spec[l];
+		if ((net = AnnCreateNet((int)layers, units)) == NULL)
+			return NULL;
+		for (std::size_t l = 1; l < layers; l++) {
+			std::size_t off = WeightOffset(l), n = sizeof(double)*WeightsOf(l);
+
+			std::memcpy(net->layer[l].weight, &weight_[off], n);
+			std::memcpy(net->layer[l].pgradient, &pgradient_[off], n);
+			std::memcpy(net->layer[l].delta, &delta_[off], n);
+		}
+		for (std::size_t l = 0; l < layers-1; l++)
+			net->layer[l].activation = activation_[l];
+		LEARN_RATE(net) = learn_rate;
+		MOMENTUM(net) = momentum;
+		RPROP_NMINUS(net) = rprop_nminus;
+		RPROP_NPLUS(net) = rprop_nplus;
+		RPROP_MAXUPDATE(net) = rprop_maxupdate;
+		RPROP_MINUPDATE(net) = rprop_minupdate;
+		AnnSetSigmoid(net, sigmoid);
+		return net;
+	}
+
+private:
+	static constexpr std::size_t UnitsOf(std::size_t l) { return detail::Units(spec, l); }
+	static constexpr std::size_t WeightsOf(std::size_t l) { return detail::Weights(spec, l); }
+	static constexpr std::size_t OutputOffset(std::size_t l) { return detail::OutputOffset(spec, l); }
+	static constexpr std::size_t WeightOffset(std::size_t l) { return detail::WeightOffset(spec, l); }
+
+	static constexpr std::size_t noutputs = detail::OutputOffset(spec, layers);
+	static constexpr std::size_t nweights = detail::WeightOffset(spec, layers);
+
+	alignas(64) std::array<double, nweights> weight_;
+	alignas(64) std::array<double, nweights> gradient_;
+	alignas(64) std::array<double, nweights> sgradient_;
+	alignas(64) std::array<double, nweights> pgradient_;	/* t-1 sgradient for RPROP */
+	alignas(64) std::array<double, nweights> delta_;	/* per-weight RPROP delta */
+	alignas(64) std::array<double, noutputs> output_;
+	alignas(64) std::array<double, noutputs> error_;
+	std::array<int, layers> activation_;
+
+	/* The activations of AnnActivationVector() with the exact sigmoid
+	 * are computed inline, the other sigmoid modes use nn.c. */
+	void Activation(double *v, std::size_t n, int activation)
+	{
+		std::size_t i;
+
+		if (sigmoid != ANN_SIGMOID_EXACT &&
+		    (activation == ANN_ACT_LOGISTIC || activation == ANN_ACT_TANH)) {
+			AnnActivationVector(v, (int)n, activation, sigmoid);
+			return;
+		}
+		switch(activation) {
+		case ANN_ACT_LOGISTIC:
+			for (i = 0; i < n; i++)
+				v[i] = (double)1/(1+std::exp(-v[i]));
+			break;
+		case ANN_ACT_TANH:
+			for (i = 0; i < n; i++)
+				v[i] = std::tanh(v[i]);
+			break;
+		case ANN_ACT_RELU:
+			for (i = 0; i < n; i++)
+				v[i] = v[i] > 0 ? v[i] : 0;
+			break;
+		case ANN_ACT_LRELU:
+			for (i = 0; i < n; i++)
+				v[i] = v[i] > 0 ? v[i] : v[i]*ANN_LRELU_SLOPE;
+			break;
+		case ANN_ACT_HARDSIG:
+			for (i = 0; i < n; i++) {
+				double x = v[i]*0.2+0.5;
+				x = x < 0 ? 0 : x;
+				v[i] = x > 1 ? 1 : x;
+			}
+			break;
+		default: /* ANN_ACT_LINEAR */
+			break;
+		}
+	}
+
+	static void Derivative(double *e, const double *o, std::size_t n, int activation)
+	{
+		std::size_t i;
+
+		switch(activation) {
+		case ANN_ACT_LOGISTIC:
+			for (i = 0; i < n; i++)
+				e[i] *= o[i]*(1-o[i]);
+			break;
+		case ANN_ACT_TANH:
+			for (i = 0; i < n; i++)
+				e[i] *= 1-o[i]*o[i];
+			break;
+		case ANN_ACT_RELU:
+			for (i = 0; i < n; i++)
+				e[i] = o[i] > 0 ? e[i] : 0;
+			break;
+		case ANN_ACT_LRELU:
+			for (i = 0; i < n; i++)
+				e[i] = o[i] > 0 ? e[i] : e[i]*ANN_LRELU_SLOPE;
+			break;
+		case ANN_ACT_HARDSIG:
+			for (i = 0; i < n; i++)
+				e[i] = (o[i] > 0 && o[i] < 1) ? e[i]*0.2 : 0;
+			break;
+		default: /* ANN_ACT_LINEAR */
+			break;
+		}
+	}
+
+	/* Compute the outputs of the layer I-1 from the ones of the layer I,
+	 * like AnnSimulateLayer(). The sums are accumulated in a local
+	 * array, that the compiler knows can't alias the weights. */
+	template<std::size_t I>
+	void SimulateLayer()
+	{
+		constexpr std::size_t units = UnitsOf(I);
+		constexpr std::size_t next = UnitsOf(I-1) - (I > 2);
+		constexpr std::size_t stride = UnitsOf(I-1);
+		const double *O = &output_[OutputOffset(I)];
+		const double *W = &weight_[WeightOffset(I)];
+		double *A = &output_[OutputOffset(I-1)];
+		alignas(64) double a[next];
+
+		for (std::size_t j = 0; j < next; j++)
+			a[j] = 0;
+		for (std::size_t k = 0; k < units; k++) {
+			const double o = O[k], *w = W+k*stride;
+
+			if (o == 0)
+				continue;
+			for (std::size_t j = 0; j < next; j++)
+				a[j] += w[j]*o;
+		}
+		Activation(a, next, activation_[I-1]);
+		std::memcpy(A, a, sizeof(a));
+	}
+
+	template<std::size_t... L>
+	void Simulate(std::index_sequence<L...>)
+	{
+		(SimulateLayer<layers-1-L>(), ...);
+	}
+
+	/* Turn the errors of the layer J into derivatives, then compute the
+	 * gradients of the weights of the layer J+1 and, unless it is the
+	 * input layer, its errors, like AnnCalculateGradients(). */
+	template<std::size_t J>
+	void BackpropLayer()
+	{
+		constexpr std::size_t units = UnitsOf(J) - (J > 1);
+		constexpr std::size_t prev = UnitsOf(J+1);
+		constexpr std::size_t stride = UnitsOf(J);
+		double *E = &error_[OutputOffset(J)];
+		const double *O = &output_[OutputOffset(J+1)];
+		const double *W = &weight_[WeightOffset(J+1)];
+		double *G = &gradient_[WeightOffset(J+1)];
+		double *PE = &error_[OutputOffset(J+1)];
+
+		Derivative(E, &output_[OutputOffset(J)], units, activation_[J]);
+		for (std::size_t k = 0; k < prev; k++) {
+			const double o = O[k], *w = W+k*stride;
+			double *g = G+k*stride;
+
+			if constexpr (J+1 == layers-1) {
+				for (std::size_t i = 0; i < units; i++)
+					g[i] = o*E[i];
+				if (o == 0)
+					std::memset(g, 0, sizeof(double)*units);
+			} else {
+				double e = 0;
+
+				for (std::size_t i = 0; i < units; i++) {
+					g[i] = E[i]*o;
+					e += E[i]*w[i];
+				}
+				PE[k] = e;
+			}
+		}
+	}
+
+	template<std::size_t... L>
+	void Backprop(std::index_sequence<L...>)
+	{
+		(BackpropLayer<L>(), ...);
+	}
+
+	double SimulateSample(const double *in, const double *desidered, std::size_t j)
+	{
+		simulate(in+j*inputs);
+		return global_error(desidered+j*outputs);
+	}
+
+	double OnlineEpoch(const double *in, const double *desidered, std::size_t setlen, bool gdm)
+	{
+		double maxerr = 0, toterr = 0;
+
+		for (std::size_t j = 0; j < setlen; j++) {
+			double e = SimulateSample(in, desidered, j);
+
+			if (e > maxerr) maxerr = e;
+			toterr += e;
+			calculate_gradients(desidered+j*outputs);
+			if (gdm)
+				adjust_weights_gdm();
+			else
+				adjust_weights_gd();
+		}
+		meanerr = setlen ? toterr/setlen : 0;
+		return maxerr;
+	}
+};
+
+} /* namespace gnegnu */
+
+#endif /* __GNEGNU_HPP */
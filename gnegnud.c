@@ -0,0 +1,559 @@
+/* gnegnud - gnegnu NN inference daemon
+ * Copyright(C) 2003 Salvatore Sanfilippo
+ * All rights reserved.
+ *
+ * Serves the nets saved with AnnSave() (ann::save) to other processes
+ * over a Unix domain socket, see gnegnud.h for the protocol.
+ * Every connection has a reader thread that queues the requests of the
+ * client on the queue of their model, and a writer thread that sends
+ * the replies queued for the connection, so a client that doesn't read
+ * its replies only stalls itself. A pool of worker threads takes
+ * the requests of a model in micro-batches and runs them through
+ * AnnSimulateBatch(): a batch starts as soon as 'maxbatch' requests are
+ * queued, or when the oldest queued request has waited 'window'
+ * microseconds, so a single client sees at most 'window' of added
+ * latency, while under load the batches fill up and the weights are
+ * loaded once every 'maxbatch' vectors. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nn.h"
+#include "gnegnud.h"
+
+/* A queued simulate request, the inputs follow the structure */
+struct DaemonRequest {
+	struct DaemonRequest *next;
+	struct DaemonConn *conn;
+	uint32_t id;
+	double arrival;		/* monotonic time the request was queued */
+	double input[1];
+};
+
+struct DaemonModel {
+	char *filename;
+	struct Ann *net;
+	int inputs;
+	int outputs;
+	struct DaemonRequest *head, *tail; /* requests queue */
+	int pending;		/* queued requests */
+};
+
+/* A reply waiting to be sent, the outputs follow the structure */
+struct DaemonOut {
+	struct DaemonOut *next;
+	struct GnegnudReply r;
+	double v[1];
+};
+
+/* A client connection. It is referenced by its reader and writer
+ * threads and by every queued request, and closed when the last
+ * reference goes away. */
+struct DaemonConn {
+	int fd;
+	int refcount;
+	pthread_mutex_t wlock;	/* protects the fields below */
+	pthread_cond_t wcond;	/* replies were queued, or closing */
+	pthread_cond_t rcond;	/* outstanding replies decreased */
+	struct DaemonOut *head, *tail; /* replies to send */
+	int outstanding;	/* requests read whose reply was not sent */
+	int closing;		/* the reader thread exited */
+	int dead;		/* write error, replies are discarded */
+};
+
+/* Options */
+static char *opt_socket = GNEGNUD_SOCKET;
+static int opt_maxbatch = 32;
+static double opt_window = 0.0002;
+static int opt_threads = 2;
+
+#define DAEMON_MAXOUTSTANDING 1024 /* replies a client can leave unread */
+
+static struct DaemonModel *models;
+static int nmodels;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* queues, stats */
+static pthread_cond_t cond;	/* requests were queued */
+static double served, batches;
+
+static double DaemonTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static int DaemonWrite(int fd, void *buf, size_t len)
+{
+	char *b = buf;
+
+	while (len) {
+		ssize_t n = write(fd, b, len);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int DaemonRead(int fd, void *buf, size_t len)
+{
+	char *b = buf;
+
+	while (len) {
+		ssize_t n = read(fd, b, len);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void DaemonConnRelease(struct DaemonConn *c)
+{
+	if (__sync_sub_and_fetch(&c->refcount, 1))
+		return;
+	close(c->fd);
+	pthread_mutex_destroy(&c->wlock);
+	pthread_cond_destroy(&c->wcond);
+	pthread_cond_destroy(&c->rcond);
+	free(c);
+}
+
+/* Account for a reply that was sent or discarded. Called with the
+ * connection lock held. */
+static void DaemonReplyDone(struct DaemonConn *c)
+{
+	c->outstanding--;
+	pthread_cond_signal(&c->rcond);
+	if (c->closing && c->outstanding == 0)
+		pthread_cond_signal(&c->wcond);
+}
+
+/* Queue a reply with 'len' doubles at 'v' for the writer thread of the
+ * connection. Without memory the reply is lost. */
+static void DaemonReply(struct DaemonConn *c, uint32_t id, uint32_t status, double *v, uint32_t len)
+{
+	struct DaemonOut *o = malloc(sizeof(*o)+sizeof(double)*len);
+
+	pthread_mutex_lock(&c->wlock);
+	if (o == NULL) {
+		DaemonReplyDone(c);
+		pthread_mutex_unlock(&c->wlock);
+		return;
+	}
+	o->next = NULL;
+	o->r.id = id;
+	o->r.status = status;
+	o->r.len = len;
+	o->r.reserved = 0;
+	if (len)
+		memcpy(o->v, v, sizeof(double)*len);
+	if (c->tail)
+		c->tail->next = o;
+	else
+		c->head = o;
+	c->tail = o;
+	pthread_cond_signal(&c->wcond);
+	pthread_mutex_unlock(&c->wlock);
+}
+
+/* Connection writer thread: send the queued replies until the reader
+ * exited and every request got its reply. After a write error the
+ * connection is shut down, waking up the reader, and the replies are
+ * discarded. */
+static void *DaemonWriter(void *arg)
+{
+	struct DaemonConn *c = arg;
+
+	pthread_mutex_lock(&c->wlock);
+	while(1) {
+		struct DaemonOut *o = c->head;
+		int dead = c->dead;
+
+		if (o == NULL) {
+			if (c->closing && c->outstanding == 0)
+				break;
+			pthread_cond_wait(&c->wcond, &c->wlock);
+			continue;
+		}
+		if ((c->head = o->next) == NULL)
+			c->tail = NULL;
+		pthread_mutex_unlock(&c->wlock);
+		if (!dead && (DaemonWrite(c->fd, &o->r, sizeof(o->r)) == -1 ||
+		    (o->r.len &&
+		     DaemonWrite(c->fd, o->v, sizeof(double)*o->r.len) == -1))) {
+			shutdown(c->fd, SHUT_RDWR);
+			dead = 1;
+		}
+		free(o);
+		pthread_mutex_lock(&c->wlock);
+		c->dead |= dead;
+		DaemonReplyDone(c);
+	}
+	pthread_mutex_unlock(&c->wlock);
+	DaemonConnRelease(c);
+	return NULL;
+}
+
+/* Wait until the client can send another request, that is until it
+ * has less than DAEMON_MAXOUTSTANDING replies to read, and count the
+ * request as outstanding. Return -1 if the connection is dead. */
+static int DaemonConnAccept(struct DaemonConn *c)
+{
+	int dead;
+
+	pthread_mutex_lock(&c->wlock);
+	while (c->outstanding >= DAEMON_MAXOUTSTANDING && !c->dead)
+		pthread_cond_wait(&c->rcond, &c->wlock);
+	if (!(dead = c->dead))
+		c->outstanding++;
+	pthread_mutex_unlock(&c->wlock);
+	return dead ? -1 : 0;
+}
+
+/* A request counted by DaemonConnAccept() won't have a reply */
+static void DaemonConnCancel(struct DaemonConn *c)
+{
+	pthread_mutex_lock(&c->wlock);
+	DaemonReplyDone(c);
+	pthread_mutex_unlock(&c->wlock);
+}
+
+/* Return the model whose oldest queued request is the oldest one, or
+ * NULL if there are no queued requests. Called with the lock held. */
+static struct DaemonModel *DaemonNextModel(void)
+{
+	struct DaemonModel *best = NULL;
+	int j;
+
+	for (j = 0; j < nmodels; j++) {
+		struct DaemonModel *m = &models[j];
+
+		if (m->pending && (!best || m->head->arrival < best->head->arrival))
+			best = m;
+	}
+	return best;
+}
+
+/* Worker thread: run the micro-batches */
+static void *DaemonWorker(void *arg)
+{
+	struct DaemonRequest **batch;
+	double *input, *output;
+	int j, n, maxin = 0, maxout = 0;
+
+	for (j = 0; j < nmodels; j++) {
+		maxin = MAX(maxin, models[j].inputs);
+		maxout = MAX(maxout, models[j].outputs);
+	}
+	batch = malloc(sizeof(*batch)*opt_maxbatch);
+	input = malloc(sizeof(double)*opt_maxbatch*maxin);
+	output = malloc(sizeof(double)*opt_maxbatch*maxout);
+	if (!batch || !input || !output) {
+		fprintf(stderr, "Out of memory starting the workers\n");
+		exit(1);
+	}
+	pthread_mutex_lock(&lock);
+	while(1) {
+		struct DaemonModel *m = DaemonNextModel();
+		double deadline;
+		int err;
+
+		if (m == NULL) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		deadline = m->head->arrival+opt_window;
+		if (m->pending < opt_maxbatch && DaemonTime() < deadline) {
+			struct timespec ts;
+
+			ts.tv_sec = (time_t)deadline;
+			ts.tv_nsec = (long)((deadline-ts.tv_sec)*1e9);
+			pthread_cond_timedwait(&cond, &lock, &ts);
+			continue;
+		}
+		for (n = 0; n < opt_maxbatch && m->head; n++) {
+			batch[n] = m->head;
+			m->head = m->head->next;
+		}
+		if (m->head == NULL)
+			m->tail = NULL;
+		m->pending -= n;
+		served += n;
+		batches++;
+		/* More requests may be ready for the other workers */
+		if (m->pending)
+			pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&lock);
+
+		for (j = 0; j < n; j++)
+			memcpy(input+j*m->inputs, batch[j]->input,
+				sizeof(double)*m->inputs);
+		err = AnnSimulateBatch(m->net, input, output, n);
+		for (j = 0; j < n; j++) {
+			if (err)
+				DaemonReply(batch[j]->conn, batch[j]->id,
+					GNEGNUD_ERR_OOM, NULL, 0);
+			else
+				DaemonReply(batch[j]->conn, batch[j]->id,
+					GNEGNUD_OK, output+j*m->outputs,
+					m->outputs);
+			DaemonConnRelease(batch[j]->conn);
+			free(batch[j]);
+		}
+		pthread_mutex_lock(&lock);
+	}
+	return NULL;
+}
+
+/* Discard 'len' doubles from the connection. Return non-zero on error */
+static int DaemonSkip(int fd, uint32_t len)
+{
+	double buf[256];
+
+	while (len) {
+		uint32_t n = MIN(len, 256);
+
+		if (DaemonRead(fd, buf, sizeof(double)*n) == -1)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Connection reader thread: parse the requests and queue them. Every
+ * request is counted as outstanding from the moment it is read until
+ * its reply is sent. */
+static void *DaemonReader(void *arg)
+{
+	struct DaemonConn *c = arg;
+	struct GnegnudRequest q;
+	double v[2];
+
+	while (DaemonConnAccept(c) == 0) {
+		struct DaemonModel *m;
+		struct DaemonRequest *r;
+
+		if (DaemonRead(c->fd, &q, sizeof(q)) == -1 ||
+		    q.len > GNEGNUD_MAXLEN) {
+			DaemonConnCancel(c);
+			break;
+		}
+		m = q.model < (uint32_t)nmodels ? &models[q.model] : NULL;
+		if (q.op != GNEGNUD_OP_SIMULATE || m == NULL ||
+		    q.len != (uint32_t)m->inputs)
+		{
+			uint32_t status = GNEGNUD_OK, len = 2;
+
+			if (DaemonSkip(c->fd, q.len) == -1) {
+				DaemonConnCancel(c);
+				break;
+			}
+			if (q.op == GNEGNUD_OP_STATS) {
+				pthread_mutex_lock(&lock);
+				v[0] = served;
+				v[1] = batches;
+				pthread_mutex_unlock(&lock);
+			} else if (q.op != GNEGNUD_OP_INFO &&
+				   q.op != GNEGNUD_OP_SIMULATE) {
+				status = GNEGNUD_ERR_OP;
+			} else if (m == NULL) {
+				status = GNEGNUD_ERR_MODEL;
+			} else if (q.op == GNEGNUD_OP_INFO) {
+				v[0] = m->inputs;
+				v[1] = m->outputs;
+			} else {
+				status = GNEGNUD_ERR_LEN;
+			}
+			if (status != GNEGNUD_OK)
+				len = 0;
+			DaemonReply(c, q.id, status, v, len);
+			continue;
+		}
+		r = malloc(sizeof(*r)+sizeof(double)*m->inputs);
+		if (r == NULL) {
+			if (DaemonSkip(c->fd, q.len) == -1) {
+				DaemonConnCancel(c);
+				break;
+			}
+			DaemonReply(c, q.id, GNEGNUD_ERR_OOM, NULL, 0);
+			continue;
+		}
+		if (DaemonRead(c->fd, r->input, sizeof(double)*q.len) == -1) {
+			free(r);
+			DaemonConnCancel(c);
+			break;
+		}
+		r->next = NULL;
+		r->conn = c;
+		r->id = q.id;
+		__sync_add_and_fetch(&c->refcount, 1);
+		pthread_mutex_lock(&lock);
+		r->arrival = DaemonTime();
+		if (m->tail)
+			m->tail->next = r;
+		else
+			m->head = r;
+		m->tail = r;
+		m->pending++;
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+	/* The writer exits once the replies of the queued requests are sent */
+	pthread_mutex_lock(&c->wlock);
+	c->closing = 1;
+	pthread_cond_signal(&c->wcond);
+	pthread_mutex_unlock(&c->wlock);
+	DaemonConnRelease(c);
+	return NULL;
+}
+
+static void DaemonExit(int sig)
+{
+	unlink(opt_socket);
+	_exit(0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: gnegnud [options] model.ann ?model.ann ...?\n"
+"  -socket <path> Unix domain socket (default " GNEGNUD_SOCKET ")\n"
+"  -maxbatch <n>  max requests per batch (default 32)\n"
+"  -window <us>   max microseconds a request waits for its batch to\n"
+"                 fill up (default 200)\n"
+"  -threads <n>   worker threads running the batches (default 2)\n"
+"Models are numbered from 0 in the order they are given.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un sa;
+	pthread_condattr_t ca;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int j, fd;
+
+	for (j = 1; j < argc && argv[j][0] == '-'; j++) {
+		int last = j == argc-1;
+
+		if (!strcmp(argv[j], "-socket") && !last) {
+			opt_socket = argv[++j];
+		} else if (!strcmp(argv[j], "-maxbatch") && !last) {
+			opt_maxbatch = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-window") && !last) {
+			opt_window = atof(argv[++j])/1e6;
+		} else if (!strcmp(argv[j], "-threads") && !last) {
+			opt_threads = atoi(argv[++j]);
+		} else {
+			usage();
+		}
+	}
+	if (j == argc || opt_maxbatch < 1 || opt_window < 0 ||
+	    opt_threads < 1 || strlen(opt_socket) >= sizeof(sa.sun_path))
+		usage();
+	nmodels = argc-j;
+	if ((models = calloc(nmodels, sizeof(*models))) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (; j < argc; j++) {
+		struct DaemonModel *m = &models[nmodels-(argc-j)];
+
+		m->filename = argv[j];
+		if ((m->net = AnnLoad(argv[j])) == NULL) {
+			fprintf(stderr, "Can't load the net %s\n", argv[j]);
+			exit(1);
+		}
+		m->inputs = INPUT_UNITS(m->net);
+		m->outputs = OUTPUT_UNITS(m->net);
+		printf("model %d: %s, %d inputs, %d outputs\n",
+			nmodels-(argc-j), argv[j], m->inputs, m->outputs);
+	}
+
+	/* The batch deadlines are computed on the monotonic clock */
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &ca);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (j = 0; j < opt_threads; j++) {
+		if (pthread_create(&tid, &attr, DaemonWorker, NULL)) {
+			fprintf(stderr, "Can't create the worker threads\n");
+			exit(1);
+		}
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("socket");
+		exit(1);
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, opt_socket);
+	unlink(opt_socket);
+	if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+	    listen(fd, 128) == -1) {
+		perror(opt_socket);
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, DaemonExit);
+	signal(SIGTERM, DaemonExit);
+	printf("listening on %s\n", opt_socket);
+	fflush(stdout);
+
+	while(1) {
+		struct DaemonConn *c;
+		int cfd = accept(fd, NULL, NULL);
+
+		if (cfd == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				perror("accept");
+			continue;
+		}
+		if ((c = malloc(sizeof(*c))) == NULL) {
+			close(cfd);
+			continue;
+		}
+		memset(c, 0, sizeof(*c));
+		c->fd = cfd;
+		c->refcount = 2;
+		pthread_mutex_init(&c->wlock, NULL);
+		pthread_cond_init(&c->wcond, NULL);
+		pthread_cond_init(&c->rcond, NULL);
+		if (pthread_create(&tid, &attr, DaemonWriter, c)) {
+			c->refcount = 1;
+			DaemonConnRelease(c);
+			continue;
+		}
+		if (pthread_create(&tid, &attr, DaemonReader, c)) {
+			/* Let the writer exit and release the connection */
+			pthread_mutex_lock(&c->wlock);
+			c->closing = 1;
+			pthread_cond_signal(&c->wcond);
+			pthread_mutex_unlock(&c->wlock);
+			DaemonConnRelease(c);
+		}
+	}
+	return 0;
+}
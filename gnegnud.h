@@ -0,0 +1,50 @@
+#ifndef __GNEGNUD_H
+#define __GNEGNUD_H
+
+#include <stdint.h>
+
+/* gnegnud protocol.
+ * Clients connect to the daemon Unix domain socket and send requests,
+ * every one made of a GnegnudRequest header followed by 'len' doubles.
+ * Every request gets a reply made of a GnegnudReply header followed by
+ * 'len' doubles, with the 'id' of the request. Requests are pipelined:
+ * a client can send more requests before reading the replies, and the
+ * replies may arrive in a different order. All the fields are in the
+ * native byte order, since client and daemon run on the same host.
+ *
+ * GNEGNUD_OP_SIMULATE: the doubles are the inputs of the net 'model'
+ * (models are numbered in the order they are given to the daemon), the
+ * reply carries the outputs.
+ * GNEGNUD_OP_INFO: no doubles, the reply carries the number of inputs
+ * and outputs of the net 'model'.
+ * GNEGNUD_OP_STATS: no doubles, the reply carries the number of
+ * simulate requests served and of batches run since the daemon started. */
+#define GNEGNUD_SOCKET "/tmp/gnegnud.sock"
+
+#define GNEGNUD_OP_SIMULATE 0
+#define GNEGNUD_OP_INFO 1
+#define GNEGNUD_OP_STATS 2
+
+#define GNEGNUD_OK 0
+#define GNEGNUD_ERR_OP 1	/* unknown operation */
+#define GNEGNUD_ERR_MODEL 2	/* no such model */
+#define GNEGNUD_ERR_LEN 3	/* wrong number of inputs */
+#define GNEGNUD_ERR_OOM 4	/* out of memory */
+
+#define GNEGNUD_MAXLEN (1<<20)	/* longer requests close the connection */
+
+struct GnegnudRequest {
+	uint32_t op;		/* GNEGNUD_OP_* */
+	uint32_t model;
+	uint32_t id;		/* returned in the reply */
+	uint32_t len;		/* doubles following the header */
+};
+
+struct GnegnudReply {
+	uint32_t id;
+	uint32_t status;	/* GNEGNUD_OK or GNEGNUD_ERR_* */
+	uint32_t len;		/* doubles following the header */
+	uint32_t reserved;
+};
+
+#endif /* __GNEGNUD_H */
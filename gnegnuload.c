@@ -0,0 +1,328 @@
+/* gnegnuload - load generator for gnegnud
+ * Copyright(C) 2003 Salvatore Sanfilippo
+ * All rights reserved.
+ *
+ * Opens 'conns' connections to the daemon and sends simulate requests
+ * with random inputs, reporting the latency percentiles and the
+ * throughput. In closed loop mode (the default) every connection keeps
+ * 'inflight' requests outstanding. With -rate the requests are sent at a
+ * fixed total rate no matter how fast the replies arrive, and the latency
+ * is measured from the time the request was scheduled, so that a slow
+ * daemon is not hidden by the client slowing down. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "gnegnud.h"
+
+/* Options */
+static char *opt_socket = GNEGNUD_SOCKET;
+static int opt_model = 0;
+static int opt_conns = 4;
+static int opt_requests = 10000;
+static int opt_inflight = 1;
+static double opt_rate = 0;
+
+struct LoadConn {
+	int fd;
+	int requests;		/* requests to send on this connection */
+	int inputs;
+	double *sent;		/* sent[id] time request id was (scheduled to be) sent */
+	double *latency;	/* latency[id] */
+	int errors;
+	double start;		/* open loop schedule start */
+	unsigned int seed;	/* random inputs */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* a reply arrived */
+	int inflight;
+};
+
+static double LoadTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static int LoadWrite(int fd, void *buf, size_t len)
+{
+	char *b = buf;
+
+	while (len) {
+		ssize_t n = write(fd, b, len);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int LoadRead(int fd, void *buf, size_t len)
+{
+	char *b = buf;
+
+	while (len) {
+		ssize_t n = read(fd, b, len);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int LoadConnect(void)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, opt_socket, sizeof(sa.sun_path)-1);
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Send a request without inputs and read the two doubles of the reply.
+ * Return non-zero on error. */
+static int LoadQuery(int fd, uint32_t op, double *v)
+{
+	struct GnegnudRequest q;
+	struct GnegnudReply r;
+
+	q.op = op;
+	q.model = opt_model;
+	q.id = 0;
+	q.len = 0;
+	if (LoadWrite(fd, &q, sizeof(q)) == -1 ||
+	    LoadRead(fd, &r, sizeof(r)) == -1 ||
+	    r.status != GNEGNUD_OK || r.len != 2 ||
+	    LoadRead(fd, v, sizeof(double)*2) == -1)
+		return 1;
+	return 0;
+}
+
+/* Reader thread of a connection: record the latency of the replies */
+static void *LoadReader(void *arg)
+{
+	struct LoadConn *c = arg;
+	double *out = NULL;
+	int j;
+
+	for (j = 0; j < c->requests; j++) {
+		struct GnegnudReply r;
+		double now;
+
+		if (LoadRead(c->fd, &r, sizeof(r)) == -1 ||
+		    r.len > GNEGNUD_MAXLEN || r.id >= (uint32_t)c->requests ||
+		    (out = realloc(out, sizeof(double)*(r.len+1))) == NULL ||
+		    LoadRead(c->fd, out, sizeof(double)*r.len) == -1) {
+			fprintf(stderr, "Connection to the daemon lost\n");
+			exit(1);
+		}
+		now = LoadTime();
+		pthread_mutex_lock(&c->lock);
+		c->latency[r.id] = now-c->sent[r.id];
+		if (r.status != GNEGNUD_OK)
+			c->errors++;
+		c->inflight--;
+		pthread_cond_signal(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+	}
+	free(out);
+	return NULL;
+}
+
+/* Sender thread of a connection */
+static void *LoadSender(void *arg)
+{
+	struct LoadConn *c = arg;
+	struct GnegnudRequest *q;
+	double *input;
+	int j, k;
+
+	q = malloc(sizeof(*q)+sizeof(double)*c->inputs);
+	if (q == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	input = (double*)(q+1);
+	for (j = 0; j < c->requests; j++) {
+		for (k = 0; k < c->inputs; k++)
+			input[k] = (double)rand_r(&c->seed)/RAND_MAX;
+		q->op = GNEGNUD_OP_SIMULATE;
+		q->model = opt_model;
+		q->id = j;
+		q->len = c->inputs;
+		pthread_mutex_lock(&c->lock);
+		if (opt_rate > 0) {
+			double when = c->start+j*opt_conns/opt_rate;
+			double wait = when-LoadTime();
+
+			pthread_mutex_unlock(&c->lock);
+			if (wait > 0) {
+				struct timespec ts;
+
+				ts.tv_sec = (time_t)wait;
+				ts.tv_nsec = (long)((wait-ts.tv_sec)*1e9);
+				nanosleep(&ts, NULL);
+			}
+			pthread_mutex_lock(&c->lock);
+			c->sent[j] = when;
+		} else {
+			while (c->inflight >= opt_inflight)
+				pthread_cond_wait(&c->cond, &c->lock);
+			c->sent[j] = LoadTime();
+		}
+		c->inflight++;
+		pthread_mutex_unlock(&c->lock);
+		if (LoadWrite(c->fd, q, sizeof(*q)+sizeof(double)*c->inputs) == -1) {
+			fprintf(stderr, "Connection to the daemon lost\n");
+			exit(1);
+		}
+	}
+	free(q);
+	return NULL;
+}
+
+static int LoadCmpDouble(const void *a, const void *b)
+{
+	double x = *(double*)a, y = *(double*)b;
+
+	return x < y ? -1 : (x > y);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: gnegnuload [options]\n"
+"  -socket <path> daemon socket (default " GNEGNUD_SOCKET ")\n"
+"  -model <n>     model to simulate (default 0)\n"
+"  -conns <n>     concurrent connections (default 4)\n"
+"  -requests <n>  total requests (default 10000)\n"
+"  -inflight <n>  outstanding requests per connection in closed loop\n"
+"                 mode (default 1)\n"
+"  -rate <r>      open loop mode: send r requests per second in total\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct LoadConn *conns;
+	pthread_t *tid;
+	double info[2], before[2], after[2], *lat, start, elapsed;
+	int j, k, n = 0, errors = 0, fd;
+
+	for (j = 1; j < argc; j++) {
+		int last = j == argc-1;
+
+		if (!strcmp(argv[j], "-socket") && !last) {
+			opt_socket = argv[++j];
+		} else if (!strcmp(argv[j], "-model") && !last) {
+			opt_model = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-conns") && !last) {
+			opt_conns = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-requests") && !last) {
+			opt_requests = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-inflight") && !last) {
+			opt_inflight = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-rate") && !last) {
+			opt_rate = atof(argv[++j]);
+		} else {
+			usage();
+		}
+	}
+	if (opt_conns < 1 || opt_requests < opt_conns || opt_inflight < 1 ||
+	    opt_rate < 0)
+		usage();
+
+	/* Model size and daemon counters before the run */
+	if ((fd = LoadConnect()) == -1) {
+		perror(opt_socket);
+		exit(1);
+	}
+	if (LoadQuery(fd, GNEGNUD_OP_INFO, info) ||
+	    LoadQuery(fd, GNEGNUD_OP_STATS, before)) {
+		fprintf(stderr, "No model %d on the daemon\n", opt_model);
+		exit(1);
+	}
+
+	conns = calloc(opt_conns, sizeof(*conns));
+	tid = malloc(sizeof(pthread_t)*2*opt_conns);
+	lat = malloc(sizeof(double)*opt_requests);
+	if (!conns || !tid || !lat) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	start = LoadTime();
+	for (j = 0; j < opt_conns; j++) {
+		struct LoadConn *c = &conns[j];
+
+		c->requests = opt_requests/opt_conns +
+			(j < opt_requests%opt_conns);
+		c->inputs = (int)info[0];
+		c->sent = malloc(sizeof(double)*c->requests);
+		c->latency = malloc(sizeof(double)*c->requests);
+		c->start = opt_rate > 0 ? start+j/opt_rate : start;
+		c->seed = j+1;
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->cond, NULL);
+		if (!c->sent || !c->latency ||
+		    (c->fd = LoadConnect()) == -1 ||
+		    pthread_create(&tid[2*j], NULL, LoadReader, c) ||
+		    pthread_create(&tid[2*j+1], NULL, LoadSender, c)) {
+			fprintf(stderr, "Can't start connection %d\n", j);
+			exit(1);
+		}
+	}
+	for (j = 0; j < 2*opt_conns; j++)
+		pthread_join(tid[j], NULL);
+	elapsed = LoadTime()-start;
+	if (LoadQuery(fd, GNEGNUD_OP_STATS, after)) {
+		fprintf(stderr, "Connection to the daemon lost\n");
+		exit(1);
+	}
+
+	for (j = 0; j < opt_conns; j++) {
+		for (k = 0; k < conns[j].requests; k++)
+			lat[n++] = conns[j].latency[k];
+		errors += conns[j].errors;
+		close(conns[j].fd);
+	}
+	qsort(lat, n, sizeof(double), LoadCmpDouble);
+	printf("model %d: %d inputs, %d outputs\n", opt_model,
+		(int)info[0], (int)info[1]);
+	printf("requests   %d (%d errors) in %.3f s\n", n, errors, elapsed);
+	printf("throughput %.0f requests/s\n", n/elapsed);
+	printf("latency    p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+		"p99.9 %.1f us, max %.1f us\n",
+		lat[n/2]*1e6, lat[(int)(n*0.9)]*1e6, lat[(int)(n*0.99)]*1e6,
+		lat[(int)(n*0.999)]*1e6, lat[n-1]*1e6);
+	if (after[1] > before[1])
+		printf("batches    %.0f, %.1f requests per batch\n",
+			after[1]-before[1],
+			(after[0]-before[0])/(after[1]-before[1]));
+	close(fd);
+	return 0;
+}
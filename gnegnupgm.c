@@ -0,0 +1,206 @@
+/* gnegnupgm - PGM images for the gnegnu command line tools
+ * Copyright(C) 2003 Salvatore Sanfilippo
+ * All rights reserved.
+ *
+ * Images are split in blocks of bw*bh pixels, from left to right and
+ * from top to bottom, the pixels at the right and bottom borders not
+ * filling a whole block being ignored. Every block is a sample of the
+ * dataset of an image compression net, like the one of imgcompr.tcl:
+ * the block pixels are both the inputs and the targets. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "gnegnupgm.h"
+
+/* Return the next number of the PGM header, skipping blanks and
+ * comments, or -1 on error. */
+static int PgmHeaderInt(FILE *fp)
+{
+	int c, v = 0, digits = 0;
+
+	while ((c = getc(fp)) != EOF) {
+		if (c == '#') {
+			while ((c = getc(fp)) != EOF && c != '\n')
+				;
+		} else if (!isspace(c)) {
+			break;
+		}
+	}
+	while (c != EOF && isdigit(c)) {
+		if (v > 100000000)
+			return -1;
+		v = v*10+c-'0';
+		digits++;
+		c = getc(fp);
+	}
+	/* The single blank after the last header value is not pushed
+	 * back: the binary pixels start right after it. */
+	if (!digits || (c != EOF && !isspace(c)))
+		return -1;
+	return v;
+}
+
+/* Create an image with all the pixels set to zero.
+ * On out of memory NULL is returned. */
+struct PgmImage *PgmCreate(int width, int height)
+{
+	struct PgmImage *img;
+
+	if ((img = malloc(sizeof(*img))) == NULL)
+		return NULL;
+	img->width = width;
+	img->height = height;
+	if ((img->pixel = calloc((size_t)width*height+1, sizeof(double))) == NULL) {
+		free(img);
+		return NULL;
+	}
+	return img;
+}
+
+void PgmFree(struct PgmImage *img)
+{
+	free(img->pixel);
+	free(img);
+}
+
+/* Load a binary (P5) or plain (P2) PGM image.
+ * Return NULL if the file can't be read or is not a valid PGM image,
+ * or on out of memory. */
+struct PgmImage *PgmLoad(char *filename)
+{
+	FILE *fp;
+	struct PgmImage *img = NULL;
+	int width, height, maxval, plain;
+	size_t j, n;
+	char magic[2];
+
+	if ((fp = fopen(filename, "rb")) == NULL)
+		return NULL;
+	if (fread(magic, 2, 1, fp) != 1 || magic[0] != 'P' ||
+	    (magic[1] != '5' && magic[1] != '2'))
+		goto err;
+	plain = magic[1] == '2';
+	width = PgmHeaderInt(fp);
+	height = PgmHeaderInt(fp);
+	maxval = PgmHeaderInt(fp);
+	if (width < 1 || height < 1 || maxval < 1 || maxval > 65535 ||
+	    (img = PgmCreate(width, height)) == NULL)
+		goto err;
+	n = (size_t)width*height;
+	for (j = 0; j < n; j++) {
+		int v;
+
+		if (plain) {
+			if (fscanf(fp, "%d", &v) != 1)
+				goto err;
+		} else if (maxval < 256) {
+			if ((v = getc(fp)) == EOF)
+				goto err;
+		} else {
+			int hi = getc(fp), lo = getc(fp);
+
+			if (hi == EOF || lo == EOF)
+				goto err;
+			v = (hi << 8) | lo;
+		}
+		if (v < 0 || v > maxval)
+			goto err;
+		img->pixel[j] = (double)v/maxval;
+	}
+	fclose(fp);
+	return img;
+err:
+	if (img)
+		PgmFree(img);
+	fclose(fp);
+	return NULL;
+}
+
+/* Save the image as a binary PGM with 8 bits pixels, the values out of
+ * the [0,1] range being saturated.
+ * Return non-zero on error, with errno set. */
+int PgmSave(struct PgmImage *img, char *filename)
+{
+	FILE *fp;
+	size_t j, n = (size_t)img->width*img->height;
+	int err;
+
+	if ((fp = fopen(filename, "wb")) == NULL)
+		return 1;
+	fprintf(fp, "P5\n%d %d\n255\n", img->width, img->height);
+	for (j = 0; j < n; j++) {
+		double v = img->pixel[j]*255+0.5;
+
+		putc(v < 0 ? 0 : (v > 255 ? 255 : (int)v), fp);
+	}
+	err = ferror(fp);
+	if (fclose(fp) != 0 || err) {
+		remove(filename);
+		return 1;
+	}
+	return 0;
+}
+
+/* Return the number of blocks of bw*bh pixels of the image */
+int PgmBlocks(struct PgmImage *img, int bw, int bh)
+{
+	return (img->width/bw)*(img->height/bh);
+}
+
+/* Copy the pixels of the block 'k' of the image at 'dst' */
+void PgmGetBlock(struct PgmImage *img, int bw, int bh, int k, double *dst)
+{
+	int x = (k % (img->width/bw))*bw, y = (k / (img->width/bw))*bh, j;
+
+	for (j = 0; j < bh; j++) {
+		double *row = img->pixel+(size_t)(y+j)*img->width+x;
+		int i;
+
+		for (i = 0; i < bw; i++)
+			*dst++ = row[i];
+	}
+}
+
+/* Set the pixels of the block 'k' of the image from 'src' */
+void PgmSetBlock(struct PgmImage *img, int bw, int bh, int k, double *src)
+{
+	int x = (k % (img->width/bw))*bw, y = (k / (img->width/bw))*bh, j;
+
+	for (j = 0; j < bh; j++) {
+		double *row = img->pixel+(size_t)(y+j)*img->width+x;
+		int i;
+
+		for (i = 0; i < bw; i++)
+			row[i] = *src++;
+	}
+}
+
+/* Return the dataset made of the blocks of the 'n' images, stored as
+ * 'type' (ANN_DATA_U8 and ANN_DATA_U16 cover the [0,1] range), with
+ * the pixels of every block as both inputs and targets.
+ * On out of memory NULL is returned. */
+struct AnnDataset *PgmDataset(struct PgmImage **img, int n, int bw, int bh, int type)
+{
+	struct AnnDataset *ds;
+	double *block, scale = type == ANN_DATA_U16 ? 1.0/65535 : 1.0/255;
+	int j, k, setlen = 0, s = 0;
+
+	for (j = 0; j < n; j++)
+		setlen += PgmBlocks(img[j], bw, bh);
+	if ((block = malloc(sizeof(double)*bw*bh)) == NULL)
+		return NULL;
+	if ((ds = AnnDatasetCreate(type, setlen, bw*bh, bw*bh, scale, 0)) == NULL) {
+		free(block);
+		return NULL;
+	}
+	for (j = 0; j < n; j++) {
+		for (k = 0; k < PgmBlocks(img[j], bw, bh); k++) {
+			PgmGetBlock(img[j], bw, bh, k, block);
+			AnnDatasetSetSample(ds, s++, block, block);
+		}
+	}
+	free(block);
+	return ds;
+}
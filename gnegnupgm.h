@@ -0,0 +1,23 @@
+#ifndef __GNEGNUPGM_H
+#define __GNEGNUPGM_H
+
+#include "nn.h"
+
+/* PGM images for the command line tools. Pixels are kept as doubles in
+ * the [0,1] range, one row after the other. */
+struct PgmImage {
+	int width;
+	int height;
+	double *pixel;
+};
+
+struct PgmImage *PgmLoad(char *filename);
+int PgmSave(struct PgmImage *img, char *filename);
+struct PgmImage *PgmCreate(int width, int height);
+void PgmFree(struct PgmImage *img);
+int PgmBlocks(struct PgmImage *img, int bw, int bh);
+void PgmGetBlock(struct PgmImage *img, int bw, int bh, int k, double *dst);
+void PgmSetBlock(struct PgmImage *img, int bw, int bh, int k, double *src);
+struct AnnDataset *PgmDataset(struct PgmImage **img, int n, int bw, int bh, int type);
+
+#endif /* __GNEGNUPGM_H */
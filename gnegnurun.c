@@ -0,0 +1,232 @@
+/* gnegnu-run - run a net from the command line
+ * Copyright(C) 2003 Salvatore Sanfilippo
+ * All rights reserved.
+ *
+ * Runs a net saved with AnnSave() over all the samples of a training set
+ * file saved with AnnDatasetSave(), or over the blocks of a PGM image
+ * (see gnegnupgm.c), reporting the error against the targets and the
+ * throughput. The outputs of a training set are written as text, one
+ * sample per line, the outputs of a PGM image as a new PGM image.
+ * The samples are split among the threads in contiguous ranges, and
+ * every thread runs its range with AnnSimulateBatch() 'batch' samples
+ * at a time: the net is only read, so all the threads share it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "gnegnu.h"
+#include "gnegnupgm.h"
+
+/* Options */
+static char *opt_output = NULL;
+static int opt_threads = 1;
+static int opt_batch = 32;
+static int opt_sigmoid = -1;
+static int opt_bw = 8, opt_bh = 8;
+static int opt_quiet = 0;
+
+struct RunWorker {
+	struct Ann *net;
+	struct AnnDataset *ds;
+	int first, last;	/* samples first to last-1 */
+	double *output;		/* outputs of all the samples */
+	double toterr;		/* error of the range */
+	double maxerr;
+	int oom;
+};
+
+/* Run the samples of a range, storing their outputs and error */
+static void *RunWorkerMain(void *arg)
+{
+	struct RunWorker *w = arg;
+	int inputs = w->ds->inputs, outputs = w->ds->outputs, j, k, i;
+	double *in, *target;
+
+	in = malloc(sizeof(double)*inputs*opt_batch);
+	target = malloc(sizeof(double)*outputs);
+	if (in == NULL || target == NULL) {
+		w->oom = 1;
+		goto out;
+	}
+	for (j = w->first; j < w->last; j += opt_batch) {
+		int n = MIN(opt_batch, w->last-j);
+		double *out = w->output+(size_t)j*outputs;
+
+		for (k = 0; k < n; k++)
+			AnnDatasetGetSample(w->ds, j+k, in+k*inputs, NULL);
+		if (AnnSimulateBatch(w->net, in, out, n)) {
+			w->oom = 1;
+			goto out;
+		}
+		/* Same error of AnnGlobalError() */
+		for (k = 0; k < n; k++) {
+			double e = 0;
+
+			AnnDatasetGetSample(w->ds, j+k, in, target);
+			for (i = 0; i < outputs; i++) {
+				double t = target[i]-out[k*outputs+i];
+
+				e += t*t;
+			}
+			e *= .5;
+			w->toterr += e;
+			if (e > w->maxerr)
+				w->maxerr = e;
+		}
+	}
+out:
+	free(in);
+	free(target);
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: gnegnu-run [options] net.ann data\n"
+"Data is a training set file, or a PGM image whose blocks are both the\n"
+"inputs and the targets.\n"
+"  -o <file>       write the outputs in the file (default: standard output\n"
+"                  for training sets, required for PGM images)\n"
+"  -threads <n>    threads running the samples (default 1)\n"
+"  -batch <n>      samples per AnnSimulateBatch() call (default 32)\n"
+"  -sigmoid <mode> exact, fast or table (default: the one of the net)\n"
+"  -block <w>x<h>  PGM block size (default 8x8)\n"
+"  -quiet          only report the error and the throughput\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct Ann *net;
+	struct AnnDataset *ds;
+	struct PgmImage *img = NULL;
+	struct RunWorker *w;
+	pthread_t *tid;
+	double *output, start, elapsed, toterr = 0, maxerr = 0;
+	int j, k;
+
+	for (j = 1; j < argc && argv[j][0] == '-'; j++) {
+		int last = j == argc-1;
+
+		if (!strcmp(argv[j], "-o") && !last) {
+			opt_output = argv[++j];
+		} else if (!strcmp(argv[j], "-threads") && !last) {
+			opt_threads = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-batch") && !last) {
+			opt_batch = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-sigmoid") && !last) {
+			if ((opt_sigmoid = AnnSigmoidByName(argv[++j])) == -1)
+				usage();
+		} else if (!strcmp(argv[j], "-block") && !last) {
+			if (sscanf(argv[++j], "%dx%d", &opt_bw, &opt_bh) != 2)
+				usage();
+		} else if (!strcmp(argv[j], "-quiet")) {
+			opt_quiet = 1;
+		} else {
+			usage();
+		}
+	}
+	if (argc-j != 2 || opt_threads < 1 || opt_batch < 1 ||
+	    opt_bw < 1 || opt_bh < 1)
+		usage();
+	if ((net = AnnLoad(argv[j])) == NULL) {
+		fprintf(stderr, "Can't load the net %s\n", argv[j]);
+		exit(1);
+	}
+	if (opt_sigmoid != -1)
+		AnnSetSigmoid(net, opt_sigmoid);
+	if ((ds = AnnDatasetRead(argv[j+1])) == NULL) {
+		if ((img = PgmLoad(argv[j+1])) == NULL) {
+			fprintf(stderr, "%s is not a training set file or a "
+				"PGM image\n", argv[j+1]);
+			exit(1);
+		}
+		if (opt_output == NULL && !opt_quiet)
+			usage();
+		if ((ds = PgmDataset(&img, 1, opt_bw, opt_bh,
+		    ANN_DATA_DOUBLE)) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	if (INPUT_UNITS(net) != ds->inputs || OUTPUT_UNITS(net) != ds->outputs) {
+		fprintf(stderr, "The net units don't match the data, "
+			"%d inputs and %d outputs\n", ds->inputs, ds->outputs);
+		exit(1);
+	}
+
+	output = malloc(sizeof(double)*((size_t)ds->setlen*ds->outputs+1));
+	w = calloc(opt_threads, sizeof(*w));
+	tid = malloc(sizeof(pthread_t)*opt_threads);
+	if (!output || !w || !tid) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	start = AnnTime();
+	for (k = 0; k < opt_threads; k++) {
+		w[k].net = net;
+		w[k].ds = ds;
+		w[k].first = (int)((long long)ds->setlen*k/opt_threads);
+		w[k].last = (int)((long long)ds->setlen*(k+1)/opt_threads);
+		w[k].output = output;
+		if (pthread_create(&tid[k], NULL, RunWorkerMain, &w[k])) {
+			fprintf(stderr, "Can't create the threads\n");
+			exit(1);
+		}
+	}
+	/* The errors are added in the same order for any number of threads */
+	for (k = 0; k < opt_threads; k++) {
+		pthread_join(tid[k], NULL);
+		if (w[k].oom) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		toterr += w[k].toterr;
+		if (w[k].maxerr > maxerr)
+			maxerr = w[k].maxerr;
+	}
+	elapsed = AnnTime()-start;
+
+	if (img) {
+		/* Rebuild the image from the output blocks */
+		for (k = 0; k < ds->setlen; k++)
+			PgmSetBlock(img, opt_bw, opt_bh, k,
+				output+(size_t)k*ds->outputs);
+		if (opt_output && PgmSave(img, opt_output)) {
+			perror(opt_output);
+			exit(1);
+		}
+	} else if (!opt_quiet) {
+		FILE *fp = stdout;
+
+		if (opt_output && (fp = fopen(opt_output, "w")) == NULL) {
+			perror(opt_output);
+			exit(1);
+		}
+		for (j = 0; j < ds->setlen; j++) {
+			for (k = 0; k < ds->outputs; k++)
+				fprintf(fp, k ? " %.17g" : "%.17g",
+					output[(size_t)j*ds->outputs+k]);
+			fputc('\n', fp);
+		}
+		if (fp != stdout && fclose(fp) != 0) {
+			perror(opt_output);
+			exit(1);
+		}
+	}
+	fprintf(stderr, "%d samples in %.3f s, %.0f samples/s, "
+		"max error %.6f, mean error %.6f\n", ds->setlen, elapsed,
+		ds->setlen/elapsed, maxerr,
+		ds->setlen ? toterr/ds->setlen : 0);
+	free(output);
+	free(w);
+	free(tid);
+	if (img)
+		PgmFree(img);
+	AnnDatasetFree(ds);
+	AnnFree(net);
+	return 0;
+}
@@ -0,0 +1,357 @@
+/* gnegnu-train - train a net from the command line
+ * Copyright(C) 2003 Salvatore Sanfilippo
+ * All rights reserved.
+ *
+ * Trains a new net, or continues training a net or checkpoint saved with
+ * AnnSave() / AnnCheckpoint(), on a training set file saved with
+ * AnnDatasetSave() or on the blocks of PGM images (see gnegnupgm.c),
+ * and saves the result with AnnSave(). It uses libgnegnu only, without
+ * the Tcl interpreter. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "gnegnu.h"
+#include "gnegnupgm.h"
+
+/* Options */
+static char *opt_units = NULL;
+static char *opt_load = NULL;
+static char *opt_output = NULL;
+static char *opt_savedata = NULL;
+static char *opt_checkpoint = NULL;
+static char *opt_validation = NULL;
+static int opt_algo = 0;
+static int opt_threads = 1;
+static int opt_epochs = 1000;
+static double opt_maxerr = 0;
+static double opt_learnrate = -1;
+static double opt_momentum = -1;
+static int opt_sigmoid = -1;
+static int opt_activation = -1;
+static int opt_store = ANN_DATA_U8;
+static int opt_bw = 8, opt_bh = 8;
+static long long opt_seed = -1;
+static int opt_shuffle = 0;
+static double opt_importance = 0;
+static int opt_ckevery = 0;
+static double opt_ckseconds = 0;
+static int opt_every = 0;
+static int opt_valevery = 1;
+static int opt_patience = 0;
+
+/* Progress report every 'opt_every' epochs */
+static int TrainProgress(struct Ann *net, struct AnnEpochStats *st, void *privdata)
+{
+	printf("epoch %d: max error %.6f, mean error %.6f, %.3f ms\n",
+		net->epochs, st->maxerr, st->meanerr, st->time*1e3);
+	fflush(stdout);
+	return 0;
+}
+
+/* Load a training set file, or the blocks of a single PGM image */
+static struct AnnDataset *TrainLoadValidation(char *filename)
+{
+	struct AnnDataset *ds;
+	struct PgmImage *img;
+
+	if ((ds = AnnDatasetRead(filename)) != NULL)
+		return ds;
+	if ((img = PgmLoad(filename)) == NULL) {
+		fprintf(stderr, "%s is not a training set file or a PGM image\n",
+			filename);
+		exit(1);
+	}
+	ds = PgmDataset(&img, 1, opt_bw, opt_bh, opt_store);
+	PgmFree(img);
+	if (ds == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return ds;
+}
+
+/* Create the net for the dataset, with the units given by -units from
+ * the output layer to the input one like ann::create, or with a hidden
+ * layer of eight units. */
+static struct Ann *TrainCreateNet(struct AnnDataset *ds)
+{
+	int units[64], layers = 0;
+	char *p = opt_units;
+
+	if (p == NULL) {
+		units[0] = ds->outputs;
+		units[1] = 8;
+		units[2] = ds->inputs;
+		layers = 3;
+	} else {
+		while (*p && layers < 64) {
+			char *end;
+
+			units[layers] = strtol(p, &end, 10);
+			if (end == p || units[layers] < 1)
+				return NULL;
+			layers++;
+			p = end+strspn(end, " ,");
+		}
+		if (layers < 2)
+			return NULL;
+	}
+	if (units[0] != ds->outputs || units[layers-1] != ds->inputs) {
+		fprintf(stderr, "The net units don't match the dataset, "
+			"%d inputs and %d outputs\n", ds->inputs, ds->outputs);
+		exit(1);
+	}
+	return AnnCreateNet(layers, units);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: gnegnu-train [options] -o net.ann data ?data ...?\n"
+"Data is a training set file, or PGM images whose blocks are both the\n"
+"inputs and the targets.\n"
+"  -o <file>            save the trained net in the file (required)\n"
+"  -units <list>        units of the new net from the output layer to the\n"
+"                       input one, like ann::create (default: outputs 8\n"
+"                       inputs)\n"
+"  -load <file>         continue training the saved net or checkpoint\n"
+"  -algo <name>         rprop, irprop-, irprop+, bbprop, obprop, bbpropm,\n"
+"                       obpropm, lm, lbfgs, scg (default rprop)\n"
+"  -threads <n>         training threads (default 1)\n"
+"  -epochs <n>          max epochs (default 1000)\n"
+"  -maxerr <e>          stop once the max error is below e (default 0)\n"
+"  -learnrate <r>       learning rate of the backprop algorithms\n"
+"  -momentum <m>        momentum of the backprop algorithms\n"
+"  -sigmoid <mode>      exact, fast or table\n"
+"  -activation <name>   activation of all the non input layers\n"
+"  -store <type>        PGM samples kept as double, u8 or u16 (default u8)\n"
+"  -block <w>x<h>       PGM block size (default 8x8)\n"
+"  -seed <n>            seed of the initial weights and of shuffling\n"
+"  -shuffle             shuffle the samples every epoch (online algorithms)\n"
+"  -importance <f>      importance sampling of this fraction of samples\n"
+"  -checkpoint <file>   write checkpoints in the file\n"
+"  -checkpointevery <n> epochs between checkpoints (default 100)\n"
+"  -checkpointseconds <s> seconds between checkpoints\n"
+"  -every <n>           report the error every n epochs\n"
+"  -validation <data>   keep the weights with the lowest error on this\n"
+"                       training set file or PGM image\n"
+"  -validateevery <n>   epochs between validations (default 1)\n"
+"  -patience <n>        stop after n validations without improvement\n"
+"                       (default 0, never)\n"
+"  -savedata <file>     save the training set in the file\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct Ann *net;
+	struct AnnDataset *ds = NULL, *vds = NULL;
+	struct PgmImage **img;
+	double start;
+	int j, nimg = 0, ret;
+
+	for (j = 1; j < argc && argv[j][0] == '-'; j++) {
+		int last = j == argc-1;
+
+		if (!strcmp(argv[j], "-o") && !last) {
+			opt_output = argv[++j];
+		} else if (!strcmp(argv[j], "-units") && !last) {
+			opt_units = argv[++j];
+		} else if (!strcmp(argv[j], "-load") && !last) {
+			opt_load = argv[++j];
+		} else if (!strcmp(argv[j], "-algo") && !last) {
+			if ((opt_algo = AnnAlgoByName(argv[++j])) == 0)
+				usage();
+		} else if (!strcmp(argv[j], "-threads") && !last) {
+			opt_threads = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-epochs") && !last) {
+			opt_epochs = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-maxerr") && !last) {
+			opt_maxerr = atof(argv[++j]);
+		} else if (!strcmp(argv[j], "-learnrate") && !last) {
+			opt_learnrate = atof(argv[++j]);
+		} else if (!strcmp(argv[j], "-momentum") && !last) {
+			opt_momentum = atof(argv[++j]);
+		} else if (!strcmp(argv[j], "-sigmoid") && !last) {
+			if ((opt_sigmoid = AnnSigmoidByName(argv[++j])) == -1)
+				usage();
+		} else if (!strcmp(argv[j], "-activation") && !last) {
+			if ((opt_activation = AnnActivationByName(argv[++j])) == -1)
+				usage();
+		} else if (!strcmp(argv[j], "-store") && !last) {
+			char *type = argv[++j];
+
+			if (!strcmp(type, "double"))
+				opt_store = ANN_DATA_DOUBLE;
+			else if (!strcmp(type, "u8"))
+				opt_store = ANN_DATA_U8;
+			else if (!strcmp(type, "u16"))
+				opt_store = ANN_DATA_U16;
+			else
+				usage();
+		} else if (!strcmp(argv[j], "-block") && !last) {
+			if (sscanf(argv[++j], "%dx%d", &opt_bw, &opt_bh) != 2)
+				usage();
+		} else if (!strcmp(argv[j], "-seed") && !last) {
+			opt_seed = atoll(argv[++j]);
+		} else if (!strcmp(argv[j], "-shuffle")) {
+			opt_shuffle = 1;
+		} else if (!strcmp(argv[j], "-importance") && !last) {
+			opt_importance = atof(argv[++j]);
+		} else if (!strcmp(argv[j], "-checkpoint") && !last) {
+			opt_checkpoint = argv[++j];
+		} else if (!strcmp(argv[j], "-checkpointevery") && !last) {
+			opt_ckevery = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-checkpointseconds") && !last) {
+			opt_ckseconds = atof(argv[++j]);
+		} else if (!strcmp(argv[j], "-every") && !last) {
+			opt_every = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-validation") && !last) {
+			opt_validation = argv[++j];
+		} else if (!strcmp(argv[j], "-validateevery") && !last) {
+			opt_valevery = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-patience") && !last) {
+			opt_patience = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-savedata") && !last) {
+			opt_savedata = argv[++j];
+		} else {
+			usage();
+		}
+	}
+	if (j == argc || opt_output == NULL || opt_threads < 1 ||
+	    opt_epochs < 0 || opt_bw < 1 || opt_bh < 1 ||
+	    opt_importance < 0 || opt_importance > 1 ||
+	    opt_ckevery < 0 || opt_ckseconds < 0 || opt_every < 0 ||
+	    opt_valevery < 1 || opt_patience < 0)
+		usage();
+	if (opt_checkpoint && !opt_ckevery && !opt_ckseconds)
+		opt_ckevery = DEFAULT_CHECKPOINT_EVERY;
+
+	/* A training set file, or PGM images */
+	if (argc-j == 1)
+		ds = AnnDatasetRead(argv[j]);
+	if (ds == NULL) {
+		if ((img = malloc(sizeof(*img)*(argc-j))) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		for (; j < argc; j++) {
+			if ((img[nimg++] = PgmLoad(argv[j])) == NULL) {
+				fprintf(stderr, "%s is not a training set file "
+					"or a PGM image\n", argv[j]);
+				exit(1);
+			}
+		}
+		ds = PgmDataset(img, nimg, opt_bw, opt_bh, opt_store);
+		while (nimg)
+			PgmFree(img[--nimg]);
+		free(img);
+		if (ds == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	if (ds->setlen == 0) {
+		fprintf(stderr, "The training set is empty\n");
+		exit(1);
+	}
+	if (opt_savedata && AnnDatasetSave(ds, opt_savedata)) {
+		perror(opt_savedata);
+		exit(1);
+	}
+	if (opt_validation) {
+		vds = TrainLoadValidation(opt_validation);
+		if (vds->inputs != ds->inputs || vds->outputs != ds->outputs) {
+			fprintf(stderr, "The validation set doesn't match the "
+				"training set, %d inputs and %d outputs\n",
+				vds->inputs, vds->outputs);
+			exit(1);
+		}
+	}
+
+	/* The net */
+	if (opt_load) {
+		if ((net = AnnLoad(opt_load)) == NULL) {
+			fprintf(stderr, "Can't load the net %s\n", opt_load);
+			exit(1);
+		}
+		if (INPUT_UNITS(net) != ds->inputs ||
+		    OUTPUT_UNITS(net) != ds->outputs) {
+			fprintf(stderr, "The net units don't match the dataset, "
+				"%d inputs and %d outputs\n", ds->inputs,
+				ds->outputs);
+			exit(1);
+		}
+	} else {
+		if ((net = TrainCreateNet(ds)) == NULL)
+			usage();
+		if (opt_seed != -1) {
+			AnnSetSeed(net, opt_seed);
+			AnnSetRandomWeights(net);
+		}
+	}
+	/* A loaded net keeps its algorithm and state unless -algo is given */
+	if (opt_algo == 0 && !opt_load)
+		opt_algo = ANN_RPROP;
+	if (opt_algo && (net->flags & ANN_ALGOMASK) != opt_algo &&
+	    AnnSetLearningAlgo(net, opt_algo)) {
+		fprintf(stderr, "Can't allocate the state of %s, out of memory "
+			"or too many weights\n", AnnAlgoName(opt_algo));
+		exit(1);
+	}
+	if (opt_activation != -1) {
+		for (j = 0; j < LAYERS(net)-1; j++)
+			AnnSetActivation(net, j, opt_activation);
+	}
+	if (opt_sigmoid != -1)
+		AnnSetSigmoid(net, opt_sigmoid);
+	if (opt_learnrate >= 0)
+		LEARN_RATE(net) = opt_learnrate;
+	if (opt_momentum >= 0)
+		MOMENTUM(net) = opt_momentum;
+	if (opt_seed != -1 && opt_load)
+		AnnSetSeed(net, opt_seed);
+	THREADS(net) = opt_threads;
+	net->shuffle |= opt_shuffle;
+	net->importance = opt_importance;
+	if (opt_every) {
+		net->callback = TrainProgress;
+		net->cbevery = opt_every;
+	}
+	if (opt_checkpoint &&
+	    AnnSetCheckpoint(net, opt_checkpoint, opt_ckevery, opt_ckseconds)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (vds)
+		AnnSetValidation(net, vds, opt_valevery, opt_patience);
+
+	printf("training %s on %d samples, %d inputs, %d outputs, %s\n",
+		AnnAlgoName(net->flags & ANN_ALGOMASK), ds->setlen,
+		ds->inputs, ds->outputs, opt_load ? "resumed" : "new net");
+	start = AnnTime();
+	ret = AnnTrainDataset(net, ds, opt_maxerr, opt_epochs);
+	printf("%s after %d epochs in %.3f s, mean error %.6f\n",
+		ret ? "converged" : "stopped", net->epochs,
+		AnnTime()-start, net->meanerr);
+	if (vds)
+		printf("best validation mean error %.6f at epoch %d, "
+			"saving the net of that epoch\n", net->valerr,
+			net->valepoch);
+	if (net->checkpoint_errno) {
+		errno = net->checkpoint_errno;
+		perror(opt_checkpoint);
+	}
+	if (AnnSave(net, opt_output)) {
+		perror(opt_output);
+		exit(1);
+	}
+	AnnFree(net);
+	AnnDatasetFree(ds);
+	if (vds)
+		AnnDatasetFree(vds);
+	return 0;
+}
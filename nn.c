@@ -7,12 +7,18 @@
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "nn.h"
 
 /* TODO:
- * Load/Save nets on file
- * Read training data from file
  * Ability to print the net as a C function with hard-coded weights.
  */
 
@@ -21,10 +27,39 @@ double sigmoid(double x) {
 	return (double)1/(1+exp(-x));
 }
 
+/* Allocate an array of 'n' elements of 'size' bytes, to release with
+ * free(). Arrays of ANN_HUGEPAGE_SIZE bytes or more, like the weights
+ * and the training state of wide layers, are aligned to a huge page and
+ * backed by transparent huge pages where the kernel supports them: the
+ * update passes scan them sequentially, touching a TLB entry every 2 MB
+ * instead of every 4 KB.
+ * On out of memory, or if n*size overflows, NULL is returned. */
+void *AnnMalloc(size_t n, size_t size)
+{
+	size_t bytes;
+	void *p;
+
+	if (size && n > SIZE_MAX/size)
+		return NULL;
+	bytes = n*size;
+	if (bytes < ANN_HUGEPAGE_SIZE)
+		return malloc(bytes ? bytes : 1);
+	if (posix_memalign(&p, ANN_HUGEPAGE_SIZE, bytes))
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	/* Only a hint: on failure the array uses normal pages */
+	madvise(p, bytes & ~((size_t)ANN_HUGEPAGE_SIZE-1), MADV_HUGEPAGE);
+#endif
+	return p;
+}
+
 /* Reset layer data to zero-units */
 void AnnResetLayer(struct AnnLayer *layer)
 {
 	layer->units = 0;
+	layer->activation = ANN_ACT_LOGISTIC;
+	layer->tied = 0;
+	layer->frozen = 0;
 	layer->output = NULL;
 	layer->error = NULL;
 	layer->weight = NULL;
@@ -32,6 +67,49 @@ void AnnResetLayer(struct AnnLayer *layer)
 	layer->pgradient = NULL;
 	layer->delta = NULL;
 	layer->sgradient = NULL;
+	layer->mask = NULL;
+	layer->sparse_row = NULL;
+	layer->sparse_col = NULL;
+	layer->sparse = 0;
+}
+
+/* Counter based random numbers. The n-th number of the stream 'seed' is
+ * the SplitMix64 finalizer of seed+(n+1)*2^64/phi, so it only depends
+ * on the seed and on its position in the stream: every net has its own
+ * stream, there is no shared state to lock, and the same seed always
+ * gives the same numbers. */
+unsigned long long AnnRandomBits(unsigned long long seed, unsigned long long n)
+{
+	unsigned long long z = seed+(n+1)*0x9E3779B97F4A7C15ULL;
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* Return the next number of the net stream, uniform in [0,1) */
+double AnnRandom(struct Ann *net)
+{
+	return (AnnRandomBits(net->seed, net->rng_next++) >> 11) *
+		(1.0/9007199254740992.0);
+}
+
+/* Restart the random stream of the net from the given seed */
+void AnnSetSeed(struct Ann *net, unsigned long long seed)
+{
+	net->seed = seed;
+	net->rng_next = 0;
+}
+
+/* Seed of the nets whose seed is not set: different for every net, even
+ * if created in the same second. */
+static unsigned long long AnnDefaultSeed(void)
+{
+	static unsigned long long created = 0;
+
+	return AnnRandomBits((unsigned long long)time(NULL) ^
+		((unsigned long long)clock() << 32),
+		__sync_fetch_and_add(&created, 1));
 }
 
 /* Allocate and return an initialized N-layers network */
@@ -56,6 +134,39 @@ struct Ann *AnnAlloc(int layers)
 	net->rprop_nplus = DEFAULT_RPROP_NPLUS;
 	net->rprop_maxupdate = DEFAULT_RPROP_MAXUPDATE;
 	net->rprop_minupdate = DEFAULT_RPROP_MINUPDATE;
+	net->rprop_perror = HUGE_VAL;
+	net->threads = DEFAULT_THREADS;
+	net->sigmoid = ANN_SIGMOID_EXACT;
+	net->epochs = 0;
+	net->meanerr = 0;
+	net->stats = NULL;
+	net->stats_size = net->stats_len = net->stats_next = 0;
+	net->callback = NULL;
+	net->cbdata = NULL;
+	net->cbevery = 1;
+	net->opt = NULL;
+	net->sample_target = NULL;
+	net->cache_frozen = 0;
+	net->cache_layer = 0;
+	net->cache_output = NULL;
+	net->cache_valid = NULL;
+	net->importance = 0;
+	net->importance_every = DEFAULT_IMPORTANCE_EVERY;
+	net->sample_weight = 1;
+	net->shuffle = 0;
+	AnnSetSeed(net, AnnDefaultSeed());
+	net->checkpoint = NULL;
+	net->checkpoint_every = 0;
+	net->checkpoint_seconds = 0;
+	net->checkpoint_errno = 0;
+	net->validation = NULL;
+	net->validate_every = 1;
+	net->patience = 0;
+	net->valerr = HUGE_VAL;
+	net->valepoch = 0;
+#ifdef ANN_PROFILE
+	AnnProfileReset(net);
+#endif
 	/* Init layers */
 	for (i = 0; i < layers; i++)
 		AnnResetLayer(&net->layer[i]);
@@ -72,6 +183,9 @@ void AnnFreeLayer(struct AnnLayer *layer)
 	free(layer->pgradient);
 	free(layer->delta);
 	free(layer->sgradient);
+	free(layer->mask);
+	free(layer->sparse_row);
+	free(layer->sparse_col);
 	AnnResetLayer(layer);
 }
 
@@ -86,26 +200,44 @@ void AnnFree(struct Ann *net)
 	}
 	/* Free allocated layers structures */
 	free(net->layer);
+	free(net->stats);
+	free(net->opt);
+	free(net->sample_target);
+	free(net->checkpoint);
 	/* And the main structure itself */
 	free(net);
 }
 
 /* Init a layer of the net with the specified number of units.
- * Return non-zero on out of memory. */
+ * Return non-zero on out of memory, or if the units are not valid. */
 int AnnInitLayer(struct Ann *net, int i, int units, int bias)
 {
+	size_t weights;
+
+	if (units < 1 || (bias && units == INT_MAX))
+		return 1;
 	if (bias)
 		units++; /* Take count of the bias unit */
+	weights = i ? (size_t)units*net->layer[i-1].units : 0;
 	net->layer[i].output = malloc(sizeof(double)*units);
 	net->layer[i].error = malloc(sizeof(double)*units);
+	if (i == 0) {
+		free(net->sample_target);
+		if ((net->sample_target = malloc(sizeof(double)*units)) == NULL) {
+			AnnFreeLayer(&net->layer[i]);
+			AnnResetLayer(&net->layer[i]);
+			return 1;
+		}
+	}
 	if (i) { /* not for output layer */
-		net->layer[i].weight = malloc(sizeof(double)*units*net->layer[i-1].units);
-		net->layer[i].gradient = malloc(sizeof(double)*units*net->layer[i-1].units);
-		net->layer[i].pgradient = malloc(sizeof(double)*units*net->layer[i-1].units);
-		net->layer[i].delta = malloc(sizeof(double)*units*net->layer[i-1].units);
-		net->layer[i].sgradient = malloc(sizeof(double)*units*net->layer[i-1].units);
+		net->layer[i].weight = AnnMalloc(weights, sizeof(double));
+		net->layer[i].gradient = AnnMalloc(weights, sizeof(double));
+		net->layer[i].pgradient = AnnMalloc(weights, sizeof(double));
+		net->layer[i].delta = AnnMalloc(weights, sizeof(double));
+		net->layer[i].sgradient = AnnMalloc(weights, sizeof(double));
 	}
 	net->layer[i].units = units;
+	net->layer[i].activation = ANN_ACT_LOGISTIC;
 	/* Check for out of memory conditions */
 	if (net->layer[i].output == NULL ||
 	    net->layer[i].error == NULL ||
@@ -123,11 +255,11 @@ int AnnInitLayer(struct Ann *net, int i, int units, int bias)
 	memset(net->layer[i].output, 0, sizeof(double)*units);
 	memset(net->layer[i].error, 0, sizeof(double)*units);
 	if (i) {
-		memset(net->layer[i].weight, 0, sizeof(double)*units*net->layer[i-1].units);
-		memset(net->layer[i].gradient, 0, sizeof(double)*units*net->layer[i-1].units);
-		memset(net->layer[i].pgradient, 0, sizeof(double)*units*net->layer[i-1].units);
-		memset(net->layer[i].delta, 0, sizeof(double)*units*net->layer[i-1].units);
-		memset(net->layer[i].sgradient, 0, sizeof(double)*units*net->layer[i-1].units);
+		memset(net->layer[i].weight, 0, sizeof(double)*weights);
+		memset(net->layer[i].gradient, 0, sizeof(double)*weights);
+		memset(net->layer[i].pgradient, 0, sizeof(double)*weights);
+		memset(net->layer[i].delta, 0, sizeof(double)*weights);
+		memset(net->layer[i].sgradient, 0, sizeof(double)*weights);
 	}
 	/* Set the bias unit output ot 1 */
 	if (bias)
@@ -135,6 +267,87 @@ int AnnInitLayer(struct Ann *net, int i, int units, int bias)
 	return 0;
 }
 
+/* Return the total number of weights of the net, weights shared by
+ * tied layers are counted once. */
+static size_t AnnCountWeights(struct Ann *net)
+{
+	size_t weights = 0;
+	int j;
+
+	for (j = 1; j < LAYERS(net); j++)
+		weights += STORED_WEIGHTS(net,j);
+	return weights;
+}
+
+/* Allocate the state of the second order algorithm 'algoid' for the
+ * net, that has 'n' weights. Return NULL on out of memory, or if the
+ * net has too many weights for Levenberg-Marquardt. */
+static struct AnnOptState *AnnAllocOptState(struct Ann *net, int algoid, size_t n)
+{
+	struct AnnOptState *o;
+	size_t len = 5*n;
+	double *v;
+
+	switch(algoid) {
+	case ANN_LBFGS: len += 2*ANN_LBFGS_HISTORY*n + ANN_LBFGS_HISTORY; break;
+	case ANN_SCG: len += n; break;
+	case ANN_LM:
+		if (n > ANN_LM_MAXWEIGHTS)
+			return NULL;
+		len += 2*n*n + OUTPUT_UNITS(net);
+		break;
+	}
+	if (len > (SIZE_MAX-sizeof(*o))/sizeof(double) ||
+	    (o = AnnMalloc(sizeof(*o)+sizeof(double)*len, 1)) == NULL)
+		return NULL;
+	memset(o, 0, sizeof(*o)+sizeof(double)*len);
+	v = (double*) (o+1);
+	o->n = n;
+	o->w = v; v += n;
+	o->g = v; v += n;
+	o->wt = v; v += n;
+	o->gt = v; v += n;
+	o->d = v; v += n;
+	switch(algoid) {
+	case ANN_LBFGS:
+		o->s = v; v += ANN_LBFGS_HISTORY*n;
+		o->y = v; v += ANN_LBFGS_HISTORY*n;
+		o->rho = v;
+		break;
+	case ANN_SCG:
+		o->r = v;
+		break;
+	case ANN_LM:
+		o->jtj = v; v += n*n;
+		o->chol = v; v += n*n;
+		o->target = v;
+		o->mu = ANN_LM_MU;
+		break;
+	}
+	return o;
+}
+
+/* Copy the pruning mask and the sparse structure of the layer 'src',
+ * with 'units' units and 'weights' stored weights, to 'dst'.
+ * Return non-zero on out of memory. */
+static int AnnCloneSparse(struct AnnLayer *dst, struct AnnLayer *src, int units, size_t weights)
+{
+	if ((dst->mask = AnnMalloc(weights+1, sizeof(double))) == NULL)
+		return 1;
+	memcpy(dst->mask, src->mask, sizeof(double)*weights);
+	if (src->sparse_row == NULL)
+		return 0;
+	dst->sparse_row = malloc(sizeof(int)*(units+1));
+	dst->sparse_col = malloc(sizeof(int)*(src->sparse_row[units]+1));
+	if (dst->sparse_row == NULL || dst->sparse_col == NULL)
+		return 1;
+	memcpy(dst->sparse_row, src->sparse_row, sizeof(int)*(units+1));
+	memcpy(dst->sparse_col, src->sparse_col,
+		sizeof(int)*src->sparse_row[units]);
+	dst->sparse = src->sparse;
+	return 0;
+}
+
 /* Clone a network. On out of memory NULL is returned. */
 struct Ann *AnnClone(struct Ann* net)
 {
@@ -144,15 +357,24 @@ struct Ann *AnnClone(struct Ann* net)
 	if ((copy = AnnAlloc(LAYERS(net))) == NULL)
 		return NULL;
 	for (j = 0; j < LAYERS(net); j++) {
-		struct AnnLayer *ldst, *lsrc;
-		int units = UNITS(net,j);
-		int weights = WEIGHTS(net,j);
 		if (AnnInitLayer(copy, j, UNITS(net,j), 0)) {
 			AnnFree(copy);
 			return NULL;
 		}
+	}
+	if (LAYERS(net) > 2 && TIED(net,1) && AnnSetTied(copy, 1)) {
+		AnnFree(copy);
+		return NULL;
+	}
+	for (j = 0; j < LAYERS(net); j++) {
+		struct AnnLayer *ldst, *lsrc;
+		int units = UNITS(net,j);
+		size_t weights = j ? STORED_WEIGHTS(net,j) : 0;
+
 		lsrc = &net->layer[j];
 		ldst = &copy->layer[j];
+		ldst->activation = lsrc->activation;
+		ldst->frozen = lsrc->frozen;
 		if (lsrc->output)
 			memcpy(ldst->output, lsrc->output, sizeof(double)*units);
 		if (lsrc->error)
@@ -167,6 +389,10 @@ struct Ann *AnnClone(struct Ann* net)
 			memcpy(ldst->delta, lsrc->delta, sizeof(double)*weights);
 		if (lsrc->sgradient)
 			memcpy(ldst->sgradient, lsrc->sgradient, sizeof(double)*weights);
+		if (lsrc->mask && AnnCloneSparse(ldst, lsrc, units, weights)) {
+			AnnFree(copy);
+			return NULL;
+		}
 	}
 	copy->learn_rate = net->learn_rate;
 	copy->momentum = net->momentum;
@@ -174,14 +400,263 @@ struct Ann *AnnClone(struct Ann* net)
 	copy->rprop_nplus = net->rprop_nplus;
 	copy->rprop_maxupdate = net->rprop_maxupdate;
 	copy->rprop_minupdate = net->rprop_minupdate;
+	copy->rprop_perror = net->rprop_perror;
+	copy->threads = net->threads;
+	copy->sigmoid = net->sigmoid;
+	copy->cache_frozen = net->cache_frozen;
+	copy->importance = net->importance;
+	copy->importance_every = net->importance_every;
+	copy->shuffle = net->shuffle;
+	copy->seed = net->seed;
+	copy->rng_next = net->rng_next;
+	/* The checkpoint settings are not copied: two nets writing the same
+	 * checkpoint file would overwrite each other. Neither is the
+	 * validation set, that may not outlive the original net. */
+	copy->valerr = net->valerr;
+	copy->valepoch = net->valepoch;
 	copy->flags = net->flags;
+	copy->epochs = net->epochs;
+	copy->meanerr = net->meanerr;
+	/* The second order algorithms restart from scratch in the copy */
+	if (net->opt &&
+	    (copy->opt = AnnAllocOptState(copy, net->flags & ANN_ALGOMASK,
+				AnnCountWeights(copy))) == NULL) {
+		AnnFree(copy);
+		return NULL;
+	}
+	if (net->stats) {
+		if (AnnEnableStats(copy, net->stats_size)) {
+			AnnFree(copy);
+			return NULL;
+		}
+		memcpy(copy->stats, net->stats,
+			sizeof(struct AnnEpochStats)*net->stats_size);
+		copy->stats_len = net->stats_len;
+		copy->stats_next = net->stats_next;
+	}
 	return copy;
 }
 
+/* Copy the weights of 'src' into 'dst', that must have the same
+ * topology. */
+void AnnCopyWeights(struct Ann *dst, struct Ann *src)
+{
+	int j;
+
+	for (j = 1; j < LAYERS(src); j++)
+		memcpy(dst->layer[j].weight, src->layer[j].weight,
+			sizeof(double)*STORED_WEIGHTS(src,j));
+	dst->epochs = src->epochs;
+}
+
+/* Fill the array 'dst' of the decoder layer 'l' from the old array 'src'
+ * of the same layer and the array 'enc' of the mirrored encoder layer.
+ * When the layer gets tied only the bias unit row of 'src' is retained,
+ * otherwise the weights are set to the transposed encoder ones. */
+static void AnnTieArray(struct Ann *net, int l, double *dst, double *src, double *enc, int tied)
+{
+	int m = LAYERS(net)-l, prev = UNITS(net,l-1), units = UNITS(net,l);
+	int encrow = UNITS(net,m-1), enccols = UNITS(net,m)-(m > 1);
+	int i, k;
+
+	if (tied) {
+		if (l > 1)
+			memcpy(dst, src, sizeof(double)*prev);
+		return;
+	}
+	for (k = 0; k < units-(l > 1); k++)
+		for (i = 0; i < prev; i++)
+			dst[(size_t)k*prev+i] = i < enccols ? enc[(size_t)i*encrow+k] : 0;
+	if (l > 1)
+		memcpy(dst+(size_t)(units-1)*prev, src, sizeof(double)*prev);
+}
+
+/* Tie the weights of the mirrored layers of a symmetric net, like an
+ * autoencoder where the layer i has the same units of the layer
+ * LAYERS-1-i (not counting the bias units), or untie them if 'tied' is
+ * zero. The layer l near the output uses the transpose of the weights
+ * of the layer LAYERS-l, and only stores the weights of its bias unit:
+ * the backpropagation sums the gradients of both the layers into the
+ * shared weights, so weights, gradients and optimizer state take half
+ * the memory and the update pass half the work. The weights of the
+ * decoder layers are discarded when tying, and set to the transposed
+ * ones when untying. The middle layer of nets with an even number of
+ * layers is never tied. Pruning masks are removed.
+ * Return non-zero if the net is not symmetric or on out of memory, in
+ * that case the net is unchanged. */
+int AnnSetTied(struct Ann *net, int tied)
+{
+	int j, layers = LAYERS(net);
+	size_t n = 0;
+	struct AnnLayer *tmp;
+	struct AnnOptState *opt = NULL;
+
+	if (layers < 3)
+		return 1;
+	if (!TIED(net,1) == !tied)
+		return 0;
+	for (j = 0; j < layers; j++) {
+		int mirror = layers-1-j;
+
+		if (UNITS(net,j)-(j > 1) != UNITS(net,mirror)-(mirror > 1))
+			return 1;
+	}
+	if ((tmp = malloc(sizeof(*tmp)*layers)) == NULL)
+		return 1;
+	for (j = 0; j < layers; j++)
+		AnnResetLayer(&tmp[j]);
+	/* Allocate the new arrays of the decoder layers first, so that
+	 * nothing is modified on out of memory. */
+	for (j = 1; j < layers; j++) {
+		struct AnnLayer *l = &tmp[j];
+		size_t weights;
+
+		if (j >= layers-j) { /* encoder or middle layer */
+			n += WEIGHTS(net,j);
+			continue;
+		}
+		weights = tied ? (j > 1 ? (size_t)UNITS(net,j-1) : 0) : WEIGHTS(net,j);
+		n += weights;
+		l->weight = AnnMalloc(weights+1, sizeof(double));
+		l->gradient = AnnMalloc(weights+1, sizeof(double));
+		l->pgradient = AnnMalloc(weights+1, sizeof(double));
+		l->delta = AnnMalloc(weights+1, sizeof(double));
+		l->sgradient = AnnMalloc(weights+1, sizeof(double));
+		if (!l->weight || !l->gradient || !l->pgradient ||
+		    !l->delta || !l->sgradient)
+			goto oom;
+	}
+	if (net->opt &&
+	    (opt = AnnAllocOptState(net, net->flags & ANN_ALGOMASK, n)) == NULL)
+		goto oom;
+	/* Move the data to the new arrays */
+	for (j = 1; j < layers-j; j++) {
+		struct AnnLayer *l = &net->layer[j], *enc = &net->layer[layers-j];
+		size_t bias = (size_t)(UNITS(net,j)-1)*UNITS(net,j-1);
+
+		AnnTieArray(net, j, tmp[j].weight,
+			tied ? l->weight+bias : l->weight, enc->weight, tied);
+		AnnTieArray(net, j, tmp[j].gradient,
+			tied ? l->gradient+bias : l->gradient, enc->gradient, tied);
+		AnnTieArray(net, j, tmp[j].pgradient,
+			tied ? l->pgradient+bias : l->pgradient, enc->pgradient, tied);
+		AnnTieArray(net, j, tmp[j].delta,
+			tied ? l->delta+bias : l->delta, enc->delta, tied);
+		AnnTieArray(net, j, tmp[j].sgradient,
+			tied ? l->sgradient+bias : l->sgradient, enc->sgradient, tied);
+		free(l->weight);
+		free(l->gradient);
+		free(l->pgradient);
+		free(l->delta);
+		free(l->sgradient);
+		l->weight = tmp[j].weight;
+		l->gradient = tmp[j].gradient;
+		l->pgradient = tmp[j].pgradient;
+		l->delta = tmp[j].delta;
+		l->sgradient = tmp[j].sgradient;
+		TIED(net,j) = tied ? layers-j : 0;
+		TIED(net,layers-j) = tied ? j : 0;
+	}
+	/* The layout of the weights changed */
+	AnnPruneReset(net);
+	if (opt) {
+		free(net->opt);
+		net->opt = opt;
+	}
+	free(tmp);
+	return 0;
+oom:
+	for (j = 0; j < layers; j++)
+		AnnFreeLayer(&tmp[j]);
+	free(tmp);
+	return 1;
+}
+
+/* Freeze the weights between the layer 'layer' (1 to LAYERS-1) and the
+ * next one, or unfreeze them if 'frozen' is zero. Frozen weights are
+ * not updated and their gradients are not computed (they are zero), and
+ * backpropagation stops at the frozen prefix of the net, that is the
+ * layers near the input that are all frozen. A tied layer and its
+ * mirrored one share the weights, so they are frozen together.
+ * The gradients and the deltas of the layer are reset.
+ * Return non-zero if the layer does not exist. */
+int AnnSetFrozen(struct Ann *net, int layer, int frozen)
+{
+	int j, rprop = ANN_IS_RPROP(net->flags & ANN_ALGOMASK);
+
+	if (layer < 1 || layer >= LAYERS(net))
+		return 1;
+	for (j = 0; j < 2; j++) {
+		int l = j ? TIED(net,layer) : layer;
+		size_t i, weights;
+
+		if (l == 0)
+			break;
+		weights = STORED_WEIGHTS(net,l);
+		FROZEN(net,l) = frozen != 0;
+		memset(net->layer[l].gradient, 0, sizeof(double)*weights);
+		memset(net->layer[l].pgradient, 0, sizeof(double)*weights);
+		memset(net->layer[l].sgradient, 0, sizeof(double)*weights);
+		for (i = 0; i < weights; i++)
+			net->layer[l].delta[i] = rprop ? RPROP_INITIAL_DELTA : 0;
+	}
+	return 0;
+}
+
+/* Return the first layer of the frozen prefix: the layers from it to
+ * the input one are all frozen. LAYERS(net) is returned if the weights
+ * of the input layer are not frozen. */
+static int AnnFrozenPrefix(struct Ann *net)
+{
+	int l = LAYERS(net);
+
+	while (l > 1 && FROZEN(net,l-1))
+		l--;
+	return l;
+}
+
+static struct {
+	char *name;
+	int algo;
+} AnnAlgoNames[] = {
+	{"bbprop", ANN_BBPROP}, {"obprop", ANN_OBPROP},
+	{"bbpropm", ANN_BBPROPM}, {"obpropm", ANN_OBPROPM},
+	{"rprop", ANN_RPROP}, {"lm", ANN_LM}, {"lbfgs", ANN_LBFGS},
+	{"scg", ANN_SCG}, {"irprop-", ANN_IRPROPM}, {"irprop+", ANN_IRPROPP},
+	{NULL, 0}
+};
+
+/* Return the name of the learning algorithm, or "unknown" */
+char *AnnAlgoName(int algo)
+{
+	int j;
+
+	for (j = 0; AnnAlgoNames[j].name; j++)
+		if (AnnAlgoNames[j].algo == algo)
+			return AnnAlgoNames[j].name;
+	return "unknown";
+}
+
+/* Return the learning algorithm with the given name, or 0 if there
+ * is none */
+int AnnAlgoByName(char *name)
+{
+	int j;
+
+	for (j = 0; AnnAlgoNames[j].name; j++)
+		if (!strcmp(name, AnnAlgoNames[j].name))
+			return AnnAlgoNames[j].algo;
+	return 0;
+}
+
 /* Set the learning algorithm, and initialized the net
- * to work with such algorithm. */
-void AnnSetLearningAlgo(struct Ann *net, int algoid)
+ * to work with such algorithm.
+ * Return non-zero if the state needed by the algorithm can't be
+ * allocated, in that case the previous algorithm is retained. */
+int AnnSetLearningAlgo(struct Ann *net, int algoid)
 {
+	struct AnnOptState *opt = NULL;
+
 	switch(algoid) {
 	case ANN_BBPROP:
 	case ANN_OBPROP:
@@ -191,14 +666,28 @@ void AnnSetLearningAlgo(struct Ann *net, int algoid)
 		AnnResetDeltas(net);
 		break;
 	case ANN_RPROP:
+	case ANN_IRPROPM:
+	case ANN_IRPROPP:
 		net->flags = (net->flags & (~ANN_ALGOMASK)) | algoid;
 		AnnSetDeltas(net, RPROP_INITIAL_DELTA);
+		net->rprop_perror = HUGE_VAL;
+		break;
+	case ANN_LM:
+	case ANN_LBFGS:
+	case ANN_SCG:
+		if ((opt = AnnAllocOptState(net, algoid,
+					AnnCountWeights(net))) == NULL)
+			return 1;
+		net->flags = (net->flags & (~ANN_ALGOMASK)) | algoid;
 		break;
 	default:
 		fprintf(stderr, "AnnSetLearningAlgo called with bad algoid\n");
 		exit(1);
 		break;
 	}
+	free(net->opt);
+	net->opt = opt;
+	return 0;
 }
 
 /* Create a N-layer input/hidden/output net.
@@ -245,106 +734,557 @@ struct Ann *AnnCreateNet4(int iunits, int hunits, int hunits2, int ounits)
 	return AnnCreateNet(4, units);
 }
 
-/* Simulate the net one time. */
-void AnnSimulate(struct Ann *net)
+/* Sigmoid lookup table: ANN_SIGMOID_TABLE_SIZE intervals covering
+ * [-ANN_SIGMOID_TABLE_RANGE, +ANN_SIGMOID_TABLE_RANGE]. */
+static double AnnSigmoidTable[ANN_SIGMOID_TABLE_SIZE+1];
+static pthread_once_t AnnSigmoidTableOnce = PTHREAD_ONCE_INIT;
+
+static void AnnSigmoidTableBuild(void)
 {
-	int i, j, k;
+	int i;
 
-	for (i = net->layers-1; i > 0; i--) {
-		int nextunits = net->layer[i-1].units;
-		int units = net->layer[i].units;
-		if (i > 2) nextunits--; /* dont output on bias units */
-		for (j = 0; j < nextunits; j++) {
-			double A = 0, W;
-			for (k = 0; k < units; k++) {
-				W = WEIGHT(net, i, k, j);
-				A += W*OUTPUT(net, i, k);
-			}
-			OUTPUT(net, i-1, j) = sigmoid(A);
-		}
+	for (i = 0; i <= ANN_SIGMOID_TABLE_SIZE; i++) {
+		double x = -ANN_SIGMOID_TABLE_RANGE +
+			(2.0*ANN_SIGMOID_TABLE_RANGE*i)/ANN_SIGMOID_TABLE_SIZE;
+		AnnSigmoidTable[i] = sigmoid(x);
 	}
 }
 
-/* Create a Tcl procedure that simulates the neural network */
-void Ann2Tcl(struct Ann *net)
+/* Build the table the first time it is used. Nets are simulated by
+ * many threads at once, so the table is built exactly once and it is
+ * visible to every thread when pthread_once() returns. */
+static void AnnSigmoidTableInit(void)
 {
-	int i, j, k;
+	pthread_once(&AnnSigmoidTableOnce, AnnSigmoidTableBuild);
+}
 
-	printf("proc ann input {\n");
-	printf("    set output {");
-	for (i = 0; i < OUTPUT_UNITS(net); i++) {
-		printf("0 ");
+/* Fast sigmoid approximation, see AnnSigmoidVector() */
+static inline double AnnFastSigmoid(double x)
+{
+	double t, kd, f, p, p2;
+	uint64_t k;
+
+	/* Clamp x to [-40,40] without comparisons, so that the loops
+	 * using this function have no control flow. */
+	x = 0.5*(x+40-fabs(x-40));
+	x = 0.5*(x-40+fabs(x+40));
+	t = -x*1.4426950408889634; /* log2(e) */
+	/* Round t to the nearest integer adding and subtracting 1.5*2^52:
+	 * the low bits of the sum are the integer itself, in two's
+	 * complement, so the shift below leaves just n+1023 in the
+	 * exponent bits. It is done unsigned, where the bits shifted out
+	 * are simply discarded. */
+	kd = t+6755399441055744.0;
+	memcpy(&k, &kd, sizeof(k));
+	kd -= 6755399441055744.0;
+	f = (t-kd)*0.6931471805599453; /* ln(2) */
+	p = 1+f*(1+f*(1.0/2+f*(1.0/6+f*(1.0/24+f*(1.0/120+
+		f*(1.0/720+f*(1.0/5040)))))));
+	k = (k+1023) << 52;
+	memcpy(&p2, &k, sizeof(p2));
+	return 1/(1+p*p2);
+}
+
+/* Apply the sigmoid to the 'n' values of 'v' in place.
+ *
+ * ANN_SIGMOID_EXACT uses libm exp().
+ *
+ * ANN_SIGMOID_FAST computes exp(-x) as 2^n * e^f, with n the integer
+ * nearest to -x*log2(e), so that f is in [-ln(2)/2,ln(2)/2] and e^f is
+ * well approximated by a 7th degree polynomial, while 2^n is built
+ * directly in the exponent bits. The input is clamped to [-40,40], where
+ * the sigmoid is already 0 or 1 in double precision. The max absolute
+ * error against the exact sigmoid is below 2e-9. The values are processed
+ * in groups of four so that the compiler vectorizes the loop even at -O2.
+ *
+ * ANN_SIGMOID_TABLE interpolates linearly a table of 4096 intervals
+ * covering [-16,16], with a max absolute error below 1e-6 (the table
+ * saturates to 0 and 1 outside the range). */
+void AnnSigmoidVector(double *v, int n, int mode)
+{
+	int i, k;
+
+	switch(mode) {
+	case ANN_SIGMOID_FAST:
+		for (i = 0; i+4 <= n; i += 4) {
+			for (k = 0; k < 4; k++)
+				v[i+k] = AnnFastSigmoid(v[i+k]);
+		}
+		for (; i < n; i++)
+			v[i] = AnnFastSigmoid(v[i]);
+		break;
+	case ANN_SIGMOID_TABLE:
+		AnnSigmoidTableInit();
+		for (i = 0; i < n; i++) {
+			double x = v[i], pos, frac;
+			int idx;
+
+			pos = (x+ANN_SIGMOID_TABLE_RANGE) *
+			      (ANN_SIGMOID_TABLE_SIZE/(2.0*ANN_SIGMOID_TABLE_RANGE));
+			pos = pos < 0 ? 0 : pos;
+			pos = pos > ANN_SIGMOID_TABLE_SIZE ?
+				ANN_SIGMOID_TABLE_SIZE : pos;
+			idx = (int)pos;
+			idx = idx == ANN_SIGMOID_TABLE_SIZE ? idx-1 : idx;
+			frac = pos-idx;
+			v[i] = AnnSigmoidTable[idx] + frac *
+				(AnnSigmoidTable[idx+1]-AnnSigmoidTable[idx]);
+		}
+		break;
+	default:
+		for (i = 0; i < n; i++)
+			v[i] = sigmoid(v[i]);
+		break;
 	}
-	printf("}\n");
-	for (i = net->layers-1; i > 0; i--) {
-		int nextunits = net->layer[i-1].units;
-		int units = net->layer[i].units;
-		if (i > 2) nextunits--; /* dont output on bias units */
-		for (j = 0; j < nextunits; j++) {
-			double W;
-			if (i == 1) {
-				printf("    lset output %d ", j);
-			} else {
-				printf("    set O_%d_%d", i-1, j);
-			}
-			printf(" [expr { \\\n");
-			for (k = 0; k < units; k++) {
-				W = WEIGHT(net, i, k, j);
-				if (i > 1 && k == units-1) {
-					printf("        (%.9f)", W);
-				} else if (i == net->layers-1) {
-					printf("        (%.9f*[lindex $input %d])", W, k);
-				} else {
-					printf("        (%.9f*$O_%d_%d)", W, i, k);
-				}
-				if ((k+1) < units) printf("+ \\\n");
-			}
-			printf("}]\n");
-			if (i == 1) {
-				printf("    lset output %d [expr {1/(1+exp(-[lindex $output %d]))}]\n", j, j);
-			} else {
-				printf("    lset O_%d_%d [expr {1/(1+exp(-$O_%d_%d))}]\n", i-1, j, i-1, j);
-			}
+}
+
+/* Set the sigmoid implementation used by the net */
+void AnnSetSigmoid(struct Ann *net, int mode)
+{
+	if (mode == ANN_SIGMOID_TABLE)
+		AnnSigmoidTableInit();
+	net->sigmoid = mode;
+}
+
+static char *AnnSigmoidNames[] = {"exact", "fast", "table", NULL};
+
+/* Return the sigmoid implementation (ANN_SIGMOID_*) with the given
+ * name, or -1 if there is none */
+int AnnSigmoidByName(char *name)
+{
+	int j;
+
+	for (j = 0; AnnSigmoidNames[j]; j++)
+		if (!strcmp(name, AnnSigmoidNames[j]))
+			return j;
+	return -1;
+}
+
+static char *AnnActivationNames[ANN_ACTIVATIONS] = {
+	"logistic", "tanh", "relu", "lrelu", "linear", "hardsig"
+};
+
+/* Return the name of the activation, or "unknown" */
+char *AnnActivationName(int activation)
+{
+	if (activation < 0 || activation >= ANN_ACTIVATIONS)
+		return "unknown";
+	return AnnActivationNames[activation];
+}
+
+/* Return the activation with the given name, or -1 if there is none */
+int AnnActivationByName(char *name)
+{
+	int j;
+
+	for (j = 0; j < ANN_ACTIVATIONS; j++)
+		if (!strcmp(name, AnnActivationNames[j]))
+			return j;
+	return -1;
+}
+
+/* Set the activation of the units of the given layer.
+ * Return non-zero if the layer or the activation are invalid. */
+int AnnSetActivation(struct Ann *net, int layer, int activation)
+{
+	if (layer < 0 || layer >= LAYERS(net) ||
+	    activation < 0 || activation >= ANN_ACTIVATIONS)
+		return 1;
+	net->layer[layer].activation = activation;
+	return 0;
+}
+
+/* Apply the activation to the 'n' values of 'v' in place. The logistic
+ * and tanh activations use the sigmoid implementation 'mode', with
+ * tanh(x) computed as 2*sigmoid(2x)-1 in the approximated modes. */
+void AnnActivationVector(double *v, int n, int activation, int mode)
+{
+	int i;
+
+	switch(activation) {
+	case ANN_ACT_LOGISTIC:
+		AnnSigmoidVector(v, n, mode);
+		break;
+	case ANN_ACT_TANH:
+		if (mode == ANN_SIGMOID_EXACT) {
+			for (i = 0; i < n; i++)
+				v[i] = tanh(v[i]);
+			break;
 		}
+		for (i = 0; i < n; i++)
+			v[i] *= 2;
+		AnnSigmoidVector(v, n, mode);
+		for (i = 0; i < n; i++)
+			v[i] = 2*v[i]-1;
+		break;
+	case ANN_ACT_RELU:
+		for (i = 0; i < n; i++)
+			v[i] = v[i] > 0 ? v[i] : 0;
+		break;
+	case ANN_ACT_LRELU:
+		for (i = 0; i < n; i++)
+			v[i] = v[i] > 0 ? v[i] : v[i]*ANN_LRELU_SLOPE;
+		break;
+	case ANN_ACT_HARDSIG:
+		for (i = 0; i < n; i++) {
+			double x = v[i]*0.2+0.5;
+			x = x < 0 ? 0 : x;
+			v[i] = x > 1 ? 1 : x;
+		}
+		break;
+	default: /* ANN_ACT_LINEAR */
+		break;
 	}
-	printf("    return $output\n");
-	printf("}\n");
 }
 
-/* Print a network representation */
-void AnnPrint(struct Ann *net)
+/* Multiply the 'n' errors in 'e' by the derivative of the activation,
+ * computed from the outputs 'o' of the units. */
+static void AnnActivationDerivative(double *e, double *o, int n, int activation)
 {
-	int i, j, k;
+	int i;
 
-	for (i = 0; i < LAYERS(net); i++) {
-		if (i) {
-			/* Weights */
-			printf("\t\tW");
-			for (j = 0; j < UNITS(net, i); j++) {
-				printf("(");
-				for (k = 0; k < UNITS(net, i-1); k++) {
-					printf("%f", WEIGHT(net,i,j,k));
-					if (k != UNITS(net, i-1)-1)
-						printf(" ");
-				}
-				printf(") ");
-			}
-			printf("\n");
-			/* Gradients */
-			printf("\t\tg");
-			for (j = 0; j < UNITS(net, i); j++) {
-				printf("[");
-				for (k = 0; k < UNITS(net, i-1); k++) {
-					printf("%f", GRADIENT(net,i,j,k));
-					if (k != UNITS(net, i-1)-1)
-						printf(" ");
+	switch(activation) {
+	case ANN_ACT_LOGISTIC:
+		for (i = 0; i < n; i++)
+			e[i] *= o[i]*(1-o[i]);
+		break;
+	case ANN_ACT_TANH:
+		for (i = 0; i < n; i++)
+			e[i] *= 1-o[i]*o[i];
+		break;
+	case ANN_ACT_RELU:
+		for (i = 0; i < n; i++)
+			e[i] = o[i] > 0 ? e[i] : 0;
+		break;
+	case ANN_ACT_LRELU:
+		for (i = 0; i < n; i++)
+			e[i] = o[i] > 0 ? e[i] : e[i]*ANN_LRELU_SLOPE;
+		break;
+	case ANN_ACT_HARDSIG:
+		for (i = 0; i < n; i++)
+			e[i] = (o[i] > 0 && o[i] < 1) ? e[i]*0.2 : 0;
+		break;
+	default: /* ANN_ACT_LINEAR */
+		break;
+	}
+}
+
+/* Dot product of a weights row and the layer outputs, with four
+ * partial sums so that it is vectorized without -ffast-math. */
+static double AnnDotRow(const double *w, const double *o, int n)
+{
+	double s[4] = {0, 0, 0, 0};
+	int i, k;
+
+	for (i = 0; i+4 <= n; i += 4)
+		for (k = 0; k < 4; k++)
+			s[k] += w[i+k]*o[i+k];
+	for (; i < n; i++)
+		s[0] += w[i]*o[i];
+	return (s[0]+s[2])+(s[1]+s[3]);
+}
+
+/* Compute the outputs of the layer i-1 from the ones of the layer i.
+ * The weighted sums are accumulated directly in the next layer outputs,
+ * scanning the weights of every unit sequentially, then the activation
+ * is applied to the whole layer at once.
+ * Tied layers scan the rows of the mirrored layer weights instead,
+ * that are the columns of their transposed matrix. Pruned layers with
+ * the sparse kernel enabled only visit the surviving weights. */
+void AnnSimulateLayer(struct Ann *net, int i)
+{
+	int j, k, p;
+	int nextunits = net->layer[i-1].units;
+	int units = net->layer[i].units;
+	double *A = net->layer[i-1].output;
+
+	if (i > 2) nextunits--; /* dont output on bias units */
+	if (IS_TIED(net,i)) {
+		struct AnnLayer *m = &net->layer[TIED(net,i)];
+		double *O = net->layer[i].output;
+		int shared = units-(i > 1);
+
+		for (j = 0; j < nextunits; j++) {
+			double *W = &WEIGHT(net, TIED(net,i), j, 0);
+			double a = i > 1 ? net->layer[i].weight[j] : 0;
+
+			if (m->sparse) {
+				for (p = m->sparse_row[j]; p < m->sparse_row[j+1]; p++)
+					a += W[m->sparse_col[p]]*O[m->sparse_col[p]];
+				A[j] = a;
+			} else {
+				A[j] = a + AnnDotRow(W, O, shared);
+			}
+		}
+	} else if (net->layer[i].sparse) {
+		int *row = net->layer[i].sparse_row, *col = net->layer[i].sparse_col;
+
+		for (j = 0; j < nextunits; j++)
+			A[j] = 0;
+		for (k = 0; k < units; k++) {
+			double O = OUTPUT(net, i, k);
+			double *W = &WEIGHT(net, i, k, 0);
+
+			if (O == 0)
+				continue;
+			for (p = row[k]; p < row[k+1]; p++)
+				A[col[p]] += W[col[p]]*O;
+		}
+	} else {
+		for (j = 0; j < nextunits; j++)
+			A[j] = 0;
+		/* Rows of zero outputs don't contribute: with sparse
+		 * inputs, like binary images, only the rows of the
+		 * nonzero ones are visited. */
+		for (k = 0; k < units; k++) {
+			double O = OUTPUT(net, i, k);
+			double *W = &WEIGHT(net, i, k, 0);
+
+			if (O == 0)
+				continue;
+			for (j = 0; j < nextunits; j++)
+				A[j] += W[j]*O;
+		}
+	}
+	{
+		ANN_PROF_START(sprof);
+		AnnActivationVector(A, nextunits,
+			net->layer[i-1].activation, net->sigmoid);
+		ANN_PROF_END(net, ANN_PROF_SIGMOID, sprof,
+			4*nextunits, 16*nextunits);
+	}
+}
+
+/* Simulate the net starting from the outputs of the layer 'start' */
+static void AnnSimulateFrom(struct Ann *net, int start)
+{
+	int i;
+	ANN_PROF_START(prof);
+
+	for (i = start; i > 0; i--)
+		AnnSimulateLayer(net, i);
+	ANN_PROF_END(net, ANN_PROF_SIMULATE, prof,
+		2*AnnProfileWeights(net), 8*AnnProfileWeights(net));
+}
+
+/* Simulate the net one time */
+void AnnSimulate(struct Ann *net)
+{
+	AnnSimulateFrom(net, LAYERS(net)-1);
+}
+
+/* Compute the outputs 'A' of the layer i-1 from the outputs 'O' of the
+ * layer i for a batch of 'n' samples, stored one after the other with
+ * the layer units (bias included) as stride. Samples are processed in
+ * groups of ANN_BATCH_BLOCK so that every row of weights is loaded once
+ * per group instead of once per sample, as in AnnSimulateLayer(). */
+static void AnnSimulateLayerBatch(struct Ann *net, int i, const double *O, double *A, size_t n)
+{
+	size_t units = UNITS(net,i), stride = UNITS(net,i-1), s, s0, s1, k;
+	int nextunits = stride-(i > 2), j, p;
+
+	for (s0 = 0; s0 < n; s0 += ANN_BATCH_BLOCK) {
+		s1 = MIN(s0+ANN_BATCH_BLOCK, n);
+		if (IS_TIED(net,i)) {
+			int shared = units-(i > 1);
+
+			for (j = 0; j < nextunits; j++) {
+				double *W = &WEIGHT(net, TIED(net,i), j, 0);
+				double a = i > 1 ? net->layer[i].weight[j] : 0;
+
+				for (s = s0; s < s1; s++)
+					A[s*stride+j] = a +
+						AnnDotRow(W, O+s*units, shared);
+			}
+		} else {
+			int *row = net->layer[i].sparse_row;
+			int *col = net->layer[i].sparse_col;
+
+			for (s = s0; s < s1; s++)
+				for (j = 0; j < nextunits; j++)
+					A[s*stride+j] = 0;
+			for (k = 0; k < units; k++) {
+				double *W = &WEIGHT(net, i, k, 0);
+
+				for (s = s0; s < s1; s++) {
+					double o = O[s*units+k], *a = A+s*stride;
+
+					if (o == 0)
+						continue;
+					if (net->layer[i].sparse) {
+						for (p = row[k]; p < row[k+1]; p++)
+							a[col[p]] += W[col[p]]*o;
+					} else {
+						for (j = 0; j < nextunits; j++)
+							a[j] += W[j]*o;
+					}
+				}
+			}
+		}
+		for (s = s0; s < s1; s++) {
+			AnnActivationVector(A+s*stride, nextunits,
+				net->layer[i-1].activation, net->sigmoid);
+			if (i > 2)
+				A[s*stride+nextunits] = 1;
+		}
+	}
+}
+
+/* Simulate the net for a batch of 'n' samples: the inputs of the sample
+ * s are at input[s*INPUT_UNITS], the outputs are stored at
+ * output[s*OUTPUT_UNITS]. The net itself is only read, so several
+ * threads can simulate batches on the same net at the same time.
+ * Return non-zero on out of memory. */
+int AnnSimulateBatch(struct Ann *net, double *input, double *output, size_t n)
+{
+	int l, in = LAYERS(net)-1;
+	size_t units = UNITS(net,in), inputs = INPUT_UNITS(net), s;
+	size_t maxunits = 0;
+	double *buf, *O, *A;
+
+	for (l = 0; l < LAYERS(net); l++)
+		maxunits = MAX(maxunits, (size_t)UNITS(net,l));
+	if ((buf = malloc(sizeof(double)*(2*maxunits*n+1))) == NULL)
+		return 1;
+	O = buf;
+	A = buf+maxunits*n;
+	for (s = 0; s < n; s++) {
+		memcpy(O+s*units, input+s*inputs, sizeof(double)*inputs);
+		if (units > inputs)
+			O[s*units+inputs] = 1;
+	}
+	for (l = in; l > 0; l--) {
+		double *t = O;
+
+		AnnSimulateLayerBatch(net, l, O, l == 1 ? output : A, n);
+		O = A;
+		A = t;
+	}
+	free(buf);
+	return 0;
+}
+
+/* Print the Tcl expression of the activation applied to 'x' */
+static void Ann2TclActivation(int activation, char *x)
+{
+	switch(activation) {
+	case ANN_ACT_LOGISTIC:
+		printf("1/(1+exp(-%s))", x); break;
+	case ANN_ACT_TANH:
+		printf("tanh(%s)", x); break;
+	case ANN_ACT_RELU:
+		printf("%s > 0 ? %s : 0", x, x); break;
+	case ANN_ACT_LRELU:
+		printf("%s > 0 ? %s : %s*%g", x, x, x, ANN_LRELU_SLOPE); break;
+	case ANN_ACT_HARDSIG:
+		printf("%s < -2.5 ? 0 : (%s > 2.5 ? 1 : 0.2*%s+0.5)", x, x, x);
+		break;
+	default:
+		printf("%s", x); break;
+	}
+}
+
+/* Return the weight between the unit i of the layer l and the unit j
+ * of the next layer, resolving tied layers. */
+static double AnnGetWeight(struct Ann *net, int l, int i, int j)
+{
+	if (!IS_TIED(net,l))
+		return WEIGHT(net,l,i,j);
+	if (l > 1 && i == UNITS(net,l)-1)
+		return net->layer[l].weight[j];
+	return WEIGHT(net,TIED(net,l),j,i);
+}
+
+/* Create a Tcl procedure that simulates the neural network */
+void Ann2Tcl(struct Ann *net)
+{
+	int i, j, k;
+	char x[64];
+
+	printf("proc ann input {\n");
+	printf("    set output {");
+	for (i = 0; i < OUTPUT_UNITS(net); i++) {
+		printf("0 ");
+	}
+	printf("}\n");
+	for (i = net->layers-1; i > 0; i--) {
+		int nextunits = net->layer[i-1].units;
+		int units = net->layer[i].units;
+		if (i > 2) nextunits--; /* dont output on bias units */
+		for (j = 0; j < nextunits; j++) {
+			double W;
+			if (i == 1) {
+				printf("    lset output %d ", j);
+			} else {
+				printf("    set O_%d_%d", i-1, j);
+			}
+			printf(" [expr { \\\n");
+			for (k = 0; k < units; k++) {
+				W = AnnGetWeight(net, i, k, j);
+				if (i > 1 && k == units-1) {
+					printf("        (%.9f)", W);
+				} else if (i == net->layers-1) {
+					printf("        (%.9f*[lindex $input %d])", W, k);
+				} else {
+					printf("        (%.9f*$O_%d_%d)", W, i, k);
+				}
+				if ((k+1) < units) printf("+ \\\n");
+			}
+			printf("}]\n");
+			if (i == 1) {
+				sprintf(x, "[lindex $output %d]", j);
+				printf("    lset output %d [expr {", j);
+			} else {
+				sprintf(x, "$O_%d_%d", i-1, j);
+				printf("    lset O_%d_%d [expr {", i-1, j);
+			}
+			Ann2TclActivation(net->layer[i-1].activation, x);
+			printf("}]\n");
+		}
+	}
+	printf("    return $output\n");
+	printf("}\n");
+}
+
+/* Print a network representation */
+void AnnPrint(struct Ann *net)
+{
+	int i, j, k;
+
+	for (i = 0; i < LAYERS(net); i++) {
+		if (i) {
+			/* Tied layers only store the bias unit weights */
+			int rows = IS_TIED(net,i) ? (i > 1) : UNITS(net,i);
+
+			if (IS_TIED(net,i))
+				printf("\t\ttied to layer %d\n", TIED(net,i));
+			/* Weights */
+			printf("\t\tW");
+			for (j = 0; j < rows; j++) {
+				printf("(");
+				for (k = 0; k < UNITS(net, i-1); k++) {
+					printf("%f", WEIGHT(net,i,j,k));
+					if (k != UNITS(net, i-1)-1)
+						printf(" ");
+				}
+				printf(") ");
+			}
+			printf("\n");
+			/* Gradients */
+			printf("\t\tg");
+			for (j = 0; j < rows; j++) {
+				printf("[");
+				for (k = 0; k < UNITS(net, i-1); k++) {
+					printf("%f", GRADIENT(net,i,j,k));
+					if (k != UNITS(net, i-1)-1)
+						printf(" ");
 				}
 				printf("] ");
 			}
 			printf("\n");
 			/* SGradients */
 			printf("\t\tG");
-			for (j = 0; j < UNITS(net, i); j++) {
+			for (j = 0; j < rows; j++) {
 				printf("[");
 				for (k = 0; k < UNITS(net, i-1); k++) {
 					printf("%f", SGRADIENT(net,i,j,k));
@@ -356,7 +1296,7 @@ void AnnPrint(struct Ann *net)
 			printf("\n");
 			/* Gradients at t-1 */
 			printf("\t\tM");
-			for (j = 0; j < UNITS(net, i); j++) {
+			for (j = 0; j < rows; j++) {
 				printf("[");
 				for (k = 0; k < UNITS(net, i-1); k++) {
 					printf("%f", PGRADIENT(net,i,j,k));
@@ -368,7 +1308,7 @@ void AnnPrint(struct Ann *net)
 			printf("\n");
 			/* Delta */
 			printf("\t\tD");
-			for (j = 0; j < UNITS(net, i); j++) {
+			for (j = 0; j < rows; j++) {
 				printf("|");
 				for (k = 0; k < UNITS(net, i-1); k++) {
 					printf("%f", DELTA(net,i,j,k));
@@ -422,6 +1362,316 @@ double AnnSimulateError(struct Ann *net, double *input, double *desidered)
 	return AnnGlobalError(net, desidered);
 }
 
+/* Return the size of the elements of a training set of type 'type' */
+static size_t AnnDatasetElementSize(int type)
+{
+	switch(type) {
+	case ANN_DATA_U8: return sizeof(unsigned char);
+	case ANN_DATA_U16: return sizeof(unsigned short);
+	default: return sizeof(double);
+	}
+}
+
+/* Create a training set of 'setlen' samples stored as 'type'.
+ * Integer values are expanded as raw*scale+offset.
+ * On out of memory NULL is returned. */
+struct AnnDataset *AnnDatasetCreate(int type, int setlen, int inputs, int outputs, double scale, double offset)
+{
+	struct AnnDataset *ds;
+	size_t size = AnnDatasetElementSize(type);
+
+	if (type == ANN_DATA_DOUBLE) {
+		scale = 1;
+		offset = 0;
+	}
+	if ((ds = malloc(sizeof(*ds))) == NULL)
+		return NULL;
+	ds->type = type;
+	ds->setlen = setlen;
+	ds->inputs = inputs;
+	ds->outputs = outputs;
+	ds->scale = scale;
+	ds->offset = offset;
+	ds->owned = 1;
+	ds->weight = NULL;
+	ds->index = NULL;
+	ds->totweight = setlen;
+	/* Allocate at least one element, so that NULL means out of memory */
+	ds->input = AnnMalloc((size_t)setlen*inputs+1, size);
+	ds->target = AnnMalloc((size_t)setlen*outputs+1, size);
+	if (ds->input == NULL || ds->target == NULL) {
+		AnnDatasetFree(ds);
+		return NULL;
+	}
+	return ds;
+}
+
+/* Initialize 'ds' to refer to already existing arrays of doubles,
+ * that are not released by AnnDatasetFree(). */
+void AnnDatasetWrap(struct AnnDataset *ds, double *input, double *target, int setlen, int inputs, int outputs)
+{
+	ds->type = ANN_DATA_DOUBLE;
+	ds->setlen = setlen;
+	ds->inputs = inputs;
+	ds->outputs = outputs;
+	ds->input = input;
+	ds->target = target;
+	ds->scale = 1;
+	ds->offset = 0;
+	ds->owned = 0;
+	ds->weight = NULL;
+	ds->index = NULL;
+	ds->totweight = setlen;
+}
+
+/* Free a training set created with AnnDatasetCreate() */
+void AnnDatasetFree(struct AnnDataset *ds)
+{
+	if (ds->owned) {
+		free(ds->input);
+		free(ds->target);
+	}
+	free(ds->weight);
+	free(ds->index);
+	free(ds);
+}
+
+/* Store 'n' values of 'src' at 'dst' (an array of 'type'), starting
+ * from the element 'off'. Integer values are rounded and saturated. */
+static void AnnDatasetStore(struct AnnDataset *ds, void *dst, size_t off, double *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		double v = src[i];
+
+		if (ds->type != ANN_DATA_DOUBLE) {
+			double max = ds->type == ANN_DATA_U8 ? 255 : 65535;
+
+			v = floor((v-ds->offset)/ds->scale+0.5);
+			v = v < 0 ? 0 : (v > max ? max : v);
+		}
+		switch(ds->type) {
+		case ANN_DATA_U8: ((unsigned char*)dst)[off+i] = v; break;
+		case ANN_DATA_U16: ((unsigned short*)dst)[off+i] = v; break;
+		default: ((double*)dst)[off+i] = v; break;
+		}
+	}
+}
+
+/* Set the j-th sample of the training set */
+void AnnDatasetSetSample(struct AnnDataset *ds, int j, double *input, double *target)
+{
+	AnnDatasetStore(ds, ds->input, (size_t)j*ds->inputs, input, ds->inputs);
+	AnnDatasetStore(ds, ds->target, (size_t)j*ds->outputs, target,
+		ds->outputs);
+}
+
+/* Return the memory used by the samples of the training set */
+size_t AnnDatasetBytes(struct AnnDataset *ds)
+{
+	return AnnDatasetElementSize(ds->type)*ds->setlen*
+		(ds->inputs+ds->outputs);
+}
+
+/* Expand 'n' values of 'src' (an array of 'type') starting from the
+ * element 'off' to the doubles at 'dst' */
+static void AnnDatasetLoad(struct AnnDataset *ds, void *src, size_t off, double *dst, int n)
+{
+	double scale = ds->scale, offset = ds->offset;
+	int i;
+
+	switch(ds->type) {
+	case ANN_DATA_U8: {
+		unsigned char *p = (unsigned char*)src+off;
+		for (i = 0; i < n; i++)
+			dst[i] = p[i]*scale+offset;
+		break;
+	}
+	case ANN_DATA_U16: {
+		unsigned short *p = (unsigned short*)src+off;
+		for (i = 0; i < n; i++)
+			dst[i] = p[i]*scale+offset;
+		break;
+	}
+	default:
+		memcpy(dst, (double*)src+off, sizeof(double)*n);
+		break;
+	}
+}
+
+/* Store at 'input' and 'target' (if not NULL) the j-th sample of the
+ * training set as doubles */
+void AnnDatasetGetSample(struct AnnDataset *ds, int j, double *input, double *target)
+{
+	if (ds->index)
+		j = ds->index[j];
+	AnnDatasetLoad(ds, ds->input, (size_t)j*ds->inputs, input, ds->inputs);
+	if (target)
+		AnnDatasetLoad(ds, ds->target, (size_t)j*ds->outputs, target,
+			ds->outputs);
+}
+
+/* Return the bucket of a sample with mean 'mean' for AnnDatasetDedup():
+ * the index of the 'tolerance' sized cell containing it, or the mean
+ * itself if the tolerance is zero. */
+static long long AnnDedupCell(double mean, double tolerance)
+{
+	long long c;
+
+	if (tolerance > 0)
+		return (long long)floor(mean/tolerance);
+	memcpy(&c, &mean, sizeof(c));
+	return c;
+}
+
+static size_t AnnDedupHash(long long cell, size_t mask)
+{
+	return ((unsigned long long)cell * 0x9e3779b97f4a7c15ULL >> 17) & mask;
+}
+
+/* Merge the samples of the training set that differ by at most
+ * 'tolerance' in every input and target value into a single
+ * representative, the first one found, whose weight is the sum of the
+ * merged weights. With tolerance 0 only exact duplicates are merged.
+ * Image sets like the 8x8 blocks of a picture have many flat, near
+ * identical blocks, every one costing a full sample per epoch.
+ * Representatives are bucketed by their mean value, and a sample is
+ * only compared with the ones in the buckets of its mean and the two
+ * neighbours, where all the samples within the tolerance are.
+ * The training algorithms scale the gradient and the error of every
+ * sample by its weight, so the batch algorithms see the same total
+ * error as with the original set.
+ * Return the new training set, or NULL on out of memory. */
+struct AnnDataset *AnnDatasetDedup(struct AnnDataset *ds, double tolerance)
+{
+	int n = ds->inputs+ds->outputs, j, k, reps = 0;
+	size_t tsize = 1, esize = AnnDatasetElementSize(ds->type);
+	int *table = NULL, *first = NULL, *next = NULL;
+	long long *cell = NULL;
+	double *rep = NULL, *weight = NULL;
+	struct AnnDataset *dd = NULL;
+
+	while (tsize < (size_t)ds->setlen*2)
+		tsize <<= 1;
+	table = malloc(sizeof(int)*tsize);
+	first = malloc(sizeof(int)*(ds->setlen+1));
+	next = malloc(sizeof(int)*(ds->setlen+1));
+	cell = malloc(sizeof(long long)*(ds->setlen+1));
+	weight = malloc(sizeof(double)*(ds->setlen+1));
+	rep = malloc(sizeof(double)*((size_t)ds->setlen+1)*n);
+	if (!table || !first || !next || !cell || !weight || !rep)
+		goto oom;
+	memset(table, -1, sizeof(int)*tsize);
+	for (j = 0; j < ds->setlen; j++) {
+		int s = ds->index ? ds->index[j] : j, r = -1, d;
+		double *sample = rep+(size_t)reps*n, mean = 0;
+		long long c;
+
+		/* Load it as a candidate representative */
+		AnnDatasetLoad(ds, ds->input, (size_t)s*ds->inputs, sample,
+			ds->inputs);
+		AnnDatasetLoad(ds, ds->target, (size_t)s*ds->outputs,
+			sample+ds->inputs, ds->outputs);
+		for (k = 0; k < n; k++)
+			mean += sample[k];
+		c = AnnDedupCell(mean/n, tolerance);
+		for (d = (tolerance > 0 ? -1 : 0); r == -1 && d <= 1; d++) {
+			r = table[AnnDedupHash(c+d, tsize-1)];
+			for (; r != -1; r = next[r]) {
+				double *v = rep+(size_t)r*n;
+
+				if (cell[r] != c+d)
+					continue;
+				for (k = 0; k < n; k++)
+					if (fabs(v[k]-sample[k]) > tolerance)
+						break;
+				if (k == n)
+					break;
+			}
+			if (tolerance == 0)
+				break;
+		}
+		if (r != -1) {
+			weight[r] += ds->weight ? ds->weight[j] : 1;
+			continue;
+		}
+		cell[reps] = c;
+		next[reps] = table[AnnDedupHash(c, tsize-1)];
+		table[AnnDedupHash(c, tsize-1)] = reps;
+		first[reps] = s;
+		weight[reps] = ds->weight ? ds->weight[j] : 1;
+		reps++;
+	}
+	dd = AnnDatasetCreate(ds->type, reps, ds->inputs, ds->outputs,
+		ds->scale, ds->offset);
+	if (dd == NULL)
+		goto oom;
+	for (j = 0; j < reps; j++) {
+		memcpy((char*)dd->input+(size_t)j*ds->inputs*esize,
+		       (char*)ds->input+(size_t)first[j]*ds->inputs*esize,
+		       ds->inputs*esize);
+		memcpy((char*)dd->target+(size_t)j*ds->outputs*esize,
+		       (char*)ds->target+(size_t)first[j]*ds->outputs*esize,
+		       ds->outputs*esize);
+	}
+	dd->weight = weight;
+	dd->totweight = ds->totweight;
+	weight = NULL;
+oom:
+	free(table);
+	free(first);
+	free(next);
+	free(cell);
+	free(weight);
+	free(rep);
+	return dd;
+}
+
+/* Set the j-th sample of the training set as input of the net, simulate
+ * it, and return the global error. The target of the sample, expanded
+ * to doubles if needed, is stored at 'targetp'.
+ * While the frozen prefix cache is active, the outputs of the last
+ * frozen layer are taken from the cache once computed, and only the
+ * layers after it are simulated.
+ * The weight of the sample is stored in the net, and scales the
+ * gradients computed by AnnCalculateGradients(). */
+double AnnSimulateSample(struct Ann *net, struct AnnDataset *ds, int j, double **targetp)
+{
+	int outputs = OUTPUT_UNITS(net);
+
+	net->sample_weight = ds->weight ? ds->weight[j] : 1;
+	if (ds->index)
+		j = ds->index[j];
+
+	if (net->cache_valid && net->cache_valid[j]) {
+		int l = net->cache_layer, units = UNITS(net,l)-(l > 1);
+
+		memcpy(net->layer[l].output, net->cache_output+(size_t)j*units,
+			sizeof(double)*units);
+		AnnSimulateFrom(net, l);
+	} else {
+		AnnDatasetLoad(ds, ds->input, (size_t)j*ds->inputs,
+			&INPUT_NODE(net,0), INPUT_UNITS(net));
+		AnnSimulate(net);
+		if (net->cache_valid) {
+			int l = net->cache_layer, units = UNITS(net,l)-(l > 1);
+
+			memcpy(net->cache_output+(size_t)j*units,
+				net->layer[l].output, sizeof(double)*units);
+			net->cache_valid[j] = 1;
+		}
+	}
+	if (ds->type == ANN_DATA_DOUBLE) {
+		*targetp = (double*)ds->target + (size_t)j*outputs;
+	} else {
+		AnnDatasetLoad(ds, ds->target, (size_t)j*outputs,
+			net->sample_target, outputs);
+		*targetp = net->sample_target;
+	}
+	return AnnGlobalError(net, *targetp);
+}
+
 /* Calculate gradients with a trivial and slow algorithm, this
  * is useful to check that the real implementation is working
  * well, comparing the results.
@@ -432,11 +1682,14 @@ double AnnSimulateError(struct Ann *net, double *input, double *desidered)
 #define GTRIVIAL_DELTA 0.001
 void AnnCalculateGradientsTrivial(struct Ann *net, double *desidered)
 {
-	int j, i, layers = LAYERS(net);
+	int j, layers = LAYERS(net);
+	size_t i;
 
 	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		if (FROZEN(net,j))
+			continue;
 		for (i = 0; i < weights; i++) {
 			double t, e1, e2;
 
@@ -453,71 +1706,271 @@ void AnnCalculateGradientsTrivial(struct Ann *net, double *desidered)
 			net->layer[j].weight[i] = t;
 			/* Calculate the gradient */
 			net->layer[j].gradient[i] = (e2-e1)/GTRIVIAL_DELTA;
+			if (net->layer[j].mask)
+				net->layer[j].gradient[i] *= net->layer[j].mask[i];
 		}
 	}
 }
 
-/* Calculate gradients using the back propagation algorithm */
-void AnnCalculateGradients(struct Ann *net, double *desidered)
+/* Compare the gradients computed by AnnCalculateGradients() for the
+ * given sample with the ones computed by AnnCalculateGradientsTrivial(),
+ * and return the max absolute difference. This is used to check that
+ * training is still consistent with an approximated sigmoid, since
+ * backpropagation uses the derivative of the exact one.
+ * On return the gradient arrays contain the trivial gradients.
+ * On out of memory -1 is returned. */
+double AnnCheckGradients(struct Ann *net, double *input, double *desidered)
 {
-	int j, layers = LAYERS(net)-1;
+	int j, layers = LAYERS(net);
+	size_t i;
+	double **saved, maxdiff = 0;
 
-	/* First we need to calculate the error for every output
-	 * node. */
-	for (j = 0; j < OUTPUT_UNITS(net); j++) {
-		net->layer[0].error[j] =
-			net->layer[0].output[j] - desidered[j];
-	}
-	/* Back-propagate the error and compute the gradient
-	 * for every weight in the net. */
-	for (j = 0; j < layers; j++) {
-		int units = UNITS(net, j);
-		int i;
+	if ((saved = malloc(sizeof(double*)*layers)) == NULL)
+		return -1;
+	AnnSimulateError(net, input, desidered);
+	AnnCalculateGradients(net, desidered);
+	for (j = 1; j < layers; j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
 
-		/* Skip bias units */
-		if (j > 1)
-			units--;
-		/* Reset the next layer errors array */
-		for (i = 0; i < UNITS(net,j+1); i++)
-			net->layer[j+1].error[i] = 0;
-		/* For every node in this layer ... */
-		for (i = 0; i < units; i++) {
-			double delta, e, o;
-			int k, prevunits;
-			
-			/* Compute (d-o)*o*(1-o) */
-			e = net->layer[j].error[i];
-			o = net->layer[j].output[i];
-			delta = e*o*(1-o);
-			/* For every weight between this node and
-			 * the previous layer's nodes... */
-			prevunits = UNITS(net,j+1);
-			for (k = 0; k < prevunits; k++) {
-				/* Calculate the gradient */
-				GRADIENT(net,j+1,k,i) =
-					delta * OUTPUT(net,j+1,k);
-				/* And back-propagate the error to
-				 * the previous layer */
-				ERROR(net,j+1,k) +=
-					delta * WEIGHT(net,j+1,k,i);
-			}
+		if ((saved[j] = AnnMalloc(weights, sizeof(double))) == NULL) {
+			while(--j)
+				free(saved[j]);
+			free(saved);
+			return -1;
 		}
+		memcpy(saved[j], net->layer[j].gradient, sizeof(double)*weights);
 	}
+	AnnCalculateGradientsTrivial(net, desidered);
+	for (j = 1; j < layers; j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		for (i = 0; i < weights; i++) {
+			double d = fabs(saved[j][i]-net->layer[j].gradient[i]);
+			if (d > maxdiff) maxdiff = d;
+		}
+		free(saved[j]);
+	}
+	free(saved);
+	return maxdiff;
+}
+
+/* Gradients and back-propagated errors of a row of tied weights */
+static void __attribute__((noinline)) AnnTiedRow(double *restrict g, double *restrict e, const double *restrict w, const double *restrict o, double delta, int n)
+{
+	int i, k;
+
+	for (k = 0; k+4 <= n; k += 4) {
+		for (i = 0; i < 4; i++) {
+			g[k+i] = delta * o[k+i];
+			e[k+i] += delta * w[k+i];
+		}
+	}
+	for (; k < n; k++) {
+		g[k] = delta * o[k];
+		e[k] += delta * w[k];
+	}
+}
+
+/* Multiply the gradients by the pruning mask */
+static void __attribute__((noinline)) AnnMaskRow(double *restrict g, const double *restrict mask, int n)
+{
+	int i, k;
+
+	for (i = 0; i+4 <= n; i += 4)
+		for (k = 0; k < 4; k++)
+			g[i+k] *= mask[i+k];
+	for (; i < n; i++)
+		g[i] *= mask[i];
+}
+
+/* Backpropagation step of the tied layer 'l', 'units' being the units
+ * of the layer l-1 (not counting the bias unit). */
+static void AnnCalculateGradientsTied(struct Ann *net, int l, int units)
+{
+	int i, k, m = TIED(net,l), prevunits = UNITS(net,l);
+	int shared = prevunits-(l > 1);
+	double *O = net->layer[l].output, *E = net->layer[l].error;
+
+	/* The weight from the unit k of the layer 'l' to the unit i of the
+	 * next one is WEIGHT(net,m,i,k): for every unit i the weights and
+	 * gradients are the i-th row of the mirrored layer arrays. */
+	for (i = 0; i < units; i++) {
+		double delta = net->layer[l-1].error[i];
+		double *W = &WEIGHT(net,m,i,0);
+		double *G = &GRADIENT(net,m,i,0);
+
+		if (FROZEN(net,l)) {
+			for (k = 0; k < shared; k++)
+				E[k] += delta * W[k];
+			if (l > 1)
+				E[shared] += delta * net->layer[l].weight[i];
+			continue;
+		}
+		AnnTiedRow(G, E, W, O, delta, shared);
+		/* Weights of the bias unit are stored in the layer */
+		if (l > 1) {
+			net->layer[l].gradient[i] = delta * O[shared];
+			E[shared] += delta * net->layer[l].weight[i];
+		}
+	}
+}
+
+/* Gradient row of the input unit with output 'o': g = o*delta,
+ * accumulated into 'g' if 'add' is true. */
+static void __attribute__((noinline)) AnnInputRow(double *restrict g, const double *restrict delta, double o, int n, int add)
+{
+	int i, k;
+
+	if (add) {
+		for (i = 0; i+4 <= n; i += 4)
+			for (k = 0; k < 4; k++)
+				g[i+k] += o*delta[i+k];
+		for (; i < n; i++)
+			g[i] += o*delta[i];
+	} else {
+		for (i = 0; i+4 <= n; i += 4)
+			for (k = 0; k < 4; k++)
+				g[i+k] = o*delta[i+k];
+		for (; i < n; i++)
+			g[i] = o*delta[i];
+	}
+}
+
+/* Backpropagation step of the input layer, 'units' being the units of
+ * the next layer (not counting the bias unit). The gradients are
+ * computed a row (an input) at a time, and the rows of zero inputs are
+ * just cleared, so the cost scales with the number of nonzero inputs.
+ * The error is not propagated to the inputs, nothing uses it. */
+static void AnnCalculateGradientsInput(struct Ann *net, int units)
+{
+	int l = LAYERS(net)-1, k, inputs = UNITS(net,l);
+	int shared = TIED(net,l) ? inputs-(l > 1) : 0;
+	double *D = net->layer[l-1].error;
+
+	for (k = 0; k < inputs; k++) {
+		double O = OUTPUT(net,l,k);
+		double *G = &GRADIENT(net,l,k,0);
+
+		/* Shared rows already hold the tied layer gradient */
+		if (O == 0) {
+			if (k >= shared)
+				memset(G, 0, sizeof(double)*units);
+			continue;
+		}
+		AnnInputRow(G, D, O, units, k < shared);
+	}
+}
+
+/* Calculate gradients using the back propagation algorithm.
+ * On return the error array of every layer but the input one contains
+ * the derivative of the error with respect to the net input of the
+ * units. Errors are scaled by the weight of the sample.
+ * Tied layers are processed before their mirrored layer: they store
+ * their gradients into the shared gradient array, then the mirrored
+ * layer adds its own ones. */
+void AnnCalculateGradients(struct Ann *net, double *desidered)
+{
+	int j, layers = AnnFrozenPrefix(net)-1;
+	ANN_PROF_START(prof);
+
+	/* First we need to calculate the error for every output
+	 * node. */
+	for (j = 0; j < OUTPUT_UNITS(net); j++) {
+		net->layer[0].error[j] = net->sample_weight *
+			(net->layer[0].output[j] - desidered[j]);
+	}
+	/* Back-propagate the error and compute the gradient
+	 * for every weight in the net, up to the frozen prefix. */
+	for (j = 0; j < layers; j++) {
+		int units = UNITS(net, j);
+		int i;
+
+		/* Skip bias units */
+		if (j > 1)
+			units--;
+		/* Reset the next layer errors array */
+		for (i = 0; i < UNITS(net,j+1); i++)
+			net->layer[j+1].error[i] = 0;
+		/* Turn the errors of this layer into the derivatives of
+		 * the error with respect to the units net input. */
+		AnnActivationDerivative(net->layer[j].error,
+			net->layer[j].output, units, net->layer[j].activation);
+		if (IS_TIED(net,j+1)) {
+			AnnCalculateGradientsTied(net, j+1, units);
+			continue;
+		}
+		if (j+1 == LAYERS(net)-1) {
+			AnnCalculateGradientsInput(net, units);
+			continue;
+		}
+		if (FROZEN(net,j+1)) {
+			/* Just back-propagate the error */
+			for (i = 0; i < units; i++) {
+				double delta = net->layer[j].error[i];
+				int k;
+
+				for (k = 0; k < UNITS(net,j+1); k++)
+					ERROR(net,j+1,k) +=
+						delta * WEIGHT(net,j+1,k,i);
+			}
+			continue;
+		}
+		/* For every node in this layer ... */
+		for (i = 0; i < units; i++) {
+			double delta;
+			int k, prevunits, shared;
+
+			delta = net->layer[j].error[i];
+			/* For every weight between this node and
+			 * the previous layer's nodes... */
+			prevunits = UNITS(net,j+1);
+			/* Gradients of weights shared with a tied layer
+			 * already hold the tied layer contribution. */
+			shared = TIED(net,j+1) ? prevunits-(j+1 > 1) : 0;
+			for (k = 0; k < shared; k++) {
+				GRADIENT(net,j+1,k,i) +=
+					delta * OUTPUT(net,j+1,k);
+				ERROR(net,j+1,k) +=
+					delta * WEIGHT(net,j+1,k,i);
+			}
+			for (; k < prevunits; k++) {
+				/* Calculate the gradient */
+				GRADIENT(net,j+1,k,i) =
+					delta * OUTPUT(net,j+1,k);
+				/* And back-propagate the error to
+				 * the previous layer */
+				ERROR(net,j+1,k) +=
+					delta * WEIGHT(net,j+1,k,i);
+			}
+		}
+	}
+	/* Pruned weights are never trained */
+	for (j = 1; j < LAYERS(net); j++) {
+		if (net->layer[j].mask && !FROZEN(net,j))
+			AnnMaskRow(net->layer[j].gradient, net->layer[j].mask,
+				STORED_WEIGHTS(net,j));
+	}
+	ANN_PROF_END(net, ANN_PROF_GRADIENTS, prof,
+		4*AnnProfileWeights(net), 32*AnnProfileWeights(net));
 }
 
 /* Set the delta values of the net to a given value */
 void AnnSetDeltas(struct Ann *net, double val)
 {
 	int j, layers = LAYERS(net);
+	ANN_PROF_START(prof);
 
 	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
-		int i;
+		size_t i, weights = STORED_WEIGHTS(net,j);
+
+		if (FROZEN(net,j))
+			continue;
 
 		for (i = 0; i < weights; i++)
 			net->layer[j].delta[i] = val;
 	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		0, 8*AnnProfileWeights(net));
 }
 
 /* Set deltas to zero */
@@ -530,27 +1983,30 @@ void AnnResetDeltas(struct Ann *net)
 void AnnResetSgradient(struct Ann *net)
 {
 	int j, layers = LAYERS(net);
+	ANN_PROF_START(prof);
 
 	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		if (FROZEN(net,j))
+			continue;
 		memset(net->layer[j].sgradient, 0, sizeof(double)*weights);
 	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		0, 8*AnnProfileWeights(net));
 }
 
-/* Set random weights in the range -0.5,+0.5 */
+/* Set random weights in the range -0.5,+0.5, drawn from the net
+ * random stream. */
 void AnnSetRandomWeights(struct Ann *net)
 {
 	int j, layers = LAYERS(net);
 
-	srand(time(NULL));
 	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
-		int i;
+		size_t i, weights = STORED_WEIGHTS(net,j);
 
 		for (i = 0; i < weights; i++)
-			net->layer[j].weight[i] = -.5+(rand()/(RAND_MAX+1.0));
+			net->layer[j].weight[i] = -.5+AnnRandom(net);
 	}
 }
 
@@ -560,207 +2016,2734 @@ void AnnScaleWeights(struct Ann *net, double factor)
 	int j, layers = LAYERS(net);
 
 	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
-		int i;
+		size_t i, weights = STORED_WEIGHTS(net,j);
 
 		for (i = 0; i < weights; i++)
 			net->layer[j].weight[i] *= factor;
 	}
 }
 
-/* Update the deltas using the gradient descend algorithm.
- * Gradients should be already computed with AnnCalculateGraidents(). */
-void AnnUpdateDeltasGD(struct Ann *net)
+/* Helpers to scan the weights of the layer l that are actually used:
+ * the stored rows (just the bias unit one for tied layers), and the
+ * columns of the units of the next layer, excluding its bias unit. */
+#define PRUNE_ROWS(net,l) (IS_TIED(net,l) ? ((l) > 1) : UNITS(net,l))
+#define PRUNE_COLS(net,l) (UNITS(net,(l)-1)-((l)-1 > 1))
+
+static int AnnCmpDouble(const void *a, const void *b)
 {
-	int j, i, layers = LAYERS(net);
+	double da = *(double*)a, db = *(double*)b;
 
-	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
-		for (i = 0; i < weights; i++)
-			net->layer[j].delta[i] += -(LEARN_RATE(net)*net->layer[j].gradient[i]);
+	return (da > db) - (da < db);
+}
+
+/* Return the magnitude threshold that prunes the given fraction of the
+ * weights of the layer 'layer', or of the whole net if 'layer' is 0.
+ * Weights already pruned are counted as well, so 'fraction' is the
+ * resulting sparsity. On out of memory -1 is returned. */
+double AnnPruneThreshold(struct Ann *net, int layer, double fraction)
+{
+	int l, i, j, lo = layer ? layer : 1, hi = layer ? layer : LAYERS(net)-1;
+	size_t n = 0, k;
+	double *v, t;
+
+	for (l = lo; l <= hi; l++)
+		n += (size_t)PRUNE_ROWS(net,l)*PRUNE_COLS(net,l);
+	if ((v = malloc(sizeof(double)*(n+1))) == NULL)
+		return -1;
+	n = 0;
+	for (l = lo; l <= hi; l++) {
+		for (i = 0; i < PRUNE_ROWS(net,l); i++)
+			for (j = 0; j < PRUNE_COLS(net,l); j++)
+				v[n++] = fabs(WEIGHT(net,l,i,j));
 	}
+	qsort(v, n, sizeof(double), AnnCmpDouble);
+	k = fraction <= 0 ? 0 : (size_t)(fraction*n);
+	if (k == 0)
+		t = 0;
+	else if (k >= n)
+		t = HUGE_VAL;
+	else
+		t = v[k];
+	free(v);
+	return t;
 }
 
-/* Update the deltas using the gradient descend algorithm with momentum.
- * Gradients should be already computed with AnnCalculateGraidents(). */
-void AnnUpdateDeltasGDM(struct Ann *net)
+/* Build the sparse structure of the surviving weights of the layer l,
+ * enabling the sparse forward kernel if the density is low enough.
+ * Tied layers use the structure of the mirrored layer.
+ * Return non-zero on out of memory, the dense kernel is used then. */
+static int AnnSparseBuild(struct Ann *net, int l)
 {
-	int j, i, layers = LAYERS(net);
+	struct AnnLayer *layer = &net->layer[l];
+	int i, j, p = 0, units = UNITS(net,l), cols = PRUNE_COLS(net,l);
 
-	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
-		for (i = 0; i < weights; i++) {
-			net->layer[j].delta[i] += -(LEARN_RATE(net)*net->layer[j].gradient[i]);
-			net->layer[j].delta[i] += -(LEARN_RATE(net)*net->layer[j].pgradient[i])*MOMENTUM(net);
-			net->layer[j].pgradient[i] = net->layer[j].gradient[i];
+	free(layer->sparse_row);
+	free(layer->sparse_col);
+	layer->sparse_row = NULL;
+	layer->sparse_col = NULL;
+	layer->sparse = 0;
+	/* The sparse structure indexes the weights with an int */
+	if (IS_TIED(net,l) || WEIGHTS(net,l) > INT_MAX)
+		return 0;
+	for (i = 0; i < units; i++)
+		for (j = 0; j < cols; j++)
+			p += layer->mask[(size_t)i*UNITS(net,l-1)+j] != 0;
+	layer->sparse_row = malloc(sizeof(int)*(units+1));
+	layer->sparse_col = malloc(sizeof(int)*(p+1));
+	if (layer->sparse_row == NULL || layer->sparse_col == NULL) {
+		free(layer->sparse_row);
+		free(layer->sparse_col);
+		layer->sparse_row = NULL;
+		layer->sparse_col = NULL;
+		return 1;
+	}
+	p = 0;
+	for (i = 0; i < units; i++) {
+		layer->sparse_row[i] = p;
+		for (j = 0; j < cols; j++)
+			if (layer->mask[(size_t)i*UNITS(net,l-1)+j] != 0)
+				layer->sparse_col[p++] = j;
+	}
+	layer->sparse_row[units] = p;
+	layer->sparse = p < ANN_SPARSE_DENSITY*units*cols;
+	return 0;
+}
+
+/* Prune the weights of the layer 'layer' (all the layers if 0) whose
+ * magnitude is below 'threshold': they are set to zero, and are kept at
+ * zero by all the training algorithms until AnnPruneReset() is called,
+ * so the net can be retrained with a fixed sparsity mask.
+ * Layers with a density below ANN_SPARSE_DENSITY switch to a forward
+ * kernel that only visits the surviving weights.
+ * Return the number of pruned weights, or -1 on out of memory. */
+int AnnPrune(struct Ann *net, int layer, double threshold)
+{
+	int l, i, j, pruned = 0, lo = layer ? layer : 1;
+	int hi = layer ? layer : LAYERS(net)-1;
+
+	for (l = lo; l <= hi; l++) {
+		struct AnnLayer *ly = &net->layer[l];
+		size_t k, weights = STORED_WEIGHTS(net,l);
+
+		if (weights == 0)
+			continue;
+		if (ly->mask == NULL) {
+			if ((ly->mask = AnnMalloc(weights, sizeof(double))) == NULL)
+				return -1;
+			for (k = 0; k < weights; k++)
+				ly->mask[k] = 1;
+		}
+		for (i = 0; i < PRUNE_ROWS(net,l); i++) {
+			for (j = 0; j < PRUNE_COLS(net,l); j++) {
+				size_t w = (size_t)i*UNITS(net,l-1)+j;
+
+				if (ly->mask[w] == 0 ||
+				    fabs(ly->weight[w]) >= threshold)
+					continue;
+				ly->weight[w] = 0;
+				ly->gradient[w] = ly->pgradient[w] = 0;
+				ly->sgradient[w] = 0;
+				ly->mask[w] = 0;
+				pruned++;
+			}
 		}
+		if (AnnSparseBuild(net, l))
+			return -1;
 	}
+	return pruned;
 }
 
-/* Update the sgradient, that's the sum of the weight's gradient for every
- * element of the training set. This is used for the RPROP algorithm
- * that works with the sign of the derivative for the whole set. */
-void AnnUpdateSgradient(struct Ann *net)
+/* Remove the pruning masks: pruned weights stay at zero, but they are
+ * trained again. */
+void AnnPruneReset(struct Ann *net)
 {
-	int j, i, layers = LAYERS(net);
+	int l;
 
-	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
-		for (i = 0; i < weights; i++)
-			net->layer[j].sgradient[i] += net->layer[j].gradient[i];
+	for (l = 1; l < LAYERS(net); l++) {
+		struct AnnLayer *ly = &net->layer[l];
+
+		free(ly->mask);
+		free(ly->sparse_row);
+		free(ly->sparse_col);
+		ly->mask = NULL;
+		ly->sparse_row = NULL;
+		ly->sparse_col = NULL;
+		ly->sparse = 0;
 	}
 }
 
-/* Adjust net weights using the (already) calculated deltas. */
-void AnnAdjustWeights(struct Ann *net)
+/* Return the fraction of the weights of the layer 'layer' (of the whole
+ * net if 0) that survived pruning. Tied layers report the density of
+ * the shared weights. */
+double AnnDensity(struct Ann *net, int layer)
 {
-	int j, i, layers = LAYERS(net);
+	int l, i, j, lo = layer ? layer : 1, hi = layer ? layer : LAYERS(net)-1;
+	double alive = 0, total = 0;
 
-	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
-		for (i = 0; i < weights; i++) {
-			net->layer[j].weight[i] += net->layer[j].delta[i];
+	for (l = lo; l <= hi; l++) {
+		int s = IS_TIED(net,l) && layer ? TIED(net,l) : l;
+
+		for (i = 0; i < PRUNE_ROWS(net,s); i++) {
+			for (j = 0; j < PRUNE_COLS(net,s); j++) {
+				double *m = net->layer[s].mask;
+
+				alive += m ? m[(size_t)i*UNITS(net,s-1)+j] != 0 : 1;
+				total++;
+			}
 		}
 	}
+	return total ? alive/total : 1;
 }
 
-/* Batch Gradient Descend Epoch */
-double AnnBatchGDEpoch(struct Ann *net, double *input, double *desidered, int setlen)
+/* Nets are saved in a binary file in the native byte order, made of:
+ * the ANN_FILE_MAGIC string, the ANN_FILE_* header values as ints, the
+ * ANN_FILE_PARAM_* training parameters as doubles, five ints for every
+ * layer from the output to the input (units without the bias unit,
+ * activation, tied, frozen, pruned), and for every layer but the output
+ * one its stored weights followed by its pruning mask if pruned.
+ * Checkpoints are ANN_FILE_STATE_VERSION files, where the weights are
+ * followed by the training state: the seed and the position of the
+ * random stream as unsigned long long, the RPROP previous error as
+ * double, the shuffle flag as int, and for every layer but the output
+ * one its stored deltas and previous gradients.
+ * The header records sizeof(int), sizeof(double) and a known value so
+ * that files written on a different architecture are rejected. */
+#define ANN_FILE_MAGIC "GNEGNU"
+#define ANN_FILE_VERSION 1
+#define ANN_FILE_STATE_VERSION 2
+#define ANN_FILE_ENDIAN 0x01020304
+#define ANN_FILE_HEADER 8	/* version, sizes, endian, layers, flags, */
+				/* sigmoid, epochs */
+#define ANN_FILE_PARAMS 7	/* learn rate, momentum, rprop, meanerr */
+#define ANN_FILE_LAYER 5
+
+/* Write the net to 'fp', with the training state if 'state' is true.
+ * Return non-zero on error. */
+static int AnnWrite(struct Ann *net, FILE *fp, int state)
 {
-	double maxerr = 0, e;
-	int j, inputs = INPUT_UNITS(net), outputs = OUTPUT_UNITS(net);
+	int j, header[ANN_FILE_HEADER];
+	double param[ANN_FILE_PARAMS];
 
-	AnnResetDeltas(net);
-	for (j = 0; j < setlen; j++) {
-		e = AnnSimulateError(net, input, desidered);
-		if (e > maxerr) maxerr = e;
-		AnnCalculateGradients(net, desidered);
-		AnnUpdateDeltasGD(net);
-		input += inputs;
-		desidered += outputs;
+	header[0] = state ? ANN_FILE_STATE_VERSION : ANN_FILE_VERSION;
+	header[1] = sizeof(int);
+	header[2] = sizeof(double);
+	header[3] = ANN_FILE_ENDIAN;
+	header[4] = LAYERS(net);
+	header[5] = net->flags;
+	header[6] = net->sigmoid;
+	header[7] = net->epochs;
+	param[0] = net->learn_rate;
+	param[1] = net->momentum;
+	param[2] = net->rprop_nminus;
+	param[3] = net->rprop_nplus;
+	param[4] = net->rprop_maxupdate;
+	param[5] = net->rprop_minupdate;
+	param[6] = net->meanerr;
+	fwrite(ANN_FILE_MAGIC, strlen(ANN_FILE_MAGIC), 1, fp);
+	fwrite(header, sizeof(header), 1, fp);
+	fwrite(param, sizeof(param), 1, fp);
+	for (j = 0; j < LAYERS(net); j++) {
+		int l[ANN_FILE_LAYER];
+
+		l[0] = UNITS(net,j)-(j > 1);
+		l[1] = net->layer[j].activation;
+		l[2] = TIED(net,j);
+		l[3] = FROZEN(net,j);
+		l[4] = net->layer[j].mask != NULL;
+		fwrite(l, sizeof(l), 1, fp);
 	}
-	AnnAdjustWeights(net);
-	return maxerr;
+	for (j = 1; j < LAYERS(net); j++) {
+		fwrite(net->layer[j].weight, sizeof(double),
+			STORED_WEIGHTS(net,j), fp);
+		if (net->layer[j].mask)
+			fwrite(net->layer[j].mask, sizeof(double),
+				STORED_WEIGHTS(net,j), fp);
+	}
+	if (state) {
+		unsigned long long rng[2];
+
+		rng[0] = net->seed;
+		rng[1] = net->rng_next;
+		fwrite(rng, sizeof(rng), 1, fp);
+		fwrite(&net->rprop_perror, sizeof(double), 1, fp);
+		fwrite(&net->shuffle, sizeof(int), 1, fp);
+		for (j = 1; j < LAYERS(net); j++) {
+			fwrite(net->layer[j].delta, sizeof(double),
+				STORED_WEIGHTS(net,j), fp);
+			fwrite(net->layer[j].pgradient, sizeof(double),
+				STORED_WEIGHTS(net,j), fp);
+		}
+	}
+	return ferror(fp);
 }
 
-/* Batch Gradient Descend Epoch with Momentum */
-double AnnBatchGDMEpoch(struct Ann *net, double *input, double *desidered, int setlen)
+/* Save the net into the file 'filename'.
+ * Return non-zero on error, with errno set. */
+int AnnSave(struct Ann *net, char *filename)
 {
-	double maxerr = 0, e;
-	int j, inputs = INPUT_UNITS(net), outputs = OUTPUT_UNITS(net);
+	FILE *fp;
+	int err;
 
-	AnnResetDeltas(net);
-	for (j = 0; j < setlen; j++) {
-		e = AnnSimulateError(net, input, desidered);
-		if (e > maxerr) maxerr = e;
-		AnnCalculateGradients(net, desidered);
-		AnnUpdateDeltasGDM(net);
-		input += inputs;
-		desidered += outputs;
+	if ((fp = fopen(filename, "wb")) == NULL)
+		return 1;
+	err = AnnWrite(net, fp, 0);
+	if (fclose(fp) != 0 || err) {
+		remove(filename);
+		return 1;
 	}
-	AnnAdjustWeights(net);
-	return maxerr;
+	return 0;
 }
 
-/* Helper function for RPROP, returns -1 if n < 0, +1 if n > 0, 0 if n == 0 */
-double sign(double n)
+/* Flush to disk the directory holding 'filename', so that a file just
+ * renamed there survives a crash. Return non-zero on error, with errno
+ * set. File systems not supporting it are not an error. */
+static int AnnSyncDir(char *filename)
 {
-	if (n > 0) return +1;
-	if (n < 0) return -1;
+	char *dir, *slash = strrchr(filename, '/');
+	int fd, err = 0;
+
+	if ((dir = strdup(slash ? filename : ".")) == NULL) {
+		errno = ENOMEM;
+		return 1;
+	}
+	if (slash)
+		dir[slash == filename ? 1 : slash-filename] = '\0';
+	if ((fd = open(dir, O_RDONLY)) == -1) {
+		free(dir);
+		return 1;
+	}
+	if (fsync(fd) == -1 && errno != EINVAL)
+		err = errno;
+	close(fd);
+	free(dir);
+	errno = err;
+	return err != 0;
+}
+
+/* Save the net and its training state into the file 'filename', so
+ * that the net returned by AnnLoad() continues the training exactly
+ * where it was, as long as it is trained with the same dataset and
+ * parameters. The second order algorithms (LM, L-BFGS, SCG) restart
+ * their history, and importance sampling draws new samples.
+ * The checkpoint is written to an unique temporary file in the same
+ * directory, flushed to disk and renamed to 'filename', then the
+ * directory is flushed too: a crash at any time leaves either the
+ * previous checkpoint or the new one, never a partial file. The file
+ * keeps the permissions of the previous checkpoint, if any.
+ * Return non-zero on error, with errno set. */
+int AnnCheckpoint(struct Ann *net, char *filename)
+{
+	FILE *fp;
+	struct stat st;
+	char *tmp;
+	int fd, err;
+
+	if ((tmp = malloc(strlen(filename)+8)) == NULL) {
+		errno = ENOMEM;
+		return 1;
+	}
+	sprintf(tmp, "%s.XXXXXX", filename);
+	if ((fd = mkstemp(tmp)) == -1) {
+		free(tmp);
+		return 1;
+	}
+	if (stat(filename, &st) == 0)
+		fchmod(fd, st.st_mode & 07777);
+	if ((fp = fdopen(fd, "wb")) == NULL) {
+		err = errno;
+		close(fd);
+		remove(tmp);
+		free(tmp);
+		errno = err;
+		return 1;
+	}
+	err = AnnWrite(net, fp, 1) || fflush(fp) != 0 ||
+		fsync(fileno(fp)) != 0;
+	if (fclose(fp) != 0 || err || rename(tmp, filename) != 0) {
+		err = errno;
+		remove(tmp);
+		free(tmp);
+		errno = err;
+		return 1;
+	}
+	free(tmp);
+	return AnnSyncDir(filename);
+}
+
+/* Make AnnTrainDataset() write a checkpoint of the net into 'filename'
+ * every 'every' epochs if non zero, and after 'seconds' seconds since
+ * the previous one if non zero, plus a last one when training ends.
+ * A NULL filename disables checkpoints.
+ * Return non-zero on out of memory. */
+int AnnSetCheckpoint(struct Ann *net, char *filename, int every, double seconds)
+{
+	char *copy = NULL;
+
+	if (filename && (copy = strdup(filename)) == NULL)
+		return 1;
+	free(net->checkpoint);
+	net->checkpoint = copy;
+	net->checkpoint_every = every;
+	net->checkpoint_seconds = seconds;
+	net->checkpoint_errno = 0;
 	return 0;
 }
 
-/* The core of the RPROP algorithm.
- *
- * Note that:
- * sgradient is the set-wise gradient.
- * delta is the per-weight update value. */
-void AnnAdjustWeightsResilientBP(struct Ann *net)
+/* Make AnnTrainDataset() evaluate the net on the held-out samples of
+ * 'ds' every 'every' epochs, keeping the weights with the lowest mean
+ * error, and stop training after 'patience' evaluations in a row that
+ * don't improve it (never if zero). The dataset is not copied: it must
+ * be valid while training. A NULL dataset disables the validation. */
+void AnnSetValidation(struct Ann *net, struct AnnDataset *ds, int every, int patience)
 {
-	int j, i, layers = LAYERS(net);
+	net->validation = ds;
+	net->validate_every = MAX(every,1);
+	net->patience = patience;
+}
 
-	for (j = 1; j < layers; j++) {
-		int units = UNITS(net, j);
-		int weights = units * UNITS(net,j-1);
-		for (i = 0; i < weights; i++) {
-			double t = net->layer[j].pgradient[i] *
-				   net->layer[j].sgradient[i];
-			if (t > 0) {
-				net->layer[j].delta[i] =
-					MIN(net->layer[j].delta[i]*RPROP_NPLUS(net),
-					    RPROP_MAXUPDATE(net));
-				net->layer[j].weight[i] -=
-					sign(net->layer[j].sgradient[i]) *
-					net->layer[j].delta[i];
-				net->layer[j].pgradient[i] =
-					net->layer[j].sgradient[i];
-			} else if (t < 0) {
-				net->layer[j].delta[i] =
-					MAX(net->layer[j].delta[i]*RPROP_NMINUS(net),
-					    RPROP_MINUPDATE(net));
-				net->layer[j].pgradient[i] = 0;
-			} else {
-				net->layer[j].weight[i] -=
-					sign(net->layer[j].sgradient[i]) *
-					net->layer[j].delta[i];
-				net->layer[j].pgradient[i] =
-					net->layer[j].sgradient[i];
-			}
+/* Load a net saved with AnnSave() or AnnCheckpoint() from the file
+ * 'filename'.
+ * Return NULL if the file can't be read or is not a valid net file for
+ * this architecture, or on out of memory. */
+struct Ann *AnnLoad(char *filename)
+{
+	FILE *fp;
+	struct Ann *net = NULL;
+	int j, algo, header[ANN_FILE_HEADER], (*l)[ANN_FILE_LAYER] = NULL;
+	double param[ANN_FILE_PARAMS];
+	char magic[sizeof(ANN_FILE_MAGIC)];
+
+	if ((fp = fopen(filename, "rb")) == NULL)
+		return NULL;
+	if (fread(magic, strlen(ANN_FILE_MAGIC), 1, fp) != 1 ||
+	    memcmp(magic, ANN_FILE_MAGIC, strlen(ANN_FILE_MAGIC)) ||
+	    fread(header, sizeof(header), 1, fp) != 1 ||
+	    (header[0] != ANN_FILE_VERSION &&
+	     header[0] != ANN_FILE_STATE_VERSION) || header[1] != sizeof(int) ||
+	    header[2] != sizeof(double) || header[3] != ANN_FILE_ENDIAN ||
+	    header[4] < 2 || header[6] < 0 || header[6] > ANN_SIGMOID_TABLE ||
+	    fread(param, sizeof(param), 1, fp) != 1)
+		goto err;
+	if ((l = malloc(sizeof(*l)*header[4])) == NULL ||
+	    fread(l, sizeof(*l), header[4], fp) != (size_t)header[4])
+		goto err;
+	if ((net = AnnAlloc(header[4])) == NULL)
+		goto err;
+	for (j = 0; j < LAYERS(net); j++) {
+		if (l[j][0] < 1 || AnnInitLayer(net, j, l[j][0], j > 1))
+			goto err;
+	}
+	if (l[1][2] && AnnSetTied(net, 1))
+		goto err;
+	for (j = 1; j < LAYERS(net); j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		if (TIED(net,j) != l[j][2] ||
+		    fread(net->layer[j].weight, sizeof(double), weights, fp) != weights)
+			goto err;
+		if (!l[j][4])
+			continue;
+		if ((net->layer[j].mask = AnnMalloc(weights+1, sizeof(double))) == NULL ||
+		    fread(net->layer[j].mask, sizeof(double), weights, fp) != weights ||
+		    AnnSparseBuild(net, j))
+			goto err;
+	}
+	algo = header[5] & ANN_ALGOMASK;
+	if (algo == 0 || (algo & (algo-1)) || AnnSetLearningAlgo(net, algo))
+		goto err;
+	for (j = 0; j < LAYERS(net); j++) {
+		if (AnnSetActivation(net, j, l[j][1]) ||
+		    (j && l[j][3] && AnnSetFrozen(net, j, 1)))
+			goto err;
+	}
+	AnnSetSigmoid(net, header[6]);
+	net->learn_rate = param[0];
+	net->momentum = param[1];
+	net->rprop_nminus = param[2];
+	net->rprop_nplus = param[3];
+	net->rprop_maxupdate = param[4];
+	net->rprop_minupdate = param[5];
+	net->meanerr = param[6];
+	net->epochs = header[7];
+	/* The training state, set after the algorithm reset it */
+	if (header[0] == ANN_FILE_STATE_VERSION) {
+		unsigned long long rng[2];
+
+		if (fread(rng, sizeof(rng), 1, fp) != 1 ||
+		    fread(&net->rprop_perror, sizeof(double), 1, fp) != 1 ||
+		    fread(&net->shuffle, sizeof(int), 1, fp) != 1)
+			goto err;
+		net->seed = rng[0];
+		net->rng_next = rng[1];
+		for (j = 1; j < LAYERS(net); j++) {
+			size_t weights = STORED_WEIGHTS(net,j);
+
+			if (fread(net->layer[j].delta, sizeof(double), weights,
+			    fp) != weights ||
+			    fread(net->layer[j].pgradient, sizeof(double),
+			    weights, fp) != weights)
+				goto err;
 		}
 	}
+	free(l);
+	fclose(fp);
+	return net;
+err:
+	if (net)
+		AnnFree(net);
+	free(l);
+	fclose(fp);
+	return NULL;
 }
 
-/* Resilient Backpropagation Epoch */
-double AnnResilientBPEpoch(struct Ann *net, double *input, double *desidered, int setlen)
+/* Training sets are saved in a binary file in the native byte order,
+ * made of: the ANN_DATASET_MAGIC string, the ANN_DATASET_* header values
+ * as ints (version, sizeof(int), sizeof(double), ANN_FILE_ENDIAN, type,
+ * samples, inputs, outputs, weighted), the scale and offset doubles,
+ * the inputs and the targets of all the samples stored as 'type', and
+ * the weights of the samples as doubles if 'weighted' is set. */
+#define ANN_DATASET_MAGIC "GNEGNUDS"
+#define ANN_DATASET_VERSION 1
+#define ANN_DATASET_HEADER 9
+
+/* Write 'n' values per sample of 'data' (inputs or targets of 'ds') */
+static void AnnDatasetWriteData(struct AnnDataset *ds, void *data, int n, FILE *fp)
 {
-	double maxerr = 0, e;
-	int j, inputs = INPUT_UNITS(net), outputs = OUTPUT_UNITS(net);
+	size_t size = AnnDatasetElementSize(ds->type);
+	int j;
 
-	AnnResetSgradient(net);
-	for (j = 0; j < setlen; j++) {
-		e = AnnSimulateError(net, input, desidered);
-		if (e > maxerr) maxerr = e;
-		AnnCalculateGradients(net, desidered);
-		AnnUpdateSgradient(net);
-		input += inputs;
-		desidered += outputs;
+	if (ds->index == NULL) {
+		fwrite(data, size*n, ds->setlen, fp);
+		return;
 	}
-	AnnAdjustWeightsResilientBP(net);
-	return maxerr;
+	for (j = 0; j < ds->setlen; j++)
+		fwrite((char*)data+size*n*ds->index[j], size*n, 1, fp);
 }
 
-/* Train the net */
-int AnnTrain(struct Ann *net, double *input, double *desidered, double maxerr, int maxepochs, int setlen)
+/* Save the training set into the file 'filename', with the samples in
+ * the order seen by the training.
+ * Return non-zero on error, with errno set. */
+int AnnDatasetSave(struct AnnDataset *ds, char *filename)
 {
-	int i = 0;
-	double e = maxerr+1;
-	int algo = net->flags & ANN_ALGOMASK;
+	FILE *fp;
+	int header[ANN_DATASET_HEADER], err;
+	double param[2];
 
-	while (i++ < maxepochs && e >= maxerr) {
-		switch(algo) {
-		case ANN_RPROP:
-			e = AnnResilientBPEpoch(net, input, desidered, setlen);
-			break;
-		case ANN_OBPROP: /* fixme, for now use the batch mode */
+	if ((fp = fopen(filename, "wb")) == NULL)
+		return 1;
+	header[0] = ANN_DATASET_VERSION;
+	header[1] = sizeof(int);
+	header[2] = sizeof(double);
+	header[3] = ANN_FILE_ENDIAN;
+	header[4] = ds->type;
+	header[5] = ds->setlen;
+	header[6] = ds->inputs;
+	header[7] = ds->outputs;
+	header[8] = ds->weight != NULL;
+	param[0] = ds->scale;
+	param[1] = ds->offset;
+	fwrite(ANN_DATASET_MAGIC, strlen(ANN_DATASET_MAGIC), 1, fp);
+	fwrite(header, sizeof(header), 1, fp);
+	fwrite(param, sizeof(param), 1, fp);
+	AnnDatasetWriteData(ds, ds->input, ds->inputs, fp);
+	AnnDatasetWriteData(ds, ds->target, ds->outputs, fp);
+	if (ds->weight)
+		fwrite(ds->weight, sizeof(double), ds->setlen, fp);
+	err = ferror(fp);
+	if (fclose(fp) != 0 || err) {
+		remove(filename);
+		return 1;
+	}
+	return 0;
+}
+
+/* Load a training set saved with AnnDatasetSave() from the file
+ * 'filename'. Return NULL if the file can't be read or is not a valid
+ * training set file for this architecture, or on out of memory. */
+struct AnnDataset *AnnDatasetRead(char *filename)
+{
+	FILE *fp;
+	struct AnnDataset *ds = NULL;
+	int header[ANN_DATASET_HEADER], j;
+	double param[2];
+	char magic[sizeof(ANN_DATASET_MAGIC)];
+	size_t size, n;
+
+	if ((fp = fopen(filename, "rb")) == NULL)
+		return NULL;
+	if (fread(magic, strlen(ANN_DATASET_MAGIC), 1, fp) != 1 ||
+	    memcmp(magic, ANN_DATASET_MAGIC, strlen(ANN_DATASET_MAGIC)) ||
+	    fread(header, sizeof(header), 1, fp) != 1 ||
+	    header[0] != ANN_DATASET_VERSION || header[1] != sizeof(int) ||
+	    header[2] != sizeof(double) || header[3] != ANN_FILE_ENDIAN ||
+	    (header[4] != ANN_DATA_DOUBLE && header[4] != ANN_DATA_U8 &&
+	     header[4] != ANN_DATA_U16) ||
+	    header[5] < 0 || header[6] < 1 || header[7] < 1 ||
+	    fread(param, sizeof(param), 1, fp) != 1)
+		goto err;
+	if ((ds = AnnDatasetCreate(header[4], header[5], header[6], header[7],
+	    param[0], param[1])) == NULL)
+		goto err;
+	size = AnnDatasetElementSize(ds->type);
+	n = (size_t)ds->setlen*ds->inputs;
+	if (fread(ds->input, size, n, fp) != n)
+		goto err;
+	n = (size_t)ds->setlen*ds->outputs;
+	if (fread(ds->target, size, n, fp) != n)
+		goto err;
+	if (header[8]) {
+		n = ds->setlen;
+		if ((ds->weight = malloc(sizeof(double)*(n+1))) == NULL ||
+		    fread(ds->weight, sizeof(double), n, fp) != n)
+			goto err;
+		ds->totweight = 0;
+		for (j = 0; j < ds->setlen; j++)
+			ds->totweight += ds->weight[j];
+	}
+	fclose(fp);
+	return ds;
+err:
+	if (ds)
+		AnnDatasetFree(ds);
+	fclose(fp);
+	return NULL;
+}
+
+/* Evaluation workers of AnnEvaluate(): the samples are split in chunks
+ * of ANN_EVAL_CHUNK samples, pulled by the workers in any order, and
+ * the partial sums of every chunk are stored in its own slot so that
+ * they are added in the same order for any number of threads. */
+struct AnnEvalWorker {
+	struct Ann *net;
+	struct AnnDataset *ds;
+	int *next;		/* next chunk to evaluate */
+	int chunks;
+	double *part;		/* 2+outputs sums for every chunk */
+	int oom;
+	int started;
+};
+
+/* Evaluate the chunks, the slot of a chunk holds the weighted sum of
+ * the sample errors, the max sample error, and the weighted sum of the
+ * squared errors of every output. */
+static void *AnnEvalWorkerMain(void *arg)
+{
+	struct AnnEvalWorker *w = arg;
+	struct AnnDataset *ds = w->ds;
+	int inputs = ds->inputs, outputs = ds->outputs, c;
+	double *in, *out, *target;
+
+	in = malloc(sizeof(double)*ANN_EVAL_CHUNK*inputs);
+	out = malloc(sizeof(double)*ANN_EVAL_CHUNK*outputs);
+	target = malloc(sizeof(double)*ANN_EVAL_CHUNK*outputs);
+	if (in == NULL || out == NULL || target == NULL) {
+		w->oom = 1;
+		goto out;
+	}
+	while ((c = __sync_fetch_and_add(w->next, 1)) < w->chunks) {
+		int first = c*ANN_EVAL_CHUNK, k, i;
+		int n = MIN(ANN_EVAL_CHUNK, ds->setlen-first);
+		double *p = w->part+(size_t)c*(outputs+2);
+
+		for (k = 0; k < n; k++)
+			AnnDatasetGetSample(ds, first+k, in+k*inputs,
+				target+k*outputs);
+		if (AnnSimulateBatch(w->net, in, out, n)) {
+			w->oom = 1;
+			break;
+		}
+		memset(p, 0, sizeof(double)*(outputs+2));
+		for (k = 0; k < n; k++) {
+			double *o = out+k*outputs, *t = target+k*outputs;
+			double e = 0, sw = ds->weight ? ds->weight[first+k] : 1;
+
+			/* Same error of AnnGlobalError() */
+			for (i = 0; i < outputs; i++) {
+				double d = t[i]-o[i];
+
+				e += d*d;
+				p[2+i] += sw*d*d;
+			}
+			e *= .5;
+			p[0] += sw*e;
+			if (e > p[1])
+				p[1] = e;
+		}
+	}
+out:
+	free(in);
+	free(target);
+	free(out);
+	return NULL;
+}
+
+/* Evaluate the net on the dataset 'ds' with the forward pass only,
+ * without modifying the net, filling 'res': the mean and max sample
+ * error (the error of AnnGlobalError(), the mean being weighted like
+ * net->meanerr), the mean squared error of the outputs, and its PSNR
+ * assuming outputs in the [0,1] range like image pixels. If res->outerr
+ * is not NULL the mean squared error of every output is stored there.
+ * The samples are simulated in batches by THREADS(net) threads, and the
+ * results are the same for any number of threads.
+ * Return non-zero on out of memory. */
+int AnnEvaluate(struct Ann *net, struct AnnDataset *ds, struct AnnEvalResult *res)
+{
+	int outputs = OUTPUT_UNITS(net), threads = THREADS(net), next = 0;
+	int chunks = (ds->setlen+ANN_EVAL_CHUNK-1)/ANN_EVAL_CHUNK, j, i, oom = 0;
+	struct AnnEvalWorker *w;
+	pthread_t *tid;
+	double *part, sq = 0, totweight = ds->totweight;
+
+	threads = MAX(1, MIN(threads, chunks));
+	part = AnnMalloc((size_t)chunks*(outputs+2)+1, sizeof(double));
+	w = malloc(sizeof(*w)*threads);
+	tid = malloc(sizeof(pthread_t)*threads);
+	if (part == NULL || w == NULL || tid == NULL) {
+		free(part);
+		free(w);
+		free(tid);
+		return 1;
+	}
+	/* The worker 0 runs in this thread */
+	for (j = 0; j < threads; j++) {
+		w[j].net = net;
+		w[j].ds = ds;
+		w[j].next = &next;
+		w[j].chunks = chunks;
+		w[j].part = part;
+		w[j].oom = 0;
+		w[j].started = j && pthread_create(&tid[j], NULL,
+			AnnEvalWorkerMain, &w[j]) == 0;
+	}
+	AnnEvalWorkerMain(&w[0]);
+	for (j = 0; j < threads; j++) {
+		if (w[j].started)
+			pthread_join(tid[j], NULL);
+		oom |= w[j].oom;
+	}
+	if (!oom) {
+		res->meanerr = res->maxerr = 0;
+		if (res->outerr)
+			memset(res->outerr, 0, sizeof(double)*outputs);
+		for (j = 0; j < chunks; j++) {
+			double *p = part+(size_t)j*(outputs+2);
+
+			res->meanerr += p[0];
+			if (p[1] > res->maxerr)
+				res->maxerr = p[1];
+			for (i = 0; i < outputs; i++) {
+				sq += p[2+i];
+				if (res->outerr)
+					res->outerr[i] += p[2+i];
+			}
+		}
+		if (totweight > 0) {
+			res->meanerr /= totweight;
+			sq /= totweight;
+			if (res->outerr)
+				for (i = 0; i < outputs; i++)
+					res->outerr[i] /= totweight;
+		}
+		res->mse = sq/outputs;
+		res->psnr = res->mse > 0 ? 10*log10(1/res->mse) : HUGE_VAL;
+	}
+	free(part);
+	free(w);
+	free(tid);
+	return oom;
+}
+
+/* Update the deltas using the gradient descend algorithm.
+ * Gradients should be already computed with AnnCalculateGraidents(). */
+void AnnUpdateDeltasGD(struct Ann *net)
+{
+	int j, layers = LAYERS(net);
+	size_t i;
+	ANN_PROF_START(prof);
+
+	for (j = 1; j < layers; j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		if (FROZEN(net,j))
+			continue;
+		for (i = 0; i < weights; i++)
+			net->layer[j].delta[i] += -(LEARN_RATE(net)*net->layer[j].gradient[i]);
+	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		2*AnnProfileWeights(net), 24*AnnProfileWeights(net));
+}
+
+/* Update the deltas using the gradient descend algorithm with momentum.
+ * Gradients should be already computed with AnnCalculateGraidents(). */
+void AnnUpdateDeltasGDM(struct Ann *net)
+{
+	int j, layers = LAYERS(net);
+	size_t i;
+	ANN_PROF_START(prof);
+
+	for (j = 1; j < layers; j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		if (FROZEN(net,j))
+			continue;
+		for (i = 0; i < weights; i++) {
+			net->layer[j].delta[i] += -(LEARN_RATE(net)*net->layer[j].gradient[i]);
+			net->layer[j].delta[i] += -(LEARN_RATE(net)*net->layer[j].pgradient[i])*MOMENTUM(net);
+			net->layer[j].pgradient[i] = net->layer[j].gradient[i];
+		}
+	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		5*AnnProfileWeights(net), 48*AnnProfileWeights(net));
+}
+
+/* Update the sgradient, that's the sum of the weight's gradient for every
+ * element of the training set. This is used for the RPROP algorithm
+ * that works with the sign of the derivative for the whole set. */
+void AnnUpdateSgradient(struct Ann *net)
+{
+	int j, layers = LAYERS(net);
+	size_t i;
+	ANN_PROF_START(prof);
+
+	for (j = 1; j < layers; j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		if (FROZEN(net,j))
+			continue;
+		for (i = 0; i < weights; i++)
+			net->layer[j].sgradient[i] += net->layer[j].gradient[i];
+	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		AnnProfileWeights(net), 24*AnnProfileWeights(net));
+}
+
+/* Adjust net weights using the (already) calculated deltas. */
+void AnnAdjustWeights(struct Ann *net)
+{
+	int j, layers = LAYERS(net);
+	size_t i;
+	ANN_PROF_START(prof);
+
+	for (j = 1; j < layers; j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		if (FROZEN(net,j))
+			continue;
+		for (i = 0; i < weights; i++) {
+			net->layer[j].weight[i] += net->layer[j].delta[i];
+		}
+	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		AnnProfileWeights(net), 24*AnnProfileWeights(net));
+}
+
+/* Adjust net weights directly with the gradient, without to accumulate
+ * the deltas first. Used by the online algorithms, where the update
+ * is performed after every sample. */
+void AnnAdjustWeightsGD(struct Ann *net)
+{
+	int j, layers = LAYERS(net);
+	size_t i;
+	ANN_PROF_START(prof);
+
+	for (j = 1; j < layers; j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+		double *w = net->layer[j].weight;
+		double *g = net->layer[j].gradient;
+
+		if (FROZEN(net,j))
+			continue;
+		for (i = 0; i < weights; i++)
+			w[i] -= LEARN_RATE(net)*g[i];
+	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		2*AnnProfileWeights(net), 24*AnnProfileWeights(net));
+}
+
+/* Like AnnAdjustWeightsGD() but with momentum, using the same update
+ * rule of AnnUpdateDeltasGDM(). */
+void AnnAdjustWeightsGDM(struct Ann *net)
+{
+	int j, layers = LAYERS(net);
+	size_t i;
+	ANN_PROF_START(prof);
+
+	for (j = 1; j < layers; j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+		double *w = net->layer[j].weight;
+		double *g = net->layer[j].gradient;
+		double *pg = net->layer[j].pgradient;
+
+		if (FROZEN(net,j))
+			continue;
+		for (i = 0; i < weights; i++) {
+			w[i] -= LEARN_RATE(net)*(g[i] + pg[i]*MOMENTUM(net));
+			pg[i] = g[i];
+		}
+	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		4*AnnProfileWeights(net), 40*AnnProfileWeights(net));
+}
+
+/* Batch Gradient Descend Epoch */
+double AnnBatchGDEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	double maxerr = 0, toterr = 0, e;
+	int j, setlen = ds->setlen;
+
+	AnnResetDeltas(net);
+	if (net->stats || net->callback)
+		AnnResetSgradient(net);
+	for (j = 0; j < setlen; j++) {
+		double *desidered;
+
+		e = AnnSimulateSample(net, ds, j, &desidered);
+		if (e > maxerr) maxerr = e;
+		toterr += net->sample_weight*e;
+		AnnCalculateGradients(net, desidered);
+		AnnUpdateDeltasGD(net);
+		if (net->stats || net->callback)
+			AnnUpdateSgradient(net);
+	}
+	AnnAdjustWeights(net);
+	net->meanerr = setlen ? toterr/ds->totweight : 0;
+	return maxerr;
+}
+
+/* Batch Gradient Descend Epoch with Momentum */
+double AnnBatchGDMEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	double maxerr = 0, toterr = 0, e;
+	int j, setlen = ds->setlen;
+
+	AnnResetDeltas(net);
+	if (net->stats || net->callback)
+		AnnResetSgradient(net);
+	for (j = 0; j < setlen; j++) {
+		double *desidered;
+
+		e = AnnSimulateSample(net, ds, j, &desidered);
+		if (e > maxerr) maxerr = e;
+		toterr += net->sample_weight*e;
+		AnnCalculateGradients(net, desidered);
+		AnnUpdateDeltasGDM(net);
+		if (net->stats || net->callback)
+			AnnUpdateSgradient(net);
+	}
+	AnnAdjustWeights(net);
+	net->meanerr = setlen ? toterr/ds->totweight : 0;
+	return maxerr;
+}
+
+/* Online Gradient Descend Epoch: weights are updated after every sample */
+double AnnOnlineGDEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	double maxerr = 0, toterr = 0, e;
+	int j, setlen = ds->setlen;
+
+	if (net->stats || net->callback)
+		AnnResetSgradient(net);
+	for (j = 0; j < setlen; j++) {
+		double *desidered;
+
+		e = AnnSimulateSample(net, ds, j, &desidered);
+		if (e > maxerr) maxerr = e;
+		toterr += net->sample_weight*e;
+		AnnCalculateGradients(net, desidered);
+		AnnAdjustWeightsGD(net);
+		if (net->stats || net->callback)
+			AnnUpdateSgradient(net);
+	}
+	net->meanerr = setlen ? toterr/ds->totweight : 0;
+	return maxerr;
+}
+
+/* Online Gradient Descend Epoch with Momentum */
+double AnnOnlineGDMEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	double maxerr = 0, toterr = 0, e;
+	int j, setlen = ds->setlen;
+
+	if (net->stats || net->callback)
+		AnnResetSgradient(net);
+	for (j = 0; j < setlen; j++) {
+		double *desidered;
+
+		e = AnnSimulateSample(net, ds, j, &desidered);
+		if (e > maxerr) maxerr = e;
+		toterr += net->sample_weight*e;
+		AnnCalculateGradients(net, desidered);
+		AnnAdjustWeightsGDM(net);
+		if (net->stats || net->callback)
+			AnnUpdateSgradient(net);
+	}
+	net->meanerr = setlen ? toterr/ds->totweight : 0;
+	return maxerr;
+}
+
+/* Create a net that shares the weights of 'net', but has private
+ * output, error, gradient and pgradient arrays, so that it can be
+ * simulated and trained by a different thread than the original one.
+ * Every weight update performed on the copy is visible to 'net'.
+ * The copy must be released with AnnFreeShared().
+ * On out of memory NULL is returned. */
+struct Ann *AnnCloneShared(struct Ann *net)
+{
+	struct Ann *copy;
+	int j;
+
+	if ((copy = malloc(sizeof(*copy))) == NULL)
+		return NULL;
+	*copy = *net;
+#ifdef ANN_PROFILE
+	AnnProfileReset(copy);
+#endif
+	/* Statistics are recorded by the original net only: the copies
+	 * share the sgradient array, see AnnHogwildSgradient(). */
+	copy->stats = NULL;
+	copy->callback = NULL;
+	copy->opt = NULL;
+	if ((copy->sample_target = malloc(sizeof(double)*OUTPUT_UNITS(net))) == NULL) {
+		free(copy);
+		return NULL;
+	}
+	if ((copy->layer = malloc(sizeof(struct AnnLayer)*LAYERS(net))) == NULL) {
+		free(copy->sample_target);
+		free(copy);
+		return NULL;
+	}
+	for (j = 0; j < LAYERS(net); j++) {
+		struct AnnLayer *l = &copy->layer[j];
+		int units = UNITS(net,j);
+		size_t weights = j ? STORED_WEIGHTS(net,j) : 0;
+
+		*l = net->layer[j];
+		l->output = malloc(sizeof(double)*units);
+		l->error = malloc(sizeof(double)*units);
+		l->gradient = l->pgradient = NULL;
+		if (j) {
+			l->gradient = AnnMalloc(MAX(weights,1), sizeof(double));
+			l->pgradient = AnnMalloc(MAX(weights,1), sizeof(double));
+		}
+		if (l->output == NULL || l->error == NULL ||
+		    (j && (l->gradient == NULL || l->pgradient == NULL)))
+		{
+			copy->layers = j+1;
+			AnnFreeShared(copy);
+			return NULL;
+		}
+		memcpy(l->output, net->layer[j].output, sizeof(double)*units);
+		memset(l->error, 0, sizeof(double)*units);
+		if (j) {
+			memset(l->gradient, 0, sizeof(double)*weights);
+			memset(l->pgradient, 0, sizeof(double)*weights);
+		}
+	}
+	return copy;
+}
+
+/* Free a net created with AnnCloneShared(). The shared weights
+ * are not touched. */
+void AnnFreeShared(struct Ann *net)
+{
+	int j;
+
+	for (j = 0; j < LAYERS(net); j++) {
+		free(net->layer[j].output);
+		free(net->layer[j].error);
+		free(net->layer[j].gradient);
+		free(net->layer[j].pgradient);
+	}
+	free(net->layer);
+	free(net->sample_target);
+	free(net);
+}
+
+/* Hogwild worker state */
+struct AnnHogwild {
+	struct Ann *net;	/* private copy sharing the weights */
+	struct AnnDataset *ds;	/* the whole training set */
+	int *next;		/* next sample to process, shared */
+	int sgradient;		/* accumulate the set-wise gradient */
+	double maxerr;
+	double toterr;
+};
+
+/* Give the hogwild copy 'net' private zeroed sgradient arrays, so that
+ * the set-wise gradient can be accumulated without races.
+ * Return non-zero on out of memory. */
+static int AnnHogwildSgradient(struct Ann *net)
+{
+	int j;
+
+	for (j = 1; j < LAYERS(net); j++)
+		net->layer[j].sgradient = NULL;
+	for (j = 1; j < LAYERS(net); j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		if ((net->layer[j].sgradient = AnnMalloc(MAX(weights,1),
+		     sizeof(double))) == NULL)
+			return 1;
+		memset(net->layer[j].sgradient, 0, sizeof(double)*weights);
+	}
+	return 0;
+}
+
+/* Add the private set-wise gradient of the hogwild copy 'copy' to the
+ * one of 'net' and release it. */
+static void AnnHogwildMergeSgradient(struct Ann *net, struct Ann *copy)
+{
+	int j;
+	size_t i;
+
+	for (j = 1; j < LAYERS(net); j++) {
+		double *sg = copy->layer[j].sgradient;
+
+		if (sg && !FROZEN(net,j)) {
+			for (i = 0; i < STORED_WEIGHTS(net,j); i++)
+				net->layer[j].sgradient[i] += sg[i];
+		}
+		free(sg);
+		copy->layer[j].sgradient = net->layer[j].sgradient;
+	}
+}
+
+/* Hogwild worker thread: fetch chunks of samples from the shared
+ * counter and apply the online update to the shared weights after
+ * every sample, without any locking. Concurrent updates may overwrite
+ * each other, but since every sample touches the weights only by a small
+ * amount the lost updates don't prevent convergence. */
+static void *AnnHogwildWorker(void *arg)
+{
+	struct AnnHogwild *hw = arg;
+	struct Ann *net = hw->net;
+	int algo = net->flags & ANN_ALGOMASK, setlen = hw->ds->setlen;
+
+	hw->maxerr = hw->toterr = 0;
+	while(1) {
+		int j, start = __sync_fetch_and_add(hw->next, HOGWILD_CHUNK);
+		int end = MIN(start+HOGWILD_CHUNK, setlen);
+
+		if (start >= setlen)
+			break;
+		for (j = start; j < end; j++) {
+			double *desidered, e;
+
+			e = AnnSimulateSample(net, hw->ds, j, &desidered);
+			if (e > hw->maxerr) hw->maxerr = e;
+			hw->toterr += net->sample_weight*e;
+			AnnCalculateGradients(net, desidered);
+			if (algo == ANN_OBPROPM)
+				AnnAdjustWeightsGDM(net);
+			else
+				AnnAdjustWeightsGD(net);
+			if (hw->sgradient)
+				AnnUpdateSgradient(net);
+		}
+	}
+	return NULL;
+}
+
+/* Hogwild-style parallel online epoch: THREADS(net) workers pull samples
+ * from the training set and update the shared weights lock-free.
+ * If the threads can't be created the epoch is performed by the
+ * calling thread alone. */
+double AnnHogwildEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	int j, started = 0, next = 0, threads = THREADS(net);
+	int setlen = ds->setlen, sgradient = net->stats || net->callback;
+	struct AnnHogwild *hw;
+	pthread_t *tid;
+	double maxerr = 0, toterr = 0;
+
+	hw = malloc(sizeof(*hw)*threads);
+	tid = malloc(sizeof(pthread_t)*threads);
+	if (hw == NULL || tid == NULL)
+		goto serial;
+	/* Every worker accumulates its own part of the set-wise gradient,
+	 * merged in worker order once the epoch is done. */
+	if (sgradient)
+		AnnResetSgradient(net);
+	for (j = 0; j < threads; j++) {
+		hw[j].net = AnnCloneShared(net);
+		hw[j].ds = ds;
+		hw[j].next = &next;
+		hw[j].sgradient = sgradient;
+		if (hw[j].net == NULL ||
+		    (sgradient && AnnHogwildSgradient(hw[j].net)) ||
+		    pthread_create(&tid[j], NULL, AnnHogwildWorker, &hw[j]))
+		{
+			if (hw[j].net) {
+				if (sgradient)
+					AnnHogwildMergeSgradient(net, hw[j].net);
+				AnnFreeShared(hw[j].net);
+			}
+			break;
+		}
+		started++;
+	}
+	for (j = 0; j < started; j++) {
+		pthread_join(tid[j], NULL);
+		if (hw[j].maxerr > maxerr) maxerr = hw[j].maxerr;
+		toterr += hw[j].toterr;
+#ifdef ANN_PROFILE
+		AnnProfileMerge(&net->profile, &hw[j].net->profile);
+#endif
+		if (sgradient)
+			AnnHogwildMergeSgradient(net, hw[j].net);
+		AnnFreeShared(hw[j].net);
+	}
+	free(hw);
+	free(tid);
+	if (started) {
+		net->meanerr = setlen ? toterr/ds->totweight : 0;
+		return maxerr;
+	}
+serial:
+	free(hw);
+	free(tid);
+	if ((net->flags & ANN_ALGOMASK) == ANN_OBPROPM)
+		return AnnOnlineGDMEpoch(net, ds);
+	return AnnOnlineGDEpoch(net, ds);
+}
+
+/* Helper function for RPROP, returns -1 if n < 0, +1 if n > 0, 0 if n == 0 */
+double sign(double n)
+{
+	if (n > 0) return +1;
+	if (n < 0) return -1;
+	return 0;
+}
+
+/* The core of the RPROP algorithm.
+ *
+ * Note that:
+ * sgradient is the set-wise gradient.
+ * delta is the per-weight update value. */
+void AnnAdjustWeightsResilientBP(struct Ann *net)
+{
+	int j, layers = LAYERS(net);
+	size_t i;
+	ANN_PROF_START(prof);
+
+	for (j = 1; j < layers; j++) {
+		size_t weights = STORED_WEIGHTS(net,j);
+
+		if (FROZEN(net,j))
+			continue;
+		for (i = 0; i < weights; i++) {
+			double t = net->layer[j].pgradient[i] *
+				   net->layer[j].sgradient[i];
+			if (t > 0) {
+				net->layer[j].delta[i] =
+					MIN(net->layer[j].delta[i]*RPROP_NPLUS(net),
+					    RPROP_MAXUPDATE(net));
+				net->layer[j].weight[i] -=
+					sign(net->layer[j].sgradient[i]) *
+					net->layer[j].delta[i];
+				net->layer[j].pgradient[i] =
+					net->layer[j].sgradient[i];
+			} else if (t < 0) {
+				net->layer[j].delta[i] =
+					MAX(net->layer[j].delta[i]*RPROP_NMINUS(net),
+					    RPROP_MINUPDATE(net));
+				net->layer[j].pgradient[i] = 0;
+			} else {
+				net->layer[j].weight[i] -=
+					sign(net->layer[j].sgradient[i]) *
+					net->layer[j].delta[i];
+				net->layer[j].pgradient[i] =
+					net->layer[j].sgradient[i];
+			}
+		}
+	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		4*AnnProfileWeights(net), 56*AnnProfileWeights(net));
+}
+
+/* Resilient Backpropagation Epoch */
+double AnnResilientBPEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	double maxerr = 0, toterr = 0, e;
+	int j, setlen = ds->setlen;
+
+	AnnResetSgradient(net);
+	for (j = 0; j < setlen; j++) {
+		double *desidered;
+
+		e = AnnSimulateSample(net, ds, j, &desidered);
+		if (e > maxerr) maxerr = e;
+		toterr += net->sample_weight*e;
+		AnnCalculateGradients(net, desidered);
+		AnnUpdateSgradient(net);
+	}
+	AnnAdjustWeightsResilientBP(net);
+	net->meanerr = setlen ? toterr/ds->totweight : 0;
+	return maxerr;
+}
+
+/* Bit level helpers for the branchless iRPROP kernel. Comparisons
+ * between doubles are turned into branches by the compiler, so signs
+ * and orderings are computed on the IEEE 754 representation, and
+ * selections are performed with all-ones/all-zeros masks. */
+#define ANN_MAG_MASK 0x7fffffffffffffffULL
+
+static inline unsigned long long AnnBits(double x)
+{
+	unsigned long long b;
+
+	memcpy(&b, &x, sizeof(b));
+	return b;
+}
+
+static inline double AnnFromBits(unsigned long long b)
+{
+	double x;
+
+	memcpy(&x, &b, sizeof(x));
+	return x;
+}
+
+/* Return 'a' if the mask is all ones, 'b' if it is all zeros */
+static inline double AnnSelect(unsigned long long mask, double a, double b)
+{
+	return AnnFromBits((AnnBits(a) & mask) | (AnnBits(b) & ~mask));
+}
+
+/* All ones if x != 0 (+0 and -0 are both zero) */
+static inline unsigned long long AnnNonZeroMask(unsigned long long x)
+{
+	return -(((x & ANN_MAG_MASK) + ANN_MAG_MASK) >> 63);
+}
+
+/* All ones if a < b, for non negative a and b */
+static inline unsigned long long AnnLessMask(double a, double b)
+{
+	return -((AnnBits(a) - AnnBits(b)) >> 63);
+}
+
+/* Update a single weight with iRPROP. 'back' is all ones if the weight
+ * change of the previous epoch should be undone on sign change (iRPROP+
+ * when the error increased), otherwise all zeros. */
+static inline void AnnIRpropWeight(double *w, double *d, double *pg, double g, unsigned long long back, double nplus, double nminus, double maxupdate, double minupdate)
+{
+	unsigned long long t = AnnBits(g * *pg), nz = AnnNonZeroMask(t);
+	unsigned long long neg = nz & -(t >> 63), pos = nz & ~neg;
+	double up = *d*nplus, down = *d*nminus, dn, gs;
+
+	up = AnnSelect(AnnLessMask(up, maxupdate), up, maxupdate);
+	down = AnnSelect(AnnLessMask(minupdate, down), down, minupdate);
+	dn = AnnSelect(pos, up, AnnSelect(neg, down, *d));
+	/* On sign change the gradient is considered zero: no update now,
+	 * and no step size change at the next epoch. */
+	gs = AnnFromBits(AnnBits(g) & ~neg);
+	/* The previous change was -sign(pg)*d, undo it if needed */
+	*w += AnnFromBits((AnnBits(*d) | (AnnBits(*pg) & ~ANN_MAG_MASK)) &
+		neg & back);
+	/* w -= sign(gs)*dn */
+	*w -= AnnFromBits((AnnBits(dn) | (AnnBits(gs) & ~ANN_MAG_MASK)) &
+		AnnNonZeroMask(AnnBits(gs)));
+	*pg = gs;
+	*d = dn;
+}
+
+/* Update the 'n' weights of a layer with iRPROP. The arrays are declared
+ * restrict and processed in groups of four, that's what the compiler
+ * needs to vectorize the loop at -O2. Once inlined, the restrict
+ * information is lost, so the function is kept out of line. */
+static void __attribute__((noinline)) AnnIRpropLayer(double *restrict w, double *restrict d, double *restrict pg, const double *restrict g, size_t n, unsigned long long back, double nplus, double nminus, double maxupdate, double minupdate)
+{
+	size_t i;
+	int k;
+
+	for (i = 0; i+4 <= n; i += 4) {
+		for (k = 0; k < 4; k++)
+			AnnIRpropWeight(w+i+k, d+i+k, pg+i+k, g[i+k], back,
+				nplus, nminus, maxupdate, minupdate);
+	}
+	for (; i < n; i++)
+		AnnIRpropWeight(w+i, d+i, pg+i, g[i], back,
+			nplus, nminus, maxupdate, minupdate);
+}
+
+/* iRPROP weights update (Igel and Husken, "Improving the Rprop learning
+ * algorithm", 2000), performed in a single pass over every layer that
+ * reads and writes sgradient, pgradient, delta and weight together.
+ * With 'backtrack' non-zero the iRPROP+ variant is used: the weights
+ * changes of the previous epoch are undone where the gradient sign
+ * changed, if the error increased. */
+void AnnAdjustWeightsIRprop(struct Ann *net, int backtrack)
+{
+	unsigned long long back = backtrack ? ~0ULL : 0;
+	int j, layers = LAYERS(net);
+	ANN_PROF_START(prof);
+
+	for (j = 1; j < layers; j++) {
+		if (FROZEN(net,j))
+			continue;
+		AnnIRpropLayer(net->layer[j].weight, net->layer[j].delta,
+			net->layer[j].pgradient, net->layer[j].sgradient,
+			STORED_WEIGHTS(net,j), back, RPROP_NPLUS(net), RPROP_NMINUS(net),
+			RPROP_MAXUPDATE(net), RPROP_MINUPDATE(net));
+	}
+	ANN_PROF_END(net, ANN_PROF_UPDATE, prof,
+		20*AnnProfileWeights(net), 56*AnnProfileWeights(net));
+}
+
+/* iRPROP- / iRPROP+ Epoch.
+ * Note that AnnResilientBPEpoch() is already iRPROP-, since it does not
+ * backtrack and zeroes the previous gradient on sign change: the
+ * difference is the update kernel. */
+double AnnIRpropEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	double maxerr = 0, toterr = 0, e;
+	int j, setlen = ds->setlen;
+
+	AnnResetSgradient(net);
+	for (j = 0; j < setlen; j++) {
+		double *desidered;
+
+		e = AnnSimulateSample(net, ds, j, &desidered);
+		if (e > maxerr) maxerr = e;
+		toterr += net->sample_weight*e;
+		AnnCalculateGradients(net, desidered);
+		AnnUpdateSgradient(net);
+	}
+	AnnAdjustWeightsIRprop(net, (net->flags & ANN_ALGOMASK) == ANN_IRPROPP &&
+		toterr > net->rprop_perror);
+	net->rprop_perror = toterr;
+	net->meanerr = setlen ? toterr/ds->totweight : 0;
+	return maxerr;
+}
+
+/* ------------------------- Second order algorithms ------------------------
+ * The algorithms below see the weights of all the layers as a single
+ * vector, and the total error over the training set as the function to
+ * minimize. Every epoch performs one iteration of the algorithm, that
+ * may require more than one pass over the training set. */
+
+/* Copy the weights of the net to the vector 'w' */
+static void AnnGetWeightVector(struct Ann *net, double *w)
+{
+	int j;
+
+	for (j = 1; j < LAYERS(net); j++) {
+		memcpy(w, net->layer[j].weight, sizeof(double)*STORED_WEIGHTS(net,j));
+		w += STORED_WEIGHTS(net,j);
+	}
+}
+
+/* Set the weights of the net from the vector 'w' */
+static void AnnSetWeightVector(struct Ann *net, double *w)
+{
+	int j;
+
+	for (j = 1; j < LAYERS(net); j++) {
+		memcpy(net->layer[j].weight, w, sizeof(double)*STORED_WEIGHTS(net,j));
+		w += STORED_WEIGHTS(net,j);
+	}
+}
+
+/* Copy the gradient (if 'set' is zero) or the set-wise gradient
+ * (if 'set' is non-zero) of the net to the vector 'g' */
+static void AnnGetGradientVector(struct Ann *net, double *g, int set)
+{
+	int j;
+
+	for (j = 1; j < LAYERS(net); j++) {
+		memcpy(g, set ? net->layer[j].sgradient : net->layer[j].gradient,
+			sizeof(double)*STORED_WEIGHTS(net,j));
+		g += STORED_WEIGHTS(net,j);
+	}
+}
+
+static double AnnDot(double *a, double *b, size_t n)
+{
+	double dot = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dot += a[i]*b[i];
+	return dot;
+}
+
+/* Set the weights of the net to 'w' and compute the total error over
+ * the training set, and if 'g' is not NULL the gradient of the total
+ * error. The max per-sample error is stored at 'maxerrp'. */
+static double AnnOptEval(struct Ann *net, double *w, double *g, struct AnnDataset *ds, double *maxerrp)
+{
+	double maxerr = 0, toterr = 0, e;
+	int j, setlen = ds->setlen;
+
+	AnnSetWeightVector(net, w);
+	if (g)
+		AnnResetSgradient(net);
+	for (j = 0; j < setlen; j++) {
+		double *desidered;
+
+		e = AnnSimulateSample(net, ds, j, &desidered);
+		if (e > maxerr) maxerr = e;
+		toterr += net->sample_weight*e;
+		if (g) {
+			AnnCalculateGradients(net, desidered);
+			AnnUpdateSgradient(net);
+		}
+	}
+	if (g)
+		AnnGetGradientVector(net, g, 1);
+	net->meanerr = setlen ? toterr/ds->totweight : 0;
+	*maxerrp = maxerr;
+	return toterr;
+}
+
+/* Make sure the optimizer state refers to the current weights.
+ * Return non-zero if the state was (re)initialized. */
+static int AnnOptStart(struct Ann *net, struct AnnDataset *ds)
+{
+	struct AnnOptState *o = net->opt;
+
+	if (o->valid)
+		return 0;
+	AnnGetWeightVector(net, o->w);
+	o->f = AnnOptEval(net, o->w, o->g, ds, &o->maxerr);
+	o->valid = 1;
+	o->iter = 0;
+	o->hlen = o->hnext = 0;
+	return 1;
+}
+
+/* Factorize the symmetric positive definite n*n matrix 'a' (only the
+ * upper triangle is used) as L*L', storing L in the lower triangle of
+ * 'l'. 'mu' is added to the diagonal of 'a'.
+ * Return non-zero if the matrix is not positive definite. */
+static int AnnCholesky(double *a, double *l, int n, double mu)
+{
+	int i, j, k;
+
+	for (j = 0; j < n; j++) {
+		double *lj = l+j*n, sum = a[j*n+j]+mu;
+
+		for (k = 0; k < j; k++)
+			sum -= lj[k]*lj[k];
+		if (sum <= 0)
+			return 1;
+		lj[j] = sqrt(sum);
+		for (i = j+1; i < n; i++) {
+			double *li = l+i*n;
+
+			sum = a[j*n+i];
+			for (k = 0; k < j; k++)
+				sum -= li[k]*lj[k];
+			li[j] = sum/lj[j];
+		}
+	}
+	return 0;
+}
+
+/* Solve L*L'*x = b, with L computed by AnnCholesky() */
+static void AnnCholeskySolve(double *l, int n, double *b, double *x)
+{
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		double sum = b[i];
+
+		for (k = 0; k < i; k++)
+			sum -= l[i*n+k]*x[k];
+		x[i] = sum/l[i*n+i];
+	}
+	for (i = n-1; i >= 0; i--) {
+		double sum = x[i];
+
+		for (k = i+1; k < n; k++)
+			sum -= l[k*n+i]*x[k];
+		x[i] = sum/l[i*n+i];
+	}
+}
+
+/* Levenberg-Marquardt Epoch.
+ * The Jacobian of the outputs with respect to the weights is computed
+ * one row at a time, backpropagating an unitary error from every output
+ * of every sample, and accumulated directly in J'J, so the memory used
+ * is n*n and not proportional to the training set size.
+ * Then (J'J + mu*I) * step = -J'e is solved with increasing damping
+ * 'mu' until the error decreases. */
+double AnnLevenbergMarquardtEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	struct AnnOptState *o = net->opt;
+	int n = (int)o->n;	/* at most ANN_LM_MAXWEIGHTS */
+	int outputs = OUTPUT_UNITS(net), setlen = ds->setlen;
+	double *row = o->gt, toterr = 0, maxerr = 0;
+	int j, k, i, l, tries;
+
+	AnnGetWeightVector(net, o->w);
+	memset(o->jtj, 0, sizeof(double)*n*n);
+	memset(o->g, 0, sizeof(double)*n);
+	for (j = 0; j < setlen; j++) {
+		double *des, e = AnnSimulateSample(net, ds, j, &des);
+		double w = net->sample_weight;
+
+		if (e > maxerr) maxerr = e;
+		toterr += w*e;
+		for (k = 0; k < outputs; k++) {
+			double err = OUTPUT_NODE(net,k)-des[k];
+
+			/* With target = output - unit vector the gradient
+			 * computed by backprop is the k-th output derivative,
+			 * scaled by the sample weight: the weighted J'J needs
+			 * it just once. */
+			for (i = 0; i < outputs; i++)
+				o->target[i] = OUTPUT_NODE(net,i)-(i == k);
+			AnnCalculateGradients(net, o->target);
+			AnnGetGradientVector(net, row, 0);
+			for (i = 0; i < n; i++) {
+				double ri = row[i], *a = o->jtj+i*n;
+
+				if (ri == 0) continue;
+				o->g[i] += err*ri;
+				ri /= w;
+				for (l = i; l < n; l++)
+					a[l] += ri*row[l];
+			}
+		}
+	}
+	o->f = toterr;
+	o->maxerr = maxerr;
+	net->meanerr = setlen ? toterr/ds->totweight : 0;
+	for (i = 0; i < n; i++)
+		o->g[i] = -o->g[i];
+	for (tries = 0; tries < ANN_LM_TRIES; tries++) {
+		double f, m;
+
+		if (AnnCholesky(o->jtj, o->chol, n, o->mu)) {
+			o->mu *= 10;
+			continue;
+		}
+		AnnCholeskySolve(o->chol, n, o->g, o->d);
+		for (i = 0; i < n; i++)
+			o->wt[i] = o->w[i]+o->d[i];
+		f = AnnOptEval(net, o->wt, NULL, ds, &m);
+		if (f < o->f) {
+			o->f = f;
+			o->maxerr = m;
+			o->mu = MAX(o->mu/10, 1e-12);
+			return m;
+		}
+		o->mu *= 10;
+	}
+	/* No improvement, restore the weights */
+	AnnSetWeightVector(net, o->w);
+	net->meanerr = setlen ? o->f/ds->totweight : 0;
+	return o->maxerr;
+}
+
+/* L-BFGS Epoch.
+ * The search direction is computed from the last ANN_LBFGS_HISTORY
+ * weight and gradient changes with the two-loop recursion, then the
+ * step is halved until the Armijo condition is satisfied. */
+double AnnLBFGSEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	struct AnnOptState *o = net->opt;
+	double alpha[ANN_LBFGS_HISTORY], gamma, gd, t = 1, f = 0, m = 0, *tmp;
+	size_t n = o->n, i;
+	int setlen = ds->setlen, j, h, tries;
+
+	AnnOptStart(net, ds);
+	/* d = -H*g with the two-loop recursion */
+	memcpy(o->d, o->g, sizeof(double)*n);
+	for (h = 0; h < o->hlen; h++) {
+		j = (o->hnext-1-h+ANN_LBFGS_HISTORY) % ANN_LBFGS_HISTORY;
+		alpha[j] = o->rho[j]*AnnDot(o->s+j*n, o->d, n);
+		for (i = 0; i < n; i++)
+			o->d[i] -= alpha[j]*o->y[j*n+i];
+	}
+	if (o->hlen) {
+		j = (o->hnext-1+ANN_LBFGS_HISTORY) % ANN_LBFGS_HISTORY;
+		gamma = 1/(o->rho[j]*AnnDot(o->y+j*n, o->y+j*n, n));
+	} else {
+		gamma = sqrt(AnnDot(o->g, o->g, n));
+		gamma = gamma > 0 ? 1/gamma : 1;
+	}
+	for (i = 0; i < n; i++)
+		o->d[i] *= gamma;
+	for (h = o->hlen-1; h >= 0; h--) {
+		double beta;
+
+		j = (o->hnext-1-h+ANN_LBFGS_HISTORY) % ANN_LBFGS_HISTORY;
+		beta = o->rho[j]*AnnDot(o->y+j*n, o->d, n);
+		for (i = 0; i < n; i++)
+			o->d[i] += o->s[j*n+i]*(alpha[j]-beta);
+	}
+	for (i = 0; i < n; i++)
+		o->d[i] = -o->d[i];
+	/* Not a descent direction: restart from the gradient */
+	if ((gd = AnnDot(o->g, o->d, n)) >= 0) {
+		o->hlen = 0;
+		gamma = sqrt(AnnDot(o->g, o->g, n));
+		if (gamma == 0)
+			return o->maxerr;
+		for (i = 0; i < n; i++)
+			o->d[i] = -o->g[i]/gamma;
+		gd = -gamma;
+	}
+	/* Backtracking line search */
+	for (tries = 0; tries < ANN_LINESEARCH_TRIES; tries++) {
+		for (i = 0; i < n; i++)
+			o->wt[i] = o->w[i]+t*o->d[i];
+		f = AnnOptEval(net, o->wt, o->gt, ds, &m);
+		if (f <= o->f + 1e-4*t*gd)
+			break;
+		t *= 0.5;
+	}
+	if (tries == ANN_LINESEARCH_TRIES) {
+		/* Restore the weights and forget the history */
+		AnnSetWeightVector(net, o->w);
+		net->meanerr = setlen ? o->f/ds->totweight : 0;
+		o->hlen = 0;
+		return o->maxerr;
+	}
+	/* Store the new correction pair, s = wt-w, y = gt-g */
+	j = o->hnext;
+	for (i = 0; i < n; i++) {
+		o->s[j*n+i] = o->wt[i]-o->w[i];
+		o->y[j*n+i] = o->gt[i]-o->g[i];
+	}
+	gd = AnnDot(o->s+j*n, o->y+j*n, n);
+	if (gd > 1e-10) {
+		o->rho[j] = 1/gd;
+		o->hnext = (o->hnext+1) % ANN_LBFGS_HISTORY;
+		if (o->hlen < ANN_LBFGS_HISTORY)
+			o->hlen++;
+	}
+	tmp = o->w; o->w = o->wt; o->wt = tmp;
+	tmp = o->g; o->g = o->gt; o->gt = tmp;
+	o->f = f;
+	o->maxerr = m;
+	o->iter++;
+	return m;
+}
+
+/* Scaled Conjugate Gradient Epoch, see Moller, "A scaled conjugate
+ * gradient algorithm for fast supervised learning", 1993.
+ * The second order information along the search direction is
+ * estimated with a finite difference of the gradient, and a
+ * Levenberg-Marquardt like scaling replaces the line search. */
+double AnnSCGEpoch(struct Ann *net, struct AnnDataset *ds)
+{
+	struct AnnOptState *o = net->opt;
+	double *p = o->d, pp, mu, alpha, f, m, cmp, *tmp;
+	size_t n = o->n, i;
+	int setlen = ds->setlen;
+
+	if (AnnOptStart(net, ds)) {
+		for (i = 0; i < n; i++)
+			o->r[i] = p[i] = -o->g[i];
+		o->lambda = ANN_SCG_LAMBDA;
+		o->lambdabar = 0;
+		o->success = 1;
+	}
+	if ((pp = AnnDot(p, p, n)) == 0)
+		return o->maxerr;
+	/* Second order information along p */
+	if (o->success) {
+		double sigma = ANN_SCG_SIGMA/sqrt(pp);
+
+		for (i = 0; i < n; i++)
+			o->wt[i] = o->w[i]+sigma*p[i];
+		AnnOptEval(net, o->wt, o->gt, ds, &m);
+		o->delta = (AnnDot(p, o->gt, n)-AnnDot(p, o->g, n))/sigma;
+	}
+	/* Scale, and make the Hessian positive definite if needed */
+	o->delta += (o->lambda-o->lambdabar)*pp;
+	if (o->delta <= 0) {
+		o->lambdabar = 2*(o->lambda-o->delta/pp);
+		o->delta = -o->delta+o->lambda*pp;
+		o->lambda = o->lambdabar;
+	}
+	/* Step size and comparison parameter */
+	mu = AnnDot(p, o->r, n);
+	alpha = mu/o->delta;
+	for (i = 0; i < n; i++)
+		o->wt[i] = o->w[i]+alpha*p[i];
+	f = AnnOptEval(net, o->wt, o->gt, ds, &m);
+	cmp = 2*o->delta*(o->f-f)/(mu*mu);
+	if (cmp >= 0) {
+		/* Successful reduction of the error */
+		double rr = AnnDot(o->gt, o->gt, n), rrold = -AnnDot(o->gt, o->r, n);
+
+		tmp = o->w; o->w = o->wt; o->wt = tmp;
+		tmp = o->g; o->g = o->gt; o->gt = tmp;
+		o->f = f;
+		o->maxerr = m;
+		o->lambdabar = 0;
+		o->success = 1;
+		o->iter++;
+		if (o->iter % n == 0) {
+			for (i = 0; i < n; i++)
+				p[i] = -o->g[i];
+		} else {
+			double beta = (rr-rrold)/mu;
+
+			for (i = 0; i < n; i++)
+				p[i] = -o->g[i]+beta*p[i];
+		}
+		for (i = 0; i < n; i++)
+			o->r[i] = -o->g[i];
+		if (cmp >= 0.75)
+			o->lambda *= 0.25;
+	} else {
+		AnnSetWeightVector(net, o->w);
+		net->meanerr = setlen ? o->f/ds->totweight : 0;
+		o->lambdabar = o->lambda;
+		o->success = 0;
+	}
+	if (cmp < 0.25)
+		o->lambda += o->delta*(1-cmp)/pp;
+	return o->maxerr;
+}
+
+/* Return the current time in seconds, from an arbitrary origin */
+double AnnTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Enable the recording of the last 'size' epochs statistics, or
+ * disable it if size is zero. Previous statistics are discarded.
+ * Return non-zero on out of memory. */
+int AnnEnableStats(struct Ann *net, int size)
+{
+	free(net->stats);
+	net->stats = NULL;
+	net->stats_size = net->stats_len = net->stats_next = 0;
+	if (size <= 0)
+		return 0;
+	if ((net->stats = malloc(sizeof(struct AnnEpochStats)*size)) == NULL)
+		return 1;
+	net->stats_size = size;
+	return 0;
+}
+
+/* Forget the recorded statistics, without to disable the recording */
+void AnnResetStats(struct Ann *net)
+{
+	net->stats_len = net->stats_next = 0;
+}
+
+/* Return the i-th recorded epoch statistics, 0 being the oldest one,
+ * or NULL if there is no such entry. */
+struct AnnEpochStats *AnnGetStats(struct Ann *net, int i)
+{
+	if (i < 0 || i >= net->stats_len)
+		return NULL;
+	i = (net->stats_next - net->stats_len + i + net->stats_size) %
+		net->stats_size;
+	return &net->stats[i];
+}
+
+/* Fill 'st' with the statistics of the epoch just performed.
+ * The gradient norm is the norm of the full-set gradient in sgradient,
+ * or of the one kept by the second order algorithms in their state:
+ * sgradient is left by their last trial evaluation, if any. The step
+ * size statistics are only meaningful for RPROP. */
+static void AnnEpochStats(struct Ann *net, struct AnnEpochStats *st, double maxerr, double time)
+{
+	int j, layers = LAYERS(net);
+	int rprop = ANN_IS_RPROP(net->flags & ANN_ALGOMASK);
+	size_t i, weights, count = 0;
+	double norm = 0, dsum = 0;
+
+	st->epoch = net->epochs;
+	st->maxerr = maxerr;
+	st->meanerr = net->meanerr;
+	st->deltamin = st->deltamax = 0;
+	if (net->opt)
+		norm = AnnDot(net->opt->g, net->opt->g, net->opt->n);
+	for (j = 1; j < layers; j++) {
+		double *sg = net->layer[j].sgradient;
+		double *d = net->layer[j].delta;
+
+		weights = STORED_WEIGHTS(net,j);
+		for (i = 0; i < weights; i++) {
+			if (!net->opt)
+				norm += sg[i]*sg[i];
+			if (!rprop) continue;
+			if (count == 0 || d[i] < st->deltamin)
+				st->deltamin = d[i];
+			if (count == 0 || d[i] > st->deltamax)
+				st->deltamax = d[i];
+			dsum += d[i];
+			count++;
+		}
+	}
+	st->gradnorm = sqrt(norm);
+	st->deltamean = count ? dsum/count : 0;
+	st->time = time;
+}
+
+/* Allocate the frozen prefix cache for the training set 'ds', if enabled
+ * and if the net has a frozen prefix. On out of memory the net is just
+ * trained without the cache. */
+static void AnnCacheStart(struct Ann *net, struct AnnDataset *ds)
+{
+	int l = AnnFrozenPrefix(net)-1;
+	size_t units;
+
+	if (!net->cache_frozen || l == LAYERS(net)-1 || ds->setlen == 0)
+		return;
+	units = UNITS(net,l)-(l > 1);
+	net->cache_output = AnnMalloc(units*ds->setlen, sizeof(double));
+	net->cache_valid = calloc(ds->setlen, 1);
+	if (net->cache_output == NULL || net->cache_valid == NULL) {
+		free(net->cache_output);
+		free(net->cache_valid);
+		net->cache_output = NULL;
+		net->cache_valid = NULL;
+		return;
+	}
+	net->cache_layer = l;
+}
+
+static void AnnCacheFree(struct Ann *net)
+{
+	free(net->cache_output);
+	free(net->cache_valid);
+	net->cache_output = NULL;
+	net->cache_valid = NULL;
+	net->cache_layer = 0;
+}
+
+/* Return a view of 'ds' with 'm' samples, whose index and weight
+ * arrays are set by the caller, or NULL on out of memory. */
+static struct AnnDataset *AnnDatasetView(struct AnnDataset *ds, int m)
+{
+	struct AnnDataset *view;
+
+	if ((view = malloc(sizeof(*view))) == NULL)
+		return NULL;
+	*view = *ds;
+	view->owned = 0;
+	view->setlen = m;
+	view->index = malloc(sizeof(int)*m);
+	view->weight = malloc(sizeof(double)*m);
+	if (view->index == NULL || view->weight == NULL) {
+		AnnDatasetFree(view);
+		return NULL;
+	}
+	return view;
+}
+
+/* Return a view of the training set 'ds' holding the fraction
+ * net->importance of its samples, to be drawn by AnnImportanceDraw().
+ * On out of memory NULL is returned. */
+static struct AnnDataset *AnnImportanceView(struct Ann *net, struct AnnDataset *ds)
+{
+	int m = (int)ceil(net->importance*ds->setlen);
+
+	if (m < 1)
+		m = 1;
+	if (m > ds->setlen)
+		m = ds->setlen;
+	return AnnDatasetView(ds, m);
+}
+
+/* Simulate all the samples of 'ds', and draw with replacement the
+ * samples of 'view' with probability proportional to their (weighted)
+ * error, plus ANN_IMPORTANCE_FLOOR times the mean error so that every
+ * sample has a chance. Every drawn sample is weighted by the inverse of
+ * its probability, so the gradient of the view is an unbiased estimate
+ * of the gradient of the whole set.
+ * Return non-zero on out of memory. */
+static int AnnImportanceDraw(struct Ann *net, struct AnnDataset *ds, struct AnnDataset *view)
+{
+	int j, k, setlen = ds->setlen, m = view->setlen;
+	double *cum, tot = 0, mean = 0;
+
+	if ((cum = malloc(sizeof(double)*setlen)) == NULL)
+		return 1;
+	for (j = 0; j < setlen; j++) {
+		double *desidered;
+
+		cum[j] = AnnSimulateSample(net, ds, j, &desidered);
+		mean += net->sample_weight*cum[j];
+	}
+	mean /= ds->totweight;
+	for (j = 0; j < setlen; j++) {
+		double w = ds->weight ? ds->weight[j] : 1;
+
+		tot += mean > 0 ? w*(cum[j]+ANN_IMPORTANCE_FLOOR*mean) : w;
+		cum[j] = tot;
+	}
+	view->totweight = 0;
+	for (k = 0; k < m; k++) {
+		double u = AnnRandom(net)*tot, p;
+		int lo = 0, hi = setlen-1;
+
+		/* First sample whose cumulative probability exceeds u */
+		while (lo < hi) {
+			int mid = (lo+hi)/2;
+
+			if (cum[mid] > u)
+				hi = mid;
+			else
+				lo = mid+1;
+		}
+		p = (cum[lo]-(lo ? cum[lo-1] : 0))/tot;
+		view->index[k] = ds->index ? ds->index[lo] : lo;
+		view->weight[k] = (ds->weight ? ds->weight[lo] : 1)/(m*p);
+		view->totweight += view->weight[k];
+	}
+	free(cum);
+	return 0;
+}
+
+/* Set 'view', a view of all the samples of 'ds', to a permutation of
+ * them drawn with the net random stream (Fisher-Yates), so that the
+ * online algorithms see the samples in a different order every epoch.
+ * The permutation only depends on the position of the random stream,
+ * so a net restored from a checkpoint shuffles as the original one. */
+static void AnnShuffle(struct Ann *net, struct AnnDataset *ds, struct AnnDataset *view)
+{
+	int j;
+
+	for (j = 0; j < ds->setlen; j++) {
+		view->index[j] = ds->index ? ds->index[j] : j;
+		view->weight[j] = ds->weight ? ds->weight[j] : 1;
+	}
+	for (j = view->setlen-1; j > 0; j--) {
+		int k = (int)(AnnRandom(net)*(j+1)), t = view->index[j];
+		double w = view->weight[j];
+
+		view->index[j] = view->index[k];
+		view->index[k] = t;
+		view->weight[j] = view->weight[k];
+		view->weight[k] = w;
+	}
+}
+
+/* Write the checkpoint of the net while training. Training goes on if
+ * it fails, the error being reported in net->checkpoint_errno. */
+static void AnnTrainCheckpoint(struct Ann *net)
+{
+	if (AnnCheckpoint(net, net->checkpoint))
+		net->checkpoint_errno = errno;
+}
+
+/* Early stopping state of AnnTrainRun(). The weights of the epochs to
+ * validate are copied into 'snap' and evaluated by a thread while the
+ * training goes on. The result is collected when the next evaluation is
+ * due, so the epoch where training stops doesn't depend on timing. */
+struct AnnValidation {
+	struct Ann *net;
+	struct Ann *snap;	/* weights being evaluated */
+	struct Ann *best;	/* weights with the lowest error so far */
+	struct AnnEvalResult res;
+	pthread_t tid;
+	int pending;		/* an evaluation was started */
+	int started;		/* it runs in the thread 'tid' */
+	int oom;
+	int last;		/* epoch of the last evaluation started */
+	int bad;		/* evaluations in a row without improvement */
+};
+
+static void *AnnValidationMain(void *arg)
+{
+	struct AnnValidation *v = arg;
+
+	v->oom = AnnEvaluate(v->snap, v->net->validation, &v->res);
+	return NULL;
+}
+
+/* Copy of the net holding the weights of an epoch, evaluated by a
+ * single thread. The state of the second order algorithms is not
+ * needed by the copy. */
+static struct Ann *AnnValidationClone(struct Ann *net)
+{
+	struct AnnOptState *opt = net->opt;
+	struct Ann *copy;
+
+	net->opt = NULL;
+	copy = AnnClone(net);
+	net->opt = opt;
+	if (copy)
+		THREADS(copy) = 1;
+	return copy;
+}
+
+/* Copy the weights of 'src' into 'dst' together with the training
+ * state that goes with them: the per-weight state of the first order
+ * algorithms, the epochs and the position of the random stream. The
+ * state of the second order algorithms is not copied. */
+static void AnnValidationCopy(struct Ann *dst, struct Ann *src)
+{
+	int j;
+
+	AnnCopyWeights(dst, src);
+	for (j = 1; j < LAYERS(src); j++) {
+		size_t len = sizeof(double)*STORED_WEIGHTS(src,j);
+
+		memcpy(dst->layer[j].delta, src->layer[j].delta, len);
+		memcpy(dst->layer[j].pgradient, src->layer[j].pgradient, len);
+		memcpy(dst->layer[j].sgradient, src->layer[j].sgradient, len);
+	}
+	dst->rprop_perror = src->rprop_perror;
+	dst->meanerr = src->meanerr;
+	dst->rng_next = src->rng_next;
+}
+
+/* Evaluate the current weights of the net in background */
+static void AnnValidationStart(struct AnnValidation *v)
+{
+	AnnValidationCopy(v->snap, v->net);
+	v->pending = 1;
+	v->last = v->net->epochs;
+	v->started = pthread_create(&v->tid, NULL, AnnValidationMain, v) == 0;
+	if (!v->started)
+		AnnValidationMain(v);
+}
+
+/* Collect the pending evaluation, if any, keeping the weights if they
+ * are the best so far. Return non-zero if the patience is exhausted. */
+static int AnnValidationCollect(struct AnnValidation *v)
+{
+	struct Ann *net = v->net, *t;
+
+	if (!v->pending)
+		return 0;
+	if (v->started)
+		pthread_join(v->tid, NULL);
+	v->pending = 0;
+	if (v->oom)
+		return 0;
+	if (v->res.meanerr < net->valerr) {
+		net->valerr = v->res.meanerr;
+		net->valepoch = v->snap->epochs;
+		t = v->best;
+		v->best = v->snap;
+		v->snap = t;
+		v->bad = 0;
+	} else {
+		v->bad++;
+	}
+	return net->patience && v->bad >= net->patience;
+}
+
+/* Set up the early stopping of AnnTrainRun(). Without the memory for
+ * the copies of the weights training goes on without it. */
+static void AnnValidationInit(struct Ann *net, struct AnnValidation *v)
+{
+	v->net = net;
+	v->snap = v->best = NULL;
+	v->res.outerr = NULL;
+	v->pending = v->bad = 0;
+	v->last = -1;
+	net->valerr = HUGE_VAL;
+	net->valepoch = 0;
+	if ((v->snap = AnnValidationClone(net)) == NULL ||
+	    (v->best = AnnValidationClone(net)) == NULL) {
+		if (v->snap)
+			AnnFree(v->snap);
+		v->snap = NULL;
+	}
+}
+
+/* Evaluate the last weights if needed, and roll the net back to the
+ * epoch of the best ones, see AnnValidationCopy(). The state of the
+ * second order algorithms, that is not saved, restarts from scratch.
+ * Return non-zero if the net was changed. */
+static int AnnValidationEnd(struct AnnValidation *v)
+{
+	struct Ann *net = v->net;
+	int changed = 0;
+
+	AnnValidationCollect(v);
+	if (v->last != net->epochs) {
+		AnnValidationStart(v);
+		AnnValidationCollect(v);
+	}
+	if (net->valerr != HUGE_VAL && net->valepoch != net->epochs) {
+		AnnValidationCopy(net, v->best);
+		if (net->opt)
+			net->opt->valid = 0;
+		changed = 1;
+	}
+	AnnFree(v->snap);
+	AnnFree(v->best);
+	return changed;
+}
+
+/* Implementation of AnnTrainDataset(). If 'resume' is true the dataset
+ * is the same of the previous call, so the state of the second order
+ * algorithms is still valid and training continues exactly as if the
+ * epochs of the two calls were performed by a single call. If 'validate'
+ * is true the net is evaluated on net->validation for early stopping.
+ * If 'converged' is not NULL it is set to non-zero if the max error of
+ * the last epoch is below 'maxerr': unlike the return value, this is
+ * also true when the net converged in one of the last epochs. */
+static int AnnTrainRun(struct Ann *net, struct AnnDataset *ds, double maxerr, int maxepochs, int resume, int validate, int *converged)
+{
+	int i = 0, stop = 0, unsaved = 0;
+	double e = maxerr+1, saved = AnnTime();
+	int algo = net->flags & ANN_ALGOMASK;
+	struct AnnDataset *all = ds, *view = NULL;
+	int sampling = net->importance > 0 && net->importance < 1;
+	int shuffle = net->shuffle && !sampling &&
+		(algo == ANN_OBPROP || algo == ANN_OBPROPM);
+	struct AnnValidation val;
+
+	/* The dataset may be different from the one of the previous call */
+	if (net->opt && !resume)
+		net->opt->valid = 0;
+	/* The cache is only valid for this dataset */
+	AnnCacheStart(net, ds);
+	if (validate)
+		AnnValidationInit(net, &val);
+	if (sampling)
+		view = AnnImportanceView(net, ds);
+	else if (shuffle && (view = AnnDatasetView(ds, ds->setlen)) != NULL)
+		ds = view;
+	while (!stop && i++ < maxepochs && e >= maxerr) {
+		double start = AnnTime();
+
+		if (sampling && view && (i-1) % MAX(net->importance_every,1) == 0) {
+			if (AnnImportanceDraw(net, all, view) == 0) {
+				ds = view;
+				if (net->opt)
+					net->opt->valid = 0;
+			} else {
+				ds = all;
+			}
+		}
+		if (shuffle && ds == view)
+			AnnShuffle(net, all, view);
+		switch(algo) {
+		case ANN_RPROP:
+			e = AnnResilientBPEpoch(net, ds);
+			break;
+		case ANN_IRPROPM:
+		case ANN_IRPROPP:
+			e = AnnIRpropEpoch(net, ds);
+			break;
+		case ANN_OBPROP:
+		case ANN_OBPROPM:
+			if (THREADS(net) > 1)
+				e = AnnHogwildEpoch(net, ds);
+			else if (algo == ANN_OBPROP)
+				e = AnnOnlineGDEpoch(net, ds);
+			else
+				e = AnnOnlineGDMEpoch(net, ds);
+			break;
 		case ANN_BBPROP:
-			e = AnnBatchGDEpoch(net, input, desidered, setlen);
+			e = AnnBatchGDEpoch(net, ds);
 			break;
-		case ANN_OBPROPM: /* fixme, for now use the batch mode */
 		case ANN_BBPROPM:
-			e = AnnBatchGDMEpoch(net, input, desidered, setlen);
+			e = AnnBatchGDMEpoch(net, ds);
+			break;
+		case ANN_LM:
+			e = AnnLevenbergMarquardtEpoch(net, ds);
 			break;
+		case ANN_LBFGS:
+			e = AnnLBFGSEpoch(net, ds);
+			break;
+		case ANN_SCG:
+			e = AnnSCGEpoch(net, ds);
+			break;
+		}
+		net->epochs++;
+		unsaved = 1;
+		if (validate && val.snap &&
+		    net->epochs % net->validate_every == 0) {
+			if (AnnValidationCollect(&val))
+				stop = 1;
+			else
+				AnnValidationStart(&val);
+		}
+		if (net->checkpoint &&
+		    ((net->checkpoint_every &&
+		      net->epochs % net->checkpoint_every == 0) ||
+		     (net->checkpoint_seconds > 0 &&
+		      AnnTime()-saved >= net->checkpoint_seconds))) {
+			AnnTrainCheckpoint(net);
+			saved = AnnTime();
+			unsaved = 0;
+		}
+		if (net->stats || net->callback) {
+			struct AnnEpochStats st;
+
+			AnnEpochStats(net, &st, e, AnnTime()-start);
+			if (net->stats) {
+				net->stats[net->stats_next] = st;
+				net->stats_next = (net->stats_next+1) % net->stats_size;
+				if (net->stats_len < net->stats_size)
+					net->stats_len++;
+			}
+			if (net->callback && (net->epochs % net->cbevery) == 0)
+				stop = net->callback(net, &st, net->cbdata);
 		}
 	}
+	AnnCacheFree(net);
+	if (view)
+		AnnDatasetFree(view);
+	net->sample_weight = 1;
+	if (validate && val.snap && AnnValidationEnd(&val))
+		unsaved = 1;
+	if (net->checkpoint && unsaved)
+		AnnTrainCheckpoint(net);
+	if (converged)
+		*converged = e < maxerr;
+	if (stop)
+		return i;
 	if (i >= maxepochs)
 		return 0;
 	return i;
 }
 
+/* Train the net.
+ * Training stops after 'maxepochs' epochs, when the max error of an epoch
+ * drops below 'maxerr', or when the net callback (if any) returns
+ * non-zero. In the last case the number of epochs performed is returned,
+ * otherwise the return value is the same as before: zero if maxepochs
+ * was reached.
+ * With importance sampling enabled the epochs use the samples drawn
+ * every net->importance_every epochs, and the max error is the one
+ * of these samples.
+ * With a validation set, see AnnSetValidation(), training also stops
+ * when the patience is exhausted, returning the number of epochs. The
+ * net is evaluated every net->validate_every epochs by a background
+ * thread on a copy of the weights, and once training ends the net is
+ * rolled back to the epoch with the lowest validation error, whose
+ * error and epoch are stored in net->valerr and net->valepoch: the
+ * weights, the RPROP and momentum state, net->epochs and the random
+ * stream are the ones of that epoch, so a checkpoint written at the
+ * end resumes from there. The state of the second order algorithms
+ * restarts from scratch. */
+int AnnTrainDataset(struct Ann *net, struct AnnDataset *ds, double maxerr, int maxepochs)
+{
+	return AnnTrainRun(net, ds, maxerr, maxepochs, 0,
+			   net->validation != NULL, NULL);
+}
+
+/* Train the net with a training set of doubles, see AnnTrainDataset() */
+int AnnTrain(struct Ann *net, double *input, double *desidered, double maxerr, int maxepochs, int setlen)
+{
+	struct AnnDataset ds;
+
+	AnnDatasetWrap(&ds, input, desidered, setlen, INPUT_UNITS(net),
+		OUTPUT_UNITS(net));
+	return AnnTrainDataset(net, &ds, maxerr, maxepochs);
+}
+
+/* Hyperparameter sweeps: AnnTrainSweep() trains many nets on the same
+ * read-only dataset with a pool of threads. The work is split in tasks
+ * of up to ANN_SWEEP_TASK epochs of a single net. Every worker has a
+ * deque of tasks: it runs the tasks at the front, puts the continuation
+ * of a net at the back, so its nets advance round robin, and when it is
+ * out of tasks it steals the task at the back of another worker deque.
+ * Nets that converge or are stopped early just don't get a continuation,
+ * so their worker moves on to other nets, or steals from busy workers.
+ *
+ * Early stopping is synchronous successive halving: the rungs are at
+ * 'rung', rung*eta, rung*eta^2 ... epochs, a net reaching a rung waits
+ * there until every other net either reached it or finished before, and
+ * then only the nets with an error in the best 1/eta of the errors at
+ * the rung continue. So which nets are stopped doesn't depend on the
+ * timing of the threads, and a sweep gives the same results with any
+ * number of threads. */
+struct AnnSweepDeque {
+	pthread_mutex_t lock;
+	int *task;		/* circular buffer of net indexes */
+	int head, len;
+};
+
+struct AnnSweep {
+	struct Ann **nets;
+	int n;
+	struct AnnDataset *ds;
+	double maxerr;
+	int maxepochs;
+	int rung, eta;
+	struct AnnSweepResult *res;
+	int workers;
+	struct AnnSweepDeque *dq;
+	pthread_mutex_t lock;	/* active, idle, rung state */
+	pthread_cond_t cond;	/* a task was queued, or all nets are done */
+	int active;		/* nets not yet done */
+	int idle;		/* workers waiting for tasks */
+	int rungs;
+	double *rerr;		/* rerr[r*n+k] error of the net k at rung r */
+	unsigned char *rin;	/* rin[r*n+k] the net k reached rung r */
+	int *rdone;		/* nets that reached or can't reach every rung */
+};
+
+struct AnnSweepWorker {
+	struct AnnSweep *sw;
+	int id;
+	int started;		/* thread created */
+};
+
+/* Put the net 'k' at the back of the deque 'w' */
+static void AnnSweepQueue(struct AnnSweep *sw, int w, int k)
+{
+	struct AnnSweepDeque *d = &sw->dq[w];
+
+	pthread_mutex_lock(&d->lock);
+	d->task[(d->head+d->len) % sw->n] = k;
+	d->len++;
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void AnnSweepPush(struct AnnSweep *sw, int w, int k)
+{
+	AnnSweepQueue(sw, w, k);
+	pthread_mutex_lock(&sw->lock);
+	if (sw->idle)
+		pthread_cond_signal(&sw->cond);
+	pthread_mutex_unlock(&sw->lock);
+}
+
+/* Take a task from the front of the deque 'w', or from the back if
+ * 'steal' is true. Return -1 if the deque is empty. */
+static int AnnSweepPop(struct AnnSweep *sw, int w, int steal)
+{
+	struct AnnSweepDeque *d = &sw->dq[w];
+	int k = -1;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->len) {
+		d->len--;
+		if (steal) {
+			k = d->task[(d->head+d->len) % sw->n];
+		} else {
+			k = d->task[d->head];
+			d->head = (d->head+1) % sw->n;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return k;
+}
+
+/* Get the next task of the worker 'w', stealing it if needed, and wait
+ * if there are no queued tasks. Return -1 once all the nets are done. */
+static int AnnSweepNext(struct AnnSweep *sw, int w)
+{
+	int j, k;
+
+	while(1) {
+		if ((k = AnnSweepPop(sw, w, 0)) != -1)
+			return k;
+		for (j = 1; j < sw->workers; j++)
+			if ((k = AnnSweepPop(sw, (w+j) % sw->workers, 1)) != -1)
+				return k;
+		pthread_mutex_lock(&sw->lock);
+		if (sw->active == 0) {
+			pthread_mutex_unlock(&sw->lock);
+			return -1;
+		}
+		for (j = 0; j < sw->workers; j++) {
+			int len;
+
+			pthread_mutex_lock(&sw->dq[j].lock);
+			len = sw->dq[j].len;
+			pthread_mutex_unlock(&sw->dq[j].lock);
+			if (len)
+				break;
+		}
+		if (j == sw->workers) {
+			sw->idle++;
+			pthread_cond_wait(&sw->cond, &sw->lock);
+			sw->idle--;
+		}
+		pthread_mutex_unlock(&sw->lock);
+	}
+}
+
+/* Return the epochs of the rung 'r' */
+static int AnnSweepRungEpochs(struct AnnSweep *sw, int r)
+{
+	double e = sw->rung;
+
+	while (r--)
+		e *= sw->eta;
+	return e > INT_MAX ? INT_MAX : (int)e;
+}
+
+/* Called with the sweep lock held once all the nets reached the rung
+ * 'r' or finished before it: queue to the worker 'w' the nets in the
+ * best 1/eta at the rung, and stop the others. */
+static void AnnSweepDecide(struct AnnSweep *sw, int r, int w)
+{
+	double *e = sw->rerr+(size_t)r*sw->n;
+	unsigned char *in = sw->rin+(size_t)r*sw->n;
+	int j, k, len = 0, better;
+
+	for (k = 0; k < sw->n; k++)
+		len += in[k];
+	for (k = 0; k < sw->n; k++) {
+		if (!in[k])
+			continue;
+		for (better = 0, j = 0; j < sw->n; j++)
+			better += in[j] && e[j] < e[k];
+		if (len >= sw->eta && better >= len/sw->eta) {
+			sw->res[k].status = ANN_SWEEP_STOPPED;
+			sw->active--;
+			for (j = r+1; j < sw->rungs; j++)
+				if (++sw->rdone[j] == sw->n)
+					AnnSweepDecide(sw, j, w);
+		} else {
+			AnnSweepQueue(sw, w, k);
+		}
+	}
+	pthread_cond_broadcast(&sw->cond);
+}
+
+/* Record the error of the net 'k' that just reached the rung 'r', that
+ * will be continued or stopped by AnnSweepDecide() once the other nets
+ * reached the rung too. */
+static void AnnSweepRung(struct AnnSweep *sw, int k, int r, int w)
+{
+	pthread_mutex_lock(&sw->lock);
+	sw->rerr[(size_t)r*sw->n+k] = sw->res[k].meanerr;
+	sw->rin[(size_t)r*sw->n+k] = 1;
+	if (++sw->rdone[r] == sw->n)
+		AnnSweepDecide(sw, r, w);
+	pthread_mutex_unlock(&sw->lock);
+}
+
+/* A net finished before the rung 'r': it will not reach it, nor the
+ * following rungs. */
+static void AnnSweepDone(struct AnnSweep *sw, int r, int w)
+{
+	pthread_mutex_lock(&sw->lock);
+	for (; r < sw->rungs; r++)
+		if (++sw->rdone[r] == sw->n)
+			AnnSweepDecide(sw, r, w);
+	if (--sw->active == 0)
+		pthread_cond_broadcast(&sw->cond);
+	pthread_mutex_unlock(&sw->lock);
+}
+
+static void *AnnSweepThread(void *arg)
+{
+	struct AnnSweepWorker *sww = arg;
+	struct AnnSweep *sw = sww->sw;
+	int k;
+
+	while ((k = AnnSweepNext(sw, sww->id)) != -1) {
+		struct AnnSweepResult *res = &sw->res[k];
+		int epochs = MIN(ANN_SWEEP_TASK, sw->maxepochs-res->epochs);
+		int r = res->rung, done = 0, converged;
+		int start = sw->nets[k]->epochs;
+
+		/* Stop at the next rung */
+		if (sw->rung && r < sw->rungs)
+			epochs = MIN(epochs, AnnSweepRungEpochs(sw, r)-res->epochs);
+		AnnTrainRun(sw->nets[k], sw->ds, sw->maxerr, epochs,
+			res->epochs > 0, 0, &converged);
+		if (converged) {
+			res->status = ANN_SWEEP_CONVERGED;
+			done = 1;
+		}
+		res->epochs += sw->nets[k]->epochs-start;
+		res->meanerr = sw->nets[k]->meanerr;
+		if (!done && sw->rung && r < sw->rungs &&
+		    res->epochs == AnnSweepRungEpochs(sw, r)) {
+			res->rung++;
+			AnnSweepRung(sw, k, r, sww->id);
+			continue;
+		}
+		if (!done && res->epochs >= sw->maxepochs) {
+			res->status = ANN_SWEEP_MAXEPOCHS;
+			done = 1;
+		}
+		if (!done)
+			AnnSweepPush(sw, sww->id, k);
+		else
+			AnnSweepDone(sw, r, sww->id);
+	}
+	return NULL;
+}
+
+/* Train the 'n' nets concurrently on the dataset 'ds' with 'threads'
+ * threads, every net until its max error is below 'maxerr' or it
+ * trained 'maxepochs' epochs, see AnnTrainDataset(). The dataset is
+ * only read, and all the nets must have the same inputs and outputs.
+ * If 'rung' is non zero the nets that are losing against the others
+ * are stopped early with synchronous successive halving: after
+ * rung*eta^i epochs only the nets with an error in the best 1/eta of
+ * the errors of all the nets reaching that point continue. The results
+ * don't depend on the number of threads.
+ * The nets are trained in place and the outcome of every one is stored
+ * in res[]; the validation sets of the nets are not used. Return the
+ * index of the net with the lowest final error, or -1 on out of
+ * memory. */
+int AnnTrainSweep(struct Ann **nets, int n, struct AnnDataset *ds, double maxerr, int maxepochs, int threads, int rung, int eta, struct AnnSweepResult *res)
+{
+	struct AnnSweep sw;
+	struct AnnSweepWorker *sww;
+	pthread_t *tid;
+	int j, best = -1;
+
+	sw.nets = nets;
+	sw.n = n;
+	sw.ds = ds;
+	sw.maxerr = maxerr;
+	sw.maxepochs = maxepochs;
+	sw.rung = rung > 0 ? rung : 0;
+	sw.eta = MAX(eta, 2);
+	sw.res = res;
+	sw.workers = MAX(MIN(threads, n), 1);
+	sw.active = n;
+	sw.idle = 0;
+	for (sw.rungs = 0; sw.rung && AnnSweepRungEpochs(&sw, sw.rungs) < maxepochs; sw.rungs++);
+	sw.rerr = malloc(sizeof(double)*((size_t)sw.rungs*n+1));
+	sw.rin = calloc((size_t)sw.rungs*n+1, 1);
+	sw.rdone = calloc(sw.rungs+1, sizeof(int));
+	sw.dq = calloc(sw.workers, sizeof(*sw.dq));
+	sww = malloc(sizeof(*sww)*sw.workers);
+	tid = malloc(sizeof(pthread_t)*sw.workers);
+	if (!sw.rerr || !sw.rin || !sw.rdone || !sw.dq || !sww || !tid)
+		goto oom;
+	for (j = 0; j < sw.workers; j++) {
+		if ((sw.dq[j].task = malloc(sizeof(int)*n)) == NULL)
+			goto oom;
+		pthread_mutex_init(&sw.dq[j].lock, NULL);
+	}
+	pthread_mutex_init(&sw.lock, NULL);
+	pthread_cond_init(&sw.cond, NULL);
+	/* Deal the nets to the workers */
+	for (j = 0; j < n; j++) {
+		struct AnnSweepDeque *d = &sw.dq[j % sw.workers];
+
+		res[j].epochs = 0;
+		res[j].meanerr = nets[j]->meanerr;
+		res[j].status = ANN_SWEEP_MAXEPOCHS;
+		res[j].rung = 0;
+		d->task[d->len++] = j;
+	}
+	if (maxepochs <= 0)
+		sw.active = 0;
+	/* The calling thread is the worker 0 */
+	for (j = 0; j < sw.workers; j++) {
+		sww[j].sw = &sw;
+		sww[j].id = j;
+		sww[j].started = j && pthread_create(&tid[j], NULL,
+			AnnSweepThread, &sww[j]) == 0;
+	}
+	/* If some thread could not be created its tasks are stolen */
+	AnnSweepThread(&sww[0]);
+	for (j = 1; j < sw.workers; j++)
+		if (sww[j].started)
+			pthread_join(tid[j], NULL);
+	for (j = 0; j < n; j++)
+		if (best == -1 || res[j].meanerr < res[best].meanerr)
+			best = j;
+	pthread_mutex_destroy(&sw.lock);
+	pthread_cond_destroy(&sw.cond);
+	for (j = 0; j < sw.workers; j++)
+		pthread_mutex_destroy(&sw.dq[j].lock);
+oom:
+	if (sw.dq)
+		for (j = 0; j < sw.workers; j++)
+			free(sw.dq[j].task);
+	free(sw.dq);
+	free(sw.rerr);
+	free(sw.rin);
+	free(sw.rdone);
+	free(sww);
+	free(tid);
+	return best;
+}
+
+#ifdef ANN_PROFILE
+/* Read the profiling clock: the time stamp counter on x86, that is cheap
+ * enough to time even a single sigmoid() call, otherwise the monotonic
+ * clock in nanoseconds. */
+unsigned long long AnnProfileClock(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned int lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long)hi << 32) | lo;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec*1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Return the number of AnnProfileClock() ticks per second. With the TSC
+ * the frequency is calibrated against the monotonic clock the first time
+ * the function is called. */
+double AnnProfileTicksPerSec(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	static double tps = 0;
+
+	if (tps == 0) {
+		struct timespec start, now, pause = {0, 20000000};
+		unsigned long long t0;
+		double elapsed;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		t0 = AnnProfileClock();
+		nanosleep(&pause, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec-start.tv_sec) +
+			  (now.tv_nsec-start.tv_nsec)/1e9;
+		tps = (AnnProfileClock()-t0)/elapsed;
+	}
+	return tps;
+#else
+	return 1e9;
+#endif
+}
+
+/* Account a profiled phase */
+void AnnProfileAdd(struct AnnProfile *p, int phase, unsigned long long ticks, double flops, double bytes)
+{
+	p->calls[phase]++;
+	p->ticks[phase] += ticks;
+	p->flops[phase] += flops;
+	p->bytes[phase] += bytes;
+}
+
+/* Add the counters of 'src' to 'dst' */
+void AnnProfileMerge(struct AnnProfile *dst, struct AnnProfile *src)
+{
+	int j;
+
+	for (j = 0; j < ANN_PROF_PHASES; j++) {
+		dst->calls[j] += src->calls[j];
+		dst->ticks[j] += src->ticks[j];
+		dst->flops[j] += src->flops[j];
+		dst->bytes[j] += src->bytes[j];
+	}
+}
+
+/* Reset all the profiling counters of the net */
+void AnnProfileReset(struct Ann *net)
+{
+	memset(&net->profile, 0, sizeof(net->profile));
+}
+
+/* Total number of weights of the net, used to estimate the flops
+ * and the memory traffic of the profiled phases. */
+double AnnProfileWeights(struct Ann *net)
+{
+	double weights = 0;
+	int j;
+
+	for (j = 1; j < LAYERS(net); j++)
+		weights += WEIGHTS(net,j);
+	return weights;
+}
+#endif /* ANN_PROFILE */
+
 #ifdef TESTMAIN
 int main(void)
 {
@@ -771,19 +4754,20 @@ int main(void)
 	double desidered[] = {0.8};
 	double e = 1;
 	int c = 0;
+	struct AnnDataset ds;
 
 	net = AnnCreateNet3(2, 3, 1);
 	LEARN_RATE(net)=.1;
 	if (!net) exit(1);
-	srand(time(NULL));
 	AnnSetRandomWeights(net);
 	AnnSetDeltas(net, RPROP_INITIAL_DELTA);
+	AnnDatasetWrap(&ds, inputa, desida, 4, 2, 1);
 	{
 		int x = 100000;
 		int j;
 		while (x-- && e > 0.000000000001) {
-			//e = AnnBatchGDMEpoch(net, inputa, desida, 4);
-			e = AnnResilientBPEpoch(net, inputa, desida, 4);
+			//e = AnnBatchGDMEpoch(net, &ds);
+			e = AnnResilientBPEpoch(net, &ds);
 			c++;
 		}
 		for (j = 0; j < 4; j++) {
@@ -1,12 +1,20 @@
 #ifndef __NN_H
 #define __NN_H
 
+#include <stddef.h>
+
 /* Data structures.
  * Nets are not so 'dynamic', but enough to support
  * an arbitrary number of layers, with arbitrary units for layer.
  * Only fully connected feed-forward networks are supported. */
 struct AnnLayer {
 	int units;
+	int activation;		/* activation of the units, ANN_ACT_* */
+				/* (unused for the input layer) */
+	int tied;		/* mirrored layer sharing the weights, or 0. */
+				/* If greater than the layer index, the */
+				/* arrays only hold the bias unit weights */
+	int frozen;		/* weights not trained, see AnnSetFrozen() */
 	double *output;		/* output[i], output of i-th unit */
 	double *error;		/* error[i], output error of i-th unit*/
 	double *weight;		/* weight[(i*units)+j] */
@@ -18,6 +26,120 @@ struct AnnLayer {
 				/* (per-weight delta for RPROP) */
 	double *sgradient;	/* gradient for the full training set */
 				/* only used for RPROP */
+	double *mask;		/* mask[(i*units)+j] 0 for pruned weights, */
+				/* 1 otherwise, NULL if not pruned */
+	int *sparse_row;	/* surviving weights of the row i are the */
+	int *sparse_col;	/* sparse_col[sparse_row[i]...sparse_row[i+1]-1] */
+				/* columns, built by AnnPrune() */
+	int sparse;		/* use the sparse forward kernel */
+};
+
+/* Hot path profiling, only compiled with -DANN_PROFILE (make PROFILE=1).
+ * Every phase accumulates the number of calls, the elapsed clock ticks
+ * (the TSC on x86, nanoseconds elsewhere) and an estimate of the floating
+ * point operations and memory traffic performed. The sigmoid phase is
+ * nested inside the simulate phase. */
+#define ANN_PROF_SIMULATE 0
+#define ANN_PROF_GRADIENTS 1
+#define ANN_PROF_UPDATE 2
+#define ANN_PROF_SIGMOID 3
+#define ANN_PROF_TCLCONV 4
+#define ANN_PROF_PHASES 5
+
+struct AnnProfile {
+	unsigned long long calls[ANN_PROF_PHASES];
+	unsigned long long ticks[ANN_PROF_PHASES];
+	double flops[ANN_PROF_PHASES];
+	double bytes[ANN_PROF_PHASES];
+};
+
+/* Statistics of a training epoch */
+struct AnnEpochStats {
+	int epoch;		/* epoch number, starting from 1 */
+	double maxerr;		/* max per-sample error */
+	double meanerr;		/* mean per-sample error */
+	double gradnorm;	/* norm of the full-set gradient */
+	double deltamin;	/* RPROP step sizes min/max/mean */
+	double deltamax;
+	double deltamean;
+	double time;		/* seconds spent in the epoch */
+};
+
+/* Training set. Samples are stored as doubles, or as 8 or 16 bit
+ * unsigned integers that are expanded to raw*scale+offset right before
+ * they are fed to the net, so that pixel data takes 1/8 or 1/4 of the
+ * memory and bandwidth. Sample 'j' is at input[j*inputs] and
+ * target[j*outputs]. */
+#define ANN_DATA_DOUBLE 0
+#define ANN_DATA_U8 1
+#define ANN_DATA_U16 2
+
+struct AnnDataset {
+	int type;		/* ANN_DATA_* */
+	int setlen;		/* number of samples */
+	int inputs;
+	int outputs;
+	void *input;
+	void *target;
+	double scale;		/* integer data only */
+	double offset;
+	int owned;		/* data freed by AnnDatasetFree() */
+	double *weight;		/* weight of every sample, NULL if all 1 */
+	int *index;		/* sample j is index[j] of the data, NULL */
+				/* if the samples are stored in order */
+	double totweight;	/* sum of the weights */
+};
+
+/* Errors of a net over a dataset, see AnnEvaluate() */
+struct AnnEvalResult {
+	double meanerr;		/* mean per-sample error */
+	double maxerr;		/* max per-sample error */
+	double mse;		/* mean squared error of the outputs */
+	double psnr;		/* PSNR in dB, for outputs in the [0,1] range */
+	double *outerr;		/* mean squared error of every output, */
+				/* set if not NULL */
+};
+
+/* Outcome of every net of AnnTrainSweep() */
+#define ANN_SWEEP_CONVERGED 0	/* error below the max error */
+#define ANN_SWEEP_MAXEPOCHS 1	/* trained for the max epochs */
+#define ANN_SWEEP_STOPPED 2	/* stopped early, losing against the others */
+
+struct AnnSweepResult {
+	int status;		/* ANN_SWEEP_* */
+	int epochs;		/* epochs trained */
+	double meanerr;		/* mean error of the last epoch */
+	int rung;		/* early stopping rungs passed */
+};
+
+/* State of the second order training algorithms. It is allocated by
+ * AnnSetLearningAlgo() only when one of them is selected, as a single
+ * block holding all the vectors, every one with a slot per weight of
+ * the net (the weights of all the layers are handled as one vector). */
+struct AnnOptState {
+	size_t n;		/* number of weights */
+	int valid;		/* 'f', 'maxerr' and 'g' are computed for 'w' */
+	int iter;		/* successful iterations */
+	double f;		/* total error at 'w' */
+	double maxerr;		/* max per-sample error at 'w' */
+	double *w;		/* current weights */
+	double *g;		/* gradient at 'w' */
+	double *wt;		/* trial weights */
+	double *gt;		/* gradient at 'wt', or Jacobian row for LM */
+	double *d;		/* search direction (p for SCG), LM step */
+	/* L-BFGS */
+	double *s, *y;		/* ANN_LBFGS_HISTORY weight/gradient changes */
+	double *rho;		/* 1/(s*y) for every history entry */
+	int hlen, hnext;	/* history entries, next entry to write */
+	/* Scaled conjugate gradient */
+	double *r;		/* -g at the start of the iteration */
+	double lambda, lambdabar, delta;
+	int success;
+	/* Levenberg-Marquardt */
+	double mu;		/* damping factor */
+	double *jtj;		/* J'J, n*n, upper triangle only */
+	double *chol;		/* Cholesky factor of J'J+mu*I */
+	double *target;		/* modified targets, one per output */
 };
 
 /* Feed forward network structure */
@@ -30,7 +152,59 @@ struct Ann {
 	double rprop_nplus;
 	double rprop_maxupdate;
 	double rprop_minupdate;
+	double rprop_perror;	/* previous epoch total error, for iRPROP+ */
+	int threads;		/* worker threads used by online training */
+	int sigmoid;		/* sigmoid implementation, ANN_SIGMOID_* */
+	int epochs;		/* epochs trained so far */
+	double meanerr;		/* mean error of the last epoch */
+	struct AnnEpochStats *stats; /* ring buffer of the last epochs stats */
+	int stats_size;		/* ring buffer size, 0 if disabled */
+	int stats_len;		/* number of valid entries */
+	int stats_next;		/* next entry to write */
+	/* Called every 'cbevery' epochs by AnnTrain(), training stops
+	 * if it returns non-zero. */
+	int (*callback)(struct Ann *net, struct AnnEpochStats *st, void *privdata);
+	void *cbdata;
+	int cbevery;
+	struct AnnOptState *opt; /* second order algorithms state, or NULL */
+	double *sample_target;	/* target of the current sample, when the */
+				/* dataset is not made of doubles */
+	/* Outputs of the last layer of the frozen prefix for every sample
+	 * of the training set, only allocated by AnnTrainDataset() while
+	 * training if 'cache_frozen' is set. */
+	int cache_frozen;
+	int cache_layer;	/* layer whose outputs are cached */
+	double *cache_output;	/* cache_output[j*units] outputs of sample j */
+	unsigned char *cache_valid; /* cache_valid[j] is set once computed */
+	/* Importance sampling: if 'importance' is non zero every epoch
+	 * trains on that fraction of the samples, drawn with probability
+	 * proportional to their error every 'importance_every' epochs. */
+	double importance;
+	int importance_every;
+	double sample_weight;	/* weight of the current sample */
+	/* If 'shuffle' is set the online algorithms visit the samples in
+	 * a different random order every epoch. */
+	int shuffle;
+	/* Random stream of the net: the next number is AnnRandomBits(seed,
+	 * rng_next), see AnnRandom(). */
+	unsigned long long seed;
+	unsigned long long rng_next;
+	/* Checkpoints written while training, see AnnSetCheckpoint() */
+	char *checkpoint;	/* file name, NULL if disabled */
+	int checkpoint_every;	/* epochs between checkpoints, 0 if unused */
+	double checkpoint_seconds; /* seconds between checkpoints, 0 if unused */
+	int checkpoint_errno;	/* errno of the last failed checkpoint */
+	/* Early stopping on a held-out set, see AnnSetValidation() */
+	struct AnnDataset *validation; /* owned by the caller, or NULL */
+	int validate_every;	/* epochs between evaluations */
+	int patience;		/* evaluations without improvement before */
+				/* stopping, 0 to never stop */
+	double valerr;		/* best validation mean error, see */
+	int valepoch;		/* AnnTrainDataset(), and its epoch */
 	struct AnnLayer *layer;
+#ifdef ANN_PROFILE
+	struct AnnProfile profile;
+#endif
 };
 
 /* Kohonen network structure (SOM) */
@@ -47,14 +221,19 @@ struct Konet2d {
 /* Raw interface to data structures */
 #define OUTPUT(net,l,i) (net)->layer[l].output[i]
 #define ERROR(net,l,i) (net)->layer[l].error[i]
-#define WEIGHT(net,l,i,j) (net)->layer[l].weight[((i)*(net)->layer[l-1].units)+(j)]
-#define GRADIENT(net,l,i,j) (net)->layer[l].gradient[((i)*(net)->layer[l-1].units)+(j)]
-#define SGRADIENT(net,l,i,j) (net)->layer[l].sgradient[((i)*(net)->layer[l-1].units)+(j)]
-#define PGRADIENT(net,l,i,j) (net)->layer[l].pgradient[((i)*(net)->layer[l-1].units)+(j)]
-#define DELTA(net,l,i,j) (net)->layer[l].delta[((i)*(net)->layer[l-1].units)+(j)]
+#define WEIGHT(net,l,i,j) (net)->layer[l].weight[((size_t)(i)*(net)->layer[l-1].units)+(j)]
+#define GRADIENT(net,l,i,j) (net)->layer[l].gradient[((size_t)(i)*(net)->layer[l-1].units)+(j)]
+#define SGRADIENT(net,l,i,j) (net)->layer[l].sgradient[((size_t)(i)*(net)->layer[l-1].units)+(j)]
+#define PGRADIENT(net,l,i,j) (net)->layer[l].pgradient[((size_t)(i)*(net)->layer[l-1].units)+(j)]
+#define DELTA(net,l,i,j) (net)->layer[l].delta[((size_t)(i)*(net)->layer[l-1].units)+(j)]
 #define LAYERS(net) (net)->layers
 #define UNITS(net,l) (net)->layer[l].units
-#define WEIGHTS(net,l) (UNITS(net,l)*UNITS(net,l-1))
+#define WEIGHTS(net,l) ((size_t)UNITS(net,l)*UNITS(net,l-1))
+#define TIED(net,l) (net)->layer[l].tied
+#define IS_TIED(net,l) (TIED(net,l) > (l))
+#define FROZEN(net,l) (net)->layer[l].frozen
+#define STORED_WEIGHTS(net,l) (IS_TIED(net,l) ? \
+	((l) > 1 ? (size_t)UNITS(net,(l)-1) : 0) : WEIGHTS(net,l))
 #define LEARN_RATE(net) (net)->learn_rate
 #define MOMENTUM(net) (net)->momentum
 #define OUTPUT_NODE(net,i) OUTPUT(net,0,i)
@@ -65,6 +244,7 @@ struct Konet2d {
 #define RPROP_NPLUS(net) (net)->rprop_nplus
 #define RPROP_MAXUPDATE(net) (net)->rprop_maxupdate
 #define RPROP_MINUPDATE(net) (net)->rprop_minupdate
+#define THREADS(net) (net)->threads
 
 /* Constants */
 #define DEFAULT_LEARN_RATE 0.1
@@ -74,6 +254,45 @@ struct Konet2d {
 #define DEFAULT_RPROP_MAXUPDATE 50
 #define DEFAULT_RPROP_MINUPDATE 0.000001
 #define RPROP_INITIAL_DELTA 0.1
+#define DEFAULT_THREADS 1
+#define DEFAULT_IMPORTANCE_EVERY 10
+#define DEFAULT_CHECKPOINT_EVERY 100
+#define HOGWILD_CHUNK 16	/* samples fetched at once by hogwild workers */
+#define ANN_LBFGS_HISTORY 10	/* L-BFGS correction pairs */
+#define ANN_LINESEARCH_TRIES 20	/* max step halvings of L-BFGS line search */
+#define ANN_LM_MAXWEIGHTS 4096	/* LM needs two n*n matrices */
+#define ANN_LM_MU 0.001		/* LM initial damping */
+#define ANN_LM_TRIES 10		/* max damping increases per LM epoch */
+#define ANN_SCG_SIGMA 1e-4	/* SCG finite difference step */
+#define ANN_SCG_LAMBDA 1e-6	/* SCG initial regularization */
+#define ANN_IMPORTANCE_FLOOR 0.1 /* importance sampling probability floor, */
+				/* relative to the mean error */
+#define ANN_SPARSE_DENSITY 0.3	/* pruned layers sparser than this use */
+				/* the sparse forward kernel */
+#define ANN_EVAL_CHUNK 256	/* samples of an AnnEvaluate() work unit */
+#define ANN_SWEEP_TASK 10	/* max epochs of a sweep task */
+#define ANN_SWEEP_ETA 3		/* sweep early stopping keeps the best 1/3 */
+#define ANN_BATCH_BLOCK 8	/* samples sharing the weight rows loads */
+				/* in AnnSimulateBatch() */
+#define ANN_HUGEPAGE_SIZE (2*1024*1024) /* arrays at least this big are */
+				/* backed by transparent huge pages */
+
+/* Activation functions, see AnnActivationVector() */
+#define ANN_ACT_LOGISTIC 0
+#define ANN_ACT_TANH 1
+#define ANN_ACT_RELU 2
+#define ANN_ACT_LRELU 3		/* leaky ReLU, slope ANN_LRELU_SLOPE if x < 0 */
+#define ANN_ACT_LINEAR 4
+#define ANN_ACT_HARDSIG 5	/* 0.2*x+0.5 clamped to [0,1] */
+#define ANN_ACTIVATIONS 6
+#define ANN_LRELU_SLOPE 0.01
+
+/* Sigmoid implementations, see AnnSigmoidVector() */
+#define ANN_SIGMOID_EXACT 0	/* libm exp() */
+#define ANN_SIGMOID_FAST 1	/* polynomial approximation, error < 2e-9 */
+#define ANN_SIGMOID_TABLE 2	/* interpolated table, error < 1e-6 */
+#define ANN_SIGMOID_TABLE_SIZE 4096
+#define ANN_SIGMOID_TABLE_RANGE 16
 
 /* Flags */
 #define ANN_BBPROP (1 << 0)	/* standard batch backprop */
@@ -81,13 +300,31 @@ struct Konet2d {
 #define ANN_BBPROPM (1 << 2)	/* standard batch backprop with momentum */
 #define ANN_OBPROPM (1 << 3)	/* online backprop with momentum */
 #define ANN_RPROP (1 << 4)	/* resilient backprop (batch) */
-#define ANN_ALGOMASK (ANN_BBPROP|ANN_OBPROP|ANN_BBPROPM|ANN_OBPROPM|ANN_RPROP)
+#define ANN_LM (1 << 5)		/* Levenberg-Marquardt (batch) */
+#define ANN_LBFGS (1 << 6)	/* limited memory BFGS (batch) */
+#define ANN_SCG (1 << 7)	/* scaled conjugate gradient (batch) */
+#define ANN_IRPROPM (1 << 8)	/* iRPROP-, fused update kernel (batch) */
+#define ANN_IRPROPP (1 << 9)	/* iRPROP+, with weight backtracking (batch) */
+#define ANN_ALGOMASK (ANN_BBPROP|ANN_OBPROP|ANN_BBPROPM|ANN_OBPROPM|ANN_RPROP|ANN_LM|ANN_LBFGS|ANN_SCG|ANN_IRPROPM|ANN_IRPROPP)
+#define ANN_IS_RPROP(algo) \
+	((algo) == ANN_RPROP || (algo) == ANN_IRPROPM || (algo) == ANN_IRPROPP)
+
+/* Profiling macros, they compile to nothing without ANN_PROFILE */
+#ifdef ANN_PROFILE
+#define ANN_PROF_START(t) unsigned long long t = AnnProfileClock()
+#define ANN_PROF_END(net,phase,t,fl,by) \
+	AnnProfileAdd(&(net)->profile, phase, AnnProfileClock()-(t), fl, by)
+#else
+#define ANN_PROF_START(t)
+#define ANN_PROF_END(net,phase,t,fl,by)
+#endif
 
 /* Misc */
 #define MAX(a,b) (((a)>(b))?(a):(b))
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
 /* Prototypes */
+void *AnnMalloc(size_t n, size_t size);
 void AnnResetLayer(struct AnnLayer *layer);
 struct Ann *AnnAlloc(int layers);
 void AnnFreeLayer(struct AnnLayer *layer);
@@ -97,28 +334,92 @@ struct Ann *AnnCreateNet(int layers, int *units);
 struct Ann *AnnCreateNet3(int iunits, int hunits, int ounits);
 struct Ann *AnnCreateNet4(int iunits, int hunits, int hunits2, int ounits);
 struct Ann *AnnClone(struct Ann* net);
+int AnnSave(struct Ann *net, char *filename);
+struct Ann *AnnLoad(char *filename);
+int AnnCheckpoint(struct Ann *net, char *filename);
+int AnnSetCheckpoint(struct Ann *net, char *filename, int every, double seconds);
+void AnnSetValidation(struct Ann *net, struct AnnDataset *ds, int every, int patience);
+void AnnCopyWeights(struct Ann *dst, struct Ann *src);
+int AnnSetTied(struct Ann *net, int tied);
+int AnnSetFrozen(struct Ann *net, int layer, int frozen);
+double AnnPruneThreshold(struct Ann *net, int layer, double fraction);
+int AnnPrune(struct Ann *net, int layer, double threshold);
+void AnnPruneReset(struct Ann *net);
+double AnnDensity(struct Ann *net, int layer);
+void AnnSigmoidVector(double *v, int n, int mode);
+void AnnSetSigmoid(struct Ann *net, int mode);
+int AnnSigmoidByName(char *name);
+void AnnActivationVector(double *v, int n, int activation, int mode);
+int AnnSetActivation(struct Ann *net, int layer, int activation);
+char *AnnActivationName(int activation);
+int AnnActivationByName(char *name);
+void AnnSimulateLayer(struct Ann *net, int i);
 void AnnSimulate(struct Ann *net);
+int AnnSimulateBatch(struct Ann *net, double *input, double *output, size_t n);
 void Ann2Tcl(struct Ann *net);
 void AnnPrint(struct Ann *net);
 double AnnGlobalError(struct Ann *net, double *desidered);
 void AnnSetInput(struct Ann *net, double *input);
 double AnnSimulateError(struct Ann *net, double *input, double *desidered);
+struct AnnDataset *AnnDatasetCreate(int type, int setlen, int inputs, int outputs, double scale, double offset);
+void AnnDatasetWrap(struct AnnDataset *ds, double *input, double *target, int setlen, int inputs, int outputs);
+void AnnDatasetFree(struct AnnDataset *ds);
+void AnnDatasetSetSample(struct AnnDataset *ds, int j, double *input, double *target);
+void AnnDatasetGetSample(struct AnnDataset *ds, int j, double *input, double *target);
+size_t AnnDatasetBytes(struct AnnDataset *ds);
+struct AnnDataset *AnnDatasetDedup(struct AnnDataset *ds, double tolerance);
+int AnnDatasetSave(struct AnnDataset *ds, char *filename);
+struct AnnDataset *AnnDatasetRead(char *filename);
+double AnnSimulateSample(struct Ann *net, struct AnnDataset *ds, int j, double **targetp);
 void AnnCalculateGradientsTrivial(struct Ann *net, double *desidered);
 void AnnCalculateGradients(struct Ann *net, double *desidered);
+double AnnCheckGradients(struct Ann *net, double *input, double *desidered);
 void AnnSetDeltas(struct Ann *net, double val);
 void AnnResetDeltas(struct Ann *net);
 void AnnResetSgradient(struct Ann *net);
 void AnnSetRandomWeights(struct Ann *net);
+unsigned long long AnnRandomBits(unsigned long long seed, unsigned long long n);
+double AnnRandom(struct Ann *net);
+void AnnSetSeed(struct Ann *net, unsigned long long seed);
 void AnnScaleWeights(struct Ann *net, double factor);
 void AnnUpdateDeltasGD(struct Ann *net);
 void AnnUpdateDeltasGDM(struct Ann *net);
 void AnnUpdateSgradient(struct Ann *net);
 void AnnAdjustWeights(struct Ann *net);
-double AnnBatchGDEpoch(struct Ann *net, double *input, double *desidered, int setlen);
-double AnnBatchGDMEpoch(struct Ann *net, double *input, double *desidered, int setlen);
+void AnnAdjustWeightsGD(struct Ann *net);
+void AnnAdjustWeightsGDM(struct Ann *net);
+double AnnBatchGDEpoch(struct Ann *net, struct AnnDataset *ds);
+double AnnBatchGDMEpoch(struct Ann *net, struct AnnDataset *ds);
+double AnnOnlineGDEpoch(struct Ann *net, struct AnnDataset *ds);
+double AnnOnlineGDMEpoch(struct Ann *net, struct AnnDataset *ds);
+struct Ann *AnnCloneShared(struct Ann *net);
+void AnnFreeShared(struct Ann *net);
+double AnnHogwildEpoch(struct Ann *net, struct AnnDataset *ds);
 void AnnAdjustWeightsResilientBP(struct Ann *net);
-double AnnResilientBPEpoch(struct Ann *net, double *input, double *desidered, int setlen);
-void AnnSetLearningAlgo(struct Ann *net, int algoid);
+double AnnResilientBPEpoch(struct Ann *net, struct AnnDataset *ds);
+void AnnAdjustWeightsIRprop(struct Ann *net, int backtrack);
+double AnnIRpropEpoch(struct Ann *net, struct AnnDataset *ds);
+double AnnLevenbergMarquardtEpoch(struct Ann *net, struct AnnDataset *ds);
+double AnnLBFGSEpoch(struct Ann *net, struct AnnDataset *ds);
+double AnnSCGEpoch(struct Ann *net, struct AnnDataset *ds);
+int AnnSetLearningAlgo(struct Ann *net, int algoid);
+char *AnnAlgoName(int algo);
+int AnnAlgoByName(char *name);
+double AnnTime(void);
+int AnnEnableStats(struct Ann *net, int size);
+void AnnResetStats(struct Ann *net);
+struct AnnEpochStats *AnnGetStats(struct Ann *net, int i);
+int AnnEvaluate(struct Ann *net, struct AnnDataset *ds, struct AnnEvalResult *res);
+int AnnTrainDataset(struct Ann *net, struct AnnDataset *ds, double maxerr, int maxepochs);
 int AnnTrain(struct Ann *net, double *input, double *desidered, double maxerr, int maxepochs, int setlen);
+int AnnTrainSweep(struct Ann **nets, int n, struct AnnDataset *ds, double maxerr, int maxepochs, int threads, int rung, int eta, struct AnnSweepResult *res);
+#ifdef ANN_PROFILE
+unsigned long long AnnProfileClock(void);
+double AnnProfileTicksPerSec(void);
+void AnnProfileAdd(struct AnnProfile *p, int phase, unsigned long long ticks, double flops, double bytes);
+void AnnProfileMerge(struct AnnProfile *dst, struct AnnProfile *src);
+void AnnProfileReset(struct Ann *net);
+double AnnProfileWeights(struct Ann *net);
+#endif
 
 #endif /* __NN_H */
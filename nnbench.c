@@ -0,0 +1,593 @@
+/* gnegnu NN - benchmark of the nn.c kernels and training algorithms
+ * Copyright(C) 2003 Salvatore Sanfilippo
+ * All rights reserved.
+ *
+ * For every topology of the grid the forward pass and the backprop
+ * speed are measured in samples per second, and the time of a full
+ * epoch is measured for every training algorithm. All the nets and
+ * datasets are generated from a fixed seed, so two runs of the same
+ * binary perform exactly the same computation. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "nn.h"
+#include "nnpar.h"
+
+#define BENCH_WORK 20000000.0	/* weight ops per measurement */
+#define BENCH_BATCH 32		/* samples per AnnSimulateBatch() call */
+
+/* Topologies, units from the output to the input layer like
+ * AnnCreateNet() expects. */
+struct BenchTopology {
+	char *name;
+	int layers;
+	int units[4];
+} topologies[] = {
+	{"2-3-1", 3, {1, 3, 2}},
+	{"64-8-64", 3, {64, 8, 64}},
+	{"64-16-64", 3, {64, 16, 64}},
+	{"256-64-256", 3, {256, 64, 256}},
+	{"64-32-16-64", 4, {64, 16, 32, 64}},
+	{"256-64-32-256", 4, {256, 32, 64, 256}},
+	{NULL, 0, {0}}
+};
+
+/* The second order algorithms have a much higher cost per epoch, so
+ * they are measured on a single epoch. */
+struct BenchAlgo {
+	char *name;
+	int algoid;
+	int maxepochs;	/* 0 means as many as BENCH_WORK requires */
+} algos[] = {
+	{"bbprop", ANN_BBPROP, 0},
+	{"bbpropm", ANN_BBPROPM, 0},
+	{"rprop", ANN_RPROP, 0},
+	{"irprop-", ANN_IRPROPM, 0},
+	{"irprop+", ANN_IRPROPP, 0},
+	{"obprop", ANN_OBPROP, 0},
+	{"obpropm", ANN_OBPROPM, 0},
+	{"lbfgs", ANN_LBFGS, 0},
+	{"scg", ANN_SCG, 0},
+	{"lm", ANN_LM, 1},
+	{NULL, 0, 0}
+};
+
+/* Options */
+static int opt_repeat = 5;
+static int opt_warmup = 1;
+static int opt_setlen = 256;
+static int opt_threads = 1;
+static int opt_sigmoid = ANN_SIGMOID_EXACT;
+static int opt_store = ANN_DATA_DOUBLE;
+static int opt_tied = 0;
+static double opt_prune = 0;
+static int opt_procs = 0;
+static char *opt_transport = "shm";
+static unsigned int opt_seed = 1234;
+static char *opt_only = NULL;
+static enum {OUT_TEXT, OUT_CSV, OUT_JSON} opt_output = OUT_TEXT;
+static int results = 0;
+
+/* Minimal linear congruential generator, so that the benchmark does not
+ * depend on the libc rand() implementation and on its global state. */
+static double BenchRandom(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return ((*seed >> 8) & 0xffffff) / (double) 0x1000000;
+}
+
+static double BenchTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Create the net for the given topology with reproducible weights.
+ * Return NULL if the algorithm can't be used with this topology. */
+static struct Ann *BenchCreateNet(struct BenchTopology *t, int algoid)
+{
+	struct Ann *net;
+	unsigned int seed = opt_seed;
+	int j, i;
+
+	if ((net = AnnCreateNet(t->layers, t->units)) == NULL) {
+		fprintf(stderr, "Out of memory creating the net\n");
+		exit(1);
+	}
+	for (j = 1; j < LAYERS(net); j++) {
+		int weights = WEIGHTS(net,j);
+		for (i = 0; i < weights; i++)
+			net->layer[j].weight[i] = -.5+BenchRandom(&seed);
+	}
+	if (opt_tied)
+		AnnSetTied(net, 1);
+	if (opt_prune > 0)
+		AnnPrune(net, 0, AnnPruneThreshold(net, 0, opt_prune));
+	/* Levenberg-Marquardt is not available for big nets */
+	if (AnnSetLearningAlgo(net, algoid)) {
+		AnnFree(net);
+		return NULL;
+	}
+	LEARN_RATE(net) = 0.01;
+	THREADS(net) = opt_threads;
+	AnnSetSigmoid(net, opt_sigmoid);
+	return net;
+}
+
+/* Create a dataset of opt_setlen samples. When the net has the same
+ * number of inputs and outputs the targets are the inputs themselves,
+ * like in the autoencoders we train. */
+static void BenchCreateDataset(struct Ann *net, double **input, double **target)
+{
+	unsigned int seed = opt_seed ^ 0x5eed;
+	int inputs = INPUT_UNITS(net), outputs = OUTPUT_UNITS(net), i;
+
+	*input = malloc(sizeof(double)*inputs*opt_setlen);
+	*target = malloc(sizeof(double)*outputs*opt_setlen);
+	if (*input == NULL || *target == NULL) {
+		fprintf(stderr, "Out of memory creating the dataset\n");
+		exit(1);
+	}
+	for (i = 0; i < inputs*opt_setlen; i++)
+		(*input)[i] = BenchRandom(&seed);
+	for (i = 0; i < outputs*opt_setlen; i++)
+		(*target)[i] = (inputs == outputs) ? (*input)[i] :
+						     BenchRandom(&seed);
+}
+
+/* True if the topology is symmetric, so that it can be tied */
+static int BenchSymmetric(struct BenchTopology *t)
+{
+	int j;
+
+	for (j = 0; j < t->layers; j++)
+		if (t->units[j] != t->units[t->layers-1-j])
+			return 0;
+	return 1;
+}
+
+static int BenchTotalWeights(struct Ann *net)
+{
+	int j, weights = 0;
+
+	for (j = 1; j < LAYERS(net); j++)
+		weights += WEIGHTS(net,j);
+	return weights;
+}
+
+static int BenchCmpDouble(const void *a, const void *b)
+{
+	double da = *(double*)a, db = *(double*)b;
+
+	return (da > db) - (da < db);
+}
+
+static void BenchReport(char *topology, char *what, char *unit, double *v, int n)
+{
+	double mean = 0, min, median;
+	int i;
+
+	qsort(v, n, sizeof(double), BenchCmpDouble);
+	for (i = 0; i < n; i++)
+		mean += v[i];
+	mean /= n;
+	min = v[0];
+	median = v[n/2];
+	switch(opt_output) {
+	case OUT_TEXT:
+		printf("%-16s %-16s %14.4f %14.4f %14.4f %s\n",
+			topology, what, median, mean, min, unit);
+		break;
+	case OUT_CSV:
+		printf("%s,%s,%s,%.6f,%.6f,%.6f,%d\n",
+			topology, what, unit, median, mean, min, n);
+		break;
+	case OUT_JSON:
+		printf("%s\n  {\"topology\": \"%s\", \"benchmark\": \"%s\", "
+		       "\"unit\": \"%s\", \"median\": %.6f, \"mean\": %.6f, "
+		       "\"min\": %.6f, \"runs\": %d}",
+		       results ? "," : "",
+		       topology, what, unit, median, mean, min, n);
+		break;
+	}
+	results++;
+}
+
+/* Forward pass speed in samples per second */
+static void BenchForward(struct BenchTopology *t)
+{
+	struct Ann *net = BenchCreateNet(t, ANN_RPROP);
+	double *input, *target, *output, *v = malloc(sizeof(double)*opt_repeat);
+	int inputs = INPUT_UNITS(net), passes, r, p, j;
+
+	BenchCreateDataset(net, &input, &target);
+	passes = 1 + BENCH_WORK/((double)BenchTotalWeights(net)*opt_setlen);
+	for (r = -opt_warmup; r < opt_repeat; r++) {
+		double start = BenchTime();
+		for (p = 0; p < passes; p++) {
+			for (j = 0; j < opt_setlen; j++) {
+				AnnSetInput(net, input+j*inputs);
+				AnnSimulate(net);
+			}
+		}
+		if (r >= 0)
+			v[r] = (double)passes*opt_setlen/(BenchTime()-start);
+	}
+	BenchReport(t->name, "forward", "samples/s", v, opt_repeat);
+	/* Same work through the batched kernel, in batches of
+	 * BENCH_BATCH samples. */
+	output = malloc(sizeof(double)*BENCH_BATCH*OUTPUT_UNITS(net));
+	for (r = -opt_warmup; r < opt_repeat; r++) {
+		double start = BenchTime();
+		for (p = 0; p < passes; p++) {
+			for (j = 0; j < opt_setlen; j += BENCH_BATCH)
+				AnnSimulateBatch(net, input+j*inputs, output,
+					MIN(BENCH_BATCH, opt_setlen-j));
+		}
+		if (r >= 0)
+			v[r] = (double)passes*opt_setlen/(BenchTime()-start);
+	}
+	BenchReport(t->name, "forward-batch", "samples/s", v, opt_repeat);
+	free(output);
+	free(input);
+	free(target);
+	free(v);
+	AnnFree(net);
+}
+
+/* Backprop speed in samples per second, the forward pass is not
+ * included in the measure. */
+static void BenchBackprop(struct BenchTopology *t)
+{
+	struct Ann *net = BenchCreateNet(t, ANN_RPROP);
+	double *input, *target, *v = malloc(sizeof(double)*opt_repeat);
+	int outputs = OUTPUT_UNITS(net), passes, r, p;
+
+	BenchCreateDataset(net, &input, &target);
+	AnnSetInput(net, input);
+	AnnSimulate(net);
+	passes = 1 + BENCH_WORK/((double)BenchTotalWeights(net)*opt_setlen);
+	for (r = -opt_warmup; r < opt_repeat; r++) {
+		double start = BenchTime();
+		for (p = 0; p < passes*opt_setlen; p++)
+			AnnCalculateGradients(net, target+(p%opt_setlen)*outputs);
+		if (r >= 0)
+			v[r] = (double)passes*opt_setlen/(BenchTime()-start);
+	}
+	BenchReport(t->name, "backprop", "samples/s", v, opt_repeat);
+	free(input);
+	free(target);
+	free(v);
+	AnnFree(net);
+}
+
+/* Density of the pruned layers, and speedup of the sparse forward
+ * kernel against the dense one, for every layer. Layers are numbered
+ * like in ann::prune, 0 is the layer feeding the output. */
+static void BenchPrune(struct BenchTopology *t)
+{
+	struct Ann *net = BenchCreateNet(t, ANN_RPROP);
+	double *input, *target, *v = malloc(sizeof(double)*opt_repeat);
+	int passes, r, p, l;
+	char what[64];
+
+	BenchCreateDataset(net, &input, &target);
+	AnnSetInput(net, input);
+	AnnSimulate(net);
+	for (l = 1; l < LAYERS(net); l++) {
+		int s = IS_TIED(net,l) ? TIED(net,l) : l;
+		int sparse = net->layer[s].sparse;
+
+		v[0] = AnnDensity(net, l);
+		snprintf(what, sizeof(what), "density-L%d", l-1);
+		BenchReport(t->name, what, "fraction", v, 1);
+		if (net->layer[s].sparse_row == NULL)
+			continue;
+		passes = 1 + BENCH_WORK/(10.0*WEIGHTS(net,l));
+		for (r = -opt_warmup; r < opt_repeat; r++) {
+			double start, dense;
+
+			net->layer[s].sparse = 0;
+			start = BenchTime();
+			for (p = 0; p < passes; p++)
+				AnnSimulateLayer(net, l);
+			dense = BenchTime()-start;
+			net->layer[s].sparse = 1;
+			start = BenchTime();
+			for (p = 0; p < passes; p++)
+				AnnSimulateLayer(net, l);
+			if (r >= 0)
+				v[r] = dense/(BenchTime()-start);
+		}
+		net->layer[s].sparse = sparse;
+		snprintf(what, sizeof(what), "sparse-speedup-L%d", l-1);
+		BenchReport(t->name, what, "x", v, opt_repeat);
+	}
+	free(input);
+	free(target);
+	free(v);
+	AnnFree(net);
+}
+
+/* Worker 'rank' of 'workers' of BenchPar(): train with data parallel
+ * RPROP on its shard of the dataset, the coordinator writes the epoch
+ * times to 'fd'. */
+static void BenchParWorker(struct BenchTopology *t, int workers, int rank, char *addr, int fd)
+{
+	struct Ann *net = BenchCreateNet(t, ANN_RPROP);
+	struct AnnDataset *ds;
+	struct AnnPar *p;
+	double *input, *target, *v = malloc(sizeof(double)*opt_repeat);
+	int epochs, r, j, k = 0;
+
+	BenchCreateDataset(net, &input, &target);
+	ds = AnnDatasetCreate(ANN_DATA_DOUBLE, (opt_setlen-rank+workers-1)/workers,
+		INPUT_UNITS(net), OUTPUT_UNITS(net), 1, 0);
+	if (ds == NULL || v == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (j = rank; j < opt_setlen; j += workers)
+		AnnDatasetSetSample(ds, k++, input+j*INPUT_UNITS(net),
+			target+j*OUTPUT_UNITS(net));
+	if (!strcmp(opt_transport, "shm"))
+		p = AnnParOpenShm(addr, workers, rank, 0);
+	else
+		p = AnnParOpenSocket(addr, workers, rank, 0);
+	if (p == NULL) {
+		fprintf(stderr, "Can't connect worker %d to %s\n", rank, addr);
+		exit(1);
+	}
+	epochs = 1 + BENCH_WORK/(3.0*BenchTotalWeights(net)*opt_setlen);
+	for (r = -opt_warmup; r < opt_repeat; r++) {
+		double start = BenchTime();
+		if (AnnParTrain(net, ds, p, 0, epochs) == -1) {
+			fprintf(stderr, "Worker %d all-reduce failed\n", rank);
+			exit(1);
+		}
+		if (r >= 0)
+			v[r] = (BenchTime()-start)*1000/epochs;
+	}
+	if (rank == 0 && write(fd, v, sizeof(double)*opt_repeat) == -1)
+		exit(1);
+	AnnParClose(p);
+	AnnDatasetFree(ds);
+	free(input);
+	free(target);
+	free(v);
+	AnnFree(net);
+}
+
+/* Run BenchParWorker() in 'workers' processes, storing the epoch times
+ * in milliseconds at 'v'. Return non-zero on error. */
+static int BenchParRun(struct BenchTopology *t, int workers, double *v)
+{
+	char addr[64];
+	int fds[2], r, status, err = 0;
+
+	if (!strcmp(opt_transport, "shm"))
+		snprintf(addr, sizeof(addr), "/nnbench.%d", (int)getpid());
+	else if (!strcmp(opt_transport, "unix"))
+		snprintf(addr, sizeof(addr), "/tmp/nnbench.%d.sock", (int)getpid());
+	else
+		snprintf(addr, sizeof(addr), "127.0.0.1:%d",
+			20000+(int)getpid()%20000);
+	if (pipe(fds) == -1)
+		return 1;
+	fflush(stdout);
+	for (r = 0; r < workers; r++) {
+		pid_t pid = fork();
+
+		if (pid == -1)
+			return 1;
+		if (pid == 0) {
+			close(fds[0]);
+			BenchParWorker(t, workers, r, addr, fds[1]);
+			_exit(0);
+		}
+	}
+	close(fds[1]);
+	if (read(fds[0], v, sizeof(double)*opt_repeat) !=
+	    (ssize_t)(sizeof(double)*opt_repeat))
+		err = 1;
+	close(fds[0]);
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			err = 1;
+	return err;
+}
+
+/* Scaling of data parallel RPROP across 1, 2, 4 ... opt_procs worker
+ * processes on the same dataset: epoch time, and efficiency against a
+ * single worker, that is T1/(workers*Tworkers). */
+static void BenchPar(struct BenchTopology *t)
+{
+	double *v = malloc(sizeof(double)*opt_repeat), t1 = 0, eff;
+	char what[64];
+	int w;
+
+	for (w = 1; w <= opt_procs; w = (w*2 > opt_procs && w < opt_procs) ? opt_procs : w*2) {
+		if (BenchParRun(t, w, v)) {
+			fprintf(stderr, "Data parallel run with %d workers failed\n", w);
+			break;
+		}
+		snprintf(what, sizeof(what), "par%s-%d", opt_transport, w);
+		BenchReport(t->name, what, "ms", v, opt_repeat);
+		/* BenchReport() sorted the times */
+		if (w == 1)
+			t1 = v[opt_repeat/2];
+		eff = t1/(w*v[opt_repeat/2]);
+		snprintf(what, sizeof(what), "par%s-%d-eff", opt_transport, w);
+		BenchReport(t->name, what, "efficiency", &eff, 1);
+	}
+	free(v);
+}
+
+/* Time of a full training epoch in milliseconds */
+static void BenchEpoch(struct BenchTopology *t, struct BenchAlgo *a)
+{
+	struct Ann *net = BenchCreateNet(t, a->algoid);
+	struct AnnDataset *ds;
+	double *input, *target, *v;
+	char what[64];
+	int epochs, r, j;
+
+	if (net == NULL)
+		return;
+	v = malloc(sizeof(double)*opt_repeat);
+	BenchCreateDataset(net, &input, &target);
+	/* Copy the dataset using the requested storage */
+	ds = AnnDatasetCreate(opt_store, opt_setlen, INPUT_UNITS(net),
+		OUTPUT_UNITS(net),
+		opt_store == ANN_DATA_U16 ? 1.0/65535 : 1.0/255, 0);
+	if (ds == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (j = 0; j < opt_setlen; j++)
+		AnnDatasetSetSample(ds, j, input+j*INPUT_UNITS(net),
+			target+j*OUTPUT_UNITS(net));
+	epochs = 1 + BENCH_WORK/(3.0*BenchTotalWeights(net)*opt_setlen);
+	if (a->maxepochs && epochs > a->maxepochs)
+		epochs = a->maxepochs;
+	for (r = -opt_warmup; r < opt_repeat; r++) {
+		double start = BenchTime();
+		AnnTrainDataset(net, ds, 0, epochs);
+		if (r >= 0)
+			v[r] = (BenchTime()-start)*1000/epochs;
+	}
+	snprintf(what, sizeof(what), "epoch-%s", a->name);
+	BenchReport(t->name, what, "ms", v, opt_repeat);
+	AnnDatasetFree(ds);
+	free(input);
+	free(target);
+	free(v);
+	AnnFree(net);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: nnbench [options]\n"
+"  -repeat <n>    measured runs for every benchmark (default 5)\n"
+"  -warmup <n>    untimed runs before measuring (default 1)\n"
+"  -setlen <n>    samples in the dataset (default 256)\n"
+"  -seed <n>      seed used for weights and dataset (default 1234)\n"
+"  -threads <n>   threads for the online algorithms (default 1)\n"
+"  -sigmoid <s>   exact, fast or table (default exact)\n"
+"  -store <s>     dataset storage for training: double, u8 or u16\n"
+"  -tied          tie the weights of the symmetric topologies, and\n"
+"                 skip the other ones\n"
+"  -prune <f>     prune the given fraction of the weights, and report\n"
+"                 the density and sparse kernel speedup per layer\n"
+"  -procs <n>     measure data parallel RPROP scaling with up to n\n"
+"                 worker processes\n"
+"  -transport <t> all-reduce transport: shm, unix or tcp (default shm)\n"
+"  -only <topo>   run only the given topology, e.g. 64-8-64\n"
+"  -csv | -json   output format (default is a text table)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct BenchTopology *t;
+	struct BenchAlgo *a;
+	int j;
+
+	for (j = 1; j < argc; j++) {
+		int last = (j == argc-1);
+		if (!strcmp(argv[j], "-repeat") && !last) {
+			opt_repeat = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-warmup") && !last) {
+			opt_warmup = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-setlen") && !last) {
+			opt_setlen = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-seed") && !last) {
+			opt_seed = strtoul(argv[++j], NULL, 10);
+		} else if (!strcmp(argv[j], "-threads") && !last) {
+			opt_threads = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-sigmoid") && !last) {
+			char *mode = argv[++j];
+			if (!strcmp(mode, "exact"))
+				opt_sigmoid = ANN_SIGMOID_EXACT;
+			else if (!strcmp(mode, "fast"))
+				opt_sigmoid = ANN_SIGMOID_FAST;
+			else if (!strcmp(mode, "table"))
+				opt_sigmoid = ANN_SIGMOID_TABLE;
+			else
+				usage();
+		} else if (!strcmp(argv[j], "-store") && !last) {
+			char *type = argv[++j];
+			if (!strcmp(type, "double"))
+				opt_store = ANN_DATA_DOUBLE;
+			else if (!strcmp(type, "u8"))
+				opt_store = ANN_DATA_U8;
+			else if (!strcmp(type, "u16"))
+				opt_store = ANN_DATA_U16;
+			else
+				usage();
+		} else if (!strcmp(argv[j], "-only") && !last) {
+			opt_only = argv[++j];
+		} else if (!strcmp(argv[j], "-prune") && !last) {
+			opt_prune = atof(argv[++j]);
+		} else if (!strcmp(argv[j], "-procs") && !last) {
+			opt_procs = atoi(argv[++j]);
+		} else if (!strcmp(argv[j], "-transport") && !last) {
+			opt_transport = argv[++j];
+			if (strcmp(opt_transport, "shm") &&
+			    strcmp(opt_transport, "unix") &&
+			    strcmp(opt_transport, "tcp"))
+				usage();
+		} else if (!strcmp(argv[j], "-tied")) {
+			opt_tied = 1;
+		} else if (!strcmp(argv[j], "-csv")) {
+			opt_output = OUT_CSV;
+		} else if (!strcmp(argv[j], "-json")) {
+			opt_output = OUT_JSON;
+		} else {
+			usage();
+		}
+	}
+	if (opt_repeat < 1 || opt_warmup < 0 || opt_setlen < 1 ||
+	    opt_threads < 1 || opt_prune < 0 || opt_prune > 1 ||
+	    opt_procs < 0)
+		usage();
+
+	switch(opt_output) {
+	case OUT_TEXT:
+		printf("%-16s %-16s %14s %14s %14s\n",
+			"topology", "benchmark", "median", "mean", "min");
+		break;
+	case OUT_CSV:
+		printf("topology,benchmark,unit,median,mean,min,runs\n");
+		break;
+	case OUT_JSON:
+		printf("[");
+		break;
+	}
+	for (t = topologies; t->name; t++) {
+		if (opt_only && strcmp(opt_only, t->name))
+			continue;
+		if (opt_tied && !BenchSymmetric(t))
+			continue;
+		BenchForward(t);
+		BenchBackprop(t);
+		if (opt_prune > 0)
+			BenchPrune(t);
+		if (opt_procs > 0)
+			BenchPar(t);
+		for (a = algos; a->name; a++)
+			BenchEpoch(t, a);
+	}
+	if (opt_output == OUT_JSON)
+		printf("\n]\n");
+	return 0;
+}
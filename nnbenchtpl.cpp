@@ -0,0 +1,192 @@
+/* gnegnu NN - benchmark of the compile time nets of gnegnu.hpp
+ * Copyright(C) 2003 Salvatore Sanfilippo
+ * All rights reserved.
+ *
+ * Every topology is created as a struct Ann with reproducible weights
+ * and converted to the gnegnu::Net with the same units. First the two
+ * nets are checked to compute the same outputs and, after a few RPROP
+ * epochs, the same weights, bit by bit; then the forward pass and the
+ * RPROP epoch of the two are timed on the same samples. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gnegnu.hpp"
+
+#define BENCH_WORK 20000000.0	/* weight ops per measurement */
+#define BENCH_BATCH 32		/* samples per AnnSimulateBatch() call */
+#define BENCH_SETLEN 256
+#define BENCH_REPEAT 5
+#define BENCH_CHECK_EPOCHS 10
+
+static double BenchTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Minimal linear congruential generator, like the one of nnbench.c */
+static double BenchRandom(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return ((*seed >> 8) & 0xffffff) / (double) 0x1000000;
+}
+
+static int BenchCmpDouble(const void *a, const void *b)
+{
+	double da = *(double*)a, db = *(double*)b;
+
+	return (da > db) - (da < db);
+}
+
+static double BenchMedian(double *v, int n)
+{
+	qsort(v, n, sizeof(double), BenchCmpDouble);
+	return v[n/2];
+}
+
+/* Time 'passes' calls of f() BENCH_REPEAT times after a warmup run,
+ * returning the median time of a call in seconds */
+template<typename F>
+static double BenchMeasure(int passes, F f)
+{
+	double v[BENCH_REPEAT];
+	int r, p;
+
+	for (r = -1; r < BENCH_REPEAT; r++) {
+		double start = BenchTime();
+
+		for (p = 0; p < passes; p++)
+			f();
+		if (r >= 0)
+			v[r] = (BenchTime()-start)/passes;
+	}
+	return BenchMedian(v, BENCH_REPEAT);
+}
+
+static void BenchReport(const char *topology, const char *what, double c, double tpl)
+{
+	printf("%-12s %-10s %14.0f %14.0f %8.2fx\n",
+		topology, what, BENCH_SETLEN/c, BENCH_SETLEN/tpl, c/tpl);
+}
+
+/* Return non-zero if the weights of the two nets are not identical */
+template<typename N>
+static int BenchDiffWeights(struct Ann *net, N *tpl)
+{
+	int l, i, j;
+
+	for (l = 1; l < LAYERS(net); l++)
+		for (i = 0; i < UNITS(net,l); i++)
+			for (j = 0; j < UNITS(net,l-1); j++)
+				if (WEIGHT(net,l,i,j) != tpl->weight(l,i,j))
+					return 1;
+	return 0;
+}
+
+template<std::size_t... Units>
+static int BenchTopology(const char *name)
+{
+	typedef gnegnu::Net<Units...> N;
+	int units[] = {(int)Units...};
+	struct Ann *net, *ref;
+	struct AnnDataset ds;
+	N *tpl = new N;
+	double *input, *target, *out, c, t;
+	unsigned int seed = 1234;
+	int j, k, inputs = N::inputs, outputs = N::outputs, passes, err = 0;
+
+	/* Two equal struct Ann: one stays in sync with the template */
+	net = AnnCreateNet(N::layers, units);
+	ref = AnnCreateNet(N::layers, units);
+	input = (double*)malloc(sizeof(double)*inputs*BENCH_SETLEN);
+	target = (double*)malloc(sizeof(double)*outputs*BENCH_SETLEN);
+	out = (double*)malloc(sizeof(double)*outputs*BENCH_BATCH);
+	if (!net || !ref || !input || !target || !out) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	AnnSetSeed(net, 1234);
+	AnnSetRandomWeights(net);
+	AnnCopyWeights(ref, net);
+	for (j = 0; j < inputs*BENCH_SETLEN; j++)
+		input[j] = BenchRandom(&seed);
+	for (j = 0; j < outputs*BENCH_SETLEN; j++)
+		target[j] = inputs == outputs ? input[j] : BenchRandom(&seed);
+	AnnDatasetWrap(&ds, input, target, BENCH_SETLEN, inputs, outputs);
+	if (tpl->from_ann(net)) {
+		fprintf(stderr, "%s: the units of the nets don't match\n", name);
+		exit(1);
+	}
+
+	/* Same outputs, and same weights after some RPROP epochs */
+	for (j = 0; j < BENCH_SETLEN; j++) {
+		AnnSetInput(net, input+j*inputs);
+		AnnSimulate(net);
+		tpl->simulate(input+j*inputs);
+		for (k = 0; k < outputs; k++)
+			if (OUTPUT_NODE(net,k) != tpl->output()[k])
+				err = 1;
+	}
+	for (j = 0; j < BENCH_CHECK_EPOCHS; j++) {
+		AnnResilientBPEpoch(net, &ds);
+		tpl->rprop_epoch(input, target, BENCH_SETLEN);
+		if (net->meanerr != tpl->meanerr)
+			err = 1;
+	}
+	if (err || BenchDiffWeights(net, tpl)) {
+		fprintf(stderr, "%s: the template net differs from the "
+			"struct Ann\n", name);
+		return 1;
+	}
+
+	passes = 1 + BENCH_WORK/((double)tpl->weight_count()*BENCH_SETLEN);
+	c = BenchMeasure(passes, [&] {
+		for (int s = 0; s < BENCH_SETLEN; s++) {
+			AnnSetInput(ref, input+s*inputs);
+			AnnSimulate(ref);
+		}
+	});
+	t = BenchMeasure(passes, [&] {
+		for (int s = 0; s < BENCH_SETLEN; s++)
+			tpl->simulate(input+s*inputs);
+	});
+	BenchReport(name, "forward", c, t);
+	c = BenchMeasure(passes, [&] {
+		for (int s = 0; s < BENCH_SETLEN; s += BENCH_BATCH)
+			AnnSimulateBatch(ref, input+s*inputs, out, BENCH_BATCH);
+	});
+	BenchReport(name, "fwd-batch", c, t);
+	passes = 1 + passes/3;
+	c = BenchMeasure(passes, [&] { AnnResilientBPEpoch(ref, &ds); });
+	t = BenchMeasure(passes, [&] {
+		tpl->rprop_epoch(input, target, BENCH_SETLEN);
+	});
+	BenchReport(name, "rprop", c, t);
+
+	AnnFree(net);
+	AnnFree(ref);
+	delete tpl;
+	free(input);
+	free(target);
+	free(out);
+	return 0;
+}
+
+int main(void)
+{
+	int err = 0;
+
+	printf("%-12s %-10s %14s %14s %9s\n", "topology", "benchmark",
+		"Ann samples/s", "Net samples/s", "speedup");
+	err |= BenchTopology<1, 3, 2>("2-3-1");
+	err |= BenchTopology<64, 8, 64>("64-8-64");
+	err |= BenchTopology<64, 16, 16>("16-16-64");
+	err |= BenchTopology<64, 16, 64>("64-16-64");
+	err |= BenchTopology<64, 16, 32, 64>("64-32-16-64");
+	return err;
+}
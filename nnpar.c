@@ -0,0 +1,598 @@
+/* gnegnu NN - data parallel training across processes
+ * Copyright(C) 2003 Salvatore Sanfilippo
+ * All rights reserved. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "nnpar.h"
+
+/* Shared memory segment: a slot of 'words' doubles for every worker,
+ * followed by the slot holding the result of the current round. */
+struct AnnParShm {
+	/* Barrier, see AnnParBarrier() */
+	volatile int count;	/* workers arrived */
+	volatile int seq;	/* incremented when all arrived */
+	volatile int broken;	/* a worker gave up waiting */
+	volatile int ready;	/* set by the coordinator once initialized */
+	int workers;
+	size_t words;
+	double data[1];
+};
+
+#define SHM_SLOT(p,r) ((p)->shm->data+(size_t)(r)*(p)->words)
+
+static struct AnnPar *AnnParAlloc(int transport, int workers, int rank, size_t words)
+{
+	struct AnnPar *p;
+
+	if (workers < 1 || rank < 0 || rank >= workers)
+		return NULL;
+	if ((p = malloc(sizeof(*p))) == NULL)
+		return NULL;
+	p->transport = transport;
+	p->workers = workers;
+	p->rank = rank;
+	p->words = words ? words : ANN_PAR_WORDS;
+	p->shm = NULL;
+	p->shmsize = 0;
+	p->fd = NULL;
+	p->buf = NULL;
+	return p;
+}
+
+static double AnnParTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Sleep until '*addr' is no longer 'val', for at most 'timeout'
+ * seconds. It may return earlier: the caller checks again. */
+static void AnnParFutexWait(volatile int *addr, int val, double timeout)
+{
+#ifdef __linux__
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)timeout;
+	ts.tv_nsec = (long)((timeout-ts.tv_sec)*1e9);
+	syscall(SYS_futex, (int*)addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+	usleep(100);
+#endif
+}
+
+static void AnnParFutexWake(volatile int *addr)
+{
+#ifdef __linux__
+	syscall(SYS_futex, (int*)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* Wait for all the workers to reach the barrier of the shared memory
+ * segment. A process-shared pthread barrier would wait forever for a
+ * worker that died, so this one gives up after ANN_PAR_TIMEOUT seconds:
+ * the barrier is then broken, and this and every following call, in
+ * all the workers, return -1. Return 0 on success. */
+static int AnnParBarrier(struct AnnPar *p)
+{
+	struct AnnParShm *shm = p->shm;
+	double deadline = AnnParTime()+ANN_PAR_TIMEOUT, left;
+	int seq = shm->seq;
+
+	if (__sync_add_and_fetch(&shm->count, 1) == p->workers) {
+		/* Last one: reset the count before releasing the others,
+		 * that can only arrive again after seeing the new seq. */
+		shm->count = 0;
+		__sync_add_and_fetch(&shm->seq, 1);
+		AnnParFutexWake(&shm->seq);
+	} else {
+		while (shm->seq == seq) {
+			if (shm->broken ||
+			    (left = deadline-AnnParTime()) <= 0) {
+				shm->broken = 1;
+				__sync_add_and_fetch(&shm->seq, 1);
+				AnnParFutexWake(&shm->seq);
+				break;
+			}
+			AnnParFutexWait(&shm->seq, seq, left);
+		}
+	}
+	__sync_synchronize();
+	return shm->broken ? -1 : 0;
+}
+
+/* Open the all-reduce shared memory segment 'name' (like "/job1") for
+ * the worker 'rank' of 'workers'. The coordinator creates it, the other
+ * workers wait up to ANN_PAR_TIMEOUT seconds for it to appear. The
+ * segment is unlinked once all the workers attached it.
+ * Return NULL on error. */
+struct AnnPar *AnnParOpenShm(char *name, int workers, int rank, size_t words)
+{
+	struct AnnPar *p = AnnParAlloc(ANN_PAR_SHM, workers, rank, words);
+	double deadline = AnnParTime()+ANN_PAR_TIMEOUT;
+	int fd = -1;
+
+	if (p == NULL)
+		return NULL;
+	p->shmsize = offsetof(struct AnnParShm, data) +
+		sizeof(double)*(workers+1)*p->words;
+	if (rank == 0) {
+		shm_unlink(name);
+		fd = shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0600);
+		if (fd == -1 || ftruncate(fd, p->shmsize) == -1)
+			goto err;
+		p->shm = mmap(NULL, p->shmsize, PROT_READ|PROT_WRITE,
+			MAP_SHARED, fd, 0);
+		if (p->shm == MAP_FAILED)
+			goto err;
+		p->shm->count = p->shm->seq = p->shm->broken = 0;
+		p->shm->workers = workers;
+		p->shm->words = p->words;
+		__sync_synchronize();
+		p->shm->ready = 1;
+	} else {
+		struct stat st;
+
+		/* Wait for the coordinator to create and size it */
+		while (1) {
+			fd = shm_open(name, O_RDWR, 0);
+			if (fd != -1 && fstat(fd, &st) == 0 &&
+			    (size_t)st.st_size >= p->shmsize)
+				break;
+			if (fd != -1)
+				close(fd);
+			fd = -1;
+			if (AnnParTime() > deadline)
+				goto err;
+			usleep(1000);
+		}
+		p->shm = mmap(NULL, p->shmsize, PROT_READ|PROT_WRITE,
+			MAP_SHARED, fd, 0);
+		if (p->shm == MAP_FAILED)
+			goto err;
+		while (!p->shm->ready) {
+			if (AnnParTime() > deadline)
+				goto err;
+			usleep(1000);
+		}
+		__sync_synchronize();
+		if (p->shm->workers != workers || p->shm->words != p->words)
+			goto err;
+	}
+	close(fd);
+	fd = -1;
+	if (AnnParBarrier(p) == -1)
+		goto err;
+	if (rank == 0)
+		shm_unlink(name);
+	return p;
+
+err:
+	if (fd != -1)
+		close(fd);
+	if (p->shm && p->shm != MAP_FAILED)
+		munmap(p->shm, p->shmsize);
+	if (rank == 0)
+		shm_unlink(name);
+	free(p);
+	return NULL;
+}
+
+static int AnnParWrite(int fd, void *buf, size_t len)
+{
+	char *b = buf;
+
+	while (len) {
+		ssize_t n = write(fd, b, len);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int AnnParRead(int fd, void *buf, size_t len)
+{
+	char *b = buf;
+
+	while (len) {
+		ssize_t n = read(fd, b, len);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Fill 'sa' with the address 'addr', that is "host:port" for TCP,
+ * otherwise the path of a Unix domain socket. Return the address
+ * length, or 0 on error. */
+static socklen_t AnnParAddress(char *addr, struct sockaddr_storage *sa)
+{
+	char *colon = strrchr(addr, ':');
+
+	memset(sa, 0, sizeof(*sa));
+	if (colon) {
+		struct addrinfo hints, *res;
+		char host[256];
+		socklen_t len;
+
+		if ((size_t)(colon-addr) >= sizeof(host))
+			return 0;
+		memcpy(host, addr, colon-addr);
+		host[colon-addr] = '\0';
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host[0] ? host : NULL, colon+1, &hints, &res))
+			return 0;
+		len = res->ai_addrlen;
+		memcpy(sa, res->ai_addr, len);
+		freeaddrinfo(res);
+		return len;
+	} else {
+		struct sockaddr_un *un = (struct sockaddr_un*)sa;
+
+		if (strlen(addr) >= sizeof(un->sun_path))
+			return 0;
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, addr);
+		return sizeof(*un);
+	}
+}
+
+/* Open the all-reduce connections for the worker 'rank' of 'workers'.
+ * The coordinator listens at 'addr' ("host:port" or a Unix domain socket
+ * path) for the other workers, that retry to connect for up to
+ * ANN_PAR_TIMEOUT seconds. Return NULL on error. */
+struct AnnPar *AnnParOpenSocket(char *addr, int workers, int rank, size_t words)
+{
+	struct AnnPar *p = AnnParAlloc(ANN_PAR_SOCKET, workers, rank, words);
+	struct sockaddr_storage sa;
+	socklen_t salen = 0;
+	double deadline = AnnParTime()+ANN_PAR_TIMEOUT;
+	int j, s = -1, one = 1;
+
+	if (p == NULL)
+		return NULL;
+	p->fd = malloc(sizeof(int)*workers);
+	p->buf = AnnMalloc(p->words, sizeof(double));
+	if (p->fd == NULL || p->buf == NULL ||
+	    (salen = AnnParAddress(addr, &sa)) == 0)
+		goto err;
+	for (j = 0; j < workers; j++)
+		p->fd[j] = -1;
+	if (rank == 0) {
+		if ((s = socket(sa.ss_family, SOCK_STREAM, 0)) == -1)
+			goto err;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (sa.ss_family == AF_UNIX)
+			unlink(addr);
+		if (bind(s, (struct sockaddr*)&sa, salen) == -1 ||
+		    listen(s, workers) == -1)
+			goto err;
+		for (j = 1; j < workers; j++) {
+			struct pollfd pfd;
+			int fd, r;
+
+			pfd.fd = s;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, (deadline-AnnParTime())*1000) <= 0 ||
+			    (fd = accept(s, NULL, NULL)) == -1)
+				goto err;
+			if (AnnParRead(fd, &r, sizeof(r)) == -1 ||
+			    r <= 0 || r >= workers || p->fd[r] != -1) {
+				close(fd);
+				goto err;
+			}
+			p->fd[r] = fd;
+		}
+		close(s);
+		if (sa.ss_family == AF_UNIX)
+			unlink(addr);
+	} else {
+		while (1) {
+			if ((s = socket(sa.ss_family, SOCK_STREAM, 0)) == -1)
+				goto err;
+			if (connect(s, (struct sockaddr*)&sa, salen) == 0)
+				break;
+			close(s);
+			s = -1;
+			if (AnnParTime() > deadline)
+				goto err;
+			usleep(10000);
+		}
+		if (AnnParWrite(s, &rank, sizeof(rank)) == -1)
+			goto err;
+		p->fd[0] = s;
+	}
+	for (j = 0; j < workers; j++) {
+		if (p->fd[j] != -1 && sa.ss_family != AF_UNIX)
+			setsockopt(p->fd[j], IPPROTO_TCP, TCP_NODELAY,
+				&one, sizeof(one));
+	}
+	return p;
+
+err:
+	if (s != -1)
+		close(s);
+	if (p->fd) {
+		for (j = 0; j < workers; j++)
+			if (p->fd[j] != -1 && p->fd[j] != s)
+				close(p->fd[j]);
+	}
+	if (rank == 0 && salen && sa.ss_family == AF_UNIX)
+		unlink(addr);
+	free(p->fd);
+	free(p->buf);
+	free(p);
+	return NULL;
+}
+
+void AnnParClose(struct AnnPar *p)
+{
+	int j;
+
+	if (p->shm)
+		munmap(p->shm, p->shmsize);
+	if (p->fd) {
+		for (j = 0; j < p->workers; j++)
+			if (p->fd[j] != -1)
+				close(p->fd[j]);
+	}
+	free(p->fd);
+	free(p->buf);
+	free(p);
+}
+
+/* acc = acc op v */
+static void AnnParApply(double *acc, double *v, size_t n, int op)
+{
+	size_t i;
+
+	if (op == ANN_PAR_MAX) {
+		for (i = 0; i < n; i++)
+			if (v[i] > acc[i]) acc[i] = v[i];
+	} else {
+		for (i = 0; i < n; i++)
+			acc[i] += v[i];
+	}
+}
+
+/* Replace 'v' with the sum (or the max) of the 'v' vectors of all the
+ * workers. The workers are always combined in rank order, so every
+ * worker gets exactly the same result with both the transports.
+ * Return -1 on error. */
+int AnnParAllreduce(struct AnnPar *p, double *v, size_t n, int op)
+{
+	size_t off, c;
+	int r;
+
+	for (off = 0; off < n; off += c) {
+		c = n-off < p->words ? n-off : p->words;
+		if (p->transport == ANN_PAR_SHM) {
+			/* Every worker combines its part of the slots */
+			size_t lo = c*p->rank/p->workers;
+			size_t hi = c*(p->rank+1)/p->workers;
+			double *res = SHM_SLOT(p, p->workers);
+
+			memcpy(SHM_SLOT(p, p->rank), v+off, sizeof(double)*c);
+			if (AnnParBarrier(p) == -1)
+				return -1;
+			memcpy(res+lo, SHM_SLOT(p, 0)+lo, sizeof(double)*(hi-lo));
+			for (r = 1; r < p->workers; r++)
+				AnnParApply(res+lo, SHM_SLOT(p, r)+lo, hi-lo, op);
+			if (AnnParBarrier(p) == -1)
+				return -1;
+			memcpy(v+off, res, sizeof(double)*c);
+		} else if (p->rank == 0) {
+			for (r = 1; r < p->workers; r++) {
+				if (AnnParRead(p->fd[r], p->buf, sizeof(double)*c))
+					return -1;
+				AnnParApply(v+off, p->buf, c, op);
+			}
+			for (r = 1; r < p->workers; r++)
+				if (AnnParWrite(p->fd[r], v+off, sizeof(double)*c))
+					return -1;
+		} else {
+			if (AnnParWrite(p->fd[0], v+off, sizeof(double)*c) ||
+			    AnnParRead(p->fd[0], v+off, sizeof(double)*c))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Replace 'v' with the 'v' vector of the coordinator.
+ * Return -1 on error. */
+int AnnParBroadcast(struct AnnPar *p, double *v, size_t n)
+{
+	size_t off, c;
+	int r;
+
+	for (off = 0; off < n; off += c) {
+		c = n-off < p->words ? n-off : p->words;
+		if (p->transport == ANN_PAR_SHM) {
+			double *res = SHM_SLOT(p, p->workers);
+
+			/* The other workers may still be copying the result
+			 * of the previous all-reduce out of the slot */
+			if (AnnParBarrier(p) == -1)
+				return -1;
+			if (p->rank == 0)
+				memcpy(res, v+off, sizeof(double)*c);
+			if (AnnParBarrier(p) == -1)
+				return -1;
+			if (p->rank != 0)
+				memcpy(v+off, res, sizeof(double)*c);
+			if (AnnParBarrier(p) == -1)
+				return -1;
+		} else if (p->rank == 0) {
+			for (r = 1; r < p->workers; r++)
+				if (AnnParWrite(p->fd[r], v+off, sizeof(double)*c))
+					return -1;
+		} else {
+			if (AnnParRead(p->fd[0], v+off, sizeof(double)*c))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Copy the array selected by 'what' of every layer to 'v' if 'get' is
+ * true, otherwise copy 'v' to the arrays. Return the number of doubles. */
+#define PAR_WEIGHT 0
+#define PAR_DELTA 1
+#define PAR_PGRADIENT 2
+#define PAR_SGRADIENT 3
+static size_t AnnParVector(struct Ann *net, double *v, int what, int get)
+{
+	size_t n = 0;
+	int j;
+
+	for (j = 1; j < LAYERS(net); j++) {
+		struct AnnLayer *l = &net->layer[j];
+		double *a;
+
+		switch(what) {
+		case PAR_WEIGHT: a = l->weight; break;
+		case PAR_DELTA: a = l->delta; break;
+		case PAR_PGRADIENT: a = l->pgradient; break;
+		default: a = l->sgradient; break;
+		}
+		if (v) {
+			if (get)
+				memcpy(v+n, a, sizeof(double)*STORED_WEIGHTS(net,j));
+			else
+				memcpy(a, v+n, sizeof(double)*STORED_WEIGHTS(net,j));
+		}
+		n += STORED_WEIGHTS(net,j);
+	}
+	return n;
+}
+
+/* Train the net on the shard of the training set owned by this worker,
+ * in lockstep with the other workers of 'p', that call this function
+ * with nets of the same topology and configuration.
+ * The training starts from the weights and the state of the coordinator
+ * net. Every epoch the partial gradient sums (the deltas for BBPROP) and
+ * errors of the shards are all-reduced, then every worker performs the
+ * same update, so the nets stay identical and the result is the same as
+ * training on the whole set up to the floating point summation order.
+ * Only the batch algorithms decomposing into a per-sample sum are
+ * supported: RPROP, iRPROP-, iRPROP+ and BBPROP.
+ * Return -1 on error or unsupported algorithm, otherwise like
+ * AnnTrainDataset(): zero if maxepochs was reached, or the number of
+ * epochs performed once the max error dropped below 'maxerr'. */
+int AnnParTrain(struct Ann *net, struct AnnDataset *shard, struct AnnPar *p, double maxerr, int maxepochs)
+{
+	int algo = net->flags & ANN_ALGOMASK, i = 0, j;
+	size_t n = AnnParVector(net, NULL, PAR_WEIGHT, 1);
+	double *v, e = maxerr+1, totweight = shard->totweight;
+
+	if (algo != ANN_RPROP && algo != ANN_IRPROPM &&
+	    algo != ANN_IRPROPP && algo != ANN_BBPROP)
+		return -1;
+	if ((v = AnnMalloc(3*n+1, sizeof(double))) == NULL)
+		return -1;
+	/* Start from the coordinator net */
+	AnnParVector(net, v, PAR_WEIGHT, 1);
+	AnnParVector(net, v+n, PAR_DELTA, 1);
+	AnnParVector(net, v+2*n, PAR_PGRADIENT, 1);
+	v[3*n] = net->rprop_perror;
+	if (AnnParBroadcast(p, v, 3*n+1) ||
+	    AnnParAllreduce(p, &totweight, 1, ANN_PAR_SUM))
+		goto err;
+	AnnParVector(net, v, PAR_WEIGHT, 0);
+	AnnParVector(net, v+n, PAR_DELTA, 0);
+	AnnParVector(net, v+2*n, PAR_PGRADIENT, 0);
+	net->rprop_perror = v[3*n];
+	while (i++ < maxepochs && e >= maxerr) {
+		double toterr = 0;
+
+		e = 0;
+		if (algo == ANN_BBPROP)
+			AnnResetDeltas(net);
+		else
+			AnnResetSgradient(net);
+		for (j = 0; j < shard->setlen; j++) {
+			double *desidered, se;
+
+			se = AnnSimulateSample(net, shard, j, &desidered);
+			if (se > e) e = se;
+			toterr += net->sample_weight*se;
+			AnnCalculateGradients(net, desidered);
+			if (algo == ANN_BBPROP)
+				AnnUpdateDeltasGD(net);
+			else
+				AnnUpdateSgradient(net);
+		}
+		/* Sum the partial sums and errors of all the shards */
+		AnnParVector(net, v,
+			algo == ANN_BBPROP ? PAR_DELTA : PAR_SGRADIENT, 1);
+		v[n] = toterr;
+		if (AnnParAllreduce(p, v, n+1, ANN_PAR_SUM) ||
+		    AnnParAllreduce(p, &e, 1, ANN_PAR_MAX))
+			goto err;
+		AnnParVector(net, v,
+			algo == ANN_BBPROP ? PAR_DELTA : PAR_SGRADIENT, 0);
+		toterr = v[n];
+		switch(algo) {
+		case ANN_RPROP:
+			AnnAdjustWeightsResilientBP(net);
+			break;
+		case ANN_IRPROPM:
+		case ANN_IRPROPP:
+			AnnAdjustWeightsIRprop(net, algo == ANN_IRPROPP &&
+				toterr > net->rprop_perror);
+			net->rprop_perror = toterr;
+			break;
+		case ANN_BBPROP:
+			AnnAdjustWeights(net);
+			break;
+		}
+		net->meanerr = totweight > 0 ? toterr/totweight : 0;
+		net->epochs++;
+	}
+	net->sample_weight = 1;
+	free(v);
+	if (i >= maxepochs)
+		return 0;
+	return i;
+
+err:
+	net->sample_weight = 1;
+	free(v);
+	return -1;
+}
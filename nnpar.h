@@ -0,0 +1,47 @@
+#ifndef __NNPAR_H
+#define __NNPAR_H
+
+#include <stddef.h>
+
+#include "nn.h"
+
+/* Data parallel training across processes.
+ * Every worker process owns a shard of the training set and computes the
+ * partial sums of the gradients over it. The partial sums are added
+ * with an all-reduce operation, so that all the workers apply the same
+ * update to identical copies of the net. Worker 0 is the coordinator.
+ * Two transports are available: POSIX shared memory for workers on the
+ * same host, and stream sockets (Unix domain or TCP, so that workers can
+ * also run on different hosts with the same floating point format). */
+#define ANN_PAR_SHM 0
+#define ANN_PAR_SOCKET 1
+
+/* All-reduce operations */
+#define ANN_PAR_SUM 0
+#define ANN_PAR_MAX 1
+
+#define ANN_PAR_WORDS 65536	/* default doubles exchanged per round */
+#define ANN_PAR_TIMEOUT 10	/* seconds to wait for the other workers */
+
+struct AnnPar {
+	int transport;		/* ANN_PAR_* */
+	int workers;
+	int rank;		/* 0 is the coordinator */
+	size_t words;		/* max doubles exchanged per round */
+	/* Shared memory */
+	struct AnnParShm *shm;
+	size_t shmsize;
+	/* Sockets: the coordinator has a connection for every other
+	 * worker (fd[rank]), the other workers just fd[0]. */
+	int *fd;
+	double *buf;		/* receive buffer, 'words' doubles */
+};
+
+struct AnnPar *AnnParOpenShm(char *name, int workers, int rank, size_t words);
+struct AnnPar *AnnParOpenSocket(char *addr, int workers, int rank, size_t words);
+void AnnParClose(struct AnnPar *p);
+int AnnParAllreduce(struct AnnPar *p, double *v, size_t n, int op);
+int AnnParBroadcast(struct AnnPar *p, double *v, size_t n);
+int AnnParTrain(struct Ann *net, struct AnnDataset *shard, struct AnnPar *p, double maxerr, int maxepochs);
+
+#endif /* __NNPAR_H */
@@ -0,0 +1,57 @@
+load tclgnegnu.so
+
+# Check that ann::sweep trains every net exactly like ann::train: a
+# sweep of a single net must stop at the same epoch with the same
+# weights as the sequential training. Then check that a sweep with
+# early stopping stops the same nets, with the same weights, with any
+# number of threads. Usage:
+#
+#   tclsh sweepcheck.tcl
+
+set xor {{0 0} {0} {0 1} {1} {1 0} {1} {1 1} {0}}
+set failed 0
+
+foreach {seed maxerr} {1 0.08 3 0.1 4 0.1 5 0.05} {
+    set a [ann::create -seed $seed 1 4 2]
+    set b [ann::create -seed $seed 1 4 2]
+    ann::configure a -stats 1
+    ann::train a $xor 1000 $maxerr
+    set epochs [dict get [lindex [ann::stats a] end] epoch]
+    set res [ann::sweep b $xor 1000 $maxerr]
+    set r [lindex [dict get $res nets] 0]
+    ann::configure a -stats 0
+    if {[dict get $r status] ne "converged" ||
+        [dict get $r epochs] != $epochs || $a ne $b} {
+        puts "seed $seed maxerr $maxerr: train $epochs epochs, sweep $r"
+        set failed 1
+    } else {
+        puts "seed $seed maxerr $maxerr: $epochs epochs, ok"
+    }
+}
+
+# Run a sweep of 8 seeded nets with early stopping, return the result
+# followed by the nets.
+proc sweep threads {
+    global xor
+    set vars {}
+    for {set seed 1} {$seed <= 8} {incr seed} {
+        set ::n$seed [ann::create -seed $seed 1 4 2]
+        lappend vars ::n$seed
+    }
+    set res [ann::sweep -threads $threads -rung 5 -eta 2 $vars $xor 200 0.05]
+    foreach v $vars {lappend res [set $v]}
+    return $res
+}
+
+set ref [sweep 1]
+for {set j 0} {$j < 10} {incr j} {
+    if {[sweep 3] ne $ref} {
+        puts "sweep -threads 3 run $j differs from -threads 1"
+        set failed 1
+        break
+    }
+}
+if {$j == 10} {
+    puts "sweep with early stopping: $j runs with 3 threads, ok"
+}
+exit $failed
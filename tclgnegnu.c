@@ -10,6 +10,10 @@
 #include <stdlib.h>
 #include "nn.h"
 
+#ifndef TCL_THREADS
+#error "a thread enabled Tcl is required, compile with -DTCL_THREADS=1"
+#endif
+
 #define VERSION "0.1"
 
 /* -------------------------- ANN object implementation --------------------- */
@@ -77,12 +81,74 @@ int Tcl_GetAnnFromObj(struct Tcl_Interp *interp, Tcl_Obj *objPtr, struct Ann **a
 	return TCL_OK;
 }
 
+/* Nets trained by 'ann::train' in this thread. A -callback script runs
+ * while the net is training, so the commands changing a net refuse to
+ * touch a busy one, and if the script frees the object holding it (for
+ * example converting it to a list) the net is released only when the
+ * training is over. */
+struct AnnBusy {
+	struct Ann *net;
+	int orphan;		/* the Tcl object dropped the net */
+	struct AnnBusy *next;
+};
+
+static Tcl_ThreadDataKey annBusyKey;
+
+static struct AnnBusy *AnnBusyLookup(struct Ann *net)
+{
+	struct AnnBusy **head, *b;
+
+	head = Tcl_GetThreadData(&annBusyKey, sizeof(struct AnnBusy*));
+	for (b = *head; b; b = b->next)
+		if (b->net == net)
+			return b;
+	return NULL;
+}
+
+static void AnnBusyPush(struct AnnBusy *b, struct Ann *net)
+{
+	struct AnnBusy **head;
+
+	head = Tcl_GetThreadData(&annBusyKey, sizeof(struct AnnBusy*));
+	b->net = net;
+	b->orphan = 0;
+	b->next = *head;
+	*head = b;
+}
+
+/* Remove 'b', that is always the last pushed, and free the net if it
+ * lost its object meanwhile. Return non-zero in this case. */
+static int AnnBusyPop(struct AnnBusy *b)
+{
+	struct AnnBusy **head;
+
+	head = Tcl_GetThreadData(&annBusyKey, sizeof(struct AnnBusy*));
+	*head = b->next;
+	if (b->orphan)
+		AnnFree(b->net);
+	return b->orphan;
+}
+
+/* Return TCL_ERROR with a message if 'net' is being trained */
+static int AnnCheckBusy(Tcl_Interp *interp, struct Ann *net)
+{
+	if (AnnBusyLookup(net) == NULL)
+		return TCL_OK;
+	Tcl_SetStringObj(Tcl_GetObjResult(interp),
+		"the net is being trained", -1);
+	return TCL_ERROR;
+}
+
 /* The 'free' method of the object. */
 void FreeAnnInternalRep(Tcl_Obj *objPtr)
 {
 	struct Ann* net= (struct Ann*) objPtr->internalRep.otherValuePtr;
+	struct AnnBusy *b = AnnBusyLookup(net);
 
-	AnnFree(net);
+	if (b)
+		b->orphan = 1;
+	else
+		AnnFree(net);
 }
 
 /* The 'dup' method of the object */
@@ -98,10 +164,10 @@ void DupAnnInternalRep(Tcl_Obj *srcPtr, Tcl_Obj *copyPtr)
 }
 
 /* Helper function for UpdateStringOfAnn() function */
-static void StrAppendListDouble(char **pptr, double *v, int len)
+static void StrAppendListDouble(char **pptr, double *v, size_t len)
 {
 	char *b = *pptr;
-	int i;
+	size_t i;
 
 	*b++ = '{';
 	if (v) {
@@ -133,8 +199,8 @@ void UpdateStringOfAnn(Tcl_Obj *objPtr)
 	/* Guess how many bytes are needed for the representation */
 	for (j = 0; j < LAYERS(net); j++) {
 		int units = UNITS(net,j);
-		int weights;
-		weights = j == 0 ? 0 : WEIGHTS(net,j);
+		size_t weights;
+		weights = j == 0 ? 0 : STORED_WEIGHTS(net,j);
 		/* output and error array */
 		len += 2 * 24 * units;
 		/* weight, gradient, pgradient, delta, sgradient */
@@ -144,13 +210,15 @@ void UpdateStringOfAnn(Tcl_Obj *objPtr)
 	}
 	len += (6 * 24) + 5; /* Final list of parameters */
 	len += 64; /* flags */
+	len += 16 * LAYERS(net) + 4; /* activations */
+	len += 8; /* tied */
 	objPtr->bytes = ckalloc(len);
 	b = (char *) objPtr->bytes;
 	/* Convert to string */
 	for (j = 0; j < LAYERS(net); j++) {
 		int units = UNITS(net,j);
-		int weights;
-		weights = j == 0 ? 0 : WEIGHTS(net,j);
+		size_t weights;
+		weights = j == 0 ? 0 : STORED_WEIGHTS(net,j);
 		*b++ = '{';
 		StrAppendListDouble(&b, net->layer[j].output, units);
 		StrAppendListDouble(&b, net->layer[j].error, units);
@@ -174,16 +242,24 @@ void UpdateStringOfAnn(Tcl_Obj *objPtr)
 	*b++ = '}';
 	*b++ = ' ';
 	/* Net flags */
-	switch(net->flags & ANN_ALGOMASK) {
-	case ANN_BBPROP:	algostr = "bbprop"; break;
-	case ANN_OBPROP:	algostr = "obprop"; break;
-	case ANN_BBPROPM:	algostr = "bbpropm"; break;
-	case ANN_OBPROPM:	algostr = "obpropm"; break;
-	case ANN_RPROP:		algostr = "rprop"; break;
-	default: algostr = "unknown"; break;
-	}
+	algostr = AnnAlgoName(net->flags & ANN_ALGOMASK);
 	memcpy(b, algostr, strlen(algostr));
 	b += strlen(algostr);
+	/* Activations, from the output layer to the last hidden layer */
+	*b++ = ' ';
+	*b++ = '{';
+	for (j = 0; j < LAYERS(net)-1; j++) {
+		char *actstr = AnnActivationName(net->layer[j].activation);
+
+		if (j) *b++ = ' ';
+		memcpy(b, actstr, strlen(actstr));
+		b += strlen(actstr);
+	}
+	*b++ = '}';
+	if (LAYERS(net) > 2 && TIED(net,1)) {
+		memcpy(b, " tied", 5);
+		b += 5;
+	}
 	*b = '\0';
 	objPtr->length = strlen(objPtr->bytes);
 }
@@ -462,65 +538,112 @@ static int AnnCreateObjCmd(ClientData clientData, Tcl_Interp *interp,
 		int objc, Tcl_Obj *CONST objv[])
 {
 	Tcl_Obj *result;
-	int *units = alloca(sizeof(int)*objc-1), i;
+	int *units = alloca(sizeof(int)*objc), i, first = 1;
 	struct Ann *net;
+	Tcl_WideInt seed = 0;
 
-	if (objc < 3) {
-		Tcl_WrongNumArgs(interp, 1, objv, "OutputUnits ?HiddenUnits1 HiddenUnits2 ...? InputUnits");
+	/* With -seed the initial weights are the same on every run */
+	if (objc > 2 && !strcmp(Tcl_GetStringFromObj(objv[1], NULL), "-seed")) {
+		if (Tcl_GetWideIntFromObj(interp, objv[2], &seed) != TCL_OK)
+			return TCL_ERROR;
+		first = 3;
+	}
+	if (objc-first < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-seed Seed? OutputUnits ?HiddenUnits1 HiddenUnits2 ...? InputUnits");
 		return TCL_ERROR;
 	}
 	/* Initialize the units vector used to create the net */
-	for (i = 1; i < objc; i++) {
-		if (Tcl_GetIntFromObj(interp, objv[i], &units[i-1]) != TCL_OK) {
+	for (i = first; i < objc; i++) {
+		if (Tcl_GetIntFromObj(interp, objv[i], &units[i-first]) != TCL_OK) {
 			return TCL_ERROR;
 		}
 	}
 	/* Create the neural net */
 	result = Tcl_GetObjResult(interp);
-	if ((net = AnnCreateNet(objc-1, units)) == NULL) {
+	if ((net = AnnCreateNet(objc-first, units)) == NULL) {
 		Tcl_SetStringObj(result, "Out of memory", -1);
 		return TCL_ERROR;
 	}
+	if (first == 3) {
+		AnnSetSeed(net, (unsigned long long)seed);
+		AnnSetRandomWeights(net);
+	}
 	Tcl_SetAnnObj(result, net);
 	AnnFree(net);
 	return TCL_OK;
 }
 
+/* Store at 'dst' the inputs of the net in the list 'obj'. If 'sparse'
+ * is true the list is made of index/value pairs, and the inputs not
+ * listed are zero. */
+static int AnnGetInputFromObj(Tcl_Interp *interp, struct Ann *net, Tcl_Obj *obj, int sparse, double *dst)
+{
+	int len, j, index;
+	Tcl_Obj *element;
+
+	if (Tcl_ListObjLength(interp, obj, &len) != TCL_OK)
+		return TCL_ERROR;
+	if (!sparse) {
+		if (len != INPUT_UNITS(net)) {
+			Tcl_SetStringObj(Tcl_GetObjResult(interp), "The input list length doesn't match the number of inputs in the neural network", -1);
+			return TCL_ERROR;
+		}
+		for (j = 0; j < len; j++) {
+			if (Tcl_ListObjIndex(interp, obj, j, &element) != TCL_OK ||
+			    Tcl_GetDoubleFromObj(interp, element, &dst[j])
+			    	!= TCL_OK)
+				return TCL_ERROR;
+		}
+		return TCL_OK;
+	}
+	if (len % 2) {
+		Tcl_SetStringObj(Tcl_GetObjResult(interp), "The sparse input list requires an even number of elements", -1);
+		return TCL_ERROR;
+	}
+	memset(dst, 0, sizeof(double)*INPUT_UNITS(net));
+	for (j = 0; j < len; j += 2) {
+		if (Tcl_ListObjIndex(interp, obj, j, &element) != TCL_OK ||
+		    Tcl_GetIntFromObj(interp, element, &index) != TCL_OK)
+			return TCL_ERROR;
+		if (index < 0 || index >= INPUT_UNITS(net)) {
+			Tcl_SetStringObj(Tcl_GetObjResult(interp),
+				"Sparse input index out of range", -1);
+			return TCL_ERROR;
+		}
+		if (Tcl_ListObjIndex(interp, obj, j+1, &element) != TCL_OK ||
+		    Tcl_GetDoubleFromObj(interp, element, &dst[index])
+		    	!= TCL_OK)
+			return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
 static int AnnSimulateObjCmd(ClientData clientData, Tcl_Interp *interp,
 		int objc, Tcl_Obj *CONST objv[])
 {
 	struct Ann *net;
 	Tcl_Obj *varObj, *result;
-	int len, j;
+	int j, sparse = 0, a = 1;
 
-	if (objc != 3) {
-		Tcl_WrongNumArgs(interp, 1, objv, "AnnVar InputList");
+	if (objc == 4 &&
+	    !strcmp(Tcl_GetStringFromObj(objv[1], NULL), "-sparse")) {
+		sparse = 1;
+		a++;
+	}
+	if (objc-a != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-sparse? AnnVar InputList");
 		return TCL_ERROR;
 	}
-	varObj = Tcl_ObjGetVar2(interp, objv[1], NULL, TCL_LEAVE_ERR_MSG);
+	varObj = Tcl_ObjGetVar2(interp, objv[a], NULL, TCL_LEAVE_ERR_MSG);
 	if (!varObj)
 		return TCL_ERROR;
-	if (Tcl_ListObjLength(interp, objv[2], &len) != TCL_OK)
-		return TCL_ERROR;
 	/* Get the neural network object */
 	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
 		return TCL_ERROR;
-	/* Check if the len matches */
-	if (len != INPUT_UNITS(net)) {
-		Tcl_SetStringObj(Tcl_GetObjResult(interp), "The input list length doesn't match the number of inputs in the neural network", -1);
-		return TCL_ERROR;
-	}
 	/* Set the list elements as the neural net inputs */
-	for (j = 0; j < INPUT_UNITS(net); j++) {
-		Tcl_Obj *element;
-		double d;
-
-		if (Tcl_ListObjIndex(interp, objv[2], j, &element) != TCL_OK)
-			return TCL_ERROR;
-		if (Tcl_GetDoubleFromObj(interp, element, &d) != TCL_OK)
-			return TCL_ERROR;
-		INPUT_NODE(net, j) = d;
-	}
+	if (AnnGetInputFromObj(interp, net, objv[a+1], sparse,
+	    &INPUT_NODE(net,0)) != TCL_OK)
+		return TCL_ERROR;
 	/* Simulate! */
 	AnnSimulate(net);
 	Tcl_InvalidateStringRep(varObj);
@@ -552,6 +675,8 @@ static int AnnConfigureObjCmd(ClientData clientData, Tcl_Interp *interp,
 	/* Get the neural network object */
 	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
 		return TCL_ERROR;
+	if (AnnCheckBusy(interp, net) != TCL_OK)
+		return TCL_ERROR;
 	Tcl_InvalidateStringRep(varObj);
 	/* process all the option/value pairs */
 	for (j = 2; j < objc; j += 2) {
@@ -590,23 +715,163 @@ static int AnnConfigureObjCmd(ClientData clientData, Tcl_Interp *interp,
 			RPROP_MINUPDATE(net) = dval;
 		} else if (!strcmp(opt, "-algo")) {
 			char *algo = Tcl_GetStringFromObj(objv[j+1], NULL);
-			int algoid = 0;
-			if (!strcmp(algo, "rprop")) {
-				algoid = ANN_RPROP;
-			} else if (!strcmp(algo, "bbprop")) {
-				algoid = ANN_BBPROP;
-			} else if (!strcmp(algo, "obprop")) {
-				algoid = ANN_OBPROP;
-			} else if (!strcmp(algo, "bbpropm")) {
-				algoid = ANN_BBPROPM;
-			} else if (!strcmp(algo, "obpropm")) {
-				algoid = ANN_OBPROPM;
-			} else {
+			int algoid = AnnAlgoByName(algo);
+
+			if (algoid == 0) {
 				Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
 					"unknown algorithm '", algo, "'", NULL);
 				return TCL_ERROR;
 			}
-			AnnSetLearningAlgo(net, algoid);
+			if (AnnSetLearningAlgo(net, algoid)) {
+				Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+					"can't allocate the state of '", algo,
+					"', out of memory or too many weights", NULL);
+				return TCL_ERROR;
+			}
+		} else if (!strcmp(opt, "-threads")) {
+			int ival;
+			if (Tcl_GetIntFromObj(interp, objv[j+1], &ival)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (ival < 1) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-threads requires a positive value", -1);
+				return TCL_ERROR;
+			}
+			THREADS(net) = ival;
+		} else if (!strcmp(opt, "-sigmoid")) {
+			char *mode = Tcl_GetStringFromObj(objv[j+1], NULL);
+			int sigmoid = AnnSigmoidByName(mode);
+
+			if (sigmoid == -1) {
+				Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+					"unknown sigmoid '", mode, "'", NULL);
+				return TCL_ERROR;
+			}
+			AnnSetSigmoid(net, sigmoid);
+		} else if (!strcmp(opt, "-activation")) {
+			int len, l, act;
+			Tcl_Obj *element;
+
+			/* A single activation for all the layers, or one
+			 * activation for every layer from the output one to
+			 * the last hidden layer. */
+			if (Tcl_ListObjLength(interp, objv[j+1], &len) != TCL_OK)
+				return TCL_ERROR;
+			if (len != 1 && len != LAYERS(net)-1) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-activation requires one activation or one for every non-input layer", -1);
+				return TCL_ERROR;
+			}
+			for (l = 0; l < LAYERS(net)-1; l++) {
+				char *name;
+
+				if (Tcl_ListObjIndex(interp, objv[j+1],
+				    len == 1 ? 0 : l, &element) != TCL_OK)
+					return TCL_ERROR;
+				name = Tcl_GetStringFromObj(element, NULL);
+				if ((act = AnnActivationByName(name)) == -1) {
+					Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+						"unknown activation '", name, "'", NULL);
+					return TCL_ERROR;
+				}
+				AnnSetActivation(net, l, act);
+			}
+		} else if (!strcmp(opt, "-frozen")) {
+			int len, l, t, ival, tval;
+			Tcl_Obj **elements;
+
+			/* One flag for every non-input layer, from the output
+			 * one, freezing the weights feeding the layer. Tied
+			 * layers share the weights, so their flags must match:
+			 * check them all before changing anything. */
+			if (Tcl_ListObjGetElements(interp, objv[j+1], &len,
+			    &elements) != TCL_OK)
+				return TCL_ERROR;
+			if (len != LAYERS(net)-1) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-frozen requires a flag for every non-input layer", -1);
+				return TCL_ERROR;
+			}
+			for (l = 1; l < LAYERS(net); l++) {
+				if (Tcl_GetBooleanFromObj(interp, elements[l-1],
+				    &ival) != TCL_OK)
+					return TCL_ERROR;
+				if ((t = TIED(net,l)) == 0)
+					continue;
+				if (Tcl_GetBooleanFromObj(interp, elements[t-1],
+				    &tval) != TCL_OK)
+					return TCL_ERROR;
+				if (ival != tval) {
+					Tcl_SetStringObj(Tcl_GetObjResult(interp),
+						"-frozen requires the same flag for tied layers", -1);
+					return TCL_ERROR;
+				}
+			}
+			for (l = 1; l < LAYERS(net); l++) {
+				Tcl_GetBooleanFromObj(NULL, elements[l-1], &ival);
+				if (FROZEN(net,l) != ival)
+					AnnSetFrozen(net, l, ival);
+			}
+		} else if (!strcmp(opt, "-cachefrozen")) {
+			int ival;
+			if (Tcl_GetBooleanFromObj(interp, objv[j+1], &ival)
+			    != TCL_OK)
+				return TCL_ERROR;
+			net->cache_frozen = ival;
+		} else if (!strcmp(opt, "-importance")) {
+			if (Tcl_GetDoubleFromObj(interp, objv[j+1], &dval)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (dval < 0 || dval > 1) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-importance requires a fraction in the range 0-1", -1);
+				return TCL_ERROR;
+			}
+			net->importance = dval;
+		} else if (!strcmp(opt, "-importanceevery")) {
+			int ival;
+			if (Tcl_GetIntFromObj(interp, objv[j+1], &ival)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (ival < 1) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-importanceevery requires a positive value", -1);
+				return TCL_ERROR;
+			}
+			net->importance_every = ival;
+		} else if (!strcmp(opt, "-shuffle")) {
+			int ival;
+			if (Tcl_GetBooleanFromObj(interp, objv[j+1], &ival)
+			    != TCL_OK)
+				return TCL_ERROR;
+			net->shuffle = ival;
+		} else if (!strcmp(opt, "-seed")) {
+			Tcl_WideInt seed;
+			if (Tcl_GetWideIntFromObj(interp, objv[j+1], &seed)
+			    != TCL_OK)
+				return TCL_ERROR;
+			AnnSetSeed(net, (unsigned long long)seed);
+		} else if (!strcmp(opt, "-tied")) {
+			int ival;
+			if (Tcl_GetBooleanFromObj(interp, objv[j+1], &ival)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (AnnSetTied(net, ival)) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"can't tie the weights, the net is not symmetric or out of memory", -1);
+				return TCL_ERROR;
+			}
+		} else if (!strcmp(opt, "-stats")) {
+			int ival;
+			if (Tcl_GetIntFromObj(interp, objv[j+1], &ival)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (AnnEnableStats(net, ival)) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"Out of memory", -1);
+				return TCL_ERROR;
+			}
 		} else if (!strcmp(opt, "-scale")) {
 			if (Tcl_GetDoubleFromObj(interp, objv[j+1], &dval)
 			    != TCL_OK)
@@ -621,109 +886,1331 @@ static int AnnConfigureObjCmd(ClientData clientData, Tcl_Interp *interp,
 	return TCL_OK;
 }
 
-/* ann::train annVar datasetListValue maxEpochs ?maxError? */
-static int AnnTrainObjCmd(ClientData clientData, Tcl_Interp *interp,
-		int objc, Tcl_Obj *CONST objv[])
+/* Convert the dataset from a Tcl list {input target input target ...}
+ * to a training set stored as 'type' (one of ANN_DATA_*), integer values
+ * being mapped to doubles as raw*scale+offset. If 'sparse' is true the
+ * inputs are lists of index/value pairs. On success the set, that
+ * must be released with AnnDatasetFree(), is stored in 'dsp'. */
+static int AnnGetDatasetFromObj(Tcl_Interp *interp, struct Ann *net, Tcl_Obj *obj, int type, double scale, double offset, int sparse, struct AnnDataset **dsp)
 {
-	struct Ann *net;
-	Tcl_Obj *varObj;
-	int j, maxepochs, setlen;
-	double maxerr = 0, *input = NULL, *target = NULL, *ip, *tp;
+	int j, setlen;
+	double *sample;
+	struct AnnDataset *ds;
+	ANN_PROF_START(prof);
 
-	if (objc != 4 && objc != 5) {
-		Tcl_WrongNumArgs(interp, 1, objv, "AnnVar DataSetListValue MaxEpochs ?MaxError?");
-		return TCL_ERROR;
-	}
-	varObj = Tcl_ObjGetVar2(interp, objv[1], NULL, TCL_LEAVE_ERR_MSG);
-	if (!varObj)
-		return TCL_ERROR;
-	/* Get the neural network object */
-	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
-		return TCL_ERROR;
-	Tcl_InvalidateStringRep(varObj);
-	/* Extract parameters from Tcl objects */
-	if (Tcl_GetIntFromObj(interp, objv[3], &maxepochs) != TCL_OK)
-		return TCL_ERROR;
-	if (objc == 5 && Tcl_GetDoubleFromObj(interp, objv[4], &maxerr) != TCL_OK)
-		return TCL_ERROR;
-	if (Tcl_ListObjLength(interp, objv[2], &setlen) != TCL_OK)
+	if (Tcl_ListObjLength(interp, obj, &setlen) != TCL_OK)
 		return TCL_ERROR;
 	if (setlen % 2) {
 		Tcl_SetStringObj(Tcl_GetObjResult(interp), "The dataset list requires an even number of elements", -1);
 		return TCL_ERROR;
 	}
-	/* Convert the dataset from a Tcl list to two C arrays of doubles. */
-	ip = input = malloc(INPUT_UNITS(net)*sizeof(double)*(setlen/2));
-	tp = target = malloc(OUTPUT_UNITS(net)*sizeof(double)*(setlen/2));
-	if (!input || !target) {
-		free(input);
-		free(target);
+	ds = AnnDatasetCreate(type, setlen/2, INPUT_UNITS(net),
+			OUTPUT_UNITS(net), scale, offset);
+	sample = malloc(sizeof(double)*(INPUT_UNITS(net)+OUTPUT_UNITS(net)));
+	if (!ds || !sample) {
+		if (ds)
+			AnnDatasetFree(ds);
+		free(sample);
 		Tcl_SetStringObj(Tcl_GetObjResult(interp),
-				"Out of memory in AnnLearnObjCmd()", -1);
+				"Out of memory in AnnGetDatasetFromObj()", -1);
 		return TCL_ERROR;
 	}
 	for (j = 0; j < setlen; j++) {
 		int l, explen, i;
 		Tcl_Obj *sublist;
+		double *dst;
 
-		if (Tcl_ListObjIndex(interp, objv[2], j, &sublist) != TCL_OK)
-			return TCL_ERROR;
+		if (Tcl_ListObjIndex(interp, obj, j, &sublist) != TCL_OK)
+			goto err;
+		if (!(j&1)) {
+			if (AnnGetInputFromObj(interp, net, sublist, sparse,
+			    sample) != TCL_OK)
+				goto err;
+			continue;
+		}
 		if (Tcl_ListObjLength(interp, sublist, &l) != TCL_OK)
-			return TCL_ERROR;
-		explen = (j&1) ? OUTPUT_UNITS(net) : INPUT_UNITS(net);
+			goto err;
+		explen = OUTPUT_UNITS(net);
 		if (l != explen) {
-			free(input);
-			free(target);
 			Tcl_SetStringObj(Tcl_GetObjResult(interp),
 				"Dataset doesn't match input/output units", -1);
-			return TCL_ERROR;
+			goto err;
 		}
-		/* Append the data to one of the arrays */
+		/* Collect the target of the sample */
+		dst = sample+INPUT_UNITS(net);
 		for (i = 0; i < l; i++) {
 			Tcl_Obj *element;
-			double t;
 
 			if (Tcl_ListObjIndex(interp, sublist, i, &element)
 			    	!= TCL_OK ||
-			    Tcl_GetDoubleFromObj(interp, element, &t)
+			    Tcl_GetDoubleFromObj(interp, element, &dst[i])
 			    	!= TCL_OK)
-			{
-				free(input);
-				free(target);
-				return TCL_ERROR;
-			}
-			if (j&1)
-				*tp++ = t;
-			else
-				*ip++ = t;
+				goto err;
 		}
+		AnnDatasetSetSample(ds, j/2, sample, sample+INPUT_UNITS(net));
 	}
-	/* Training */
-	j = AnnTrain(net, input, target, maxerr, maxepochs, setlen/2);
-	free(input);
-	free(target);
-	Tcl_SetIntObj(Tcl_GetObjResult(interp), j);
+	ANN_PROF_END(net, ANN_PROF_TCLCONV, prof, 0, AnnDatasetBytes(ds));
+	free(sample);
+	*dsp = ds;
 	return TCL_OK;
+err:
+	AnnDatasetFree(ds);
+	free(sample);
+	return TCL_ERROR;
 }
 
-/* -------------------------------  Initialization -------------------------- */
-int Tclgnegnu_Init(Tcl_Interp *interp)
+/* State of the Tcl training callback */
+struct AnnTclCallback {
+	Tcl_Interp *interp;
+	Tcl_Obj *script;
+	int code;		/* Tcl return code of the last call */
+};
+
+/* AnnTrain() callback: evaluate the script with the epoch number, the
+ * max and the mean error appended. Training stops if the script returns
+ * a true value, uses 'break', or raises an error. */
+static int AnnTclTrainCallback(struct Ann *net, struct AnnEpochStats *st, void *privdata)
 {
-	if (Tcl_InitStubs(interp, "8.0", 0) == NULL)
+	struct AnnTclCallback *cb = privdata;
+	Tcl_Obj *script = Tcl_DuplicateObj(cb->script);
+	int stop = 0;
+
+	Tcl_IncrRefCount(script);
+	Tcl_ListObjAppendElement(cb->interp, script, Tcl_NewIntObj(st->epoch));
+	Tcl_ListObjAppendElement(cb->interp, script, Tcl_NewDoubleObj(st->maxerr));
+	Tcl_ListObjAppendElement(cb->interp, script, Tcl_NewDoubleObj(st->meanerr));
+	cb->code = Tcl_EvalObjEx(cb->interp, script, TCL_EVAL_GLOBAL);
+	Tcl_DecrRefCount(script);
+	if (cb->code == TCL_OK) {
+		Tcl_Obj *res = Tcl_GetObjResult(cb->interp);
+		if (Tcl_GetCharLength(res) &&
+		    Tcl_GetBooleanFromObj(NULL, res, &stop) != TCL_OK)
+			stop = 0;
+	} else {
+		stop = 1;
+	}
+	return stop;
+}
+
+/* ------------------------ Background training jobs ------------------------ */
+
+/* 'ann::train -async' trains a private copy of the net in a new thread.
+ * Every N epochs the thread publishes a snapshot of the weights, that
+ * can be fetched with 'ann::job weights' without to stop training, and
+ * queues a progress event into the event loop of the thread that
+ * started the job. */
+
+#define ANN_JOB_RUNNING 0
+#define ANN_JOB_PAUSED 1
+#define ANN_JOB_CANCELLED 2
+#define ANN_JOB_DONE 3
+
+static char *annJobStates[] = {"running", "paused", "cancelled", "done"};
+
+struct AnnJob {
+	int id;
+	Tcl_Interp *interp;
+	Tcl_ThreadId owner;	/* thread that receives the events */
+	Tcl_ThreadId thread;	/* training thread */
+	int joined;		/* training thread already joined */
+	Tcl_Mutex lock;		/* protects the fields below */
+	Tcl_Condition cond;	/* signaled when the job is resumed */
+	int state;
+	struct Ann *snapshot;	/* latest published weights */
+	struct AnnEpochStats last; /* stats of the last published epoch */
+	int result;		/* AnnTrain() return value once done */
+	/* Fields only used by the training thread */
+	struct Ann *net;
+	struct AnnDataset *ds;
+	struct AnnDataset *validation; /* validation set of 'net', or NULL */
+	int maxepochs;
+	double maxerr;
+	/* Scripts, only accessed by the owner thread */
+	Tcl_Obj *progress;	/* called every -every epochs */
+	Tcl_Obj *command;	/* called when training ends */
+};
+
+struct AnnJobEvent {
+	Tcl_Event header;
+	int id;
+	int done;
+	struct AnnEpochStats st;
+};
+
+/* The jobs of the interpreters of all the threads, by id, protected by
+ * annJobsLock. A job is only visible to the interpreter that started
+ * it, so it is only freed by the thread of that interpreter. */
+static Tcl_HashTable annJobs;
+static int annJobsReady = 0;	/* annJobs initialized */
+static int annJobNextId = 1;
+TCL_DECLARE_MUTEX(annJobsLock)
+
+/* Return the job with the given id, or NULL */
+static struct AnnJob *AnnJobLookup(int id)
+{
+	Tcl_HashEntry *entry;
+	struct AnnJob *job = NULL;
+
+	Tcl_MutexLock(&annJobsLock);
+	entry = Tcl_FindHashEntry(&annJobs, (char*) (long) id);
+	if (entry)
+		job = Tcl_GetHashValue(entry);
+	Tcl_MutexUnlock(&annJobsLock);
+	return job;
+}
+
+/* Event handler, called in the owner thread event loop */
+static int AnnJobEventProc(Tcl_Event *evPtr, int flags)
+{
+	struct AnnJobEvent *ev = (struct AnnJobEvent*) evPtr;
+	struct AnnJob *job;
+	Tcl_Obj *script;
+	Tcl_Interp *interp;
+	char name[32];
+
+	/* The job or its interpreter may have been deleted in the meantime */
+	if ((job = AnnJobLookup(ev->id)) == NULL ||
+	    Tcl_InterpDeleted(job->interp))
+		return 1;
+	script = ev->done ? job->command : job->progress;
+	if (script == NULL)
+		return 1;
+	interp = job->interp;
+	sprintf(name, "annjob%d", job->id);
+	script = Tcl_DuplicateObj(script);
+	Tcl_IncrRefCount(script);
+	Tcl_ListObjAppendElement(interp, script, Tcl_NewStringObj(name, -1));
+	Tcl_ListObjAppendElement(interp, script, Tcl_NewIntObj(ev->st.epoch));
+	Tcl_ListObjAppendElement(interp, script, Tcl_NewDoubleObj(ev->st.maxerr));
+	Tcl_ListObjAppendElement(interp, script, Tcl_NewDoubleObj(ev->st.meanerr));
+	Tcl_Preserve((ClientData) interp);
+	if (Tcl_EvalObjEx(interp, script, TCL_EVAL_GLOBAL) != TCL_OK)
+		Tcl_BackgroundError(interp);
+	Tcl_Release((ClientData) interp);
+	Tcl_DecrRefCount(script);
+	return 1;
+}
+
+/* Queue an event for the owner thread of the job */
+static void AnnJobPost(struct AnnJob *job, int done, struct AnnEpochStats *st)
+{
+	struct AnnJobEvent *ev = (struct AnnJobEvent*) ckalloc(sizeof(*ev));
+
+	ev->header.proc = AnnJobEventProc;
+	ev->id = job->id;
+	ev->done = done;
+	ev->st = *st;
+	Tcl_ThreadQueueEvent(job->owner, (Tcl_Event*) ev, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(job->owner);
+}
+
+/* AnnTrain() callback of the training thread: publish the weights,
+ * wait while the job is paused, and stop if it was cancelled. */
+static int AnnJobCallback(struct Ann *net, struct AnnEpochStats *st, void *privdata)
+{
+	struct AnnJob *job = privdata;
+	int stop;
+
+	Tcl_MutexLock(&job->lock);
+	AnnCopyWeights(job->snapshot, net);
+	job->last = *st;
+	while (job->state == ANN_JOB_PAUSED)
+		Tcl_ConditionWait(&job->cond, &job->lock, NULL);
+	stop = job->state == ANN_JOB_CANCELLED;
+	Tcl_MutexUnlock(&job->lock);
+	if (job->progress)
+		AnnJobPost(job, 0, st);
+	return stop;
+}
+
+static Tcl_ThreadCreateType AnnJobThread(ClientData clientData)
+{
+	struct AnnJob *job = (struct AnnJob*) clientData;
+	struct AnnEpochStats last;
+	int result;
+
+	result = AnnTrainDataset(job->net, job->ds, job->maxerr,
+			job->maxepochs);
+	Tcl_MutexLock(&job->lock);
+	AnnCopyWeights(job->snapshot, job->net);
+	job->result = result;
+	if (job->state != ANN_JOB_CANCELLED)
+		job->state = ANN_JOB_DONE;
+	last = job->last;
+	Tcl_MutexUnlock(&job->lock);
+	if (job->command)
+		AnnJobPost(job, 1, &last);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* Free a job, stopping the training thread if needed */
+static void AnnJobFree(struct AnnJob *job)
+{
+	Tcl_HashEntry *entry;
+	int rc;
+
+	Tcl_MutexLock(&job->lock);
+	if (job->state != ANN_JOB_DONE)
+		job->state = ANN_JOB_CANCELLED;
+	Tcl_ConditionNotify(&job->cond);
+	Tcl_MutexUnlock(&job->lock);
+	if (!job->joined)
+		Tcl_JoinThread(job->thread, &rc);
+	Tcl_MutexLock(&annJobsLock);
+	entry = Tcl_FindHashEntry(&annJobs, (char*) (long) job->id);
+	if (entry)
+		Tcl_DeleteHashEntry(entry);
+	Tcl_MutexUnlock(&annJobsLock);
+	if (job->net)
+		AnnFree(job->net);
+	if (job->snapshot)
+		AnnFree(job->snapshot);
+	if (job->ds)
+		AnnDatasetFree(job->ds);
+	if (job->validation)
+		AnnDatasetFree(job->validation);
+	if (job->progress)
+		Tcl_DecrRefCount(job->progress);
+	if (job->command)
+		Tcl_DecrRefCount(job->command);
+	Tcl_MutexFinalize(&job->lock);
+	Tcl_ConditionFinalize(&job->cond);
+	ckfree((char*) job);
+}
+
+/* Called when an interpreter is deleted: free its jobs, since the
+ * events of their threads could no longer be delivered. */
+static void AnnJobInterpDeleted(ClientData clientData, Tcl_Interp *interp)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *entry;
+	struct AnnJob *job;
+
+	do {
+		Tcl_MutexLock(&annJobsLock);
+		for (entry = Tcl_FirstHashEntry(&annJobs, &search); entry;
+		     entry = Tcl_NextHashEntry(&search)) {
+			job = Tcl_GetHashValue(entry);
+			if (job->interp == interp)
+				break;
+		}
+		Tcl_MutexUnlock(&annJobsLock);
+		/* AnnJobFree() removes the job from the table */
+		if (entry)
+			AnnJobFree(job);
+	} while (entry);
+}
+
+/* Start a training job. The job takes ownership of the datasets 'ds'
+ * and 'vds', the validation set (NULL if not used). On success the job
+ * name is set as result. */
+static int AnnJobStart(Tcl_Interp *interp, struct Ann *net, struct AnnDataset *ds, struct AnnDataset *vds, int maxepochs, double maxerr, int every, Tcl_Obj *progress, Tcl_Obj *command)
+{
+	struct AnnJob *job = (struct AnnJob*) ckalloc(sizeof(*job));
+	Tcl_HashEntry *entry;
+	char name[32];
+	int new;
+
+	memset(job, 0, sizeof(*job));
+	job->interp = interp;
+	job->owner = Tcl_GetCurrentThread();
+	job->joined = 1; /* until the thread is created */
+	job->state = ANN_JOB_RUNNING;
+	job->ds = ds;
+	job->validation = vds;
+	job->maxepochs = maxepochs;
+	job->maxerr = maxerr;
+	job->progress = progress;
+	job->command = command;
+	if (progress)
+		Tcl_IncrRefCount(progress);
+	if (command)
+		Tcl_IncrRefCount(command);
+	Tcl_MutexLock(&annJobsLock);
+	job->id = annJobNextId++;
+	entry = Tcl_CreateHashEntry(&annJobs, (char*) (long) job->id, &new);
+	Tcl_SetHashValue(entry, job);
+	Tcl_MutexUnlock(&annJobsLock);
+	job->net = AnnClone(net);
+	job->snapshot = AnnClone(net);
+	if (job->net == NULL || job->snapshot == NULL ||
+	    AnnSetCheckpoint(job->net, net->checkpoint, net->checkpoint_every,
+			     net->checkpoint_seconds)) {
+		AnnJobFree(job);
+		Tcl_SetStringObj(Tcl_GetObjResult(interp), "Out of memory", -1);
 		return TCL_ERROR;
-	if (Tcl_PkgRequire(interp, "Tcl", TCL_VERSION, 0) == NULL)
+	}
+	AnnSetValidation(job->net, vds, net->validate_every, net->patience);
+	job->net->callback = AnnJobCallback;
+	job->net->cbdata = job;
+	job->net->cbevery = every;
+	if (Tcl_CreateThread(&job->thread, AnnJobThread, (ClientData) job,
+			TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK)
+	{
+		AnnJobFree(job);
+		Tcl_SetStringObj(Tcl_GetObjResult(interp),
+			"can't create the training thread", -1);
 		return TCL_ERROR;
-	if (Tcl_PkgProvide(interp, "tclgnegnu", VERSION) != TCL_OK)
+	}
+	job->joined = 0;
+	sprintf(name, "annjob%d", job->id);
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+	return TCL_OK;
+}
+
+/* Lookup a job of the interpreter by name */
+static int AnnGetJobFromObj(Tcl_Interp *interp, Tcl_Obj *obj, struct AnnJob **jobp)
+{
+	char *name = Tcl_GetStringFromObj(obj, NULL);
+	struct AnnJob *job = NULL;
+	int id;
+
+	if (sscanf(name, "annjob%d", &id) == 1)
+		job = AnnJobLookup(id);
+	if (job == NULL || job->interp != interp) {
+		Tcl_ResetResult(interp);
+		Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+			"no such training job '", name, "'", NULL);
 		return TCL_ERROR;
-	Tcl_Eval(interp, "namespace eval ann {}");
-	Tcl_CreateObjCommand(interp, "ann::create", AnnCreateObjCmd,
-			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
-	Tcl_CreateObjCommand(interp, "ann::simulate", AnnSimulateObjCmd,
-			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
-	Tcl_CreateObjCommand(interp, "ann::configure", AnnConfigureObjCmd,
-			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
-	Tcl_CreateObjCommand(interp, "ann::train", AnnTrainObjCmd,
-			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
-	/* Private data initialization here */
+	}
+	*jobp = job;
+	return TCL_OK;
+}
+
+/* ann::job status|pause|resume|cancel|weights|result|wait|delete jobName
+ * ann::job list */
+static int AnnJobObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct AnnJob *job;
+	Tcl_Obj *result = Tcl_GetObjResult(interp);
+	char *sub;
+	int rc;
+
+	if (objc == 2 && !strcmp(Tcl_GetStringFromObj(objv[1], NULL), "list")) {
+		Tcl_HashSearch search;
+		Tcl_HashEntry *entry;
+
+		Tcl_SetListObj(result, 0, NULL);
+		Tcl_MutexLock(&annJobsLock);
+		for (entry = Tcl_FirstHashEntry(&annJobs, &search); entry;
+		     entry = Tcl_NextHashEntry(&search)) {
+			char name[32];
+
+			job = Tcl_GetHashValue(entry);
+			if (job->interp != interp)
+				continue;
+			sprintf(name, "annjob%d", job->id);
+			Tcl_ListObjAppendElement(interp, result,
+				Tcl_NewStringObj(name, -1));
+		}
+		Tcl_MutexUnlock(&annJobsLock);
+		return TCL_OK;
+	}
+	if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "status|pause|resume|cancel|weights|result|wait|delete JobName");
+		return TCL_ERROR;
+	}
+	sub = Tcl_GetStringFromObj(objv[1], NULL);
+	if (AnnGetJobFromObj(interp, objv[2], &job) != TCL_OK)
+		return TCL_ERROR;
+	if (!strcmp(sub, "status")) {
+		Tcl_MutexLock(&job->lock);
+		Tcl_SetListObj(result, 0, NULL);
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("state", -1));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj(annJobStates[job->state], -1));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("epoch", -1));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewIntObj(job->last.epoch));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("maxerr", -1));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewDoubleObj(job->last.maxerr));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("meanerr", -1));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewDoubleObj(job->last.meanerr));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("result", -1));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewIntObj(job->result));
+		Tcl_MutexUnlock(&job->lock);
+	} else if (!strcmp(sub, "pause") || !strcmp(sub, "resume") ||
+		   !strcmp(sub, "cancel")) {
+		Tcl_MutexLock(&job->lock);
+		if (job->state != ANN_JOB_DONE && job->state != ANN_JOB_CANCELLED) {
+			if (sub[0] == 'p')
+				job->state = ANN_JOB_PAUSED;
+			else if (sub[0] == 'r')
+				job->state = ANN_JOB_RUNNING;
+			else
+				job->state = ANN_JOB_CANCELLED;
+			Tcl_ConditionNotify(&job->cond);
+		}
+		Tcl_MutexUnlock(&job->lock);
+	} else if (!strcmp(sub, "weights")) {
+		struct Ann *copy;
+
+		Tcl_MutexLock(&job->lock);
+		copy = AnnClone(job->snapshot);
+		Tcl_MutexUnlock(&job->lock);
+		if (copy == NULL) {
+			Tcl_SetStringObj(result, "Out of memory", -1);
+			return TCL_ERROR;
+		}
+		result = Tcl_NewObj();
+		Tcl_SetAnnObj(result, copy);
+		AnnFree(copy);
+		Tcl_SetObjResult(interp, result);
+	} else if (!strcmp(sub, "result")) {
+		if (!job->joined) {
+			Tcl_SetStringObj(result, "the job is still running, use 'ann::job wait' first", -1);
+			return TCL_ERROR;
+		}
+		result = Tcl_NewObj();
+		Tcl_SetAnnObj(result, job->net);
+		Tcl_SetObjResult(interp, result);
+	} else if (!strcmp(sub, "wait")) {
+		int paused;
+
+		/* A paused job would never end */
+		Tcl_MutexLock(&job->lock);
+		paused = job->state == ANN_JOB_PAUSED;
+		Tcl_MutexUnlock(&job->lock);
+		if (paused) {
+			Tcl_SetStringObj(result, "the job is paused, use 'ann::job resume' first", -1);
+			return TCL_ERROR;
+		}
+		if (!job->joined) {
+			Tcl_JoinThread(job->thread, &rc);
+			job->joined = 1;
+		}
+		Tcl_SetIntObj(result, job->result);
+	} else if (!strcmp(sub, "delete")) {
+		AnnJobFree(job);
+	} else {
+		Tcl_AppendStringsToObj(result, "unknown subcommand '", sub,
+			"'", NULL);
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+/* ann::train ?-callback script? ?-every epochs? ?-async? ?-progress script?
+ *            ?-command script? ?-store double|u8|u16? ?-datascale scale?
+ *            ?-dataoffset offset? ?-sparse? ?-dedup tolerance?
+ *            ?-checkpoint filename? ?-checkpointevery epochs?
+ *            ?-checkpointseconds seconds? ?-validation datasetListValue?
+ *            ?-validateevery epochs? ?-patience evaluations?
+ *            annVar datasetListValue
+ *            maxEpochs ?maxError?
+ * With -store u8 or u16 the dataset is kept as raw*scale+offset integers
+ * and expanded to doubles one sample at a time during training. With
+ * -sparse the inputs are given as {index value index value ...} lists,
+ * the inputs not listed being zero. With -dedup the samples that are
+ * the same within the given tolerance are merged into a single sample
+ * weighted by their number, see AnnDatasetDedup(). With -checkpoint
+ * the net and its training state are saved in the file every
+ * -checkpointevery epochs and/or -checkpointseconds seconds (by default
+ * every 100 epochs) and when training ends: a net loaded from the file
+ * with ann::load continues training from there, see AnnCheckpoint().
+ * With -validation the net is evaluated on the given samples every
+ * -validateevery epochs while training, training stops after -patience
+ * evaluations that don't improve the validation error, and the net is
+ * set to the weights with the lowest one, see AnnSetValidation(). */
+static int AnnTrainObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann *net;
+	Tcl_Obj *varObj, *progress = NULL, *command = NULL;
+	int j, maxepochs, every = 1, async = 0, a = 1, store = ANN_DATA_DOUBLE;
+	int sparse = 0, ckevery = 0, valevery = 1, patience = 0;
+	double maxerr = 0, datascale = -1, dataoffset = 0, dedup = -1;
+	double ckseconds = 0;
+	char *checkpoint = NULL;
+	struct AnnDataset *ds, *vds = NULL;
+	Tcl_Obj *validation = NULL;
+	struct AnnTclCallback cb;
+	struct AnnBusy busy;
+	int ckerrno, orphan;
+
+	/* Parse the options */
+	cb.interp = interp;
+	cb.script = NULL;
+	cb.code = TCL_OK;
+	for (; a < objc; a++) {
+		char *opt = Tcl_GetStringFromObj(objv[a], NULL);
+
+		if (opt[0] != '-')
+			break;
+		if (!strcmp(opt, "-async")) {
+			async = 1;
+			continue;
+		}
+		if (!strcmp(opt, "-sparse")) {
+			sparse = 1;
+			continue;
+		}
+		if (a+1 == objc)
+			goto wrongargs;
+		if (!strcmp(opt, "-callback")) {
+			cb.script = objv[++a];
+		} else if (!strcmp(opt, "-progress")) {
+			progress = objv[++a];
+		} else if (!strcmp(opt, "-command")) {
+			command = objv[++a];
+		} else if (!strcmp(opt, "-every")) {
+			if (Tcl_GetIntFromObj(interp, objv[++a], &every) != TCL_OK)
+				return TCL_ERROR;
+			if (every < 1) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-every requires a positive value", -1);
+				return TCL_ERROR;
+			}
+		} else if (!strcmp(opt, "-store")) {
+			char *type = Tcl_GetStringFromObj(objv[++a], NULL);
+
+			if (!strcmp(type, "double")) {
+				store = ANN_DATA_DOUBLE;
+			} else if (!strcmp(type, "u8")) {
+				store = ANN_DATA_U8;
+			} else if (!strcmp(type, "u16")) {
+				store = ANN_DATA_U16;
+			} else {
+				Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+					"unknown storage type '", type,
+					"', must be double, u8 or u16", NULL);
+				return TCL_ERROR;
+			}
+		} else if (!strcmp(opt, "-datascale")) {
+			if (Tcl_GetDoubleFromObj(interp, objv[++a], &datascale)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (datascale <= 0) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-datascale requires a positive value", -1);
+				return TCL_ERROR;
+			}
+		} else if (!strcmp(opt, "-dataoffset")) {
+			if (Tcl_GetDoubleFromObj(interp, objv[++a], &dataoffset)
+			    != TCL_OK)
+				return TCL_ERROR;
+		} else if (!strcmp(opt, "-dedup")) {
+			if (Tcl_GetDoubleFromObj(interp, objv[++a], &dedup)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (dedup < 0) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-dedup requires a non negative tolerance", -1);
+				return TCL_ERROR;
+			}
+		} else if (!strcmp(opt, "-checkpoint")) {
+			checkpoint = Tcl_GetStringFromObj(objv[++a], NULL);
+		} else if (!strcmp(opt, "-checkpointevery")) {
+			if (Tcl_GetIntFromObj(interp, objv[++a], &ckevery)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (ckevery < 1) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-checkpointevery requires a positive value", -1);
+				return TCL_ERROR;
+			}
+		} else if (!strcmp(opt, "-checkpointseconds")) {
+			if (Tcl_GetDoubleFromObj(interp, objv[++a], &ckseconds)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (ckseconds <= 0) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-checkpointseconds requires a positive value", -1);
+				return TCL_ERROR;
+			}
+		} else if (!strcmp(opt, "-validation")) {
+			validation = objv[++a];
+		} else if (!strcmp(opt, "-validateevery")) {
+			if (Tcl_GetIntFromObj(interp, objv[++a], &valevery)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (valevery < 1) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-validateevery requires a positive value", -1);
+				return TCL_ERROR;
+			}
+		} else if (!strcmp(opt, "-patience")) {
+			if (Tcl_GetIntFromObj(interp, objv[++a], &patience)
+			    != TCL_OK)
+				return TCL_ERROR;
+			if (patience < 0) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"-patience requires a non negative value", -1);
+				return TCL_ERROR;
+			}
+		} else {
+			Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+				"unknown option '", opt, "'", NULL);
+			return TCL_ERROR;
+		}
+	}
+	if (objc-a != 3 && objc-a != 4) {
+wrongargs:
+		Tcl_WrongNumArgs(interp, 1, objv, "?-callback Script? ?-every Epochs? ?-async? ?-progress Script? ?-command Script? ?-store double|u8|u16? ?-datascale Scale? ?-dataoffset Offset? ?-sparse? ?-dedup Tolerance? ?-checkpoint Filename? ?-checkpointevery Epochs? ?-checkpointseconds Seconds? ?-validation DataSetListValue? ?-validateevery Epochs? ?-patience Evaluations? AnnVar DataSetListValue MaxEpochs ?MaxError?");
+		return TCL_ERROR;
+	}
+	if (async && cb.script) {
+		Tcl_SetStringObj(Tcl_GetObjResult(interp),
+			"-callback can't be used with -async, use -progress", -1);
+		return TCL_ERROR;
+	}
+	if (checkpoint && !ckevery && !ckseconds)
+		ckevery = DEFAULT_CHECKPOINT_EVERY;
+	varObj = Tcl_ObjGetVar2(interp, objv[a], NULL, TCL_LEAVE_ERR_MSG);
+	if (!varObj)
+		return TCL_ERROR;
+	/* Get the neural network object */
+	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
+		return TCL_ERROR;
+	if (AnnCheckBusy(interp, net) != TCL_OK)
+		return TCL_ERROR;
+	/* Extract parameters from Tcl objects */
+	if (Tcl_GetIntFromObj(interp, objv[a+2], &maxepochs) != TCL_OK)
+		return TCL_ERROR;
+	if (objc-a == 4 &&
+	    Tcl_GetDoubleFromObj(interp, objv[a+3], &maxerr) != TCL_OK)
+		return TCL_ERROR;
+	/* By default integer storage covers the [0,1] range */
+	if (datascale < 0)
+		datascale = store == ANN_DATA_U16 ? 1.0/65535 : 1.0/255;
+	if (AnnGetDatasetFromObj(interp, net, objv[a+1], store, datascale,
+				 dataoffset, sparse, &ds) != TCL_OK)
+		return TCL_ERROR;
+	if (dedup >= 0) {
+		struct AnnDataset *dd = AnnDatasetDedup(ds, dedup);
+
+		AnnDatasetFree(ds);
+		if (dd == NULL) {
+			Tcl_SetStringObj(Tcl_GetObjResult(interp),
+				"Out of memory", -1);
+			return TCL_ERROR;
+		}
+		ds = dd;
+	}
+	if (validation && AnnGetDatasetFromObj(interp, net, validation, store,
+				datascale, dataoffset, sparse, &vds) != TCL_OK) {
+		AnnDatasetFree(ds);
+		return TCL_ERROR;
+	}
+	if (checkpoint && AnnSetCheckpoint(net, checkpoint, ckevery, ckseconds)) {
+		AnnDatasetFree(ds);
+		if (vds)
+			AnnDatasetFree(vds);
+		Tcl_SetStringObj(Tcl_GetObjResult(interp), "Out of memory", -1);
+		return TCL_ERROR;
+	}
+	/* Background training works on a copy, the variable is untouched */
+	if (async) {
+		int retval;
+
+		AnnSetValidation(net, NULL, valevery, patience);
+		retval = AnnJobStart(interp, net, ds, vds,
+				maxepochs, maxerr, every, progress, command);
+		AnnSetCheckpoint(net, NULL, 0, 0);
+		AnnSetValidation(net, NULL, 1, 0);
+		return retval;
+	}
+	AnnSetValidation(net, vds, valevery, patience);
+	/* Training. The callback may change or unset the variable: hold
+	 * the object and mark the net as busy until training is over. */
+	if (cb.script) {
+		net->callback = AnnTclTrainCallback;
+		net->cbdata = &cb;
+		net->cbevery = every;
+	}
+	Tcl_IncrRefCount(varObj);
+	AnnBusyPush(&busy, net);
+	j = AnnTrainDataset(net, ds, maxerr, maxepochs);
+	net->callback = NULL;
+	net->cbdata = NULL;
+	AnnSetValidation(net, NULL, 1, 0);
+	AnnDatasetFree(ds);
+	if (vds)
+		AnnDatasetFree(vds);
+	ckerrno = net->checkpoint_errno;
+	AnnSetCheckpoint(net, NULL, 0, 0);
+	orphan = AnnBusyPop(&busy);
+	if (!orphan)
+		Tcl_InvalidateStringRep(varObj);
+	Tcl_DecrRefCount(varObj);
+	if (cb.code == TCL_ERROR)
+		return TCL_ERROR;
+	/* The result of the callback is still set */
+	Tcl_ResetResult(interp);
+	if (orphan) {
+		Tcl_SetStringObj(Tcl_GetObjResult(interp),
+			"the net was released while training", -1);
+		return TCL_ERROR;
+	}
+	if (ckerrno) {
+		Tcl_SetErrno(ckerrno);
+		Tcl_AppendResult(interp, "can't write the checkpoint: ",
+			Tcl_PosixError(interp), NULL);
+		return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(j));
+	return TCL_OK;
+}
+
+/* ann::sweep ?-threads N? ?-rung Epochs? ?-eta N? AnnVarList DataSetListValue MaxEpochs ?MaxError?
+ * Train all the nets stored in the listed variables concurrently on the
+ * same dataset, see AnnTrainSweep(). With -rung the nets losing against
+ * the others are stopped early, the same ones with any -threads value.
+ * Return a list with the name of the
+ * variable holding the net with the lowest error after "best", and after
+ * "nets" the outcome of every net as a key/value list. */
+static char *annSweepStatus[] = {"converged", "maxepochs", "stopped"};
+
+static int AnnSweepObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann **nets = NULL;
+	struct AnnSweepResult *res = NULL;
+	struct AnnDataset *ds;
+	Tcl_Obj **vars, *result, *list;
+	int j, k, n, maxepochs, a = 1, threads = 1, rung = 0, eta = ANN_SWEEP_ETA;
+	int best, retval = TCL_ERROR;
+	double maxerr = 0;
+
+	for (; a+1 < objc; a += 2) {
+		char *opt = Tcl_GetStringFromObj(objv[a], NULL);
+		int *dst;
+
+		if (opt[0] != '-')
+			break;
+		if (!strcmp(opt, "-threads")) {
+			dst = &threads;
+		} else if (!strcmp(opt, "-rung")) {
+			dst = &rung;
+		} else if (!strcmp(opt, "-eta")) {
+			dst = &eta;
+		} else {
+			Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+				"unknown option '", opt, "'", NULL);
+			return TCL_ERROR;
+		}
+		if (Tcl_GetIntFromObj(interp, objv[a+1], dst) != TCL_OK)
+			return TCL_ERROR;
+	}
+	if (objc-a != 3 && objc-a != 4) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-threads N? ?-rung Epochs? ?-eta N? AnnVarList DataSetListValue MaxEpochs ?MaxError?");
+		return TCL_ERROR;
+	}
+	if (threads < 1 || rung < 0 || eta < 2) {
+		Tcl_SetStringObj(Tcl_GetObjResult(interp),
+			"-threads and -rung require a positive value, -eta at least 2", -1);
+		return TCL_ERROR;
+	}
+	if (Tcl_ListObjGetElements(interp, objv[a], &n, &vars) != TCL_OK ||
+	    Tcl_GetIntFromObj(interp, objv[a+2], &maxepochs) != TCL_OK)
+		return TCL_ERROR;
+	if (objc-a == 4 &&
+	    Tcl_GetDoubleFromObj(interp, objv[a+3], &maxerr) != TCL_OK)
+		return TCL_ERROR;
+	if (n == 0) {
+		Tcl_SetStringObj(Tcl_GetObjResult(interp),
+			"the list of nets is empty", -1);
+		return TCL_ERROR;
+	}
+	nets = (struct Ann**) ckalloc(sizeof(struct Ann*)*n);
+	res = (struct AnnSweepResult*) ckalloc(sizeof(*res)*n);
+	for (j = 0; j < n; j++) {
+		Tcl_Obj *varObj = Tcl_ObjGetVar2(interp, vars[j], NULL,
+			TCL_LEAVE_ERR_MSG);
+
+		if (!varObj || Tcl_GetAnnFromObj(interp, varObj, &nets[j]) != TCL_OK ||
+		    AnnCheckBusy(interp, nets[j]) != TCL_OK)
+			goto out;
+		if (INPUT_UNITS(nets[j]) != INPUT_UNITS(nets[0]) ||
+		    OUTPUT_UNITS(nets[j]) != OUTPUT_UNITS(nets[0])) {
+			Tcl_SetStringObj(Tcl_GetObjResult(interp),
+				"all the nets must have the same number of inputs and outputs", -1);
+			goto out;
+		}
+		for (k = 0; k < j; k++) {
+			if (nets[k] == nets[j]) {
+				Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+					"the net of '", Tcl_GetString(vars[j]),
+					"' is already in the list", NULL);
+				goto out;
+			}
+		}
+		Tcl_InvalidateStringRep(varObj);
+	}
+	if (AnnGetDatasetFromObj(interp, nets[0], objv[a+1], ANN_DATA_DOUBLE,
+				 1, 0, 0, &ds) != TCL_OK)
+		goto out;
+	best = AnnTrainSweep(nets, n, ds, maxerr, maxepochs, threads, rung,
+		eta, res);
+	AnnDatasetFree(ds);
+	if (best == -1) {
+		Tcl_SetStringObj(Tcl_GetObjResult(interp), "Out of memory", -1);
+		goto out;
+	}
+	result = Tcl_GetObjResult(interp);
+	Tcl_SetListObj(result, 0, NULL);
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("best", -1));
+	Tcl_ListObjAppendElement(interp, result, vars[best]);
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("nets", -1));
+	list = Tcl_NewListObj(0, NULL);
+	for (j = 0; j < n; j++) {
+		Tcl_Obj *e = Tcl_NewListObj(0, NULL);
+
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("name", -1));
+		Tcl_ListObjAppendElement(interp, e, vars[j]);
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("status", -1));
+		Tcl_ListObjAppendElement(interp, e,
+			Tcl_NewStringObj(annSweepStatus[res[j].status], -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("epochs", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewIntObj(res[j].epochs));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("meanerr", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewDoubleObj(res[j].meanerr));
+		Tcl_ListObjAppendElement(interp, list, e);
+	}
+	Tcl_ListObjAppendElement(interp, result, list);
+	retval = TCL_OK;
+out:
+	ckfree((char*)nets);
+	ckfree((char*)res);
+	return retval;
+}
+
+/* ann::stats annVar ?-reset?
+ * Return the statistics of the last recorded epochs, oldest first,
+ * as a list of key/value lists. Recording is enabled with
+ * 'ann::configure annVar -stats size'. */
+static int AnnStatsObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann *net;
+	struct AnnEpochStats *st;
+	Tcl_Obj *varObj, *result;
+	int j;
+
+	if (objc != 2 && (objc != 3 ||
+	    strcmp(Tcl_GetStringFromObj(objv[2], NULL), "-reset"))) {
+		Tcl_WrongNumArgs(interp, 1, objv, "AnnVar ?-reset?");
+		return TCL_ERROR;
+	}
+	varObj = Tcl_ObjGetVar2(interp, objv[1], NULL, TCL_LEAVE_ERR_MSG);
+	if (!varObj)
+		return TCL_ERROR;
+	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
+		return TCL_ERROR;
+	result = Tcl_GetObjResult(interp);
+	Tcl_SetListObj(result, 0, NULL);
+	for (j = 0; (st = AnnGetStats(net, j)) != NULL; j++) {
+		Tcl_Obj *e = Tcl_NewListObj(0, NULL);
+
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("epoch", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewIntObj(st->epoch));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("maxerr", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewDoubleObj(st->maxerr));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("meanerr", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewDoubleObj(st->meanerr));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("gradnorm", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewDoubleObj(st->gradnorm));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("deltamin", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewDoubleObj(st->deltamin));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("deltamax", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewDoubleObj(st->deltamax));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("deltamean", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewDoubleObj(st->deltamean));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj("time", -1));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewDoubleObj(st->time));
+		Tcl_ListObjAppendElement(interp, result, e);
+	}
+	if (objc == 3)
+		AnnResetStats(net);
+	return TCL_OK;
+}
+
+/* ann::evaluate annVar dataset
+ * Run the dataset through the net without training it, with the
+ * threads configured for the net, and return a key/value list with
+ * the mean and max per-sample error, the mean squared error of the
+ * outputs, its PSNR in dB for outputs that are pixels in the [0,1]
+ * range, and the list of the mean squared errors of every output. */
+static int AnnEvaluateObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann *net;
+	struct AnnDataset *ds;
+	struct AnnEvalResult res;
+	Tcl_Obj *varObj, *result, *list;
+	int j, err;
+
+	if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "AnnVar DataSet");
+		return TCL_ERROR;
+	}
+	varObj = Tcl_ObjGetVar2(interp, objv[1], NULL, TCL_LEAVE_ERR_MSG);
+	if (!varObj)
+		return TCL_ERROR;
+	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
+		return TCL_ERROR;
+	if (AnnGetDatasetFromObj(interp, net, objv[2], ANN_DATA_DOUBLE, 1, 0, 0,
+	    &ds) != TCL_OK)
+		return TCL_ERROR;
+	res.outerr = (double*) ckalloc(sizeof(double)*OUTPUT_UNITS(net));
+	err = AnnEvaluate(net, ds, &res);
+	AnnDatasetFree(ds);
+	if (err) {
+		ckfree((char*)res.outerr);
+		Tcl_SetStringObj(Tcl_GetObjResult(interp), "Out of memory", -1);
+		return TCL_ERROR;
+	}
+	result = Tcl_GetObjResult(interp);
+	Tcl_SetListObj(result, 0, NULL);
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("meanerr", -1));
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewDoubleObj(res.meanerr));
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("maxerr", -1));
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewDoubleObj(res.maxerr));
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("mse", -1));
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewDoubleObj(res.mse));
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("psnr", -1));
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewDoubleObj(res.psnr));
+	list = Tcl_NewListObj(0, NULL);
+	for (j = 0; j < OUTPUT_UNITS(net); j++)
+		Tcl_ListObjAppendElement(interp, list,
+			Tcl_NewDoubleObj(res.outerr[j]));
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("outerr", -1));
+	Tcl_ListObjAppendElement(interp, result, list);
+	ckfree((char*)res.outerr);
+	return TCL_OK;
+}
+
+/* ann::gradcheck annVar dataset
+ * Return the max absolute difference between the backpropagation
+ * gradients and the numerically computed ones over the dataset, using
+ * the sigmoid currently configured for the net. */
+static int AnnGradCheckObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann *net;
+	Tcl_Obj *varObj;
+	struct AnnDataset *ds;
+	double *input, *target, maxdiff = 0;
+	int j;
+
+	if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "AnnVar DataSet");
+		return TCL_ERROR;
+	}
+	varObj = Tcl_ObjGetVar2(interp, objv[1], NULL, TCL_LEAVE_ERR_MSG);
+	if (!varObj)
+		return TCL_ERROR;
+	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
+		return TCL_ERROR;
+	if (AnnCheckBusy(interp, net) != TCL_OK)
+		return TCL_ERROR;
+	if (AnnGetDatasetFromObj(interp, net, objv[2], ANN_DATA_DOUBLE, 1, 0, 0,
+	    &ds) != TCL_OK)
+		return TCL_ERROR;
+	Tcl_InvalidateStringRep(varObj);
+	input = ds->input;
+	target = ds->target;
+	for (j = 0; j < ds->setlen; j++) {
+		double d = AnnCheckGradients(net,
+			input+j*INPUT_UNITS(net), target+j*OUTPUT_UNITS(net));
+		if (d < 0) {
+			AnnDatasetFree(ds);
+			Tcl_SetStringObj(Tcl_GetObjResult(interp),
+				"Out of memory", -1);
+			return TCL_ERROR;
+		}
+		if (d > maxdiff) maxdiff = d;
+	}
+	AnnDatasetFree(ds);
+	Tcl_SetObjResult(interp, Tcl_NewDoubleObj(maxdiff));
+	return TCL_OK;
+}
+
+/* ann::prune annVar ?-layer index? ?-fraction? value
+ * Prune the weights with magnitude below 'value', or the given fraction
+ * of the weights if -fraction is used, of the whole net or of the
+ * weights feeding the given layer (0 is the output layer). Pruned
+ * weights are kept at zero by further training. Return the number of
+ * weights pruned. The masks are not part of the string representation. */
+static int AnnPruneObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann *net;
+	Tcl_Obj *varObj;
+	double value;
+	int j, layer = 0, fraction = 0, pruned;
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "AnnVar ?-layer index? ?-fraction? Value");
+		return TCL_ERROR;
+	}
+	varObj = Tcl_ObjGetVar2(interp, objv[1], NULL, TCL_LEAVE_ERR_MSG);
+	if (!varObj)
+		return TCL_ERROR;
+	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
+		return TCL_ERROR;
+	if (AnnCheckBusy(interp, net) != TCL_OK)
+		return TCL_ERROR;
+	for (j = 2; j < objc-1; j++) {
+		char *opt = Tcl_GetStringFromObj(objv[j], NULL);
+
+		if (!strcmp(opt, "-fraction")) {
+			fraction = 1;
+		} else if (!strcmp(opt, "-layer") && j+1 < objc-1) {
+			if (Tcl_GetIntFromObj(interp, objv[++j], &layer) != TCL_OK)
+				return TCL_ERROR;
+			if (layer < 0 || layer >= LAYERS(net)-1) {
+				Tcl_SetStringObj(Tcl_GetObjResult(interp),
+					"Layer index out of range", -1);
+				return TCL_ERROR;
+			}
+			layer++;
+		} else {
+			Tcl_SetStringObj(Tcl_GetObjResult(interp),
+				"Bad option, valid options are -layer and -fraction", -1);
+			return TCL_ERROR;
+		}
+	}
+	if (Tcl_GetDoubleFromObj(interp, objv[objc-1], &value) != TCL_OK)
+		return TCL_ERROR;
+	if (fraction && (value < 0 || value > 1)) {
+		Tcl_SetStringObj(Tcl_GetObjResult(interp),
+			"The fraction must be in the range 0-1", -1);
+		return TCL_ERROR;
+	}
+	if (fraction)
+		value = AnnPruneThreshold(net, layer, value);
+	if (value < 0 || (pruned = AnnPrune(net, layer, value)) == -1) {
+		Tcl_SetStringObj(Tcl_GetObjResult(interp), "Out of memory", -1);
+		return TCL_ERROR;
+	}
+	Tcl_InvalidateStringRep(varObj);
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(pruned));
+	return TCL_OK;
+}
+
+/* ann::unprune annVar
+ * Remove the pruning masks, so that all the weights are trained again. */
+static int AnnUnpruneObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann *net;
+	Tcl_Obj *varObj;
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "AnnVar");
+		return TCL_ERROR;
+	}
+	varObj = Tcl_ObjGetVar2(interp, objv[1], NULL, TCL_LEAVE_ERR_MSG);
+	if (!varObj)
+		return TCL_ERROR;
+	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
+		return TCL_ERROR;
+	if (AnnCheckBusy(interp, net) != TCL_OK)
+		return TCL_ERROR;
+	AnnPruneReset(net);
+	return TCL_OK;
+}
+
+/* ann::density annVar
+ * Return, output layer first, a {density kernel} pair for the weights
+ * feeding every layer, where kernel is "sparse" if the sparse forward
+ * kernel is in use for that layer, otherwise "dense". */
+static int AnnDensityObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann *net;
+	Tcl_Obj *varObj, *result;
+	int j;
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "AnnVar");
+		return TCL_ERROR;
+	}
+	varObj = Tcl_ObjGetVar2(interp, objv[1], NULL, TCL_LEAVE_ERR_MSG);
+	if (!varObj)
+		return TCL_ERROR;
+	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
+		return TCL_ERROR;
+	result = Tcl_GetObjResult(interp);
+	Tcl_SetListObj(result, 0, NULL);
+	for (j = 1; j < LAYERS(net); j++) {
+		Tcl_Obj *e = Tcl_NewListObj(0, NULL);
+		int s = IS_TIED(net,j) ? TIED(net,j) : j;
+
+		Tcl_ListObjAppendElement(interp, e,
+			Tcl_NewDoubleObj(AnnDensity(net, j)));
+		Tcl_ListObjAppendElement(interp, e, Tcl_NewStringObj(
+			net->layer[s].sparse ? "sparse" : "dense", -1));
+		Tcl_ListObjAppendElement(interp, result, e);
+	}
+	return TCL_OK;
+}
+
+/* ann::save ?-state? annVar filename
+ * Save the net in a binary file that can be loaded by ann::load, and
+ * served by gnegnud. With -state the training state is saved too, and
+ * the file is replaced atomically, see AnnCheckpoint(). */
+static int AnnSaveObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann *net;
+	Tcl_Obj *varObj;
+	char *filename;
+	int state = 0, err;
+
+	if (objc == 4 && !strcmp(Tcl_GetStringFromObj(objv[1], NULL), "-state"))
+		state = 1;
+	if (objc-state != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-state? AnnVar filename");
+		return TCL_ERROR;
+	}
+	varObj = Tcl_ObjGetVar2(interp, objv[1+state], NULL, TCL_LEAVE_ERR_MSG);
+	if (!varObj)
+		return TCL_ERROR;
+	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
+		return TCL_ERROR;
+	filename = Tcl_GetStringFromObj(objv[2+state], NULL);
+	err = state ? AnnCheckpoint(net, filename) : AnnSave(net, filename);
+	if (err) {
+		Tcl_AppendResult(interp, "can't save the net: ",
+			Tcl_PosixError(interp), NULL);
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+/* ann::load filename
+ * Return the net saved in the file by ann::save, or the checkpoint
+ * written by ann::train -checkpoint with its training state. */
+static int AnnLoadObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	struct Ann *net;
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "filename");
+		return TCL_ERROR;
+	}
+	if ((net = AnnLoad(Tcl_GetStringFromObj(objv[1], NULL))) == NULL) {
+		Tcl_SetStringObj(Tcl_GetObjResult(interp),
+			"can't load the net: not a valid net file for this "
+			"architecture, or out of memory", -1);
+		return TCL_ERROR;
+	}
+	Tcl_SetAnnObj(Tcl_GetObjResult(interp), net);
+	AnnFree(net);
+	return TCL_OK;
+}
+
+#ifdef ANN_PROFILE
+/* ann::profile annVar ?-keep?
+ * Return the profiling counters of the net as a list of
+ * phase/statistics pairs, then reset them unless -keep is given. */
+static int AnnProfileObjCmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	static char *phases[ANN_PROF_PHASES] = {
+		"simulate", "gradients", "update", "sigmoid", "tclconv"
+	};
+	struct Ann *net;
+	struct AnnProfile *p;
+	Tcl_Obj *varObj, *result;
+	double tps = AnnProfileTicksPerSec(), total = 0;
+	int j;
+
+	if (objc != 2 && (objc != 3 ||
+	    strcmp(Tcl_GetStringFromObj(objv[2], NULL), "-keep"))) {
+		Tcl_WrongNumArgs(interp, 1, objv, "AnnVar ?-keep?");
+		return TCL_ERROR;
+	}
+	varObj = Tcl_ObjGetVar2(interp, objv[1], NULL, TCL_LEAVE_ERR_MSG);
+	if (!varObj)
+		return TCL_ERROR;
+	if (Tcl_GetAnnFromObj(interp, varObj, &net) != TCL_OK)
+		return TCL_ERROR;
+	p = &net->profile;
+	/* The sigmoid phase is nested inside simulate, so it is not
+	 * part of the total. */
+	for (j = 0; j < ANN_PROF_PHASES; j++) {
+		if (j != ANN_PROF_SIGMOID)
+			total += p->ticks[j]/tps;
+	}
+	result = Tcl_GetObjResult(interp);
+	Tcl_SetListObj(result, 0, NULL);
+	for (j = 0; j < ANN_PROF_PHASES; j++) {
+		double secs = p->ticks[j]/tps;
+		Tcl_Obj *stats = Tcl_NewListObj(0, NULL);
+
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewStringObj("calls", -1));
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewWideIntObj((Tcl_WideInt)p->calls[j]));
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewStringObj("seconds", -1));
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewDoubleObj(secs));
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewStringObj("share", -1));
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewDoubleObj(total > 0 ? secs/total : 0));
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewStringObj("gflops", -1));
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewDoubleObj(secs > 0 ? p->flops[j]/secs/1e9 : 0));
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewStringObj("bytespersec", -1));
+		Tcl_ListObjAppendElement(interp, stats, Tcl_NewDoubleObj(secs > 0 ? p->bytes[j]/secs : 0));
+		Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj(phases[j], -1));
+		Tcl_ListObjAppendElement(interp, result, stats);
+	}
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("total", -1));
+	Tcl_ListObjAppendElement(interp, result, Tcl_NewDoubleObj(total));
+	if (objc == 2)
+		AnnProfileReset(net);
+	return TCL_OK;
+}
+#endif
+
+/* -------------------------------  Initialization -------------------------- */
+int Tclgnegnu_Init(Tcl_Interp *interp)
+{
+	if (Tcl_InitStubs(interp, "8.0", 0) == NULL)
+		return TCL_ERROR;
+	if (Tcl_PkgRequire(interp, "Tcl", TCL_VERSION, 0) == NULL)
+		return TCL_ERROR;
+	if (Tcl_PkgProvide(interp, "tclgnegnu", VERSION) != TCL_OK)
+		return TCL_ERROR;
+	Tcl_Eval(interp, "namespace eval ann {}");
+	Tcl_CreateObjCommand(interp, "ann::create", AnnCreateObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::simulate", AnnSimulateObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::configure", AnnConfigureObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::train", AnnTrainObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::stats", AnnStatsObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::job", AnnJobObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::evaluate", AnnEvaluateObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::gradcheck", AnnGradCheckObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::prune", AnnPruneObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::unprune", AnnUnpruneObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::density", AnnDensityObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::sweep", AnnSweepObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::save", AnnSaveObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+	Tcl_CreateObjCommand(interp, "ann::load", AnnLoadObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+#ifdef ANN_PROFILE
+	Tcl_CreateObjCommand(interp, "ann::profile", AnnProfileObjCmd,
+			(ClientData)NULL, (Tcl_CmdDeleteProc*)NULL);
+#endif
+	/* Private data initialization here, once for all the interpreters */
+	Tcl_MutexLock(&annJobsLock);
+	if (!annJobsReady) {
+		Tcl_InitHashTable(&annJobs, TCL_ONE_WORD_KEYS);
+		annJobsReady = 1;
+	}
+	Tcl_MutexUnlock(&annJobsLock);
+	Tcl_CallWhenDeleted(interp, AnnJobInterpDeleted, (ClientData)NULL);
 	return TCL_OK;
 }
@@ -0,0 +1,83 @@
+load tclgnegnu.so
+
+# Compare the convergence per wall-clock second of the training
+# algorithms on the 8x8 blocks of lena.pgm. Usage:
+#
+#   tclsh trainbench.tcl ?seconds? ?maxthreads?
+
+proc readpgm filename {
+    set fd [open $filename]
+    fconfigure $fd -translation binary
+    set magic [gets $fd]
+    if {$magic ne "P5"} {
+        error "$filename is not a binary PGM file"
+    }
+    set fields {}
+    while {[llength $fields] < 3} {
+        set line [gets $fd]
+        if {[string index $line 0] eq "#"} continue
+        eval lappend fields $line
+    }
+    foreach {xlen ylen maxval} $fields break
+    binary scan [read $fd [expr {$xlen*$ylen}]] cu* pixels
+    close $fd
+    return [list $xlen $ylen $pixels]
+}
+
+proc blocks {img bxlen bylen} {
+    foreach {xlen ylen pixels} $img break
+    set result {}
+    for {set y 0} {$y < $ylen} {incr y $bylen} {
+	for {set x 0} {$x < $xlen} {incr x $bxlen} {
+	    set b {}
+	    for {set j 0} {$j < $bylen} {incr j} {
+		set off [expr {($y+$j)*$xlen+$x}]
+		foreach p [lrange $pixels $off [expr {$off+$bxlen-1}]] {
+		    lappend b [expr {double($p)/255}]
+		}
+	    }
+	    lappend result $b $b
+	}
+    }
+    return $result
+}
+
+# Mean squared error of the net over the whole dataset.
+proc mse {netvar dataset} {
+    upvar $netvar net
+    set e 0.0
+    set n 0
+    foreach {input target} $dataset {
+	foreach o [ann::simulate net $input] t $target {
+	    set e [expr {$e+($o-$t)*($o-$t)}]
+	    incr n
+	}
+    }
+    return [expr {$e/$n}]
+}
+
+proc run {dataset seconds args} {
+    set net [ann::create 64 8 64]
+    eval [list ann::configure net -scale .01] $args
+    set elapsed 0.0
+    set epochs 0
+    set curve {}
+    while {$elapsed < $seconds} {
+	set start [clock clicks -microseconds]
+	ann::train net $dataset 5
+	set elapsed [expr {$elapsed+([clock clicks -microseconds]-$start)/1e6}]
+	incr epochs 5
+	lappend curve [format "%.2fs:%d:%.6f" $elapsed $epochs [mse net $dataset]]
+    }
+    puts "[format %-28s $args] $curve"
+}
+
+set seconds [expr {[llength $argv] > 0 ? [lindex $argv 0] : 10}]
+set maxthreads [expr {[llength $argv] > 1 ? [lindex $argv 1] : 4}]
+set dataset [blocks [readpgm lena.pgm] 8 8]
+
+run $dataset $seconds -algo rprop
+run $dataset $seconds -algo obprop -learnrate .01
+for {set t 2} {$t <= $maxthreads} {incr t $t} {
+    run $dataset $seconds -algo obprop -learnrate .01 -threads $t
+}